@@ -74,5 +74,6 @@
 #include "cgi/cgiwrap.h"
 #include "cgi/date.h"
 #include "cgi/html.h"
+#include "cgi/fastcgi.h"
 
 #endif /* __CLEARSILVER_H_ */
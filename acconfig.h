@@ -48,6 +48,9 @@
 /* Does your system have regex.h */
 #undef HAVE_REGEX
 
+/* Does your system have dlopen() ? */
+#undef HAVE_DLOPEN
+
 /* Does your system have pthreads? */
 #undef HAVE_PTHREADS
 
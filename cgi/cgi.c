@@ -12,6 +12,7 @@
 #include "cs_config.h"
 
 #include <unistd.h>
+#include <errno.h>
 #include <string.h>
 #include <stdlib.h>
 #include <ctype.h>
@@ -22,12 +23,17 @@
 #if defined(HTML_COMPRESSION)
 #include <zlib.h>
 #endif
+#if defined(__GNUC__) && defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #include "util/neo_misc.h"
 #include "util/neo_misc.h"
 #include "util/neo_err.h"
+#include "util/neo_hash.h"
 #include "util/neo_hdf.h"
 #include "util/neo_str.h"
+#include "util/ulocks.h"
 #include "cgi.h"
 #include "cgiwrap.h"
 #include "html.h"
@@ -194,6 +200,9 @@ static char *Argv0 = "";
 int IgnoreEmptyFormVars = 0;
 
 static int ExceptionsInit = 0;
+#ifdef HAVE_PTHREADS
+static pthread_mutex_t ExceptionsLock = PTHREAD_MUTEX_INITIALIZER;
+#endif
 NERR_TYPE CGIFinished = -1;
 NERR_TYPE CGIUploadCancelled = -1;
 NERR_TYPE CGIParseNotHandled = -1;
@@ -203,7 +212,7 @@ static NEOERR *_add_cgi_env_var (CGI *cgi, char *env, char *name)
   NEOERR *err;
   char *s;
 
-  err = cgiwrap_getenv (env, &s);
+  err = cgiwrap_ctx_getenv (cgi->wrap, env, &s);
   if (err != STATUS_OK) return nerr_pass (err);
   if (s != NULL)
   {
@@ -273,99 +282,196 @@ NEOERR *cgi_css_url_validate (const char *buf, char **esc)
   return nerr_pass(neos_css_url_validate(buf, esc));
 }
 
-static NEOERR *_parse_query (CGI *cgi, char *query)
+/* Where the next repeat of a query key goes.  A key seen more than once
+ * becomes Query.key.0, Query.key.1, etc, so each repeat has to know how
+ * many children the key has.  Rather than count them all again for
+ * every repeat, the cursor remembers the last child it counted and only
+ * walks the ones added since. */
+typedef struct _query_cursor
+{
+  HDF *obj;
+  HDF *last;
+  int count;
+  char name[1];
+} QUERY_CURSOR;
+
+typedef struct _query_parse
+{
+  CGI *cgi;
+  HDF *query;         /* the Query node, once something is set */
+  NE_OHASH *cursors;  /* key -> QUERY_CURSOR, for keys which repeat */
+  ULIST *cursor_list; /* owns the cursors */
+  int unnamed_count;
+} QUERY_PARSE;
+
+static void _query_parse_init (QUERY_PARSE *qp, CGI *cgi)
+{
+  memset(qp, 0, sizeof(QUERY_PARSE));
+  qp->cgi = cgi;
+}
+
+static void _query_parse_clear (QUERY_PARSE *qp)
+{
+  if (qp->cursors) ne_ohash_destroy(&(qp->cursors));
+  if (qp->cursor_list) uListDestroy(&(qp->cursor_list), ULIST_FREE);
+}
+
+static void _cursor_walk (QUERY_CURSOR *cur)
+{
+  HDF *next;
+
+  next = cur->last ? hdf_obj_next(cur->last) : hdf_obj_child(cur->obj);
+  while (next != NULL)
+  {
+    cur->count++;
+    cur->last = next;
+    next = hdf_obj_next(next);
+  }
+}
+
+static NEOERR *_query_cursor (QUERY_PARSE *qp, HDF *obj, const char *k,
+                              QUERY_CURSOR **cursor)
+{
+  NEOERR *err;
+  QUERY_CURSOR *cur = NULL;
+  int len;
+
+  *cursor = NULL;
+  if (qp->cursors == NULL)
+  {
+    err = ne_ohash_init(&(qp->cursors), ne_hash_str_fnv, ne_hash_str_comp);
+    if (err) return nerr_pass(err);
+    err = uListInit(&(qp->cursor_list), 0, 0);
+    if (err) return nerr_pass(err);
+  }
+  else
+  {
+    cur = (QUERY_CURSOR *) ne_ohash_lookup(qp->cursors, (void *)k);
+  }
+  if (cur == NULL || cur->obj != obj)
+  {
+    len = strlen(k);
+    cur = (QUERY_CURSOR *) calloc(1, sizeof(QUERY_CURSOR) + len);
+    if (cur == NULL)
+      return nerr_raise(NERR_NOMEM, "Unable to allocate query cursor");
+    memcpy(cur->name, k, len + 1);
+    cur->obj = obj;
+    err = uListAppend(qp->cursor_list, cur);
+    if (err)
+    {
+      free(cur);
+      return nerr_pass(err);
+    }
+    err = ne_ohash_insert(qp->cursors, cur->name, cur);
+    if (err) return nerr_pass(err);
+  }
+  _cursor_walk(cur);
+  *cursor = cur;
+  return STATUS_OK;
+}
+
+/* Adds one key=value pair (k is modified) to the Query tree */
+static NEOERR *_parse_query_pair (QUERY_PARSE *qp, char *k)
 {
   NEOERR *err = STATUS_OK;
-  char *t, *k, *v, *l;
-  char buf[256];
+  CGI *cgi = qp->cgi;
+  QUERY_CURSOR *cur;
+  char *v;
   char unnamed[10];
-  int unnamed_count = 0;
-  HDF *obj, *child;
+  char num[12];
+  HDF *obj;
 
-  if (query && *query)
+  v = strchr(k, '=');
+  if (v == NULL)
   {
-    k = strtok_r(query, "&", &l);
-    while (k && *k)
-    {
-      v = strchr(k, '=');
-      if (v == NULL)
-      {
-	v = "";
-      }
-      else
-      {
-	*v = '\0';
-	v++;
-      }
+    v = "";
+  }
+  else
+  {
+    *v = '\0';
+    v++;
+  }
 
+  /* Check for some invalid query strings */
+  if (*k == 0) {
+    /*  '?=foo' gets mapped in as Query._1=foo */
+    snprintf(unnamed,sizeof(unnamed), "_%d", qp->unnamed_count++);
+    k = unnamed;
+  } else if (*k == '.') {
+    /* an hdf element can't start with a period */
+    *k = '_';
+  }
+  cgi_url_unescape(k);
 
-      /* Check for some invalid query strings */
-      if (*k == 0) {
-        /*  '?=foo' gets mapped in as Query._1=foo */
-        snprintf(unnamed,sizeof(unnamed), "_%d", unnamed_count++);
-        k = unnamed;
-      } else if (*k == '.') {
-        /* an hdf element can't start with a period */
-        *k = '_';
-      }
-      snprintf(buf, sizeof(buf), "Query.%s", cgi_url_unescape(k));
+  if (cgi->ignore_empty_form_vars && (*v == '\0'))
+    return STATUS_OK;
 
-      if (!(cgi->ignore_empty_form_vars && (*v == '\0')))
-      {
+  cgi_url_unescape(v);
+  if (qp->query == NULL)
+  {
+    err = hdf_get_node (cgi->hdf, "Query", &(qp->query));
+    if (err != STATUS_OK) return nerr_pass(err);
+  }
+  obj = hdf_get_obj (qp->query, k);
+  if (obj != NULL)
+  {
+    err = _query_cursor (qp, obj, k, &cur);
+    if (err != STATUS_OK) return nerr_pass(err);
+    if (cur->count == 0)
+    {
+      err = hdf_set_value (obj, "0", hdf_obj_value (obj));
+      if (err != STATUS_OK) return nerr_pass(err);
+      _cursor_walk(cur);
+    }
+    snprintf (num, sizeof(num), "%d", cur->count);
+    err = hdf_set_value (obj, num, v);
+    if (err != STATUS_OK) return nerr_pass(err);
+  }
+  err = hdf_set_value (qp->query, k, v);
+  if (nerr_match(err, NERR_ASSERT)) {
+    STRING str;
 
+    string_init(&str);
+    nerr_error_string(err, &str);
+    ne_warn("Unable to set Query value: Query.%s = %s: %s", k, v, str.buf);
+    string_clear(&str);
+    nerr_ignore(&err);
+  }
+  return nerr_pass(err);
+}
 
-	cgi_url_unescape(v);
-	obj = hdf_get_obj (cgi->hdf, buf);
-	if (obj != NULL)
-	{
-	  int i = 0;
-	  char buf2[10];
-	  child = hdf_obj_child (obj);
-	  if (child == NULL)
-	  {
-	    t = hdf_obj_value (obj);
-	    err = hdf_set_value (obj, "0", t);
-	    if (err != STATUS_OK) break;
-	    i = 1;
-	  }
-	  else
-	  {
-	    while (child != NULL)
-	    {
-	      i++;
-	      child = hdf_obj_next (child);
-	      if (err != STATUS_OK) break;
-	    }
-	    if (err != STATUS_OK) break;
-	  }
-	  snprintf (buf2, sizeof(buf2), "%d", i);
-	  err = hdf_set_value (obj, buf2, v);
-	  if (err != STATUS_OK) break;
-	}
-	err = hdf_set_value (cgi->hdf, buf, v);
-	if (nerr_match(err, NERR_ASSERT)) {
-	  STRING str;
-
-	  string_init(&str);
-	  nerr_error_string(err, &str);
-	  ne_warn("Unable to set Query value: %s = %s: %s", buf, v, str.buf);
-	  string_clear(&str);
-	  nerr_ignore(&err);
-	}
-	if (err != STATUS_OK) break;
-      }
+static NEOERR *_parse_query (CGI *cgi, char *query)
+{
+  NEOERR *err = STATUS_OK;
+  QUERY_PARSE qp;
+  char *k, *l;
+
+  if (query && *query)
+  {
+    _query_parse_init(&qp, cgi);
+    k = strtok_r(query, "&", &l);
+    while (k && *k)
+    {
+      err = _parse_query_pair(&qp, k);
+      if (err != STATUS_OK) break;
       k = strtok_r(NULL, "&", &l);
     }
+    _query_parse_clear(&qp);
   }
   return nerr_pass(err);
 }
 
-/* Is it an error if its a short read? */
+/* The body is parsed as it is read, a pair at a time, so a large form
+ * never has to be held in memory all at once.  Only a pair split across
+ * reads is copied.  As with a query string, parsing stops at a NUL. */
 static NEOERR *_parse_post_form (CGI *cgi)
 {
   NEOERR *err = STATUS_OK;
-  char *l, *query;
-  int len, r, o;
+  QUERY_PARSE qp;
+  STRING pair;
+  char buf[8192];
+  char *l, *p, *end, *amp;
+  int len, r = 0, o, done = 0;
 
   l = hdf_get_value (cgi->hdf, "CGI.ContentLength", NULL);
   if (l == NULL) return STATUS_OK;
@@ -374,34 +480,61 @@ static NEOERR *_parse_post_form (CGI *cgi)
 
   cgi->data_expected = len;
 
-  query = (char *) malloc (sizeof(char) * (len + 1));
-  if (query == NULL)
-    return nerr_raise (NERR_NOMEM,
-	"Unable to allocate memory to read POST input of length %d", len);
-
-
+  _query_parse_init(&qp, cgi);
+  string_init(&pair);
   o = 0;
   while (o < len)
   {
-    cgiwrap_read (query + o, len - o, &r);
+    cgiwrap_ctx_read (cgi->wrap, buf,
+                      len - o < sizeof(buf) ? len - o : sizeof(buf), &r);
     if (r <= 0) break;
     o = o + r;
+    if (done) continue;
+
+    p = buf;
+    end = memchr(buf, '\0', r);
+    if (end != NULL)
+      done = 1;
+    else
+      end = buf + r;
+    while (p < end)
+    {
+      amp = memchr(p, '&', end - p);
+      if (amp == NULL)
+      {
+        err = string_appendn(&pair, p, end - p);
+        break;
+      }
+      if (pair.len)
+      {
+        err = string_appendn(&pair, p, amp - p);
+        if (err != STATUS_OK) break;
+        err = _parse_query_pair(&qp, pair.buf);
+        pair.len = 0;
+      }
+      else if (amp > p)
+      {
+        *amp = '\0';
+        err = _parse_query_pair(&qp, p);
+      }
+      if (err != STATUS_OK) break;
+      p = amp + 1;
+    }
+    if (err != STATUS_OK) break;
   }
-  if (r < 0)
-  {
-    free(query);
-    return nerr_raise_errno (NERR_IO, "Short read on CGI POST input (%d < %d)",
-	o, len);
-  }
-  if (o != len)
+  if (err == STATUS_OK)
   {
-    free(query);
-    return nerr_raise (NERR_IO, "Short read on CGI POST input (%d < %d)",
-	o, len);
+    if (r < 0)
+      err = nerr_raise_errno (NERR_IO,
+          "Short read on CGI POST input (%d < %d)", o, len);
+    else if (o != len)
+      err = nerr_raise (NERR_IO, "Short read on CGI POST input (%d < %d)",
+          o, len);
+    else if (pair.len)
+      err = _parse_query_pair(&qp, pair.buf);
   }
-  query[len] = '\0';
-  err = _parse_query (cgi, query);
-  free(query);
+  string_clear(&pair);
+  _query_parse_clear(&qp);
   return nerr_pass(err);
 }
 
@@ -563,7 +696,7 @@ static NEOERR *_export_http_headers (CGI *cgi)
   x = 0;
   while (1)
   {
-    err = cgiwrap_iterenv (x, &k, &v);
+    err = cgiwrap_ctx_iterenv (cgi->wrap, x, &k, &v);
     if (err) return nerr_pass (err);
     if (k == NULL) break;
     if (!strncmp (k, "HTTP_", 5))
@@ -819,9 +952,9 @@ NEOERR *cgi_parse (CGI *cgi)
       while (x < len)
       {
 	if (len-x > sizeof(buf))
-	  cgiwrap_read (buf, sizeof(buf), &r);
+	  cgiwrap_ctx_read (cgi->wrap, buf, sizeof(buf), &r);
 	else
-	  cgiwrap_read (buf, len - x, &r);
+	  cgiwrap_ctx_read (cgi->wrap, buf, len - x, &r);
 	fwrite (buf, 1, r, fp);
 	x += r;
       }
@@ -850,9 +983,9 @@ NEOERR *cgi_parse (CGI *cgi)
     while (x < len)
     {
       if (len-x > sizeof(buf))
-	cgiwrap_read (buf, sizeof(buf), &r);
+	cgiwrap_ctx_read (cgi->wrap, buf, sizeof(buf), &r);
       else
-	cgiwrap_read (buf, len - x, &r);
+	cgiwrap_ctx_read (cgi->wrap, buf, len - x, &r);
       w = fwrite (buf, sizeof(char), r, fp);
       if (w != r)
       {
@@ -883,30 +1016,72 @@ NEOERR *cgi_parse (CGI *cgi)
   return STATUS_OK;
 }
 
-NEOERR *cgi_init (CGI **cgi, HDF *hdf)
+/* Like nerr_init, only lock when it looks like the registration hasn't
+ * been done yet, since threads may be calling cgi_init at once */
+static NEOERR *_cgi_exceptions_init (void)
 {
   NEOERR *err = STATUS_OK;
-  CGI *mycgi;
 
-  if (ExceptionsInit == 0)
+#ifdef HAVE_PTHREADS
+  err = mLock(&ExceptionsLock);
+  if (err) return nerr_pass(err);
+#endif
+  do
   {
+    if (ExceptionsInit) break;
     err = nerr_init();
-    if (err) return nerr_pass(err);
+    if (err) break;
     err = nerr_register(&CGIFinished, "CGIFinished");
-    if (err) return nerr_pass(err);
+    if (err) break;
     err = nerr_register(&CGIUploadCancelled, "CGIUploadCancelled");
-    if (err) return nerr_pass(err);
+    if (err) break;
     err = nerr_register(&CGIParseNotHandled, "CGIParseNotHandled");
-    if (err) return nerr_pass(err);
+    if (err) break;
     ExceptionsInit = 1;
+  } while (0);
+#ifdef HAVE_PTHREADS
+  {
+    NEOERR *unlock_err = mUnlock(&ExceptionsLock);
+    if (err == STATUS_OK)
+      err = unlock_err;
+    else
+      nerr_ignore(&unlock_err);
   }
+#endif
+  return nerr_pass(err);
+}
+
+NEOERR *cgi_init (CGI **cgi, HDF *hdf)
+{
+  return nerr_pass (cgi_init_ctx (cgi, hdf, NULL));
+}
+
+NEOERR *cgi_init_ctx (CGI **cgi, HDF *hdf, CGIWRAP_CTX *ctx)
+{
+  NEOERR *err = STATUS_OK;
+  CGI *mycgi;
 
   *cgi = NULL;
+  /* the hdf is ours even if this fails */
+  if (ExceptionsInit == 0)
+  {
+    err = _cgi_exceptions_init();
+    if (err)
+    {
+      if (hdf) hdf_destroy(&hdf);
+      return nerr_pass(err);
+    }
+  }
+
   mycgi = (CGI *) calloc (1, sizeof(CGI));
   if (mycgi == NULL)
+  {
+    if (hdf) hdf_destroy(&hdf);
     return nerr_raise(NERR_NOMEM, "Unable to allocate space for CGI");
+  }
 
   mycgi->time_start = ne_timef();
+  mycgi->wrap = ctx;
 
   mycgi->ignore_empty_form_vars = IgnoreEmptyFormVars;
 
@@ -969,7 +1144,9 @@ static NEOERR *render_cb (void *ctx, char *buf)
   return err;
 }
 
-static NEOERR *cgi_headers (CGI *cgi)
+/* The headers are gathered into str, so they can be sent along with the
+ * start of the body */
+static NEOERR *cgi_headers (CGI *cgi, STRING *str)
 {
   NEOERR *err = STATUS_OK;
   HDF *obj, *child;
@@ -979,11 +1156,11 @@ static NEOERR *cgi_headers (CGI *cgi)
   {
     /* Ok, we try really hard to defeat caches here */
     /* this isn't in any HTTP rfc's, it just seems to be a convention */
-    err = cgiwrap_writef ("Pragma: no-cache\r\n");
+    err = string_appendf (str, "Pragma: no-cache\r\n");
     if (err != STATUS_OK) return nerr_pass (err);
-    err = cgiwrap_writef ("Expires: Fri, 01 Jan 1990 00:00:00 GMT\r\n");
+    err = string_appendf (str, "Expires: Fri, 01 Jan 1990 00:00:00 GMT\r\n");
     if (err != STATUS_OK) return nerr_pass (err);
-    err = cgiwrap_writef ("Cache-control: no-cache, must-revalidate, no-cache=\"Set-Cookie\", private\r\n");
+    err = string_appendf (str, "Cache-control: no-cache, must-revalidate, no-cache=\"Set-Cookie\", private\r\n");
     if (err != STATUS_OK) return nerr_pass (err);
   }
   obj = hdf_get_obj (cgi->hdf, "cgiout");
@@ -991,11 +1168,11 @@ static NEOERR *cgi_headers (CGI *cgi)
   {
     s = hdf_get_value (obj, "Status", NULL);
     if (s)
-      err = cgiwrap_writef ("Status: %s\r\n", s);
+      err = string_appendf (str, "Status: %s\r\n", s);
     if (err != STATUS_OK) return nerr_pass (err);
     s = hdf_get_value (obj, "Location", NULL);
     if (s)
-      err = cgiwrap_writef ("Location: %s\r\n", s);
+      err = string_appendf (str, "Location: %s\r\n", s);
     if (err != STATUS_OK) return nerr_pass (err);
     child = hdf_get_obj (cgi->hdf, "cgiout.other");
     if (child)
@@ -1004,7 +1181,7 @@ static NEOERR *cgi_headers (CGI *cgi)
       while (child != NULL)
       {
 	s = hdf_obj_value (child);
-	err = cgiwrap_writef ("%s\r\n", s);
+	err = string_appendf (str, "%s\r\n", s);
 	if (err != STATUS_OK) return nerr_pass (err);
 	child = hdf_obj_next(child);
       }
@@ -1012,15 +1189,15 @@ static NEOERR *cgi_headers (CGI *cgi)
     charset = hdf_get_value (obj, "charset", NULL);
     s = hdf_get_value (obj, "ContentType", "text/html");
     if (charset)
-      err = cgiwrap_writef ("Content-Type: %s; charset=%s\r\n\r\n", s, charset);
+      err = string_appendf (str, "Content-Type: %s; charset=%s\r\n\r\n", s, charset);
     else
-      err = cgiwrap_writef ("Content-Type: %s\r\n\r\n", s);
+      err = string_appendf (str, "Content-Type: %s\r\n\r\n", s);
     if (err != STATUS_OK) return nerr_pass (err);
   }
   else
   {
     /* Default */
-    err = cgiwrap_writef ("Content-Type: text/html\r\n\r\n");
+    err = string_appendf (str, "Content-Type: text/html\r\n\r\n");
     if (err != STATUS_OK) return nerr_pass (err);
   }
   return STATUS_OK;
@@ -1031,36 +1208,104 @@ static NEOERR *cgi_headers (CGI *cgi)
 #define DEF_MEM_LEVEL 8
 #define OS_CODE 0x03
 
-static NEOERR *cgi_compress (STRING *str, char *obuf, int *olen)
+/* Setting up a deflate stream allocates a few hundred k, so long lived
+ * processes keep a few idle ones around and just reset them for the
+ * next request.  zlib ties its state to the z_stream's address, so
+ * these are kept as pointers. */
+#define DEFLATE_POOL_SIZE 4
+
+static struct _deflate_pool
+{
+  z_stream *zstream;
+  int level;
+  int mem_level;
+} DeflatePool[DEFLATE_POOL_SIZE];
+
+#ifdef HAVE_PTHREADS
+static pthread_mutex_t DeflatePoolLock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static void deflate_pool_lock (void)
 {
-  z_stream stream;
-  int err;
+#ifdef HAVE_PTHREADS
+  NEOERR *err = mLock(&DeflatePoolLock);
+  if (err != STATUS_OK) nerr_log_error(err);
+  nerr_ignore(&err);
+#endif
+}
 
-  stream.next_in = (Bytef*)str->buf;
-  stream.avail_in = (uInt)str->len;
-  stream.next_out = (Bytef*)obuf;
-  stream.avail_out = (uInt)*olen;
-  if ((uLong)stream.avail_out != *olen)
-    return nerr_raise(NERR_NOMEM, "Destination too big: %d", *olen);
+static void deflate_pool_unlock (void)
+{
+#ifdef HAVE_PTHREADS
+  NEOERR *err = mUnlock(&DeflatePoolLock);
+  if (err != STATUS_OK) nerr_log_error(err);
+  nerr_ignore(&err);
+#endif
+}
 
-  stream.zalloc = (alloc_func)0;
-  stream.zfree = (free_func)0;
-  stream.opaque = (voidpf)0;
+/* Returns a raw deflate stream, or NULL (after logging why) if one
+ * can't be set up with these settings */
+static z_stream *deflate_get (int level, int mem_level)
+{
+  z_stream *z = NULL;
+  int x, ret;
 
-  /* err = deflateInit(&stream, Z_DEFAULT_COMPRESSION); */
-  err = deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, DEF_MEM_LEVEL, Z_DEFAULT_STRATEGY);
-  if (err != Z_OK)
-    return nerr_raise(NERR_SYSTEM, "deflateInit2 returned %d", err);
+  deflate_pool_lock();
+  for (x = 0; x < DEFLATE_POOL_SIZE; x++)
+  {
+    if (DeflatePool[x].zstream && DeflatePool[x].level == level &&
+	DeflatePool[x].mem_level == mem_level)
+    {
+      z = DeflatePool[x].zstream;
+      DeflatePool[x].zstream = NULL;
+      break;
+    }
+  }
+  deflate_pool_unlock();
+  if (z != NULL) return z;
 
-  err = deflate(&stream, Z_FINISH);
-  if (err != Z_STREAM_END) {
-    deflateEnd(&stream);
-    return nerr_raise(NERR_SYSTEM, "deflate returned %d", err);
+  z = (z_stream *) calloc (1, sizeof(z_stream));
+  if (z == NULL)
+  {
+    ne_warn("Unable to allocate z_stream");
+    return NULL;
   }
-  *olen = stream.total_out;
+  ret = deflateInit2(z, level, Z_DEFLATED, -MAX_WBITS, mem_level,
+                     Z_DEFAULT_STRATEGY);
+  if (ret != Z_OK)
+  {
+    ne_warn("deflateInit2 returned %d", ret);
+    free(z);
+    return NULL;
+  }
+  return z;
+}
 
-  err = deflateEnd(&stream);
-  return STATUS_OK;
+static void deflate_release (z_stream *z, int level, int mem_level)
+{
+  int x;
+
+  if (deflateReset(z) == Z_OK)
+  {
+    deflate_pool_lock();
+    for (x = 0; x < DEFLATE_POOL_SIZE; x++)
+    {
+      if (DeflatePool[x].zstream == NULL)
+      {
+	DeflatePool[x].zstream = z;
+	DeflatePool[x].level = level;
+	DeflatePool[x].mem_level = mem_level;
+	z = NULL;
+	break;
+      }
+    }
+    deflate_pool_unlock();
+  }
+  if (z != NULL)
+  {
+    deflateEnd(z);
+    free(z);
+  }
 }
 #endif
 
@@ -1078,186 +1323,440 @@ static NEOERR *cgi_compress (STRING *str, char *obuf, int *olen)
  *
  * */
 
-#if 0
-static void debug_output(char *header, char *s, int n)
+/* The stripper is a filter which can be fed the output a piece at a
+ * time, so it can run as the page is rendered.  Since the newline
+ * handling erases whitespace already output, trailing whitespace is held
+ * back in pending until we know whether it survives, and any bytes we
+ * can't classify yet (a '<' without enough of the tag name after it)
+ * are held back until the next write. */
+#define WS_STATE_TEXT     0
+#define WS_STATE_TAG      1
+#define WS_STATE_PRE      2
+#define WS_STATE_TEXTAREA 3
+
+typedef NEOERR* (*WS_EMIT_FUNC)(void *ctx, const char *buf, int len);
+
+typedef struct _ws_strip
 {
-  int x;
-  fprintf (stderr, "%s ", header);
-  for (x = 0; x < n; x++)
-  {
-    fprintf (stderr, "%c", s[x]);
-  }
-  fprintf(stderr, "\n");
+  int level;
+  int state;
+  int started;
+  int ws;
+  int seen_nonws;
+  WS_EMIT_FUNC emit;
+  void *rock;
+  int pending_len;
+  char pending[8];
+  int hold_len;
+  char hold[16];
+  /* adjacent pieces of the input being output are collected here, so
+   * they go to emit in one call */
+  const char *span;
+  int span_len;
+} WS_STRIP;
+
+static void _ws_strip_init (WS_STRIP *ws, int level, WS_EMIT_FUNC emit,
+                            void *rock)
+{
+  memset(ws, 0, sizeof(WS_STRIP));
+  ws->level = level;
+  ws->seen_nonws = level > 1;
+  ws->emit = emit;
+  ws->rock = rock;
 }
-#endif
 
-void cgi_html_ws_strip(STRING *str, int level)
+static NEOERR *_ws_span_flush (WS_STRIP *ws)
 {
-  int ws = 0;
-  int seen_nonws = level > 1;
-  int i, o, l;
-  char *ch;
+  NEOERR *err = STATUS_OK;
 
-  i = o = 0;
-  if (str->len) {
-    ws = isspace(str->buf[0]);
-  }
-  while (i < str->len)
+  if (ws->span_len)
   {
-    if (str->buf[i] == '<')
-    {
-      str->buf[o++] = str->buf[i++];
-      if (!strncasecmp(str->buf + i, "textarea", 8))
-      {
-	ch = str->buf + i;
-	do
-	{
-	  ch = strchr(ch, '<');
-	  if (ch == NULL)
-	  {
-	    memmove(str->buf + o, str->buf + i, str->len - i);
-	    str->len = o + str->len - i;
-	    str->buf[str->len] = '\0';
-	    return;
-	  }
-	  ch++;
-	} while (strncasecmp(ch, "/textarea>", 10));
-	ch += 10;
-	l = ch - str->buf - i;
-	memmove(str->buf + o, str->buf + i, l);
-	o += l;
-	i += l;
-      }
-      else if (!strncasecmp(str->buf + i, "pre", 3))
-      {
-	ch = str->buf + i;
-	do
-	{
-	  ch = strchr(ch, '<');
-	  if (ch == NULL)
-	  {
-	    memmove(str->buf + o, str->buf + i, str->len - i);
-	    str->len = o + str->len - i;
-	    str->buf[str->len] = '\0';
-	    return;
-	  }
-	  ch++;
-	} while (strncasecmp(ch, "/pre>", 5));
-	ch += 5;
-	l = ch - str->buf - i;
-	memmove(str->buf + o, str->buf + i, l);
-	o += l;
-	i += l;
-      }
-      else
-      {
-	ch = strchr(str->buf + i, '>');
-	if (ch == NULL)
-	{
-	  memmove(str->buf + o, str->buf + i, str->len - i);
-	  str->len = o + str->len - i;
-	  str->buf[str->len] = '\0';
-	  return;
-	}
-	ch++;
-	/* debug_output("copying tag", str->buf + i, ch - str->buf - i);
-	 * */
-	l = ch - str->buf - i;
-	memmove(str->buf + o, str->buf + i, l);
-	o += l;
-	i += l;
-      }
-      /* debug_output("result", str->buf, o); */
-      seen_nonws = 1;
-      ws = 0;
-    }
-    else if (str->buf[i] == '\n')
-    {
-      /* This has the effect of erasing all whitespace at the eol plus
-       * erasing all blank lines */
-      while (o && isspace(str->buf[o-1])) o--;
-      str->buf[o++] = str->buf[i++];
-      ws = level > 1;
-      seen_nonws = level > 1;
-    }
-    else if (seen_nonws && isspace(str->buf[i]))
-    {
-      if (ws)
-      {
-	i++;
-      }
-      else
-      {
-	str->buf[o++] = str->buf[i++];
-	ws = 1;
-      }
-    }
-    else
-    {
-      seen_nonws = 1;
-      ws = 0;
-      str->buf[o++] = str->buf[i++];
-    }
+    err = ws->emit(ws->rock, ws->span, ws->span_len);
+    ws->span_len = 0;
   }
-
-  str->len = o;
-  str->buf[str->len] = '\0';
+  return nerr_pass(err);
 }
 
-/*
- * We use this function when there's no better option than to just log
- * and free the error chain.
- */
-static void _log_clear_error (NEOERR **err)
+static NEOERR *_ws_emit (WS_STRIP *ws, const char *buf, int len)
 {
-  nerr_warn_error(*err);
-  nerr_ignore(err);
+  NEOERR *err;
+
+  if (ws->span_len && ws->span + ws->span_len == buf)
+  {
+    ws->span_len += len;
+    return STATUS_OK;
+  }
+  err = _ws_span_flush(ws);
+  if (err != STATUS_OK) return nerr_pass(err);
+  ws->span = buf;
+  ws->span_len = len;
+  return STATUS_OK;
 }
 
-NEOERR *cgi_output (CGI *cgi, STRING *str)
+static NEOERR *_ws_pending_flush (WS_STRIP *ws)
 {
   NEOERR *err = STATUS_OK;
-  double dis;
-  int is_html = 0;
-  int use_deflate = 0;
-  int use_gzip = 0;
-  int do_debug = 0;
-  int do_timefooter = 0;
-  int ws_strip_level = 0;
-  char *s, *e;
 
-  s = hdf_get_value (cgi->hdf, "Query.debug", NULL);
-  e = hdf_get_value (cgi->hdf, "Config.DebugPassword", NULL);
-  if (hdf_get_int_value(cgi->hdf, "Config.DebugEnabled", 0) && 
-      s && e && !strcmp(s, e)) do_debug = 1;
-  do_timefooter = hdf_get_int_value (cgi->hdf, "Config.TimeFooter", 1);
-  ws_strip_level = hdf_get_int_value (cgi->hdf, "Config.WhiteSpaceStrip", 1);
+  if (ws->pending_len)
+  {
+    err = _ws_span_flush(ws);
+    if (err != STATUS_OK) return nerr_pass(err);
+    err = ws->emit(ws->rock, ws->pending, ws->pending_len);
+    ws->pending_len = 0;
+  }
+  return nerr_pass(err);
+}
 
-  dis = ne_timef();
-  s = hdf_get_value (cgi->hdf, "cgiout.ContentType", "text/html");
-  if (!strcasecmp(s, "text/html"))
-    is_html = 1;
+static NEOERR *_ws_pending_add (WS_STRIP *ws, char c)
+{
+  NEOERR *err;
 
-#if defined(HTML_COMPRESSION)
-  /* Determine whether or not we can compress the output */
-  if (is_html && hdf_get_int_value (cgi->hdf, "Config.CompressionEnabled", 0))
+  /* The whitespace collapsing means this can't actually fill up */
+  if (ws->pending_len == sizeof(ws->pending))
   {
-    err = hdf_get_copy (cgi->hdf, "HTTP.AcceptEncoding", &s, NULL);
-    if (err != STATUS_OK) return nerr_pass (err);
-    if (s)
-    {
+    err = _ws_pending_flush(ws);
+    if (err != STATUS_OK) return nerr_pass(err);
+  }
+  ws->pending[ws->pending_len++] = c;
+  return STATUS_OK;
+}
+
+/* Returns the end of the run of text starting at n which is copied as
+ * is: ordinary characters, and single spaces between them.  Most of the
+ * output is like this, so skip through it a vector at a time, stopping
+ * at anything which might need a closer look: a '<', a newline, a
+ * space followed by another space or '<', or a non-ascii byte (which is
+ * left to isspace). */
+#define WS_ORDINARY(c) ((c) != '<' && !isspace(c))
+
+static int _ws_text_end (const char *s, int n, int len)
+{
+#if defined(__GNUC__) && defined(__SSE2__)
+  unsigned int sp, lt, nl, hi, stop;
+#endif
+
+  while (1)
+  {
+#if defined(__GNUC__) && defined(__SSE2__)
+    while (n + 16 <= len)
+    {
+      __m128i v = _mm_loadu_si128((const __m128i *)(s + n));
+      __m128i t = _mm_sub_epi8(v, _mm_set1_epi8('\t'));
+
+      /* '\t' through '\r' are where v - '\t' <= 4 unsigned */
+      sp = _mm_movemask_epi8(_mm_or_si128(
+	    _mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+	    _mm_cmpeq_epi8(_mm_min_epu8(t, _mm_set1_epi8(4)), t)));
+      lt = _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('<')));
+      nl = _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')));
+      hi = _mm_movemask_epi8(v);
+      stop = lt | nl | hi | (sp & (((sp | lt | hi) >> 1) | 0x8000));
+      if (stop == 0)
+      {
+	n += 16;
+	continue;
+      }
+      n += __builtin_ctz(stop);
+      break;
+    }
+#endif
+    if (n >= len)
+      return len;
+    if (WS_ORDINARY(s[n]))
+      n++;
+    else if (s[n] != '\n' && isspace(s[n]) && n + 1 < len &&
+	     WS_ORDINARY(s[n+1]))
+      n += 2;
+    else
+      return n;
+  }
+}
+
+static NEOERR *_ws_strip_scan (WS_STRIP *ws, const char *s, int len, int final)
+{
+  NEOERR *err;
+  const char *p;
+  const char *close;
+  int i = 0, n, cl, c;
+
+  if (len && !ws->started)
+  {
+    ws->ws = isspace(s[0]);
+    ws->started = 1;
+  }
+  while (i < len)
+  {
+    switch (ws->state)
+    {
+      case WS_STATE_TAG:
+	p = memchr(s + i, '>', len - i);
+	n = p ? p + 1 - (s + i) : len - i;
+	err = _ws_emit(ws, s + i, n);
+	if (err != STATUS_OK) return nerr_pass(err);
+	i += n;
+	if (p)
+	{
+	  ws->state = WS_STATE_TEXT;
+	  ws->seen_nonws = 1;
+	  ws->ws = 0;
+	}
+	break;
+      case WS_STATE_PRE:
+      case WS_STATE_TEXTAREA:
+	if (ws->state == WS_STATE_PRE)
+	{
+	  close = "/pre>";
+	  cl = 5;
+	}
+	else
+	{
+	  close = "/textarea>";
+	  cl = 10;
+	}
+	p = memchr(s + i, '<', len - i);
+	if (p == NULL)
+	{
+	  err = _ws_emit(ws, s + i, len - i);
+	  if (err != STATUS_OK) return nerr_pass(err);
+	  return STATUS_OK;
+	}
+	n = p - (s + i);
+	if (!final && len - (p + 1 - s) < cl)
+	{
+	  err = _ws_emit(ws, s + i, n);
+	  if (err != STATUS_OK) return nerr_pass(err);
+	  ws->hold_len = len - (p - s);
+	  memcpy(ws->hold, p, ws->hold_len);
+	  return STATUS_OK;
+	}
+	n++;
+	if (len - (p + 1 - s) >= cl && !strncasecmp(p + 1, close, cl))
+	{
+	  n += cl;
+	  ws->state = WS_STATE_TEXT;
+	  ws->seen_nonws = 1;
+	  ws->ws = 0;
+	}
+	err = _ws_emit(ws, s + i, n);
+	if (err != STATUS_OK) return nerr_pass(err);
+	i += n;
+	break;
+      default:
+	if (s[i] == '<')
+	{
+	  n = len - i - 1;
+	  if (!final && n < 8)
+	  {
+	    ws->hold_len = len - i;
+	    memcpy(ws->hold, s + i, ws->hold_len);
+	    return STATUS_OK;
+	  }
+	  err = _ws_pending_flush(ws);
+	  if (err != STATUS_OK) return nerr_pass(err);
+	  /* check the first letters before calling strncasecmp, most
+	   * tags are neither of these */
+	  c = n ? tolower(s[i+1]) : 0;
+	  if (c == 't' && n >= 8 && tolower(s[i+2]) == 'e' &&
+	      !strncasecmp(s + i + 1, "textarea", 8))
+	    ws->state = WS_STATE_TEXTAREA;
+	  else if (c == 'p' && n >= 3 && tolower(s[i+2]) == 'r' &&
+	           !strncasecmp(s + i + 1, "pre", 3))
+	    ws->state = WS_STATE_PRE;
+	  else
+	  {
+	    /* leave the '<' to be copied along with the rest of the tag */
+	    ws->state = WS_STATE_TAG;
+	    break;
+	  }
+	  err = _ws_emit(ws, s + i, 1);
+	  if (err != STATUS_OK) return nerr_pass(err);
+	  i++;
+	}
+	else if (s[i] == '\n')
+	{
+	  /* erase the whitespace at the eol and any blank lines */
+	  ws->pending[0] = '\n';
+	  ws->pending_len = 1;
+	  ws->ws = ws->level > 1;
+	  ws->seen_nonws = ws->level > 1;
+	  i++;
+	}
+	else if (ws->seen_nonws && isspace(s[i]))
+	{
+	  if (!ws->ws)
+	  {
+	    err = _ws_pending_add(ws, s[i]);
+	    if (err != STATUS_OK) return nerr_pass(err);
+	    ws->ws = 1;
+	  }
+	  i++;
+	}
+	else if (isspace(s[i]))
+	{
+	  err = _ws_pending_add(ws, s[i]);
+	  if (err != STATUS_OK) return nerr_pass(err);
+	  ws->seen_nonws = 1;
+	  ws->ws = 0;
+	  i++;
+	}
+	else
+	{
+	  /* copy the whole run of text at once, the single spaces between
+	   * words in it are always kept */
+	  n = _ws_text_end(s, i + 1, len);
+	  err = _ws_pending_flush(ws);
+	  if (err != STATUS_OK) return nerr_pass(err);
+	  err = _ws_emit(ws, s + i, n - i);
+	  if (err != STATUS_OK) return nerr_pass(err);
+	  i = n;
+	  ws->seen_nonws = 1;
+	  ws->ws = 0;
+	}
+	break;
+    }
+  }
+  return STATUS_OK;
+}
+
+static NEOERR *_ws_strip_run (WS_STRIP *ws, const char *s, int len, int final)
+{
+  NEOERR *err;
+
+  err = _ws_strip_scan(ws, s, len, final);
+  if (err != STATUS_OK) return nerr_pass(err);
+  return nerr_pass(_ws_span_flush(ws));
+}
+
+static NEOERR *_ws_strip_write (WS_STRIP *ws, const char *buf, int len)
+{
+  NEOERR *err;
+  char tmp[sizeof(ws->hold)];
+  int n, l;
+
+  /* Finish off anything held back from the last write, a bite at a
+   * time, before handling the rest of the buffer directly */
+  while (ws->hold_len && len)
+  {
+    n = MIN(len, (int)sizeof(tmp) - ws->hold_len);
+    memcpy(tmp, ws->hold, ws->hold_len);
+    memcpy(tmp + ws->hold_len, buf, n);
+    l = ws->hold_len + n;
+    ws->hold_len = 0;
+    buf += n;
+    len -= n;
+    err = _ws_strip_run(ws, tmp, l, 0);
+    if (err != STATUS_OK) return nerr_pass(err);
+  }
+  if (len)
+    return nerr_pass(_ws_strip_run(ws, buf, len, 0));
+  return STATUS_OK;
+}
+
+static NEOERR *_ws_strip_finish (WS_STRIP *ws)
+{
+  NEOERR *err;
+  char tmp[sizeof(ws->hold)];
+  int l;
+
+  if (ws->hold_len)
+  {
+    l = ws->hold_len;
+    memcpy(tmp, ws->hold, l);
+    ws->hold_len = 0;
+    err = _ws_strip_run(ws, tmp, l, 1);
+    if (err != STATUS_OK) return nerr_pass(err);
+  }
+  return nerr_pass(_ws_pending_flush(ws));
+}
+
+/* cgi_html_ws_strip runs the filter over the string in place, which
+ * works since the output never gets ahead of the input */
+static NEOERR *_ws_emit_inplace (void *ctx, const char *buf, int len)
+{
+  STRING *out = (STRING *)ctx;
+
+  memmove(out->buf + out->len, buf, len);
+  out->len += len;
+  return STATUS_OK;
+}
+
+void cgi_html_ws_strip(STRING *str, int level)
+{
+  NEOERR *err;
+  WS_STRIP ws;
+  STRING out;
+
+  if (str->buf == NULL) return;
+  out.buf = str->buf;
+  out.len = 0;
+  _ws_strip_init(&ws, level, _ws_emit_inplace, &out);
+  err = _ws_strip_run(&ws, str->buf, str->len, 1);
+  if (err == STATUS_OK)
+    err = _ws_pending_flush(&ws);
+  nerr_ignore(&err);
+  str->len = out.len;
+  str->buf[str->len] = '\0';
+}
+
+/*
+ * We use this function when there's no better option than to just log
+ * and free the error chain.
+ */
+static void _log_clear_error (NEOERR **err)
+{
+  nerr_warn_error(*err);
+  nerr_ignore(err);
+}
+
+/* The output settings shared by cgi_output and the streaming output,
+ * this also negotiates the content encoding and sets the header for it */
+typedef struct _output_opts
+{
+  int is_html;
+  int use_deflate;
+  int use_gzip;
+  int do_debug;
+  int do_timefooter;
+  int ws_strip_level;
+} OUTPUT_OPTS;
+
+static NEOERR *_output_opts (CGI *cgi, OUTPUT_OPTS *opts)
+{
+  NEOERR *err = STATUS_OK;
+  char *s, *e;
+
+  memset(opts, 0, sizeof(OUTPUT_OPTS));
+  s = hdf_get_value (cgi->hdf, "Query.debug", NULL);
+  e = hdf_get_value (cgi->hdf, "Config.DebugPassword", NULL);
+  if (hdf_get_int_value(cgi->hdf, "Config.DebugEnabled", 0) && 
+      s && e && !strcmp(s, e)) opts->do_debug = 1;
+  opts->do_timefooter = hdf_get_int_value (cgi->hdf, "Config.TimeFooter", 1);
+  opts->ws_strip_level = hdf_get_int_value (cgi->hdf, "Config.WhiteSpaceStrip", 1);
+
+  s = hdf_get_value (cgi->hdf, "cgiout.ContentType", "text/html");
+  if (!strcasecmp(s, "text/html"))
+    opts->is_html = 1;
+
+#if defined(HTML_COMPRESSION)
+  /* Determine whether or not we can compress the output */
+  if (opts->is_html && hdf_get_int_value (cgi->hdf, "Config.CompressionEnabled", 0))
+  {
+    err = hdf_get_copy (cgi->hdf, "HTTP.AcceptEncoding", &s, NULL);
+    if (err != STATUS_OK) return nerr_pass (err);
+    if (s)
+    {
       char *next = NULL;
 
       e = strtok_r (s, ",", &next);
-      while (e && !use_deflate)
+      while (e && !opts->use_deflate)
       {
 	if (strstr(e, "deflate") != NULL)
 	{
-	  use_deflate = 1;
-	  use_gzip = 0;
+	  opts->use_deflate = 1;
+	  opts->use_gzip = 0;
 	}
 	else if (strstr(e, "gzip") != NULL)
-	  use_gzip = 1;
+	  opts->use_gzip = 1;
 	e = strtok_r (NULL, ",", &next);
       }
       free (s);
@@ -1270,30 +1769,30 @@ NEOERR *cgi_output (CGI *cgi, STRING *str)
 	e = hdf_get_value (cgi->hdf, "HTTP.Accept", NULL);
 	if (e && !strcmp(e, "*/*"))
 	{
-	  use_deflate = 0;
-	  use_gzip = 0;
+	  opts->use_deflate = 0;
+	  opts->use_gzip = 0;
 	}
       }
       else
       {
 	if (strncasecmp(s, "mozilla/5.", 10))
 	{
-	  use_deflate = 0;
-	  use_gzip = 0;
+	  opts->use_deflate = 0;
+	  opts->use_gzip = 0;
 	}
       }
     }
     else
     {
-      use_deflate = 0;
-      use_gzip = 0;
+      opts->use_deflate = 0;
+      opts->use_gzip = 0;
     }
-    if (use_deflate)
+    if (opts->use_deflate)
     {
       err = hdf_set_value (cgi->hdf, "cgiout.other.encoding",
 	  "Content-Encoding: deflate");
     }
-    else if (use_gzip)
+    else if (opts->use_gzip)
     {
       err = hdf_set_value (cgi->hdf, "cgiout.other.encoding",
 	  "Content-Encoding: gzip");
@@ -1302,124 +1801,475 @@ NEOERR *cgi_output (CGI *cgi, STRING *str)
   }
 #endif
 
-  err = cgi_headers(cgi);
+  return STATUS_OK;
+}
+
+static NEOERR *_output_debug (CGI *cgi, STRING *str)
+{
+  NEOERR *err;
+  int x;
+
+  err = string_append (str, "<hr>");
+  if (err != STATUS_OK) return nerr_pass(err);
+  x = 0;
+  while (1)
+  {
+    char *k, *v;
+    err = cgiwrap_ctx_iterenv (cgi->wrap, x, &k, &v);
+    if (err != STATUS_OK) return nerr_pass(err);
+    if (k == NULL) break;
+    err =string_appendf (str, "%s = %s<br>", k, v);
+    if (err != STATUS_OK) return nerr_pass(err);
+    free(k);
+    free(v);
+    x++;
+  }
+  err = string_append (str, "<pre>");
   if (err != STATUS_OK) return nerr_pass(err);
+  return nerr_pass(hdf_dump_str (cgi->hdf, NULL, 0, str));
+}
+
+/* Streaming output: the rendered output goes through the whitespace
+ * filter into a fixed size buffer, which is compressed (if the client
+ * accepts it) and written out whenever it fills, so nothing ever holds
+ * the whole page. */
+#define CGI_STREAM_BUF_SIZE 8192
+
+struct _cgi_stream
+{
+  CGI *cgi;
+  OUTPUT_OPTS opts;
+  WS_STRIP ws;
+  char *flush_after;
+  int flush_match;
+  /* flush_fail[k] is how much of flush_after is still matched after a
+   * mismatch with k + 1 matched, as in Knuth-Morris-Pratt */
+  int *flush_fail;
+  /* headers waiting to go out with the first data */
+  STRING head;
+#if defined(HTML_COMPRESSION)
+  z_stream *zstream;
+  int level;
+  int mem_level;
+  uLong crc;
+  char zbuf[CGI_STREAM_BUF_SIZE];
+#endif
+  int len;
+  char buf[CGI_STREAM_BUF_SIZE];
+};
 
-  if (is_html)
+/* How far _stream_flush pushes the output: just write out the buffer,
+ * make sure everything so far reaches the client, or end the stream */
+#define STREAM_FLUSH_BUF    0
+#define STREAM_FLUSH_SYNC   1
+#define STREAM_FLUSH_FINISH 2
+
+/* Writes any pending headers, a and b with a single cgiwrap_ctx_writev */
+static NEOERR *_stream_send (CGI_STREAM *stream, const char *a, int alen,
+                             const char *b, int blen)
+{
+  NEOERR *err;
+  struct iovec iov[3];
+  int n = 0;
+
+  if (stream->head.len)
+  {
+    iov[n].iov_base = stream->head.buf;
+    iov[n++].iov_len = stream->head.len;
+  }
+  if (alen)
   {
-    char buf[50];
-    int x;
+    iov[n].iov_base = (char *)a;
+    iov[n++].iov_len = alen;
+  }
+  if (blen)
+  {
+    iov[n].iov_base = (char *)b;
+    iov[n++].iov_len = blen;
+  }
+  if (n == 0) return STATUS_OK;
+  err = cgiwrap_ctx_writev(stream->cgi->wrap, iov, n);
+  if (err != STATUS_OK) return nerr_pass(err);
+  string_clear(&(stream->head));
+  return STATUS_OK;
+}
 
-    if (do_timefooter)
+static NEOERR *_stream_flush (CGI_STREAM *stream, int flush)
+{
+  NEOERR *err = STATUS_OK;
+
+#if defined(HTML_COMPRESSION)
+  if (stream->zstream)
+  {
+    z_stream *z = stream->zstream;
+    int ret, n;
+
+    if (stream->opts.use_gzip)
+      stream->crc = crc32(stream->crc, (const Bytef *)stream->buf,
+	                  stream->len);
+    z->next_in = (Bytef *)stream->buf;
+    z->avail_in = (uInt)stream->len;
+    do
     {
-      snprintf (buf, sizeof(buf), "\n<!-- %5.3f:%d -->\n",
-	  dis - cgi->time_start, use_deflate || use_gzip);
-      err = string_append (str, buf);
-      if (err != STATUS_OK) return nerr_pass(err);
-    }
+      z->next_out = (Bytef *)stream->zbuf;
+      z->avail_out = sizeof(stream->zbuf);
+      ret = deflate(z, flush == STREAM_FLUSH_FINISH ? Z_FINISH :
+	                 flush == STREAM_FLUSH_SYNC ? Z_SYNC_FLUSH : Z_NO_FLUSH);
+      if (ret == Z_STREAM_ERROR)
+	return nerr_raise(NERR_SYSTEM, "deflate returned %d", ret);
+      n = sizeof(stream->zbuf) - z->avail_out;
+      if (n)
+      {
+	err = _stream_send(stream, stream->zbuf, n, NULL, 0);
+	if (err != STATUS_OK) return nerr_pass(err);
+      }
+    } while (z->avail_out == 0);
+    stream->len = 0;
+  }
+  else
+#endif
+  {
+    err = _stream_send(stream, stream->buf, stream->len, NULL, 0);
+    stream->len = 0;
+    if (err != STATUS_OK) return nerr_pass(err);
+  }
+  /* an empty body still needs its headers */
+  if (flush != STREAM_FLUSH_BUF && stream->head.len)
+  {
+    err = _stream_send(stream, NULL, 0, NULL, 0);
+    if (err != STATUS_OK) return nerr_pass(err);
+  }
+  if (flush == STREAM_FLUSH_SYNC)
+    return nerr_pass(cgiwrap_ctx_flush(stream->cgi->wrap));
+  return STATUS_OK;
+}
+
+static NEOERR *_stream_flush_init (CGI_STREAM *stream)
+{
+  const char *m = stream->flush_after;
+  int x, k = 0;
+
+  stream->flush_fail = (int *) malloc(strlen(m) * sizeof(int));
+  if (stream->flush_fail == NULL)
+    return nerr_raise(NERR_NOMEM, "Unable to allocate space for FlushAfter");
+  stream->flush_fail[0] = 0;
+  for (x = 1; m[x]; x++)
+  {
+    while (k && m[x] != m[k])
+      k = stream->flush_fail[k - 1];
+    if (m[x] == m[k])
+      k++;
+    stream->flush_fail[x] = k;
+  }
+  return STATUS_OK;
+}
+
+/* Returns how much of buf to take before flushing for
+ * Config.FlushAfter, or len if the marker isn't completed in buf.  The
+ * match carries over from the previous buf. */
+static int _stream_flush_point (CGI_STREAM *stream, const char *buf, int len)
+{
+  const char *m = stream->flush_after;
+  int k = stream->flush_match;
+  int x = 0;
 
-    if (ws_strip_level)
+  while (x < len)
+  {
+    if (k == 0)
+    {
+      const char *p = memchr(buf + x, m[0], len - x);
+      if (p == NULL) break;
+      x = p - buf;
+    }
+    while (k && buf[x] != m[k])
+      k = stream->flush_fail[k - 1];
+    if (buf[x] == m[k])
     {
-      cgi_html_ws_strip(str, ws_strip_level);
+      k++;
+      if (m[k] == '\0')
+      {
+	stream->flush_match = k;
+	return x + 1;
+      }
     }
+    x++;
+  }
+  stream->flush_match = k;
+  return len;
+}
+
+static int _stream_compressed (CGI_STREAM *stream)
+{
+#if defined(HTML_COMPRESSION)
+  return stream->zstream != NULL;
+#else
+  return 0;
+#endif
+}
+
+static NEOERR *_stream_emit (void *ctx, const char *buf, int len)
+{
+  CGI_STREAM *stream = (CGI_STREAM *)ctx;
+  NEOERR *err;
+  int n, l, sync;
 
-    if (do_debug)
+  while (len)
+  {
+    l = len;
+    sync = 0;
+    if (stream->flush_after)
     {
-      err = string_append (str, "<hr>");
+      l = _stream_flush_point(stream, buf, len);
+      if (stream->flush_after[stream->flush_match] == '\0')
+      {
+	/* only the first one */
+	stream->flush_after = NULL;
+	sync = 1;
+      }
+    }
+    len -= l;
+    if (l >= (int)sizeof(stream->buf) && !_stream_compressed(stream))
+    {
+      /* too big to be worth copying, send it along with the buffer */
+      err = _stream_send(stream, stream->buf, stream->len, buf, l);
+      stream->len = 0;
       if (err != STATUS_OK) return nerr_pass(err);
-      x = 0;
-      while (1)
+      buf += l;
+      l = 0;
+    }
+    while (l)
+    {
+      n = MIN(l, (int)sizeof(stream->buf) - stream->len);
+      memcpy(stream->buf + stream->len, buf, n);
+      stream->len += n;
+      buf += n;
+      l -= n;
+      if (stream->len == sizeof(stream->buf))
       {
-	char *k, *v;
-	err = cgiwrap_iterenv (x, &k, &v);
+	err = _stream_flush(stream, STREAM_FLUSH_BUF);
 	if (err != STATUS_OK) return nerr_pass(err);
-	if (k == NULL) break;
-	err =string_appendf (str, "%s = %s<br>", k, v);
-	if (err != STATUS_OK) return nerr_pass(err);
-	free(k);
-	free(v);
-	x++;
       }
-      err = string_append (str, "<pre>");
-      if (err != STATUS_OK) return nerr_pass(err);
-      err = hdf_dump_str (cgi->hdf, NULL, 0, str);
+    }
+    if (sync)
+    {
+      err = _stream_flush(stream, STREAM_FLUSH_SYNC);
       if (err != STATUS_OK) return nerr_pass(err);
     }
   }
+  return STATUS_OK;
+}
 
-#if defined(HTML_COMPRESSION)
-    if (is_html && (use_deflate || use_gzip))
+NEOERR *cgi_stream_init (CGI_STREAM **stream, CGI *cgi)
+{
+  NEOERR *err;
+  CGI_STREAM *mystream;
+
+  *stream = NULL;
+  mystream = (CGI_STREAM *) calloc (1, sizeof(CGI_STREAM));
+  if (mystream == NULL)
+    return nerr_raise(NERR_NOMEM, "Unable to allocate space for CGI_STREAM");
+  mystream->cgi = cgi;
+  string_init(&(mystream->head));
+
+  do
+  {
+    err = _output_opts(cgi, &(mystream->opts));
+    if (err != STATUS_OK) break;
+    if (mystream->opts.is_html && mystream->opts.ws_strip_level)
+      _ws_strip_init(&(mystream->ws), mystream->opts.ws_strip_level,
+	             _stream_emit, mystream);
+    mystream->flush_after = hdf_get_value(cgi->hdf, "Config.FlushAfter", NULL);
+    if (mystream->flush_after && !mystream->flush_after[0])
+      mystream->flush_after = NULL;
+    if (mystream->flush_after)
     {
-      char *dest;
-      static int gz_magic[2] = {0x1f, 0x8b}; /* gzip magic header */
-      char gz_buf[20]; /* gzip header/footer buffer, len of header is 10 bytes */
-      unsigned int crc = 0;
-      int len2;
+      err = _stream_flush_init(mystream);
+      if (err != STATUS_OK) break;
+    }
 
-      if (use_gzip)
-      {
-	crc = crc32(0L, Z_NULL, 0);
-	crc = crc32(crc, (const Bytef *)(str->buf), str->len);
-      }
-      len2 = str->len * 2;
-      dest = (char *) malloc (sizeof(char) * len2);
-      if (dest != NULL)
+#if defined(HTML_COMPRESSION)
+    if (mystream->opts.use_deflate || mystream->opts.use_gzip)
+    {
+      mystream->level = hdf_get_int_value(cgi->hdf,
+	  "Config.CompressionLevel", Z_DEFAULT_COMPRESSION);
+      mystream->mem_level = hdf_get_int_value(cgi->hdf,
+	  "Config.CompressionMemLevel", DEF_MEM_LEVEL);
+      mystream->zstream = deflate_get(mystream->level, mystream->mem_level);
+      if (mystream->zstream)
       {
-	do {
-	  err = cgi_compress (str, dest, &len2);
-	  if (err == STATUS_OK)
-	  {
-	    if (use_gzip)
-	    {
-	      /* I'm using snprintf instead of cgiwrap_writef since
-	       * the wrapper writef might not handle values with
-	       * embedded NULLs... though I should fix the python one
-	       * now as well */
-	      snprintf(gz_buf, sizeof(gz_buf), "%c%c%c%c%c%c%c%c%c%c",
-                  gz_magic[0], gz_magic[1],
-		  Z_DEFLATED, 0 /*flags*/, 0,0,0,0 /*time*/, 0 /*xflags*/,
-		  OS_CODE);
-	      err = cgiwrap_write(gz_buf, 10);
-	    }
-	    if (err != STATUS_OK) break;
-	    err = cgiwrap_write(dest, len2);
-	    if (err != STATUS_OK) break;
-
-	    if (use_gzip)
-	    {
-	      /* write crc and len in network order */
-	      snprintf(gz_buf, sizeof(gz_buf), "%c%c%c%c%c%c%c%c",
-		  (0xff & (crc >> 0)),
-		  (0xff & (crc >> 8)),
-		  (0xff & (crc >> 16)),
-		  (0xff & (crc >> 24)),
-		  (0xff & (str->len >> 0)),
-		  (0xff & (str->len >> 8)),
-		  (0xff & (str->len >> 16)),
-		  (0xff & (str->len >> 24)));
-	      err = cgiwrap_write(gz_buf, 8);
-	      if (err != STATUS_OK) break;
-	    }
-	  }
-	  else
-	  {
-	    _log_clear_error (&err);
-	    err = cgiwrap_write(str->buf, str->len);
-	  }
-	} while (0);
-	free (dest);
+	mystream->crc = crc32(0L, Z_NULL, 0);
       }
       else
       {
-	err = cgiwrap_write(str->buf, str->len);
+	/* Send it uncompressed, the header hasn't gone out yet */
+	mystream->opts.use_deflate = 0;
+	mystream->opts.use_gzip = 0;
+	err = hdf_remove_tree(cgi->hdf, "cgiout.other.encoding");
+	if (err != STATUS_OK) break;
       }
     }
-    else
 #endif
+
+    err = cgi_headers(cgi, &(mystream->head));
+    if (err != STATUS_OK) break;
+
+#if defined(HTML_COMPRESSION)
+    if (mystream->opts.use_gzip)
+    {
+      unsigned char gz_buf[10] = {0x1f, 0x8b, Z_DEFLATED, 0 /*flags*/,
+	                          0, 0, 0, 0 /*time*/, 0 /*xflags*/, OS_CODE};
+
+      err = string_appendn(&(mystream->head), (char *)gz_buf,
+	                   sizeof(gz_buf));
+      if (err != STATUS_OK) break;
+    }
+#endif
+  } while (0);
+
+  if (err != STATUS_OK)
+  {
+    cgi_stream_destroy(&mystream);
+    return nerr_pass(err);
+  }
+  *stream = mystream;
+  return STATUS_OK;
+}
+
+NEOERR *cgi_stream_write (CGI_STREAM *stream, const char *buf, int len)
+{
+  if (stream->ws.level)
+    return nerr_pass(_ws_strip_write(&(stream->ws), buf, len));
+  return nerr_pass(_stream_emit(stream, buf, len));
+}
+
+NEOERR *cgi_stream_file (CGI_STREAM *stream, int fd, off_t offset,
+                         off_t count)
+{
+  NEOERR *err;
+  char buf[CGI_STREAM_BUF_SIZE];
+  ssize_t r;
+
+  /* Without any filtering, the file can go straight out */
+  if (!stream->ws.level && !stream->flush_after && !_stream_compressed(stream))
+  {
+    err = _stream_send(stream, stream->buf, stream->len, NULL, 0);
+    stream->len = 0;
+    if (err != STATUS_OK) return nerr_pass(err);
+    return nerr_pass(cgiwrap_ctx_sendfile(stream->cgi->wrap, fd, offset, count));
+  }
+  while (count > 0)
+  {
+    r = pread(fd, buf, count < sizeof(buf) ? count : sizeof(buf), offset);
+    if (r < 0)
     {
-      err = cgiwrap_write(str->buf, str->len);
+      if (errno == EINTR) continue;
+      return nerr_raise_errno(NERR_IO, "Unable to read fd %d", fd);
     }
+    if (r == 0)
+      return nerr_raise(NERR_IO, "Unexpected end of file on fd %d", fd);
+    err = cgi_stream_write(stream, buf, r);
+    if (err != STATUS_OK) return nerr_pass(err);
+    offset += r;
+    count -= r;
+  }
+  return STATUS_OK;
+}
+
+NEOERR *cgi_stream_cb (void *ctx, char *buf)
+{
+  return nerr_pass(cgi_stream_write((CGI_STREAM *)ctx, buf, strlen(buf)));
+}
+
+NEOERR *cgi_stream_finish (CGI_STREAM *stream)
+{
+  NEOERR *err;
+  CGI *cgi = stream->cgi;
 
+  if (stream->opts.is_html)
+  {
+    if (stream->opts.do_timefooter)
+    {
+      char buf[50];
+
+      snprintf (buf, sizeof(buf), "\n<!-- %5.3f:%d -->\n",
+	  ne_timef() - cgi->time_start,
+	  stream->opts.use_deflate || stream->opts.use_gzip);
+      err = cgi_stream_write(stream, buf, strlen(buf));
+      if (err != STATUS_OK) return nerr_pass(err);
+    }
+
+    if (stream->ws.level)
+    {
+      err = _ws_strip_finish(&(stream->ws));
+      if (err != STATUS_OK) return nerr_pass(err);
+    }
+
+    if (stream->opts.do_debug)
+    {
+      STRING str;
+
+      string_init(&str);
+      err = _output_debug(cgi, &str);
+      if (err == STATUS_OK)
+	err = _stream_emit(stream, str.buf, str.len);
+      string_clear(&str);
+      if (err != STATUS_OK) return nerr_pass(err);
+    }
+  }
+
+  err = _stream_flush(stream, STREAM_FLUSH_FINISH);
+  if (err != STATUS_OK) return nerr_pass(err);
+
+#if defined(HTML_COMPRESSION)
+  if (stream->opts.use_gzip)
+  {
+    /* write crc and len in network order */
+    uLong crc = stream->crc;
+    uLong len = stream->zstream->total_in;
+    unsigned char gz_buf[8];
+
+    gz_buf[0] = 0xff & (crc >> 0);
+    gz_buf[1] = 0xff & (crc >> 8);
+    gz_buf[2] = 0xff & (crc >> 16);
+    gz_buf[3] = 0xff & (crc >> 24);
+    gz_buf[4] = 0xff & (len >> 0);
+    gz_buf[5] = 0xff & (len >> 8);
+    gz_buf[6] = 0xff & (len >> 16);
+    gz_buf[7] = 0xff & (len >> 24);
+    err = _stream_send(stream, (char *)gz_buf, sizeof(gz_buf), NULL, 0);
+    if (err != STATUS_OK) return nerr_pass(err);
+  }
+#endif
+  return STATUS_OK;
+}
+
+void cgi_stream_destroy (CGI_STREAM **stream)
+{
+  if (!stream || !*stream)
+    return;
+#if defined(HTML_COMPRESSION)
+  if ((*stream)->zstream)
+    deflate_release((*stream)->zstream, (*stream)->level,
+                    (*stream)->mem_level);
+#endif
+  string_clear(&((*stream)->head));
+  if ((*stream)->flush_fail)
+    free ((*stream)->flush_fail);
+  free (*stream);
+  *stream = NULL;
+}
+
+NEOERR *cgi_output (CGI *cgi, STRING *str)
+{
+  NEOERR *err;
+  CGI_STREAM *stream;
+
+  err = cgi_stream_init(&stream, cgi);
+  if (err != STATUS_OK) return nerr_pass(err);
+  err = cgi_stream_write(stream, str->buf, str->len);
+  if (err == STATUS_OK)
+    err = cgi_stream_finish(stream);
+  cgi_stream_destroy(&stream);
   return nerr_pass(err);
 }
 
@@ -1490,21 +2340,53 @@ NEOERR *cgi_cs_init(CGI *cgi, CSPARSE **cs)
   return nerr_pass(err);
 }
 
+static int _display_dump_enabled (CGI *cgi)
+{
+  char *debug;
+  char *t;
+
+  debug = hdf_get_value (cgi->hdf, "Query.debug", NULL);
+  t = hdf_get_value (cgi->hdf, "Config.DumpPassword", NULL);
+  if (hdf_get_int_value(cgi->hdf, "Config.DebugEnabled", 0) &&
+      debug && t && !strcmp (debug, t)) return 1;
+  return 0;
+}
+
+static NEOERR *_display_dump (CGI *cgi, CSPARSE *cs, STRING *str)
+{
+  NEOERR *err;
+
+  err = cgiwrap_ctx_writef(cgi->wrap, "Content-Type: text/plain\n\n");
+  if (err != STATUS_OK) return nerr_pass(err);
+  err = hdf_dump_str(cgi->hdf, "", 0, str);
+  if (err != STATUS_OK) return nerr_pass(err);
+  err = cs_dump(cs, str, render_cb);
+  if (err != STATUS_OK) return nerr_pass(err);
+  return nerr_pass(cgiwrap_ctx_writef(cgi->wrap, "%s", str->buf));
+}
+
 NEOERR *cgi_display (CGI *cgi, const char *cs_file)
 {
   NEOERR *err = STATUS_OK;
-  char *debug;
   CSPARSE *cs = NULL;
   STRING str;
-  int do_dump = 0;
-  char *t;
+  int do_dump;
+
+  if (hdf_get_int_value(cgi->hdf, "Config.TemplateCache", 0))
+  {
+    CS_TEMPLATE *tmpl;
+
+    err = cs_template_cache_get(&tmpl, cgi->hdf, cs_file,
+                                cgi_register_strfuncs);
+    if (err != STATUS_OK) return nerr_pass(err);
+    err = cgi_display_template(cgi, tmpl);
+    cs_template_destroy(&tmpl);
+    return nerr_pass(err);
+  }
 
   string_init(&str);
 
-  debug = hdf_get_value (cgi->hdf, "Query.debug", NULL);
-  t = hdf_get_value (cgi->hdf, "Config.DumpPassword", NULL);
-  if (hdf_get_int_value(cgi->hdf, "Config.DebugEnabled", 0) &&
-      debug && t && !strcmp (debug, t)) do_dump = 1;
+  do_dump = _display_dump_enabled(cgi);
 
   do
   {
@@ -1516,13 +2398,19 @@ NEOERR *cgi_display (CGI *cgi, const char *cs_file)
     if (err != STATUS_OK) break;
     if (do_dump)
     {
-      err = cgiwrap_writef("Content-Type: text/plain\n\n");
-      if (err != STATUS_OK) break;
-      err = hdf_dump_str(cgi->hdf, "", 0, &str);
-      if (err != STATUS_OK) break;
-      err = cs_dump(cs, &str, render_cb);
+      err = _display_dump(cgi, cs, &str);
+      break;
+    }
+    else if (hdf_get_int_value(cgi->hdf, "Config.StreamOutput", 0))
+    {
+      CGI_STREAM *stream;
+
+      err = cgi_stream_init(&stream, cgi);
       if (err != STATUS_OK) break;
-      err = cgiwrap_writef("%s", str.buf);
+      err = cs_render (cs, stream, cgi_stream_cb);
+      if (err == STATUS_OK)
+	err = cgi_stream_finish(stream);
+      cgi_stream_destroy(&stream);
       break;
     }
     else
@@ -1539,27 +2427,63 @@ NEOERR *cgi_display (CGI *cgi, const char *cs_file)
   return nerr_pass(err);
 }
 
+NEOERR *cgi_display_template (CGI *cgi, CS_TEMPLATE *tmpl)
+{
+  NEOERR *err = STATUS_OK;
+  STRING str;
+
+  string_init(&str);
+
+  do
+  {
+    if (_display_dump_enabled(cgi))
+    {
+      err = _display_dump(cgi, tmpl->parse, &str);
+      break;
+    }
+    if (hdf_get_int_value(cgi->hdf, "Config.StreamOutput", 0))
+    {
+      CGI_STREAM *stream;
+
+      err = cgi_stream_init(&stream, cgi);
+      if (err != STATUS_OK) break;
+      err = cs_template_render (tmpl, cgi->hdf, stream, cgi_stream_cb);
+      if (err == STATUS_OK)
+	err = cgi_stream_finish(stream);
+      cgi_stream_destroy(&stream);
+      break;
+    }
+    err = cs_template_render (tmpl, cgi->hdf, &str, render_cb);
+    if (err != STATUS_OK) break;
+    err = cgi_output(cgi, &str);
+  } while (0);
+
+  string_clear (&str);
+  return nerr_pass(err);
+}
+
 /*
  * All errors that occur in this function are just dumped to stderr,
  * since we're already trying to display an error.
  */
 void cgi_neo_error (CGI *cgi, NEOERR *given_err)
 {
+  CGIWRAP_CTX *wrap = cgi ? cgi->wrap : NULL;
   NEOERR *err;
   STRING str;
 
   string_init(&str);
-  err = cgiwrap_writef("Status: 500\n");
+  err = cgiwrap_ctx_writef(wrap, "Status: 500\n");
   if (err != STATUS_OK) _log_clear_error(&err);
-  err = cgiwrap_writef("Content-Type: text/html\n\n");
+  err = cgiwrap_ctx_writef(wrap, "Content-Type: text/html\n\n");
   if (err != STATUS_OK) _log_clear_error(&err);
 
-  err = cgiwrap_writef("<html><body>\nAn error occured:<pre>");
+  err = cgiwrap_ctx_writef(wrap, "<html><body>\nAn error occured:<pre>");
   if (err != STATUS_OK) _log_clear_error(&err);
   nerr_error_traceback(given_err, &str);
-  err = cgiwrap_write(str.buf, str.len);
+  err = cgiwrap_ctx_write(wrap, str.buf, str.len);
   if (err != STATUS_OK) _log_clear_error(&err);
-  err = cgiwrap_writef("</pre></body></html>\n");
+  err = cgiwrap_ctx_writef(wrap, "</pre></body></html>\n");
   if (err != STATUS_OK) _log_clear_error(&err);
   string_clear(&str);
 }
@@ -1570,6 +2494,7 @@ void cgi_neo_error (CGI *cgi, NEOERR *given_err)
  */
 void cgi_error (CGI *cgi, const char *fmt, ...)
 {
+  CGIWRAP_CTX *wrap = cgi ? cgi->wrap : NULL;
   NEOERR *err;
   va_list ap;
   char *error = NULL;
@@ -1585,16 +2510,16 @@ void cgi_error (CGI *cgi, const char *fmt, ...)
   }
   ne_warn("500 ERROR: %s", error);
 
-  err = cgiwrap_writef("Status: 500\n");
+  err = cgiwrap_ctx_writef(wrap, "Status: 500\n");
   if (err != STATUS_OK) _log_clear_error(&err);
-  err = cgiwrap_writef("Content-Type: text/html\n\n");
+  err = cgiwrap_ctx_writef(wrap, "Content-Type: text/html\n\n");
   if (err != STATUS_OK) _log_clear_error(&err);
-  err = cgiwrap_writef("<html><body>\nAn error occured:<pre>");
+  err = cgiwrap_ctx_writef(wrap, "<html><body>\nAn error occured:<pre>");
   if (err != STATUS_OK) _log_clear_error(&err);
-  err = cgiwrap_write (error, len);
+  err = cgiwrap_ctx_write(wrap, error, len);
   if (err != STATUS_OK) _log_clear_error(&err);
   va_end (ap);
-  err = cgiwrap_writef("</pre></body></html>\n");
+  err = cgiwrap_ctx_writef(wrap, "</pre></body></html>\n");
   if (err != STATUS_OK) _log_clear_error(&err);
 }
 
@@ -1631,20 +2556,20 @@ void cgi_vredirect (CGI *cgi, int uri, const char *fmt, va_list ap)
 {
   NEOERR *err;
 
-  err = cgiwrap_writef ("Status: 302\r\n");
+  err = cgiwrap_ctx_writef (cgi->wrap, "Status: 302\r\n");
   if (err != STATUS_OK) _log_clear_error(&err);
-  err = cgiwrap_writef ("Content-Type: text/html\r\n");
+  err = cgiwrap_ctx_writef (cgi->wrap, "Content-Type: text/html\r\n");
   if (err != STATUS_OK) _log_clear_error(&err);
-  err = cgiwrap_writef ("Pragma: no-cache\r\n");
+  err = cgiwrap_ctx_writef (cgi->wrap, "Pragma: no-cache\r\n");
   if (err != STATUS_OK) _log_clear_error(&err);
-  err = cgiwrap_writef ("Expires: Fri, 01 Jan 1999 00:00:00 GMT\r\n");
+  err = cgiwrap_ctx_writef (cgi->wrap, "Expires: Fri, 01 Jan 1999 00:00:00 GMT\r\n");
   if (err != STATUS_OK) _log_clear_error(&err);
-  err = cgiwrap_writef ("Cache-control: no-cache, no-cache=\"Set-Cookie\", private\r\n");
+  err = cgiwrap_ctx_writef (cgi->wrap, "Cache-control: no-cache, no-cache=\"Set-Cookie\", private\r\n");
   if (err != STATUS_OK) _log_clear_error(&err);
 
   if (uri)
   {
-    err = cgiwrap_writef ("Location: ");
+    err = cgiwrap_ctx_writef (cgi->wrap, "Location: ");
     if (err != STATUS_OK) _log_clear_error(&err);
   }
   else
@@ -1661,7 +2586,7 @@ void cgi_vredirect (CGI *cgi, int uri, const char *fmt, va_list ap)
     if (host == NULL)
       host = hdf_get_value (cgi->hdf, "CGI.ServerName", "localhost");
 
-    err = cgiwrap_writef ("Location: %s://%s", https ? "https" : "http", host);
+    err = cgiwrap_ctx_writef (cgi->wrap, "Location: %s://%s", https ? "https" : "http", host);
     if (err != STATUS_OK) _log_clear_error(&err);
 
     if ((strchr(host, ':') == NULL)) {
@@ -1669,32 +2594,32 @@ void cgi_vredirect (CGI *cgi, int uri, const char *fmt, va_list ap)
 
       if (!((https && port == 443) || (!https && port == 80)))
       {
-	err = cgiwrap_writef(":%d", port);
+	err = cgiwrap_ctx_writef(cgi->wrap, ":%d", port);
         if (err != STATUS_OK) _log_clear_error(&err);
       }
     }
   }
-  err = cgiwrap_writevf (fmt, ap);
+  err = cgiwrap_ctx_writevf (cgi->wrap, fmt, ap);
   if (err != STATUS_OK) _log_clear_error(&err);
-  err = cgiwrap_writef ("\r\n\r\n");
+  err = cgiwrap_ctx_writef (cgi->wrap, "\r\n\r\n");
   if (err != STATUS_OK) _log_clear_error(&err);
-  err = cgiwrap_writef ("Redirect page<br><br>\n");
+  err = cgiwrap_ctx_writef (cgi->wrap, "Redirect page<br><br>\n");
   if (err != STATUS_OK) _log_clear_error(&err);
 #if 0
   /* Apparently this crashes on some computers... I don't know if its
    * legal to reuse the va_list */
-  err = cgiwrap_writef ("  Destination: <A HREF=\"");
+  err = cgiwrap_ctx_writef (cgi->wrap, "  Destination: <A HREF=\"");
   if (err != STATUS_OK) _log_clear_error(&err);
-  err = cgiwrap_writevf (fmt, ap);
+  err = cgiwrap_ctx_writevf (cgi->wrap, fmt, ap);
   if (err != STATUS_OK) _log_clear_error(&err);
-  err = cgiwrap_writef ("\">");
+  err = cgiwrap_ctx_writef (cgi->wrap, "\">");
   if (err != STATUS_OK) _log_clear_error(&err);
-  err = cgiwrap_writevf (fmt, ap);
+  err = cgiwrap_ctx_writevf (cgi->wrap, fmt, ap);
   if (err != STATUS_OK) _log_clear_error(&err);
-  err = cgiwrap_writef ("</A><BR>\n<BR>\n");
+  err = cgiwrap_ctx_writef (cgi->wrap, "</A><BR>\n<BR>\n");
   if (err != STATUS_OK) _log_clear_error(&err);
 #endif
-  err = cgiwrap_writef ("There is nothing to see here, please move along...");
+  err = cgiwrap_ctx_writef (cgi->wrap, "There is nothing to see here, please move along...");
   if (err != STATUS_OK) _log_clear_error(&err);
 
 }
@@ -1805,7 +2730,7 @@ NEOERR *cgi_cookie_set (CGI *cgi, const char *name, const char *value,
     string_clear(&str);
     return nerr_pass(err);
   }
-  err = cgiwrap_write(str.buf, str.len);
+  err = cgiwrap_ctx_write(cgi->wrap, str.buf, str.len);
   string_clear(&str);
   return nerr_pass(err);
 }
@@ -1822,17 +2747,17 @@ NEOERR *cgi_cookie_clear (CGI *cgi, const char *name, const char *domain,
   {
     if (domain[0] == '.')
     {
-      err = cgiwrap_writef ("Set-Cookie: %s=; path=%s; domain=%s;"
+      err = cgiwrap_ctx_writef (cgi->wrap, "Set-Cookie: %s=; path=%s; domain=%s;"
           "expires=Thursday, 01-Jan-1970 00:00:00 GMT\r\n", name, path,
           domain + 1);
       if (err) return nerr_pass(err);
     }
-    err = cgiwrap_writef("Set-Cookie: %s=; path=%s; domain=%s;"
+    err = cgiwrap_ctx_writef(cgi->wrap, "Set-Cookie: %s=; path=%s; domain=%s;"
         "expires=Thursday, 01-Jan-1970 00:00:00 GMT\r\n", name, path,
         domain);
     if (err) return nerr_pass(err);
   }
-  err = cgiwrap_writef("Set-Cookie: %s=; path=%s; "
+  err = cgiwrap_ctx_writef(cgi->wrap, "Set-Cookie: %s=; path=%s; "
       "expires=Thursday, 01-Jan-1970 00:00:00 GMT\r\n", name, path);
   if (err) return nerr_pass(err);
 
@@ -13,9 +13,11 @@
 #define __CGI_H_ 1
 
 #include <stdarg.h>
+#include <sys/types.h>
 #include "util/neo_err.h"
 #include "util/neo_hdf.h"
 #include "cs/cs.h"
+#include "cgi/cgiwrap.h"
 
 __BEGIN_DECLS
 
@@ -29,8 +31,12 @@ extern NERR_TYPE CGIParseNotHandled;
 extern int IgnoreEmptyFormVars;
 
 typedef struct _cgi CGI;
+typedef struct _cgi_stream CGI_STREAM;
 
 typedef int (*UPLOAD_CB)(CGI *, int nread, int expected);
+typedef NEOERR* (*UPLOAD_PART_CB)(CGI *, const char *name,
+                                  const char *filename, const char *type,
+                                  const char *buf, int len);
 typedef NEOERR* (*CGI_PARSE_CB)(CGI *, char *method, char *ctype, void *rock);
 
 struct _cgi_parse_cb
@@ -53,21 +59,21 @@ struct _cgi
   BOOL ignore_empty_form_vars;
 
   UPLOAD_CB upload_cb;
+  /* If set, the contents of each file uploaded with multipart/form-data
+   * are passed to this as they are read, instead of being saved to a
+   * temporary file for cgi_filehandle.  It is called with NULL and 0 at
+   * the end of each file.  Query.name and Query.name.Type are still
+   * set, but there is no Query.name.FileHandle. */
+  UPLOAD_PART_CB part_cb;
 
   int data_expected;
   int data_read;
   struct _cgi_parse_cb *parse_callbacks;
 
-  /* For line oriented reading of form-data input.  Used during cgi_init
+  /* The buffer for reading form-data input.  Used during cgi_parse
    * only */
   char *buf;
   int buflen;
-  int readlen;
-  BOOL found_nl;
-  BOOL unget;
-  char *last_start;
-  int last_length;
-  int nl;
 
   /* this is a list of filepointers pointing at files that were uploaded */
   /* Use cgi_filehandle to access these */
@@ -82,6 +88,10 @@ struct _cgi
   /* keep track of the time between cgi_init and cgi_render */
   double time_start;
   double time_end;
+
+  /* the cgiwrap context all input and output goes through, NULL for the
+   * default.  Set by cgi_init_ctx, and not owned by the CGI */
+  CGIWRAP_CTX *wrap;
 };
 
 
@@ -110,6 +120,23 @@ struct _cgi
  */
 NEOERR *cgi_init (CGI **cgi, HDF *hdf);
 
+/*
+ * Function: cgi_init_ctx - Initialize a CGI on a cgiwrap context
+ * Description: cgi_init_ctx is cgi_init for a CGI whose environment,
+ *              input and output all go through the given cgiwrap
+ *              context instead of the default one, so that several
+ *              requests can be handled at once in one process, each
+ *              with its own CGI and context (see cgiwrap_ctx_init_emu).
+ *              The context must outlive the CGI.
+ * Input: cgi - a pointer to a CGI pointer
+ *        hdf - as for cgi_init, or NULL.  The CGI takes it over, and
+ *              it is destroyed if cgi_init_ctx fails
+ *        ctx - the cgiwrap context, or NULL for the default
+ * Output: cgi - an allocated CGI struct
+ * Return: as for cgi_init
+ */
+NEOERR *cgi_init_ctx (CGI **cgi, HDF *hdf, CGIWRAP_CTX *ctx);
+
 /*
  * Function: cgi_parse - Parse incoming CGI data
  * Description: We split cgi_init into two sections, one that parses
@@ -221,7 +248,11 @@ NEOERR *cgi_cs_init(CGI *cgi, CSPARSE **cs);
  * Description: cgi_display will render the CS template pointed to by 
  *              cs_file using the CGI's HDF data set, and send the
  *              output to the user.  Note that the output is actually
- *              rendered into memory first.
+ *              rendered into memory first, unless Config.StreamOutput
+ *              is set, in which case it is sent as it is rendered (see
+ *              cgi_stream_init).  If Config.TemplateCache
+ *              is set, the template is parsed once and kept in the
+ *              process wide template cache (see cs_template_cache_get).
  * Input: cgi - a pointer a CGI struct allocated with cgi_init
  *        cs_file - a ClearSilver template file
  * Output: None
@@ -230,11 +261,27 @@ NEOERR *cgi_cs_init(CGI *cgi, CSPARSE **cs);
  */
 NEOERR *cgi_display (CGI *cgi, const char *cs_file);
 
+/*
+ * Function: cgi_display_template - render and display a parsed template
+ * Description: cgi_display_template is like cgi_display, but renders a
+ *              CS_TEMPLATE which was parsed ahead of time (typically
+ *              once per process, with the CGI strfuncs registered via
+ *              cgi_register_strfuncs before parsing) instead of parsing
+ *              the template on every call.
+ * Input: cgi - a pointer a CGI struct allocated with cgi_init
+ *        tmpl - a template created with cs_template_init
+ * Output: None
+ * Return: NERR_IO - an IO error occured during output
+ *         NERR_NOMEM - no memory was available to render the template
+ */
+NEOERR *cgi_display_template (CGI *cgi, CS_TEMPLATE *tmpl);
+
 /*
  * Function: cgi_output - display the CGI output to the user
  * Description: Normally, this is called by cgi_display, but some
  *              people wanted it external so they could call it
- *              directly.
+ *              directly.  The output is stripped and compressed a
+ *              buffer at a time, the same as cgi_stream_write.
  * Input: cgi - a pointer a CGI struct allocated with cgi_init
  *        output - the data to send to output from the CGI
  * Output: None
@@ -243,12 +290,103 @@ NEOERR *cgi_display (CGI *cgi, const char *cs_file);
  */
 NEOERR *cgi_output (CGI *cgi, STRING *output);
 
+/*
+ * Function: cgi_stream_init - start streaming CGI output to the user
+ * Description: cgi_stream_init is the streaming version of cgi_output:
+ *              it writes the headers immediately, and data passed to
+ *              cgi_stream_write is whitespace stripped, compressed and
+ *              sent using a fixed size buffer, so the output can be
+ *              sent as it is rendered (use cgi_stream_cb as the CS
+ *              output function) without holding the whole page in
+ *              memory.  The same Config settings as cgi_output apply:
+ *              Config.CompressionLevel and Config.CompressionMemLevel
+ *              set the zlib level and memLevel, and the output is
+ *              pushed to the client after the first occurrence of
+ *              Config.FlushAfter (eg, "</head>", so the browser can
+ *              start fetching stylesheets).
+ *              Since the headers have already been sent, an error
+ *              during rendering can no longer change the response
+ *              status.
+ * Input: cgi - a pointer a CGI struct allocated with cgi_init
+ * Output: stream - an allocated CGI_STREAM
+ * Return: NERR_IO - an IO error occured during output
+ *         NERR_NOMEM - no memory was available
+ */
+NEOERR *cgi_stream_init (CGI_STREAM **stream, CGI *cgi);
+
+/*
+ * Function: cgi_stream_write - send data on a CGI output stream
+ * Description: cgi_stream_write passes len bytes of buf through the
+ *              stream.  Data is only written out when the stream's
+ *              buffer fills, or by cgi_stream_finish.
+ * Input: stream - a CGI_STREAM created with cgi_stream_init
+ *        buf - the data to send
+ *        len - the length of buf
+ * Output: None
+ * Return: NERR_IO - an IO error occured during output
+ */
+NEOERR *cgi_stream_write (CGI_STREAM *stream, const char *buf, int len);
+
+/*
+ * Function: cgi_stream_file - send part of a file on a CGI output stream
+ * Description: cgi_stream_file sends count bytes of the file fd,
+ *              starting at offset, as though they were passed to
+ *              cgi_stream_write.  When the stream isn't compressing or
+ *              stripping whitespace, anything buffered is written out
+ *              and the file is sent with cgiwrap_sendfile, without
+ *              being copied through the stream.  The file offset of fd
+ *              is not changed.
+ * Input: stream - a CGI_STREAM created with cgi_stream_init
+ *        fd - an open file descriptor to read from
+ *        offset - where in the file to start
+ *        count - the number of bytes to send
+ * Output: None
+ * Return: NERR_IO - an IO error occured reading the file or during
+ *                   output
+ */
+NEOERR *cgi_stream_file (CGI_STREAM *stream, int fd, off_t offset,
+                         off_t count);
+
+/*
+ * Function: cgi_stream_cb - CS output function for a CGI output stream
+ * Description: cgi_stream_cb can be passed to cs_render with a
+ *              CGI_STREAM as the context to stream the rendered output
+ * Input: ctx - a CGI_STREAM created with cgi_stream_init
+ *        buf - the output from cs_render
+ * Output: None
+ * Return: NERR_IO - an IO error occured during output
+ */
+NEOERR *cgi_stream_cb (void *ctx, char *buf);
+
+/*
+ * Function: cgi_stream_finish - complete a CGI output stream
+ * Description: cgi_stream_finish adds the time footer and debug output
+ *              (if enabled), and flushes everything still buffered or
+ *              held by the whitespace stripper and compressor.
+ * Input: stream - a CGI_STREAM created with cgi_stream_init
+ * Output: None
+ * Return: NERR_IO - an IO error occured during output
+ *         NERR_NOMEM - no memory was available
+ */
+NEOERR *cgi_stream_finish (CGI_STREAM *stream);
+
+/*
+ * Function: cgi_stream_destroy - free a CGI output stream
+ * Description: cgi_stream_destroy releases the stream, without sending
+ *              anything which hasn't been flushed by cgi_stream_finish
+ * Input: stream - a pointer to a CGI_STREAM pointer
+ * Output: stream - NULL
+ * Return: None
+ */
+void cgi_stream_destroy (CGI_STREAM **stream);
+
 /*
  * Function: cgi_filehandle - return a file pointer to an uploaded file
  * Description: cgi_filehandle will return the stdio FILE pointer
  *              associated with a file that was uploaded using
  *              multipart/form-data.  The FILE pointer is positioned at
- *              the start of the file when first available.
+ *              the start of the file when first available.  Files
+ *              handled by a part_cb aren't saved, so have none.
  * Input: cgi - a pointer to a CGI struct allocated with cgi_init
  *        form_name - the form name that the file was uploaded as
  *                    (not the filename) (if NULL, we're asking for the
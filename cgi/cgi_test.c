@@ -15,6 +15,14 @@
 #include "ClearSilver.h"
 
 #include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#if defined(HTML_COMPRESSION)
+#include <zlib.h>
+#endif
 
 
 /* Used by test_http_headers, this is the old hard-coded list of environment
@@ -218,6 +226,979 @@ NEOERR *test_content_type_parsing() {
   return STATUS_OK;
 }
 
+struct _ws_strip_case
+{
+  int level;
+  char *input;
+  char *output;
+} WSStripCases[] = {
+  {1, "  <html>  \n\n  <body>   hello    world  \n",
+   "  <html>\n  <body> hello world\n"},
+  {1, "a  b\t\tc \n \n\td   e\n",
+   "a b\tc\n\td e\n"},
+  {1, "<pre>  keep\n\n   this  </pre>  x  \n",
+   "<pre>  keep\n\n   this  </pre> x\n"},
+  {1, "<TEXTAREA name=\"t\">\n  a  \n\n</textarea>\n\n  y",
+   "<TEXTAREA name=\"t\">\n  a  \n\n</textarea>\n  y"},
+  {1, "<a href=\"x  y\">link  text</a>   \n",
+   "<a href=\"x  y\">link text</a>\n"},
+  {1, "unterminated <b  \n\n  tag",
+   "unterminated <b  \n\n  tag"},
+  {2, "  <html>  \n\n  <body>   hello    world  \n",
+   "<html>\n<body> hello world\n"},
+  {2, "a  b\t\tc \n \n\td   e\n",
+   "a b\tc\nd e\n"},
+  {2, "<pre>  keep\n\n   this  </pre>  x  \n",
+   "<pre>  keep\n\n   this  </pre> x\n"},
+  {2, "<TEXTAREA name=\"t\">\n  a  \n\n</textarea>\n\n  y",
+   "<TEXTAREA name=\"t\">\n  a  \n\n</textarea>\ny"},
+  {2, "<a href=\"x  y\">link  text</a>   \n",
+   "<a href=\"x  y\">link text</a>\n"},
+  {2, "unterminated <b  \n\n  tag",
+   "unterminated <b  \n\n  tag"},
+  {0, NULL, NULL}
+};
+
+NEOERR *test_ws_strip() {
+  NEOERR *err;
+  STRING str;
+  int x;
+
+  for (x = 0; WSStripCases[x].input; x++) {
+    string_init(&str);
+    err = string_append(&str, WSStripCases[x].input);
+    if (err) return nerr_pass(err);
+    cgi_html_ws_strip(&str, WSStripCases[x].level);
+    if (strcmp(str.buf, WSStripCases[x].output)) {
+      return nerr_raise(NERR_ASSERT,
+                        "cgi_html_ws_strip level %d of [%s] returned [%s], "
+                        "expected [%s]", WSStripCases[x].level,
+                        WSStripCases[x].input, str.buf,
+                        WSStripCases[x].output);
+    }
+    string_clear(&str);
+  }
+  return STATUS_OK;
+}
+
+/* Used by test_stream_output to capture the output */
+static int capture_writef(void *data, const char *fmt, va_list ap) {
+  NEOERR *err = string_appendvf((STRING *)data, fmt, ap);
+  if (err) {
+    nerr_ignore(&err);
+    return -1;
+  }
+  return 0;
+}
+
+static int capture_write(void *data, const char *buf, int len) {
+  NEOERR *err = string_appendn((STRING *)data, buf, len);
+  if (err) {
+    nerr_ignore(&err);
+    return -1;
+  }
+  return len;
+}
+
+static NEOERR *stream_page(CGI *cgi, STRING *page, int chunk) {
+  NEOERR *err;
+  CGI_STREAM *stream;
+  int x, l;
+
+  err = cgi_stream_init(&stream, cgi);
+  if (err) return nerr_pass(err);
+  for (x = 0; x < page->len; x += chunk) {
+    l = page->len - x < chunk ? page->len - x : chunk;
+    err = cgi_stream_write(stream, page->buf + x, l);
+    if (err) break;
+  }
+  if (err == STATUS_OK)
+    err = cgi_stream_finish(stream);
+  cgi_stream_destroy(&stream);
+  return nerr_pass(err);
+}
+
+/* Returns the body of the captured output, after the headers */
+static char *output_body(STRING *out) {
+  char *body = out->buf ? strstr(out->buf, "\r\n\r\n") : NULL;
+  return body ? body + 4 : NULL;
+}
+
+#if defined(HTML_COMPRESSION)
+static NEOERR *check_gzip(STRING *out, STRING *page) {
+  z_stream z;
+  char *body, *plain;
+  int ret;
+
+  body = output_body(out);
+  if (body == NULL || strstr(out->buf, "Content-Encoding: gzip") == NULL) {
+    return nerr_raise(NERR_ASSERT, "Missing gzip headers: %s", out->buf);
+  }
+  memset(&z, 0, sizeof(z));
+  if (inflateInit2(&z, 16 + MAX_WBITS) != Z_OK)
+    return nerr_raise(NERR_ASSERT, "inflateInit2 failed");
+  plain = (char *) malloc(page->len * 2);
+  if (plain == NULL) return nerr_raise(NERR_NOMEM, "Unable to allocate");
+  z.next_in = (Bytef *)body;
+  z.avail_in = out->len - (body - out->buf);
+  z.next_out = (Bytef *)plain;
+  z.avail_out = page->len * 2;
+  ret = inflate(&z, Z_FINISH);
+  inflateEnd(&z);
+  if (ret != Z_STREAM_END || z.total_out != page->len ||
+      memcmp(plain, page->buf, page->len)) {
+    free(plain);
+    return nerr_raise(NERR_ASSERT, "gzip stream didn't decompress, %d", ret);
+  }
+  free(plain);
+  return STATUS_OK;
+}
+#endif
+
+/* The streamed output should match cgi_html_ws_strip for any size of
+ * writes, and compressed output should decompress to the page */
+NEOERR *test_stream_output() {
+  NEOERR *err;
+  CGI *cgi;
+  STRING page, copy, out;
+  char *body;
+  int x, level;
+
+  string_init(&page);
+  for (x = 0; x < 1000; x++) {
+    err = string_appendf(&page, "<tr>\n  <td>row %d</td>   \n\n\t<td>  x  </td>"
+                         "<pre>\n  keep   this  \n\n</PRE>   \n"
+                         "<textarea>  and\n\n  this </textarea>\n", x);
+    if (err) return nerr_pass(err);
+  }
+
+  err = cgi_init(&cgi, NULL);
+  if (err) return nerr_pass(err);
+  err = hdf_set_value(cgi->hdf, "Config.TimeFooter", "0");
+  if (err) return nerr_pass(err);
+
+  cgiwrap_init_emu(&out, NULL, capture_writef, capture_write, NULL, NULL, NULL);
+  for (level = 0; level < 3; level++) {
+    err = hdf_set_int_value(cgi->hdf, "Config.WhiteSpaceStrip", level);
+    if (err) return nerr_pass(err);
+
+    string_init(&copy);
+    err = string_appendn(&copy, page.buf, page.len);
+    if (err) return nerr_pass(err);
+    if (level) cgi_html_ws_strip(&copy, level);
+
+    for (x = 1; x < 20; x += 6) {
+      string_init(&out);
+      err = stream_page(cgi, &page, x);
+      if (err) return nerr_pass(err);
+      body = output_body(&out);
+      if (body == NULL || out.len - (body - out.buf) != copy.len ||
+          memcmp(body, copy.buf, copy.len)) {
+        return nerr_raise(NERR_ASSERT,
+                          "Streamed output at level %d with %d byte writes "
+                          "differs from cgi_html_ws_strip", level, x);
+      }
+      string_clear(&out);
+    }
+    string_clear(&copy);
+  }
+
+#if defined(HTML_COMPRESSION)
+  err = hdf_set_value(cgi->hdf, "Config.WhiteSpaceStrip", "0");
+  if (err) return nerr_pass(err);
+  err = hdf_set_value(cgi->hdf, "Config.CompressionEnabled", "1");
+  if (err) return nerr_pass(err);
+  err = hdf_set_value(cgi->hdf, "HTTP.AcceptEncoding", "gzip");
+  if (err) return nerr_pass(err);
+  err = hdf_set_value(cgi->hdf, "HTTP.UserAgent", "Mozilla/5.0 (alike)");
+  if (err) return nerr_pass(err);
+
+  /* the second pass reuses the pooled z_stream from the first, the
+   * third has a sync flush in the middle */
+  for (x = 0; x < 3; x++) {
+    if (x == 2) {
+      err = hdf_set_value(cgi->hdf, "Config.FlushAfter", "</textarea>");
+      if (err) return nerr_pass(err);
+      err = hdf_set_value(cgi->hdf, "Config.CompressionLevel", "9");
+      if (err) return nerr_pass(err);
+    }
+    string_init(&out);
+    err = stream_page(cgi, &page, 4096);
+    if (err) return nerr_pass(err);
+    err = check_gzip(&out, &page);
+    if (err) return nerr_pass(err);
+    string_clear(&out);
+  }
+
+  string_init(&out);
+  err = cgi_output(cgi, &page);
+  if (err) return nerr_pass(err);
+  err = check_gzip(&out, &page);
+  if (err) return nerr_pass(err);
+  string_clear(&out);
+#endif
+
+  cgiwrap_init_emu(NULL, NULL, NULL, NULL, NULL, NULL, NULL);
+  cgi_destroy(&cgi);
+  string_clear(&page);
+
+  return STATUS_OK;
+}
+
+/* Marks the end of each write, to see where the stream flushed */
+static int capture_write_mark(void *data, const char *buf, int len) {
+  if (capture_write(data, buf, len) != len ||
+      capture_write(data, "|", 1) != 1)
+    return -1;
+  return len;
+}
+
+/* The FlushAfter marker overlaps itself, so a partial match has to
+ * fall back to a shorter one, here while split over writes */
+NEOERR *test_stream_flush_after() {
+  NEOERR *err;
+  CGI *cgi;
+  STRING page, out;
+  char *body;
+  int x;
+
+  err = cgi_init(&cgi, NULL);
+  if (err) return nerr_pass(err);
+  err = hdf_set_value(cgi->hdf, "Config.TimeFooter", "0");
+  if (err) return nerr_pass(err);
+  err = hdf_set_value(cgi->hdf, "Config.WhiteSpaceStrip", "0");
+  if (err) return nerr_pass(err);
+  err = hdf_set_value(cgi->hdf, "Config.FlushAfter", "aab");
+  if (err) return nerr_pass(err);
+
+  string_init(&page);
+  err = string_append(&page, "xaaabyaab");
+  if (err) return nerr_pass(err);
+  cgiwrap_init_emu(&out, NULL, capture_writef, capture_write_mark,
+                   NULL, NULL, NULL);
+  for (x = 1; x <= page.len; x++) {
+    string_init(&out);
+    err = stream_page(cgi, &page, x);
+    if (err) return nerr_pass(err);
+    body = output_body(&out);
+    if (body == NULL || strcmp(body, "|xaaab|yaab|")) {
+      return nerr_raise(NERR_ASSERT, "FlushAfter with %d byte writes "
+                        "flushed at %s", x, body ? body : "");
+    }
+    string_clear(&out);
+  }
+  cgiwrap_init_emu(NULL, NULL, NULL, NULL, NULL, NULL, NULL);
+  cgi_destroy(&cgi);
+  string_clear(&page);
+  return STATUS_OK;
+}
+
+/* Streams a prefix, part of page from a file and a suffix */
+static NEOERR *stream_file(CGI *cgi, int fd, int offset, int count) {
+  NEOERR *err;
+  CGI_STREAM *stream;
+
+  err = cgi_stream_init(&stream, cgi);
+  if (err) return nerr_pass(err);
+  err = cgi_stream_write(stream, "<p>", 3);
+  if (err == STATUS_OK)
+    err = cgi_stream_file(stream, fd, offset, count);
+  if (err == STATUS_OK)
+    err = cgi_stream_write(stream, "</p>", 4);
+  if (err == STATUS_OK)
+    err = cgi_stream_finish(stream);
+  cgi_stream_destroy(&stream);
+  return nerr_pass(err);
+}
+
+/* File bodies and large writes skip the stream buffer, through both
+ * the emulated writer and stdout, and should still come out in order
+ * after the headers */
+NEOERR *test_stream_file() {
+  NEOERR *err;
+  CGI *cgi;
+  STRING page, expect, out;
+  char path[] = "/tmp/cgi_test.XXXXXX";
+  char *body;
+  int fd, saved, x, level;
+
+  string_init(&page);
+  for (x = 0; x < 3000; x++) {
+    err = string_appendf(&page, "<td>  cell %d  </td>\n", x);
+    if (err) return nerr_pass(err);
+  }
+  fd = mkstemp(path);
+  if (fd < 0) return nerr_raise_errno(NERR_IO, "Unable to create %s", path);
+  unlink(path);
+  if (write(fd, page.buf, page.len) != page.len)
+    return nerr_raise_errno(NERR_IO, "Unable to write %s", path);
+
+  err = cgi_init(&cgi, NULL);
+  if (err) return nerr_pass(err);
+  err = hdf_set_value(cgi->hdf, "Config.TimeFooter", "0");
+  if (err) return nerr_pass(err);
+
+  for (x = 0; x < 4; x++) {
+    level = x & 1;
+    err = hdf_set_int_value(cgi->hdf, "Config.WhiteSpaceStrip", level);
+    if (err) return nerr_pass(err);
+    string_init(&expect);
+    err = string_append(&expect, "<p>");
+    if (err) return nerr_pass(err);
+    err = string_appendn(&expect, page.buf + 7, page.len - 7);
+    if (err) return nerr_pass(err);
+    err = string_append(&expect, "</p>");
+    if (err) return nerr_pass(err);
+    if (level) cgi_html_ws_strip(&expect, level);
+
+    string_init(&out);
+    if (x < 2) {
+      cgiwrap_init_emu(&out, NULL, capture_writef, capture_write, NULL, NULL,
+                       NULL);
+      err = stream_file(cgi, fd, 7, page.len - 7);
+    } else {
+      /* the regular CGI path, stdout going to the file */
+      char buf[4096];
+      int tfd, r;
+      char tpath[] = "/tmp/cgi_test.XXXXXX";
+
+      cgiwrap_init_emu(NULL, NULL, NULL, NULL, NULL, NULL, NULL);
+      tfd = mkstemp(tpath);
+      if (tfd < 0)
+        return nerr_raise_errno(NERR_IO, "Unable to create %s", tpath);
+      unlink(tpath);
+      fflush(stdout);
+      saved = dup(1);
+      dup2(tfd, 1);
+      err = stream_file(cgi, fd, 7, page.len - 7);
+      fflush(stdout);
+      dup2(saved, 1);
+      close(saved);
+      lseek(tfd, 0, SEEK_SET);
+      while ((r = read(tfd, buf, sizeof(buf))) > 0)
+        string_appendn(&out, buf, r);
+      close(tfd);
+    }
+    if (err) return nerr_pass(err);
+    body = output_body(&out);
+    if (body == NULL || strncmp(out.buf, "Content-Type: text/html", 23) ||
+        out.len - (body - out.buf) != expect.len ||
+        memcmp(body, expect.buf, expect.len)) {
+      return nerr_raise(NERR_ASSERT, "Streamed file differs, pass %d", x);
+    }
+    string_clear(&out);
+
+    /* one write bigger than the stream buffer */
+    if (x == 0) {
+      string_init(&out);
+      err = stream_page(cgi, &page, page.len);
+      if (err) return nerr_pass(err);
+      body = output_body(&out);
+      if (body == NULL || out.len - (body - out.buf) != page.len ||
+          memcmp(body, page.buf, page.len)) {
+        return nerr_raise(NERR_ASSERT, "Large stream write differs");
+      }
+      string_clear(&out);
+    }
+    string_clear(&expect);
+  }
+
+  close(fd);
+  cgiwrap_init_emu(NULL, NULL, NULL, NULL, NULL, NULL, NULL);
+  cgi_destroy(&cgi);
+  string_clear(&page);
+
+  return STATUS_OK;
+}
+
+/* A request for test_cgiwrap_ctx: its query and captured output */
+typedef struct _ctx_request {
+  const char *query;
+  STRING out;
+} CTX_REQUEST;
+
+static char *ctx_getenv(void *data, const char *k) {
+  CTX_REQUEST *req = (CTX_REQUEST *)data;
+
+  if (!strcmp(k, "QUERY_STRING")) return strdup(req->query);
+  if (!strcmp(k, "REQUEST_METHOD")) return strdup("GET");
+  return NULL;
+}
+
+static int ctx_writef(void *data, const char *fmt, va_list ap) {
+  return capture_writef(&(((CTX_REQUEST *)data)->out), fmt, ap);
+}
+
+static int ctx_write(void *data, const char *buf, int len) {
+  return capture_write(&(((CTX_REQUEST *)data)->out), buf, len);
+}
+
+/* Two CGIs on their own contexts, interleaved, should each see only
+ * their own request, and leave the default context alone */
+NEOERR *test_cgiwrap_ctx() {
+  NEOERR *err;
+  CGIWRAP_CTX *ctx[2];
+  CGI *cgi[2];
+  CTX_REQUEST req[2];
+  STRING global;
+  char expect[64];
+  int x;
+
+  string_init(&global);
+  cgiwrap_init_emu(&global, NULL, capture_writef, capture_write, NULL, NULL,
+                   NULL);
+  req[0].query = "Name=first";
+  req[1].query = "Name=second";
+  for (x = 0; x < 2; x++) {
+    string_init(&(req[x].out));
+    err = cgiwrap_ctx_init_emu(&(ctx[x]), &(req[x]), NULL, ctx_writef,
+                               ctx_write, ctx_getenv, NULL, NULL);
+    if (err) return nerr_pass(err);
+  }
+  for (x = 0; x < 2; x++) {
+    err = cgi_init_ctx(&(cgi[x]), NULL, ctx[x]);
+    if (err) return nerr_pass(err);
+  }
+  for (x = 0; x < 2; x++) {
+    err = cgi_cookie_clear(cgi[x], hdf_get_value(cgi[x]->hdf, "Query.Name",
+                                                 ""), NULL, NULL);
+    if (err) return nerr_pass(err);
+  }
+  for (x = 0; x < 2; x++) {
+    snprintf(expect, sizeof(expect), "Set-Cookie: %s=;",
+             x ? "second" : "first");
+    if (strncmp(req[x].out.buf, expect, strlen(expect)))
+      return nerr_raise(NERR_ASSERT, "Context %d wrote %s", x,
+                        req[x].out.buf);
+    cgi_destroy(&(cgi[x]));
+    cgiwrap_ctx_destroy(&(ctx[x]));
+    string_clear(&(req[x].out));
+  }
+  if (global.len)
+    return nerr_raise(NERR_ASSERT, "Default context wrote %s", global.buf);
+
+  cgiwrap_init_emu(NULL, NULL, NULL, NULL, NULL, NULL, NULL);
+  string_clear(&global);
+  return STATUS_OK;
+}
+
+/* A form body for test_query_parsing and test_multipart, read a few
+ * bytes at a time */
+typedef struct _form_request {
+  const char *query;
+  const char *ctype;
+  STRING body;
+  int pos;
+} FORM_REQUEST;
+
+static char *form_getenv(void *data, const char *k) {
+  FORM_REQUEST *req = (FORM_REQUEST *)data;
+
+  if (!strcmp(k, "QUERY_STRING")) return strdup(req->query);
+  if (!strcmp(k, "REQUEST_METHOD")) return strdup("POST");
+  if (!strcmp(k, "CONTENT_TYPE")) return strdup(req->ctype);
+  if (!strcmp(k, "CONTENT_LENGTH")) return sprintf_alloc("%d", req->body.len);
+  return NULL;
+}
+
+static int form_read(void *data, char *buf, int len) {
+  FORM_REQUEST *req = (FORM_REQUEST *)data;
+  int n = req->body.len - req->pos;
+
+  if (n > len) n = len;
+  if (n > 7) n = 7;
+  memcpy(buf, req->body.buf + req->pos, n);
+  req->pos += n;
+  return n;
+}
+
+/* Repeated keys from the query string and a form body split across
+ * reads should all end up numbered in order */
+NEOERR *test_query_parsing() {
+  NEOERR *err;
+  CGIWRAP_CTX *ctx;
+  CGI *cgi;
+  FORM_REQUEST req;
+  HDF *obj;
+  char *v;
+  int x;
+
+  req.query = "id=q0&id=q1&.dot=1&=anon";
+  req.ctype = "application/x-www-form-urlencoded";
+  req.pos = 0;
+  string_init(&(req.body));
+  for (x = 0; x < 1000; x++) {
+    err = string_appendf(&(req.body), "%sid=%d&&name=%%41%d", x ? "&" : "",
+                         x, x);
+    if (err) return nerr_pass(err);
+  }
+  err = cgiwrap_ctx_init_emu(&ctx, &req, form_read, NULL, NULL, form_getenv,
+                             NULL, NULL);
+  if (err) return nerr_pass(err);
+  err = cgi_init_ctx(&cgi, NULL, ctx);
+  if (err) return nerr_pass(err);
+  err = cgi_parse(cgi);
+  if (err) return nerr_pass(err);
+
+  if (strcmp(hdf_get_value(cgi->hdf, "Query.id", ""), "999") ||
+      strcmp(hdf_get_value(cgi->hdf, "Query._dot", ""), "1") ||
+      strcmp(hdf_get_value(cgi->hdf, "Query._0", ""), "anon") ||
+      strcmp(hdf_get_value(cgi->hdf, "Query.name.0", ""), "A0")) {
+    hdf_dump(cgi->hdf, "-E- ");
+    return nerr_raise(NERR_ASSERT, "Query values are wrong");
+  }
+  obj = hdf_obj_child(hdf_get_obj(cgi->hdf, "Query.id"));
+  for (x = 0; x < 1002; x++) {
+    v = hdf_obj_value(obj);
+    if (obj == NULL || atoi(hdf_obj_name(obj)) != x ||
+        (x < 2 && strcmp(v, x ? "q1" : "q0")) ||
+        (x >= 2 && atoi(v) != x - 2)) {
+      return nerr_raise(NERR_ASSERT, "Query.id.%d is wrong", x);
+    }
+    obj = hdf_obj_next(obj);
+  }
+  if (obj != NULL)
+    return nerr_raise(NERR_ASSERT, "Too many Query.id values");
+
+  cgi_destroy(&cgi);
+  cgiwrap_ctx_destroy(&ctx);
+  string_clear(&(req.body));
+  return STATUS_OK;
+}
+
+static int PartEnds = 0;
+
+static NEOERR *part_capture(CGI *cgi, const char *name, const char *filename,
+                            const char *type, const char *buf, int len) {
+  if (len == 0) {
+    PartEnds++;
+    return STATUS_OK;
+  }
+  return nerr_pass(string_appendn((STRING *)cgi->data, buf, len));
+}
+
+/* A multipart body with a field and a file, which both contain things
+ * which look a bit like the boundary, read a few bytes at a time.  The
+ * file goes to a temporary file, or to a part_cb. */
+NEOERR *test_multipart() {
+  NEOERR *err;
+  CGIWRAP_CTX *ctx;
+  CGI *cgi;
+  FORM_REQUEST req;
+  STRING file, got;
+  FILE *fp;
+  char buf[4096];
+  int x, r;
+
+  string_init(&file);
+  for (x = 0; x < 5000; x++) {
+    err = string_appendf(&file, "%d\r\n--AaB03\r\n--AaB03xx\n%c", x, x & 0xff);
+    if (err) return nerr_pass(err);
+  }
+  req.query = "";
+  req.ctype = "multipart/form-data; boundary=AaB03x";
+  for (x = 0; x < 2; x++) {
+    req.pos = 0;
+    string_init(&(req.body));
+    err = string_append(&(req.body), "preamble\r\n--AaB03x\r\n"
+        "Content-Disposition: form-data; name=\"field\"\r\n\r\n"
+        "one\r\n--AaB03x-\r\ntwo\r\n--AaB03x\r\n"
+        "Content-Disposition: form-data; name=\"up\"; filename=\"a.txt\"\r\n"
+        "Content-Type: text/plain\r\n\r\n");
+    if (err) return nerr_pass(err);
+    err = string_appendn(&(req.body), file.buf, file.len);
+    if (err) return nerr_pass(err);
+    err = string_append(&(req.body), "\r\n--AaB03x--\r\n");
+    if (err) return nerr_pass(err);
+
+    err = cgiwrap_ctx_init_emu(&ctx, &req, form_read, NULL, NULL, form_getenv,
+                               NULL, NULL);
+    if (err) return nerr_pass(err);
+    err = cgi_init_ctx(&cgi, NULL, ctx);
+    if (err) return nerr_pass(err);
+    string_init(&got);
+    if (x) {
+      cgi->data = &got;
+      cgi->part_cb = part_capture;
+    }
+    err = cgi_parse(cgi);
+    if (err) return nerr_pass(err);
+
+    if (strcmp(hdf_get_value(cgi->hdf, "Query.field", ""),
+               "one\r\n--AaB03x-\r\ntwo") ||
+        strcmp(hdf_get_value(cgi->hdf, "Query.up", ""), "a.txt") ||
+        strcmp(hdf_get_value(cgi->hdf, "Query.up.Type", ""), "text/plain")) {
+      hdf_dump(cgi->hdf, "-E- ");
+      return nerr_raise(NERR_ASSERT, "multipart Query values are wrong");
+    }
+    fp = cgi_filehandle(cgi, "up");
+    if (x == 0) {
+      if (fp == NULL)
+        return nerr_raise(NERR_ASSERT, "No file handle for upload");
+      while ((r = fread(buf, 1, sizeof(buf), fp)) > 0) {
+        err = string_appendn(&got, buf, r);
+        if (err) return nerr_pass(err);
+      }
+    } else if (fp != NULL || PartEnds != 1) {
+      return nerr_raise(NERR_ASSERT, "part_cb upload was saved");
+    }
+    if (got.len != file.len || memcmp(got.buf, file.buf, file.len))
+      return nerr_raise(NERR_ASSERT, "Uploaded file differs, pass %d", x);
+
+    cgi_destroy(&cgi);
+    cgiwrap_ctx_destroy(&ctx);
+    string_clear(&got);
+    string_clear(&(req.body));
+  }
+  string_clear(&file);
+  return STATUS_OK;
+}
+
+#define FASTCGI_TEST_PORT 46034
+
+static NEOERR *fcgi_test_init(void *rock, int num, HDF *hdf) {
+  return nerr_pass(hdf_set_int_value(hdf, "Skel.Num", num));
+}
+
+/* Echoes the query, the body and the worker's skeleton value */
+static NEOERR *fcgi_test_request(void *rock, int num, CGI *cgi) {
+  NEOERR *err;
+  STRING str;
+
+  err = cgi_parse(cgi);
+  if (err) return nerr_pass(err);
+  if (hdf_get_obj(cgi->hdf, "Query.fail"))
+    return nerr_raise(NERR_ASSERT, "failing as asked");
+  string_init(&str);
+  err = string_appendf(&str, "name=%s post=%s skel=%d",
+                       hdf_get_value(cgi->hdf, "Query.name", ""),
+                       hdf_get_value(cgi->hdf, "Query.post", ""),
+                       hdf_get_int_value(cgi->hdf, "Skel.Num", -1) == num);
+  if (err == STATUS_OK)
+    err = hdf_set_value(cgi->hdf, "cgiout.ContentType", "text/plain");
+  if (err == STATUS_OK)
+    err = cgi_output(cgi, &str);
+  string_clear(&str);
+  return nerr_pass(err);
+}
+
+static NEOERR *fcgi_record(NSOCK *sock, int type, int id, const char *buf,
+                           int len) {
+  NEOERR *err;
+  UINT8 h[8] = {1, 0, 0, 0, 0, 0, 0, 0};
+
+  h[1] = type;
+  h[2] = id >> 8;
+  h[3] = id & 0xff;
+  h[4] = len >> 8;
+  h[5] = len & 0xff;
+  err = ne_net_write(sock, (char *)h, 8);
+  if (err == STATUS_OK && len)
+    err = ne_net_write(sock, buf, len);
+  return nerr_pass(err);
+}
+
+static NEOERR *fcgi_begin(NSOCK *sock, int id, int keep_conn,
+                          const char *query, const char *post) {
+  NEOERR *err;
+  char body[8] = {0, 1, 0, 0, 0, 0, 0, 0};
+  STRING params;
+  char len[16];
+  const char *nv[8];
+  int x;
+
+  body[2] = keep_conn;
+  err = fcgi_record(sock, 1, id, body, 8);
+  if (err) return nerr_pass(err);
+
+  snprintf(len, sizeof(len), "%d", (int)strlen(post));
+  nv[0] = "REQUEST_METHOD"; nv[1] = post[0] ? "POST" : "GET";
+  nv[2] = "QUERY_STRING"; nv[3] = query;
+  nv[4] = "CONTENT_TYPE"; nv[5] = "application/x-www-form-urlencoded";
+  nv[6] = "CONTENT_LENGTH"; nv[7] = len;
+  string_init(&params);
+  for (x = 0; x < 8; x += 2) {
+    err = string_append_char(&params, strlen(nv[x]));
+    if (err == STATUS_OK)
+      err = string_append_char(&params, strlen(nv[x + 1]));
+    if (err == STATUS_OK) err = string_append(&params, nv[x]);
+    if (err == STATUS_OK) err = string_append(&params, nv[x + 1]);
+    if (err) return nerr_pass(err);
+  }
+  err = fcgi_record(sock, 4, id, params.buf, params.len);
+  string_clear(&params);
+  return nerr_pass(err);
+}
+
+static NEOERR *fcgi_finish(NSOCK *sock, int id, const char *post) {
+  NEOERR *err;
+
+  err = fcgi_record(sock, 4, id, NULL, 0);
+  if (err == STATUS_OK && post[0])
+    err = fcgi_record(sock, 5, id, post, strlen(post));
+  if (err == STATUS_OK)
+    err = fcgi_record(sock, 5, id, NULL, 0);
+  return nerr_pass(err);
+}
+
+/* Reads records until count requests have ended, collecting the stdout
+ * of request id in out[id] */
+static NEOERR *fcgi_responses(NSOCK *sock, STRING *out, int *status,
+                              int count) {
+  NEOERR *err;
+  UINT8 h[8], buf[65536 + 256];
+  int id, len;
+
+  while (count) {
+    err = ne_net_read(sock, h, 8);
+    if (err) return nerr_pass(err);
+    id = (h[2] << 8) | h[3];
+    len = ((h[4] << 8) | h[5]) + h[6];
+    err = ne_net_read(sock, buf, len);
+    if (err) return nerr_pass(err);
+    if (h[0] != 1 || id > 4)
+      return nerr_raise(NERR_ASSERT, "Bad record %d for %d", h[1], id);
+    if (h[1] == 6) {
+      err = string_appendn(&out[id], (char *)buf, len - h[6]);
+      if (err) return nerr_pass(err);
+    } else if (h[1] == 3) {
+      status[id] = buf[3];
+      count--;
+    } else if (h[1] == 10) {
+      err = string_appendn(&out[0], (char *)buf, len - h[6]);
+      if (err) return nerr_pass(err);
+      count--;
+    }
+  }
+  return STATUS_OK;
+}
+
+/* Runs a FastCGI server in a child, with two requests multiplexed on one
+ * connection, then a request on a connection which isn't kept open,
+ * then a request over the size limit */
+NEOERR *test_fastcgi() {
+  NEOERR *err = STATUS_OK;
+  NSOCK *sock = NULL;
+  STRING out[5];
+  int status[5];
+  char *body;
+  char post[2048];
+  char c;
+  pid_t pid;
+  int x, st;
+
+  pid = fork();
+  if (pid == -1) return nerr_raise_errno(NERR_SYSTEM, "fork failed");
+  if (pid == 0) {
+    FASTCGI fcgi;
+
+    memset(&fcgi, 0, sizeof(fcgi));
+    fcgi.init_cb = fcgi_test_init;
+    fcgi.req_cb = fcgi_test_request;
+    fcgi.num_threads = 2;
+    fcgi.port = FASTCGI_TEST_PORT;
+    fcgi.max_request_size = 1024;
+    err = cgi_fastcgi_run(&fcgi);
+    if (err) {
+      nerr_log_error(err);
+      _exit(1);
+    }
+    _exit(0);
+  }
+
+  for (x = 0; x < 50; x++) {
+    err = ne_net_connect(&sock, "127.0.0.1", FASTCGI_TEST_PORT, 5, 5);
+    if (err == STATUS_OK) break;
+    nerr_ignore(&err);
+    usleep(100000);
+  }
+  for (x = 0; x < 5; x++) {
+    string_init(&out[x]);
+    status[x] = -1;
+  }
+
+  do {
+    if (err) break;
+    err = fcgi_record(sock, 9, 0, "\017\000FCGI_MPXS_CONNS", 17);
+    if (err) break;
+    err = fcgi_begin(sock, 1, 1, "name=one", "");
+    if (err) break;
+    err = fcgi_begin(sock, 2, 1, "name=two", "post=data");
+    if (err) break;
+    err = fcgi_finish(sock, 2, "post=data");
+    if (err) break;
+    err = fcgi_finish(sock, 1, "");
+    if (err) break;
+    err = ne_net_flush(sock);
+    if (err) break;
+    err = fcgi_responses(sock, out, status, 3);
+    if (err) break;
+    ne_net_close(&sock);
+
+    if (strcmp(out[0].buf ? out[0].buf : "", "\017\001FCGI_MPXS_CONNS1")) {
+      err = nerr_raise(NERR_ASSERT, "Bad FCGI_GET_VALUES_RESULT");
+      break;
+    }
+    for (x = 1; x < 3; x++) {
+      body = output_body(&out[x]);
+      if (body == NULL || status[x] != 0 ||
+          strstr(out[x].buf, "Content-Type: text/plain") == NULL ||
+          strcmp(body, x == 1 ? "name=one post= skel=1" :
+                                "name=two post=data skel=1")) {
+        err = nerr_raise(NERR_ASSERT, "Bad FastCGI response %d: %s", x,
+                         out[x].buf ? out[x].buf : "");
+        break;
+      }
+    }
+    if (err) break;
+
+    /* not kept open, and the error page from a failing request */
+    err = ne_net_connect(&sock, "127.0.0.1", FASTCGI_TEST_PORT, 5, 5);
+    if (err) break;
+    err = fcgi_begin(sock, 3, 0, "fail=1", "");
+    if (err == STATUS_OK)
+      err = fcgi_finish(sock, 3, "");
+    if (err == STATUS_OK)
+      err = ne_net_flush(sock);
+    if (err == STATUS_OK)
+      err = fcgi_responses(sock, out, status, 1);
+    if (err) break;
+    if (status[3] != 1 || strstr(out[3].buf, "Status: 500") == NULL ||
+        strstr(out[3].buf, "failing as asked") == NULL) {
+      err = nerr_raise(NERR_ASSERT, "Bad FastCGI error response: %s",
+                       out[3].buf ? out[3].buf : "");
+      break;
+    }
+    if (read(sock->fd, &c, 1) != 0) {
+      err = nerr_raise(NERR_ASSERT, "FastCGI connection wasn't closed");
+      break;
+    }
+    ne_net_close(&sock);
+
+    /* a body over max_request_size ends the request with a 413 */
+    memset(post, 'x', sizeof(post) - 1);
+    post[sizeof(post) - 1] = '\0';
+    err = ne_net_connect(&sock, "127.0.0.1", FASTCGI_TEST_PORT, 5, 5);
+    if (err) break;
+    err = fcgi_begin(sock, 4, 1, "name=big", post);
+    if (err == STATUS_OK)
+      err = fcgi_finish(sock, 4, post);
+    if (err == STATUS_OK)
+      err = ne_net_flush(sock);
+    if (err == STATUS_OK)
+      err = fcgi_responses(sock, out, status, 1);
+    if (err) break;
+    if (status[4] != 1 || strstr(out[4].buf, "Status: 413") == NULL) {
+      err = nerr_raise(NERR_ASSERT, "Bad FastCGI response to a large "
+                       "request: %s", out[4].buf ? out[4].buf : "");
+      break;
+    }
+  } while (0);
+
+  if (sock) ne_net_close(&sock);
+  for (x = 0; x < 5; x++)
+    string_clear(&out[x]);
+  kill(pid, SIGTERM);
+  if (waitpid(pid, &st, 0) == pid && err == STATUS_OK &&
+      !(WIFEXITED(st) && WEXITSTATUS(st) == 0))
+    err = nerr_raise(NERR_ASSERT, "FastCGI server exited with %d", st);
+  return nerr_pass(err);
+}
+
+#define FASTCGI_FLOOD_PORT 46035
+/* The descriptor limit of the flooded server, and how many connections
+ * are held open against it */
+#define FASTCGI_FD_LIMIT 16
+#define FASTCGI_FLOOD 24
+
+/* Holds more connections open than a FastCGI server has descriptors
+ * for, so its accepts fail.  It shouldn't spin on them, and should
+ * answer once they're gone. */
+NEOERR *test_fastcgi_flood() {
+  NEOERR *err = STATUS_OK;
+  NSOCK *flood[FASTCGI_FLOOD];
+  NSOCK *sock = NULL;
+  STRING out[5];
+  int status[5];
+  struct rusage ru;
+  long usecs;
+  pid_t pid;
+  int x, st;
+
+  pid = fork();
+  if (pid == -1) return nerr_raise_errno(NERR_SYSTEM, "fork failed");
+  if (pid == 0) {
+    FASTCGI fcgi;
+    struct rlimit rl;
+
+    rl.rlim_cur = rl.rlim_max = FASTCGI_FD_LIMIT;
+    setrlimit(RLIMIT_NOFILE, &rl);
+    memset(&fcgi, 0, sizeof(fcgi));
+    fcgi.init_cb = fcgi_test_init;
+    fcgi.req_cb = fcgi_test_request;
+    fcgi.num_threads = 1;
+    fcgi.port = FASTCGI_FLOOD_PORT;
+    err = cgi_fastcgi_run(&fcgi);
+    if (err) {
+      nerr_log_error(err);
+      _exit(1);
+    }
+    _exit(0);
+  }
+
+  for (x = 0; x < 5; x++) {
+    string_init(&out[x]);
+    status[x] = -1;
+  }
+  memset(flood, 0, sizeof(flood));
+  sleep(1);
+  for (x = 0; x < FASTCGI_FLOOD; x++) {
+    err = ne_net_connect(&(flood[x]), "127.0.0.1", FASTCGI_FLOOD_PORT, 5, 5);
+    if (err) break;
+  }
+  if (err == STATUS_OK) sleep(2);
+  for (x = 0; x < FASTCGI_FLOOD; x++)
+    ne_net_close(&(flood[x]));
+
+  do {
+    if (err) break;
+    err = ne_net_connect(&sock, "127.0.0.1", FASTCGI_FLOOD_PORT, 5, 5);
+    if (err) break;
+    err = fcgi_begin(sock, 1, 1, "name=after", "");
+    if (err == STATUS_OK)
+      err = fcgi_finish(sock, 1, "");
+    if (err == STATUS_OK)
+      err = ne_net_flush(sock);
+    if (err == STATUS_OK)
+      err = fcgi_responses(sock, out, status, 1);
+    if (err) break;
+    if (status[1] != 0 || out[1].buf == NULL ||
+        strstr(out[1].buf, "name=after") == NULL) {
+      err = nerr_raise(NERR_ASSERT, "Bad FastCGI response after a flood: %s",
+                       out[1].buf ? out[1].buf : "");
+    }
+  } while (0);
+
+  if (sock) ne_net_close(&sock);
+  for (x = 0; x < 5; x++)
+    string_clear(&out[x]);
+  kill(pid, SIGTERM);
+  if (wait4(pid, &st, 0, &ru) != pid) {
+    nerr_ignore(&err);
+    return nerr_raise_errno(NERR_SYSTEM, "wait4 failed");
+  }
+  if (err) return nerr_pass(err);
+  if (!(WIFEXITED(st) && WEXITSTATUS(st) == 0))
+    return nerr_raise(NERR_ASSERT, "FastCGI server exited with %d", st);
+  /* spinning on the failed accepts would take the whole two seconds */
+  usecs = (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000L +
+          ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+  if (usecs > 500000)
+    return nerr_raise(NERR_ASSERT, "FastCGI server used %ldus of CPU while "
+                      "out of descriptors", usecs);
+  return STATUS_OK;
+}
+
 int main(int argc, char **argv, char **envp) {
   NEOERR *err;
 
@@ -231,6 +1212,51 @@ int main(int argc, char **argv, char **envp) {
     nerr_log_error(err);
     return -1;
   }
+  err = test_ws_strip();
+  if (err) {
+    nerr_log_error(err);
+    return -1;
+  }
+  err = test_stream_output();
+  if (err) {
+    nerr_log_error(err);
+    return -1;
+  }
+  err = test_stream_flush_after();
+  if (err) {
+    nerr_log_error(err);
+    return -1;
+  }
+  err = test_stream_file();
+  if (err) {
+    nerr_log_error(err);
+    return -1;
+  }
+  err = test_query_parsing();
+  if (err) {
+    nerr_log_error(err);
+    return -1;
+  }
+  err = test_multipart();
+  if (err) {
+    nerr_log_error(err);
+    return -1;
+  }
+  err = test_cgiwrap_ctx();
+  if (err) {
+    nerr_log_error(err);
+    return -1;
+  }
+  err = test_fastcgi();
+  if (err) {
+    nerr_log_error(err);
+    return -1;
+  }
+  err = test_fastcgi_flood();
+  if (err) {
+    nerr_log_error(err);
+    return -1;
+  }
 
   return 0;
 }
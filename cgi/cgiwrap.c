@@ -14,15 +14,18 @@
 #if HAVE_FEATURES_H
 #include <features.h>
 #endif
-#ifdef __UCLIBC__
 #include <unistd.h>
-#endif
+#include <errno.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#ifdef HAVE_PTHREADS
+#include <pthread.h>
+#endif
 #include "util/neo_misc.h"
 #include "util/neo_err.h"
+#include "util/neo_files.h"
 #include "cgi/cgiwrap.h"
 
 typedef struct _cgiwrapper
@@ -45,6 +48,37 @@ typedef struct _cgiwrapper
 
 static CGIWRAPPER GlobalWrapper = {0, NULL, NULL, 0, NULL, NULL, NULL, NULL, NULL, NULL, NULL, 0};
 
+#ifdef HAVE_PTHREADS
+/* Threads which called cgiwrap_init_emu_thread have their own wrapper,
+ * everyone else uses the GlobalWrapper.  ThreadWrappers is only set once
+ * the key exists, so programs which never use it don't pay for the
+ * lookup. */
+static pthread_key_t ThreadWrapperKey;
+static pthread_once_t ThreadWrapperOnce = PTHREAD_ONCE_INIT;
+static int ThreadWrappers = 0;
+
+static void _thread_wrapper_key (void)
+{
+  if (pthread_key_create (&ThreadWrapperKey, free) == 0)
+    ThreadWrappers = 1;
+}
+#endif
+
+/* A NULL context means the default one, which is the calling thread's
+ * wrapper if it has one, or the GlobalWrapper */
+static CGIWRAPPER *_cgiwrap (CGIWRAP_CTX *ctx)
+{
+  if (ctx != NULL) return ctx;
+#ifdef HAVE_PTHREADS
+  if (ThreadWrappers)
+  {
+    CGIWRAPPER *w = (CGIWRAPPER *) pthread_getspecific (ThreadWrapperKey);
+    if (w != NULL) return w;
+  }
+#endif
+  return &GlobalWrapper;
+}
+
 void cgiwrap_init_std (int argc, char **argv, char **envp)
 {
   /* Allow setting of these even after cgiwrap_init_emu is called */
@@ -88,11 +122,81 @@ void cgiwrap_init_emu (void *data, READ_FUNC read_cb,
   GlobalWrapper.emu_init = 1;
 }
 
-NEOERR *cgiwrap_getenv (const char *k, char **v)
+NEOERR *cgiwrap_init_emu_thread (void *data, READ_FUNC read_cb,
+    WRITEF_FUNC writef_cb, WRITE_FUNC write_cb, GETENV_FUNC getenv_cb,
+    PUTENV_FUNC putenv_cb, ITERENV_FUNC iterenv_cb)
+{
+#ifdef HAVE_PTHREADS
+  CGIWRAPPER *w;
+
+  pthread_once (&ThreadWrapperOnce, _thread_wrapper_key);
+  if (!ThreadWrappers)
+    return nerr_raise (NERR_SYSTEM, "Unable to create thread key");
+  w = (CGIWRAPPER *) pthread_getspecific (ThreadWrapperKey);
+  if (w == NULL)
+  {
+    w = (CGIWRAPPER *) malloc (sizeof(CGIWRAPPER));
+    if (w == NULL)
+      return nerr_raise (NERR_NOMEM, "Unable to allocate thread cgiwrapper");
+    if (pthread_setspecific (ThreadWrapperKey, w))
+    {
+      free (w);
+      return nerr_raise (NERR_SYSTEM, "Unable to set thread cgiwrapper");
+    }
+  }
+  /* the std fallbacks use the process's arguments and environment */
+  *w = GlobalWrapper;
+  w->data = data;
+  w->read_cb = read_cb;
+  w->writef_cb = writef_cb;
+  w->write_cb = write_cb;
+  w->getenv_cb = getenv_cb;
+  w->putenv_cb = putenv_cb;
+  w->iterenv_cb = iterenv_cb;
+  w->emu_init = 1;
+  return STATUS_OK;
+#else
+  return nerr_raise (NERR_ASSERT, "cgiwrap_init_emu_thread requires pthreads");
+#endif
+}
+
+NEOERR *cgiwrap_ctx_init_emu (CGIWRAP_CTX **ctx, void *data,
+    READ_FUNC read_cb, WRITEF_FUNC writef_cb, WRITE_FUNC write_cb,
+    GETENV_FUNC getenv_cb, PUTENV_FUNC putenv_cb, ITERENV_FUNC iterenv_cb)
 {
-  if (GlobalWrapper.getenv_cb != NULL)
+  CGIWRAPPER *w;
+
+  *ctx = NULL;
+  w = (CGIWRAPPER *) malloc (sizeof(CGIWRAPPER));
+  if (w == NULL)
+    return nerr_raise (NERR_NOMEM, "Unable to allocate cgiwrap context");
+  /* the std fallbacks use the process's arguments and environment */
+  *w = GlobalWrapper;
+  w->data = data;
+  w->read_cb = read_cb;
+  w->writef_cb = writef_cb;
+  w->write_cb = write_cb;
+  w->getenv_cb = getenv_cb;
+  w->putenv_cb = putenv_cb;
+  w->iterenv_cb = iterenv_cb;
+  w->emu_init = 1;
+  *ctx = w;
+  return STATUS_OK;
+}
+
+void cgiwrap_ctx_destroy (CGIWRAP_CTX **ctx)
+{
+  if (*ctx == NULL) return;
+  free (*ctx);
+  *ctx = NULL;
+}
+
+NEOERR *cgiwrap_ctx_getenv (CGIWRAP_CTX *ctx, const char *k, char **v)
+{
+  CGIWRAPPER *w = _cgiwrap(ctx);
+  if (w->getenv_cb != NULL)
   {
-    *v = GlobalWrapper.getenv_cb (GlobalWrapper.data, k);
+    *v = w->getenv_cb (w->data, k);
   }
   else
   {
@@ -115,11 +219,12 @@ NEOERR *cgiwrap_getenv (const char *k, char **v)
   return STATUS_OK;
 }
 
-NEOERR *cgiwrap_putenv (const char *k, const char *v)
+NEOERR *cgiwrap_ctx_putenv (CGIWRAP_CTX *ctx, const char *k, const char *v)
 {
-  if (GlobalWrapper.putenv_cb != NULL)
+  CGIWRAPPER *w = _cgiwrap(ctx);
+  if (w->putenv_cb != NULL)
   {
-    if (GlobalWrapper.putenv_cb(GlobalWrapper.data, k, v))
+    if (w->putenv_cb(w->data, k, v))
       return nerr_raise(NERR_NOMEM, "putenv_cb says nomem when %s=%s", k, v);
   }
   else
@@ -137,21 +242,22 @@ NEOERR *cgiwrap_putenv (const char *k, const char *v)
   return STATUS_OK;
 }
 
-NEOERR *cgiwrap_iterenv (int num, char **k, char **v)
+NEOERR *cgiwrap_ctx_iterenv (CGIWRAP_CTX *ctx, int num, char **k, char **v)
 {
+  CGIWRAPPER *w = _cgiwrap(ctx);
   *k = NULL;
   *v = NULL;
-  if (GlobalWrapper.iterenv_cb != NULL)
+  if (w->iterenv_cb != NULL)
   {
     int r;
 
-    r = GlobalWrapper.iterenv_cb(GlobalWrapper.data, num, k, v);
+    r = w->iterenv_cb(w->data, num, k, v);
     if (r)
       return nerr_raise(NERR_SYSTEM, "iterenv_cb returned %d", r);
   }
-  else if (GlobalWrapper.envp != NULL && num < GlobalWrapper.env_count)
+  else if (w->envp != NULL && num < w->env_count)
   {
-    char *c, *s = GlobalWrapper.envp[num];
+    char *c, *s = w->envp[num];
 
     c = strchr (s, '=');
     if (c == NULL) return STATUS_OK;
@@ -171,24 +277,25 @@ NEOERR *cgiwrap_iterenv (int num, char **k, char **v)
   return STATUS_OK;
 }
 
-NEOERR *cgiwrap_writef (const char *fmt, ...)
+NEOERR *cgiwrap_ctx_writef (CGIWRAP_CTX *ctx, const char *fmt, ...)
 {
   va_list ap;
   NEOERR *err;
 
   va_start (ap, fmt);
-  err = cgiwrap_writevf (fmt, ap);
+  err = cgiwrap_ctx_writevf (ctx, fmt, ap);
   va_end (ap);
   return nerr_pass(err);
 }
 
-NEOERR *cgiwrap_writevf (const char *fmt, va_list ap) 
+NEOERR *cgiwrap_ctx_writevf (CGIWRAP_CTX *ctx, const char *fmt, va_list ap)
 {
+  CGIWRAPPER *w = _cgiwrap(ctx);
   int r;
 
-  if (GlobalWrapper.writef_cb != NULL)
+  if (w->writef_cb != NULL)
   {
-    r = GlobalWrapper.writef_cb (GlobalWrapper.data, fmt, ap);
+    r = w->writef_cb (w->data, fmt, ap);
     if (r < 0)
       return nerr_raise_errno (NERR_IO, "writef_cb returned %d", r);
   }
@@ -200,13 +307,14 @@ NEOERR *cgiwrap_writevf (const char *fmt, va_list ap)
   return STATUS_OK;
 }
 
-NEOERR *cgiwrap_write (const char *buf, int buf_len)
+NEOERR *cgiwrap_ctx_write (CGIWRAP_CTX *ctx, const char *buf, int buf_len)
 {
+  CGIWRAPPER *w = _cgiwrap(ctx);
   int r;
 
-  if (GlobalWrapper.write_cb != NULL)
+  if (w->write_cb != NULL)
   {
-    r = GlobalWrapper.write_cb (GlobalWrapper.data, buf, buf_len);
+    r = w->write_cb (w->data, buf, buf_len);
     if (r != buf_len)
       return nerr_raise_errno (NERR_IO, "write_cb returned %d<%d", r, buf_len);
   }
@@ -220,11 +328,76 @@ NEOERR *cgiwrap_write (const char *buf, int buf_len)
   return STATUS_OK;
 }
 
-void cgiwrap_read (char *buf, int buf_len, int *read_len)
+NEOERR *cgiwrap_ctx_writev (CGIWRAP_CTX *ctx, struct iovec *iov, int iovcnt)
+{
+  CGIWRAPPER *w = _cgiwrap(ctx);
+  NEOERR *err;
+  int x;
+
+  if (w->write_cb != NULL)
+  {
+    for (x = 0; x < iovcnt; x++)
+    {
+      if (iov[x].iov_len == 0) continue;
+      err = cgiwrap_ctx_write (w, iov[x].iov_base, iov[x].iov_len);
+      if (err) return nerr_pass (err);
+    }
+    return STATUS_OK;
+  }
+  /* anything written through stdio has to go out first */
+  if (fflush(stdout))
+    return nerr_raise_errno (NERR_IO, "fflush failed");
+  return nerr_pass (ne_writev (fileno(stdout), iov, iovcnt));
+}
+
+NEOERR *cgiwrap_ctx_sendfile (CGIWRAP_CTX *ctx, int fd, off_t offset, off_t count)
 {
-  if (GlobalWrapper.read_cb != NULL)
+  CGIWRAPPER *w = _cgiwrap(ctx);
+  NEOERR *err;
+  char buf[8192];
+  ssize_t r;
+
+  if (w->write_cb == NULL)
   {
-    *read_len = GlobalWrapper.read_cb (GlobalWrapper.data, buf, buf_len);
+    if (fflush(stdout))
+      return nerr_raise_errno (NERR_IO, "fflush failed");
+    return nerr_pass (ne_sendfile (fileno(stdout), fd, offset, count));
+  }
+  while (count > 0)
+  {
+    r = pread (fd, buf, count < sizeof(buf) ? count : sizeof(buf), offset);
+    if (r < 0)
+    {
+      if (errno == EINTR) continue;
+      return nerr_raise_errno (NERR_IO, "Unable to read fd %d", fd);
+    }
+    if (r == 0)
+      return nerr_raise (NERR_IO, "Unexpected end of file on fd %d", fd);
+    err = cgiwrap_ctx_write (w, buf, r);
+    if (err) return nerr_pass (err);
+    offset += r;
+    count -= r;
+  }
+  return STATUS_OK;
+}
+
+NEOERR *cgiwrap_ctx_flush (CGIWRAP_CTX *ctx)
+{
+  CGIWRAPPER *w = _cgiwrap(ctx);
+  if (w->write_cb == NULL)
+  {
+    if (fflush(stdout))
+      return nerr_raise_errno (NERR_IO, "fflush failed");
+  }
+  return STATUS_OK;
+}
+
+void cgiwrap_ctx_read (CGIWRAP_CTX *ctx, char *buf, int buf_len, int *read_len)
+{
+  CGIWRAPPER *w = _cgiwrap(ctx);
+  if (w->read_cb != NULL)
+  {
+    *read_len = w->read_cb (w->data, buf, buf_len);
   }
   else
   {
@@ -248,3 +421,60 @@ void cgiwrap_read (char *buf, int buf_len, int *read_len)
 #endif
   }
 }
+
+/* The original interface, which uses the default context */
+NEOERR *cgiwrap_getenv (const char *k, char **v)
+{
+  return nerr_pass (cgiwrap_ctx_getenv (NULL, k, v));
+}
+
+NEOERR *cgiwrap_putenv (const char *k, const char *v)
+{
+  return nerr_pass (cgiwrap_ctx_putenv (NULL, k, v));
+}
+
+NEOERR *cgiwrap_iterenv (int num, char **k, char **v)
+{
+  return nerr_pass (cgiwrap_ctx_iterenv (NULL, num, k, v));
+}
+
+NEOERR *cgiwrap_writef (const char *fmt, ...)
+{
+  va_list ap;
+  NEOERR *err;
+
+  va_start (ap, fmt);
+  err = cgiwrap_ctx_writevf (NULL, fmt, ap);
+  va_end (ap);
+  return nerr_pass(err);
+}
+
+NEOERR *cgiwrap_writevf (const char *fmt, va_list ap)
+{
+  return nerr_pass (cgiwrap_ctx_writevf (NULL, fmt, ap));
+}
+
+NEOERR *cgiwrap_write (const char *buf, int buf_len)
+{
+  return nerr_pass (cgiwrap_ctx_write (NULL, buf, buf_len));
+}
+
+NEOERR *cgiwrap_writev (struct iovec *iov, int iovcnt)
+{
+  return nerr_pass (cgiwrap_ctx_writev (NULL, iov, iovcnt));
+}
+
+NEOERR *cgiwrap_sendfile (int fd, off_t offset, off_t count)
+{
+  return nerr_pass (cgiwrap_ctx_sendfile (NULL, fd, offset, count));
+}
+
+NEOERR *cgiwrap_flush (void)
+{
+  return nerr_pass (cgiwrap_ctx_flush (NULL));
+}
+
+void cgiwrap_read (char *buf, int buf_len, int *read_len)
+{
+  cgiwrap_ctx_read (NULL, buf, buf_len, read_len);
+}
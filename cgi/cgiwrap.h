@@ -23,6 +23,8 @@
 #define __CGIWRAP_H_ 1
 
 #include <stdarg.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 #include "util/neo_err.h"
 
 __BEGIN_DECLS
@@ -34,6 +36,13 @@ typedef char *(*GETENV_FUNC)(void *, const char *);
 typedef int (*PUTENV_FUNC)(void *, const char *, const char *);
 typedef int (*ITERENV_FUNC)(void *, int, char **, char **);
 
+/* A CGIWRAP_CTX holds one set of the callbacks below, so a server can
+ * give each request its own instead of sharing the process wide
+ * settings.  Each cgiwrap_* function has a cgiwrap_ctx_* version which
+ * takes the context as its first argument, passing NULL means the
+ * default context used by the cgiwrap_* functions. */
+typedef struct _cgiwrapper CGIWRAP_CTX;
+
 /* 
  * Function: cgiwrap_init_std - Initialize cgiwrap with default functions
  * Description: cgiwrap_init_std will initialize the cgiwrap subsystem 
@@ -70,6 +79,24 @@ void cgiwrap_init_emu (void *data, READ_FUNC read_cb,
     WRITEF_FUNC writef_cb, WRITE_FUNC write_cb, GETENV_FUNC getenv_cb,
     PUTENV_FUNC putenv_cb, ITERENV_FUNC iterenv_cb);
 
+/* 
+ * Function: cgiwrap_init_emu_thread - emulated cgiwrap for one thread
+ * Description: cgiwrap_init_emu_thread is like cgiwrap_init_emu, but
+ *              the callbacks are only used by the calling thread, so
+ *              threads serving different requests at the same time
+ *              can each have their own.  Other threads keep using the
+ *              process wide settings.  Any callback passed as NULL
+ *              uses the standard behaviour, as with cgiwrap_init_emu.
+ *              The settings are freed when the thread exits.
+ * Input: the same as cgiwrap_init_emu
+ * Output: None
+ * Returns: NERR_NOMEM
+ *          NERR_ASSERT - built without pthreads
+ */
+NEOERR *cgiwrap_init_emu_thread (void *data, READ_FUNC read_cb,
+    WRITEF_FUNC writef_cb, WRITE_FUNC write_cb, GETENV_FUNC getenv_cb,
+    PUTENV_FUNC putenv_cb, ITERENV_FUNC iterenv_cb);
+
 /* 
  * Function: cgiwrap_getenv - the wrapper for getenv
  * Description: cgiwrap_getenv wraps the getenv function for access to
@@ -151,6 +178,51 @@ NEOERR *cgiwrap_writevf (const char *fmt, va_list ap);
  */
 NEOERR *cgiwrap_write (const char *buf, int buf_len);
 
+/* 
+ * Function: cgiwrap_writev - gathered block data output
+ * Description: cgiwrap_writev writes several buffers as though by
+ *              cgiwrap_write on each in turn.  In a regular CGI, any
+ *              pending stdio output is flushed and the buffers are
+ *              written straight to stdout with writev, so headers and
+ *              body can go out in one system call without being copied
+ *              together first.  When emulated, each non-empty buffer is
+ *              passed to the write callback.
+ * Input: iov - the buffers to write, this array is modified
+ *        iovcnt - the number of entries in iov
+ * Output: None
+ * Returns: NERR_IO
+ */
+NEOERR *cgiwrap_writev (struct iovec *iov, int iovcnt);
+
+/* 
+ * Function: cgiwrap_sendfile - file data output
+ * Description: cgiwrap_sendfile writes count bytes of the file fd
+ *              starting at offset.  In a regular CGI, pending stdio
+ *              output is flushed and the data is sent with sendfile
+ *              where the system supports it, so it is never copied
+ *              through user space.  When emulated, the file is read in
+ *              blocks and passed to the write callback.  The file
+ *              offset of fd is not changed.
+ * Input: fd - an open file descriptor to read from
+ *        offset - where in the file to start
+ *        count - the number of bytes to send
+ * Output: None
+ * Returns: NERR_IO
+ */
+NEOERR *cgiwrap_sendfile (int fd, off_t offset, off_t count);
+
+/* 
+ * Function: cgiwrap_flush - push buffered output to the client
+ * Description: cgiwrap_flush flushes stdout in a regular CGI, so that
+ *              output written so far is sent without waiting for the
+ *              rest.  When emulated, buffering is left to the write
+ *              callback and this does nothing.
+ * Input: None
+ * Output: None
+ * Returns: NERR_IO
+ */
+NEOERR *cgiwrap_flush (void);
+
 /* 
  * Function: cgiwrap_read - cgiwrap input function
  * Description: cgiwrap_read is used to read incoming data from the
@@ -163,6 +235,52 @@ NEOERR *cgiwrap_write (const char *buf, int buf_len);
  */
 void cgiwrap_read (char *buf, int buf_len, int *read_len);
 
+/* 
+ * Function: cgiwrap_ctx_init_emu - create an emulated cgiwrap context
+ * Description: cgiwrap_ctx_init_emu allocates a new CGIWRAP_CTX using
+ *              the given callbacks, as cgiwrap_init_emu does for the
+ *              default context.  A callback passed as NULL uses the
+ *              standard behaviour, with the arguments and environment
+ *              from cgiwrap_init_std.  The context is only used by the
+ *              cgiwrap_ctx_* functions it is passed to, usually through
+ *              the CGI created for it by cgi_init_ctx, so one can be
+ *              made for each request being served at once.
+ * Input: data - user data to be passed to the specified callbacks
+ *        read_cb, etc - the same as cgiwrap_init_emu
+ * Output: ctx - a pointer to the new context
+ * Returns: NERR_NOMEM
+ */
+NEOERR *cgiwrap_ctx_init_emu (CGIWRAP_CTX **ctx, void *data,
+    READ_FUNC read_cb, WRITEF_FUNC writef_cb, WRITE_FUNC write_cb,
+    GETENV_FUNC getenv_cb, PUTENV_FUNC putenv_cb, ITERENV_FUNC iterenv_cb);
+
+/* 
+ * Function: cgiwrap_ctx_destroy - free a cgiwrap context
+ * Description: cgiwrap_ctx_destroy frees a context created by
+ *              cgiwrap_ctx_init_emu, and sets the pointer to NULL.  Any
+ *              CGI using the context must be destroyed first.
+ * Input: ctx - a pointer to the context
+ * Output: None
+ * Returns: None
+ */
+void cgiwrap_ctx_destroy (CGIWRAP_CTX **ctx);
+
+/* The cgiwrap_* functions above, on the given context (or the default
+ * context if ctx is NULL) */
+NEOERR *cgiwrap_ctx_getenv (CGIWRAP_CTX *ctx, const char *k, char **v);
+NEOERR *cgiwrap_ctx_putenv (CGIWRAP_CTX *ctx, const char *k, const char *v);
+NEOERR *cgiwrap_ctx_iterenv (CGIWRAP_CTX *ctx, int n, char **k, char **v);
+NEOERR *cgiwrap_ctx_writef (CGIWRAP_CTX *ctx, const char *fmt, ...)
+                            ATTRIBUTE_PRINTF(2,3);
+NEOERR *cgiwrap_ctx_writevf (CGIWRAP_CTX *ctx, const char *fmt, va_list ap);
+NEOERR *cgiwrap_ctx_write (CGIWRAP_CTX *ctx, const char *buf, int buf_len);
+NEOERR *cgiwrap_ctx_writev (CGIWRAP_CTX *ctx, struct iovec *iov, int iovcnt);
+NEOERR *cgiwrap_ctx_sendfile (CGIWRAP_CTX *ctx, int fd, off_t offset,
+                              off_t count);
+NEOERR *cgiwrap_ctx_flush (CGIWRAP_CTX *ctx);
+void cgiwrap_ctx_read (CGIWRAP_CTX *ctx, char *buf, int buf_len,
+                       int *read_len);
+
 __END_DECLS
 
 #endif /* __CGIWRAP_H_ */
@@ -0,0 +1,1148 @@
+/*
+ * Copyright 2001-2004 Brandon Long
+ * All Rights Reserved.
+ *
+ * ClearSilver Templating System
+ *
+ * This code is made available under the terms of the ClearSilver License.
+ * http://www.clearsilver.net/license.hdf
+ *
+ */
+
+/* A FastCGI responder, following the FastCGI 1.0 specification.
+ *
+ * A single event thread accepts connections and reads records from all
+ * of them with poll.  Each request's params and stdin are collected on
+ * its connection, and once the stdin stream ends the request is queued
+ * for one of a fixed pool of worker threads.  The worker runs the
+ * request through the regular CGI code, with a cgiwrap context of its
+ * own so its environment, input and output are the request's, and
+ * writes its stdout records back on the connection itself.  Since
+ * workers on the same connection can write at once, each write of
+ * whole records holds the connection's write lock.  The event thread
+ * never writes, as a write can wait on a slow web server; the records
+ * it answers itself are queued for the workers like requests.
+ */
+
+#include "cs_config.h"
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#ifdef HAVE_PTHREADS
+#include <pthread.h>
+#endif
+
+#include "util/neo_misc.h"
+#include "util/neo_err.h"
+#include "util/neo_files.h"
+#include "util/neo_hdf.h"
+#include "util/neo_net.h"
+#include "util/neo_str.h"
+#include "util/ulist.h"
+#include "cgi.h"
+#include "cgiwrap.h"
+#include "fastcgi.h"
+
+#ifdef HAVE_PTHREADS
+
+#define FCGI_LISTENSOCK_FILENO 0
+#define FCGI_VERSION_1 1
+#define FCGI_HEADER_LEN 8
+#define FCGI_MAX_CONTENT 65535
+#define FCGI_MAX_RECORD (FCGI_HEADER_LEN + FCGI_MAX_CONTENT + 255)
+
+/* record types */
+#define FCGI_BEGIN_REQUEST 1
+#define FCGI_ABORT_REQUEST 2
+#define FCGI_END_REQUEST 3
+#define FCGI_PARAMS 4
+#define FCGI_STDIN 5
+#define FCGI_STDOUT 6
+#define FCGI_GET_VALUES 9
+#define FCGI_GET_VALUES_RESULT 10
+#define FCGI_UNKNOWN_TYPE 11
+
+#define FCGI_KEEP_CONN 1
+#define FCGI_RESPONDER 1
+
+/* protocol status for FCGI_END_REQUEST */
+#define FCGI_REQUEST_COMPLETE 0
+#define FCGI_UNKNOWN_ROLE 3
+
+/* Output is gathered into a buffer of this size before it is sent */
+#define FCGI_OUT_SIZE 8192
+/* The most records put in one writev */
+#define FCGI_IOV_RECORDS 16
+/* The default for FASTCGI max_request_size */
+#define FCGI_MAX_REQUEST_SIZE (16 * 1024 * 1024)
+
+typedef struct _fcgi_conn FCGI_CONN;
+
+/* A request belongs to the event thread, on its connection's list,
+ * while its params and stdin arrive, then to the worker it is queued
+ * for.  A reply queued by the event thread only has its records, which
+ * the worker sends instead of running a request. */
+typedef struct _fcgi_req
+{
+  FCGI_CONN *conn;
+  int id;
+  int keep_conn;
+  int params_done;
+  int size;         /* bytes of params and stdin so far */
+  STRING params;
+  ULIST *env;       /* "NAME=value" strings */
+  STRING in;
+  int in_pos;
+  STRING reply;
+  struct _fcgi_req *next;
+} FCGI_REQ;
+
+struct _fcgi_conn
+{
+  int fd;
+  /* one for the event thread while it is reading the connection, and
+   * one for each request given to a worker, protected by the pool lock */
+  int refs;
+  pthread_mutex_t write_lock;
+
+  /* only touched by the event thread */
+  FCGI_REQ *reqs;
+  FCGI_CONN *next;
+  int len;
+  UINT8 buf[FCGI_MAX_RECORD];
+};
+
+typedef struct _fcgi_pool
+{
+  FASTCGI *fcgi;
+  int listen_fd;
+  int max_request_size;
+
+  /* only touched by the event thread */
+  FCGI_CONN *conns;
+  int num_conns;
+  /* while set, the listen socket isn't polled, see _fcgi_event_loop */
+  int accept_paused;
+  time_t accept_resume;
+
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  FCGI_REQ *ready;
+  FCGI_REQ *ready_tail;
+  int shutdown;
+} FCGI_POOL;
+
+typedef struct _fcgi_worker
+{
+  FCGI_POOL *pool;
+  int num;
+  pthread_t thread;
+  HDF *skel;
+  CGIWRAP_CTX *wrap;
+
+  /* the request being handled, and its buffered output */
+  FCGI_REQ *req;
+  int out_len;
+  char out[FCGI_OUT_SIZE];
+} FCGI_WORKER;
+
+static int ShutdownPending = 0;
+
+static void sig_term(int sig)
+{
+  ShutdownPending = 1;
+}
+
+static void setup_signals(void)
+{
+  struct sigaction sa;
+
+  memset(&sa, 0, sizeof(struct sigaction));
+  sa.sa_handler = SIG_IGN;
+  sigemptyset(&sa.sa_mask);
+  sa.sa_flags = SA_RESTART;
+  sigaction(SIGPIPE, &sa, NULL);
+
+  memset(&sa, 0, sizeof(struct sigaction));
+  sa.sa_handler = sig_term;
+  sigemptyset(&sa.sa_mask);
+  sa.sa_flags = 0;
+  sigaction(SIGTERM, &sa, NULL);
+}
+
+static void _fcgi_header(UINT8 *h, int type, int id, int len)
+{
+  h[0] = FCGI_VERSION_1;
+  h[1] = type;
+  h[2] = (id >> 8) & 0xff;
+  h[3] = id & 0xff;
+  h[4] = (len >> 8) & 0xff;
+  h[5] = len & 0xff;
+  h[6] = 0;
+  h[7] = 0;
+}
+
+/* Fills in a whole FCGI_END_REQUEST record, 16 bytes */
+static void _fcgi_end_record(UINT8 *h, int id, UINT32 app_status,
+                             int protocol_status)
+{
+  _fcgi_header(h, FCGI_END_REQUEST, id, 8);
+  h[8] = (app_status >> 24) & 0xff;
+  h[9] = (app_status >> 16) & 0xff;
+  h[10] = (app_status >> 8) & 0xff;
+  h[11] = app_status & 0xff;
+  h[12] = protocol_status;
+  h[13] = h[14] = h[15] = 0;
+}
+
+static NEOERR *_fcgi_conn_write(FCGI_CONN *conn, struct iovec *iov, int n)
+{
+  NEOERR *err;
+
+  pthread_mutex_lock(&(conn->write_lock));
+  err = ne_writev(conn->fd, iov, n);
+  pthread_mutex_unlock(&(conn->write_lock));
+  return nerr_pass(err);
+}
+
+/* Sends a and then b as type records for request id, without copying
+ * them.  With end set, this is followed by the end of the stream and
+ * the FCGI_END_REQUEST with app_status. */
+static NEOERR *_fcgi_send(FCGI_CONN *conn, int id, int type,
+                          const char *a, int alen, const char *b, int blen,
+                          int end, UINT32 app_status)
+{
+  NEOERR *err;
+  struct iovec iov[2 * FCGI_IOV_RECORDS + 1];
+  UINT8 hdrs[FCGI_IOV_RECORDS][FCGI_HEADER_LEN];
+  UINT8 tail[FCGI_HEADER_LEN + 16];
+  int n = 0, r = 0, l;
+
+  while (alen || blen)
+  {
+    if (alen == 0)
+    {
+      a = b;
+      alen = blen;
+      blen = 0;
+    }
+    l = MIN(alen, FCGI_MAX_CONTENT);
+    _fcgi_header(hdrs[r], type, id, l);
+    iov[n].iov_base = hdrs[r++];
+    iov[n++].iov_len = FCGI_HEADER_LEN;
+    iov[n].iov_base = (char *)a;
+    iov[n++].iov_len = l;
+    a += l;
+    alen -= l;
+    if (r == FCGI_IOV_RECORDS)
+    {
+      err = _fcgi_conn_write(conn, iov, n);
+      if (err) return nerr_pass(err);
+      n = r = 0;
+    }
+  }
+  if (end)
+  {
+    _fcgi_header(tail, type, id, 0);
+    _fcgi_end_record(tail + FCGI_HEADER_LEN, id, app_status,
+                     FCGI_REQUEST_COMPLETE);
+    iov[n].iov_base = tail;
+    iov[n++].iov_len = sizeof(tail);
+  }
+  if (n == 0) return STATUS_OK;
+  return nerr_pass(_fcgi_conn_write(conn, iov, n));
+}
+
+/* Name-value pair lengths are one byte, or four with the high bit set */
+static int _fcgi_nv_len(UINT8 **p, UINT8 *end, int *len)
+{
+  UINT8 *s = *p;
+
+  if (s >= end) return -1;
+  if (s[0] & 0x80)
+  {
+    if (end - s < 4) return -1;
+    *len = ((s[0] & 0x7f) << 24) | (s[1] << 16) | (s[2] << 8) | s[3];
+    *p = s + 4;
+  }
+  else
+  {
+    *len = s[0];
+    *p = s + 1;
+  }
+  return 0;
+}
+
+static NEOERR *_fcgi_nv_append(STRING *str, const char *name,
+                               const char *value)
+{
+  NEOERR *err;
+  int x, l;
+  char b[4];
+  const char *s[2];
+
+  s[0] = name;
+  s[1] = value;
+  for (x = 0; x < 2; x++)
+  {
+    l = strlen(s[x]);
+    if (l < 128)
+    {
+      err = string_append_char(str, l);
+    }
+    else
+    {
+      b[0] = ((l >> 24) & 0x7f) | 0x80;
+      b[1] = (l >> 16) & 0xff;
+      b[2] = (l >> 8) & 0xff;
+      b[3] = l & 0xff;
+      err = string_appendn(str, b, 4);
+    }
+    if (err) return nerr_pass(err);
+  }
+  err = string_append(str, name);
+  if (err) return nerr_pass(err);
+  return nerr_pass(string_append(str, value));
+}
+
+static NEOERR *_fcgi_parse_params(FCGI_REQ *req)
+{
+  NEOERR *err;
+  UINT8 *p = (UINT8 *)req->params.buf;
+  UINT8 *end = p + req->params.len;
+  int nlen, vlen;
+  char *s;
+
+  while (p < end)
+  {
+    if (_fcgi_nv_len(&p, end, &nlen) || _fcgi_nv_len(&p, end, &vlen) ||
+        end - p < nlen || end - p - nlen < vlen)
+      return nerr_raise(NERR_PARSE, "Invalid FastCGI params for request %d",
+                        req->id);
+    s = (char *) malloc(nlen + vlen + 2);
+    if (s == NULL)
+      return nerr_raise(NERR_NOMEM, "Unable to allocate FastCGI param");
+    memcpy(s, p, nlen);
+    s[nlen] = '=';
+    memcpy(s + nlen + 1, p + nlen, vlen);
+    s[nlen + vlen + 1] = '\0';
+    err = uListAppend(req->env, s);
+    if (err)
+    {
+      free(s);
+      return nerr_pass(err);
+    }
+    p += nlen + vlen;
+  }
+  string_clear(&(req->params));
+  return STATUS_OK;
+}
+
+static int _fcgi_env_find(FCGI_REQ *req, const char *k)
+{
+  int x, l = strlen(k);
+  char *s;
+
+  for (x = 0; x < uListLength(req->env); x++)
+  {
+    uListGet(req->env, x, (void *)&s);
+    if (!strncmp(s, k, l) && s[l] == '=')
+      return x;
+  }
+  return -1;
+}
+
+static void _fcgi_req_free(FCGI_REQ *req)
+{
+  string_clear(&(req->params));
+  string_clear(&(req->in));
+  string_clear(&(req->reply));
+  if (req->env)
+    uListDestroy(&(req->env), ULIST_FREE);
+  free(req);
+}
+
+static void _fcgi_conn_release(FCGI_POOL *pool, FCGI_CONN *conn)
+{
+  int refs;
+
+  pthread_mutex_lock(&(pool->lock));
+  refs = --conn->refs;
+  pthread_mutex_unlock(&(pool->lock));
+  if (refs) return;
+  close(conn->fd);
+  pthread_mutex_destroy(&(conn->write_lock));
+  free(conn);
+}
+
+/* The cgiwrap callbacks, the data is the FCGI_WORKER */
+static int _fcgi_read(void *data, char *buf, int len)
+{
+  FCGI_REQ *req = ((FCGI_WORKER *)data)->req;
+  int l = MIN(len, req->in.len - req->in_pos);
+
+  if (l <= 0) return 0;
+  memcpy(buf, req->in.buf + req->in_pos, l);
+  req->in_pos += l;
+  return l;
+}
+
+static int _fcgi_write(void *data, const char *buf, int len)
+{
+  FCGI_WORKER *worker = (FCGI_WORKER *)data;
+  NEOERR *err;
+
+  if (worker->out_len + len <= FCGI_OUT_SIZE)
+  {
+    memcpy(worker->out + worker->out_len, buf, len);
+    worker->out_len += len;
+    return len;
+  }
+  /* send what is buffered and buf together, buf without copying */
+  err = _fcgi_send(worker->req->conn, worker->req->id, FCGI_STDOUT,
+                   worker->out, worker->out_len, buf, len, 0, 0);
+  worker->out_len = 0;
+  if (err)
+  {
+    nerr_ignore(&err);
+    return -1;
+  }
+  return len;
+}
+
+static int _fcgi_writef(void *data, const char *fmt, va_list ap)
+{
+  char *buf = NULL;
+  int len, r;
+
+  len = visprintf_alloc(&buf, fmt, ap);
+  if (buf == NULL) return -1;
+  r = _fcgi_write(data, buf, len);
+  free(buf);
+  return r;
+}
+
+static char *_fcgi_getenv(void *data, const char *k)
+{
+  FCGI_REQ *req = ((FCGI_WORKER *)data)->req;
+  char *s;
+  int x;
+
+  x = _fcgi_env_find(req, k);
+  if (x == -1) return NULL;
+  uListGet(req->env, x, (void *)&s);
+  return strdup(s + strlen(k) + 1);
+}
+
+static int _fcgi_putenv(void *data, const char *k, const char *v)
+{
+  FCGI_REQ *req = ((FCGI_WORKER *)data)->req;
+  NEOERR *err;
+  char *s, *old;
+  int x;
+
+  s = sprintf_alloc("%s=%s", k, v);
+  if (s == NULL) return 1;
+  x = _fcgi_env_find(req, k);
+  if (x == -1)
+  {
+    err = uListAppend(req->env, s);
+  }
+  else
+  {
+    uListGet(req->env, x, (void *)&old);
+    err = uListSet(req->env, x, s);
+    if (err == STATUS_OK) free(old);
+  }
+  if (err)
+  {
+    free(s);
+    nerr_ignore(&err);
+    return 1;
+  }
+  return 0;
+}
+
+static int _fcgi_iterenv(void *data, int num, char **k, char **v)
+{
+  FCGI_REQ *req = ((FCGI_WORKER *)data)->req;
+  char *s, *c;
+
+  if (num >= uListLength(req->env)) return 0;
+  uListGet(req->env, num, (void *)&s);
+  c = strchr(s, '=');
+  *k = neos_strndup(s, c - s);
+  *v = strdup(c + 1);
+  if (*k == NULL || *v == NULL)
+  {
+    free(*k);
+    free(*v);
+    *k = *v = NULL;
+    return 1;
+  }
+  return 0;
+}
+
+static void _fcgi_handle(FCGI_WORKER *worker, FCGI_REQ *req)
+{
+  FASTCGI *fcgi = worker->pool->fcgi;
+  NEOERR *err;
+  HDF *hdf = NULL;
+  CGI *cgi = NULL;
+  UINT32 status = 0;
+
+  worker->req = req;
+  worker->out_len = 0;
+
+  do
+  {
+    err = hdf_init_overlay(&hdf, worker->skel, 0);
+    if (err) break;
+    /* cgi_init owns the hdf now, even if it fails */
+    err = cgi_init_ctx(&cgi, hdf, worker->wrap);
+    if (err) break;
+    err = fcgi->req_cb(fcgi->data, worker->num, cgi);
+  } while (0);
+
+  if (err && !nerr_handle(&err, CGIFinished))
+  {
+    status = 1;
+    cgi_neo_error(cgi, err);
+    nerr_log_error(err);
+    nerr_ignore(&err);
+  }
+  cgi_destroy(&cgi);
+
+  err = _fcgi_send(req->conn, req->id, FCGI_STDOUT, worker->out,
+                   worker->out_len, NULL, 0, 1, status);
+  /* nobody left to tell if the web server went away */
+  nerr_ignore(&err);
+  worker->out_len = 0;
+  worker->req = NULL;
+
+  /* the event thread sees the end of the connection and drops it */
+  if (!req->keep_conn)
+    shutdown(req->conn->fd, SHUT_RDWR);
+}
+
+static void _fcgi_send_reply(FCGI_REQ *req)
+{
+  NEOERR *err;
+  struct iovec iov;
+
+  iov.iov_base = req->reply.buf;
+  iov.iov_len = req->reply.len;
+  err = _fcgi_conn_write(req->conn, &iov, 1);
+  nerr_ignore(&err);
+  if (!req->keep_conn)
+    shutdown(req->conn->fd, SHUT_RDWR);
+}
+
+static void *_fcgi_worker_loop(void *arg)
+{
+  FCGI_WORKER *worker = (FCGI_WORKER *)arg;
+  FCGI_POOL *pool = worker->pool;
+  NEOERR *err;
+  FCGI_REQ *req;
+
+  /* The CGI uses the worker's context, this is for application code
+   * which calls the cgiwrap_* functions itself */
+  err = cgiwrap_init_emu_thread(worker, _fcgi_read, _fcgi_writef,
+                                _fcgi_write, _fcgi_getenv, _fcgi_putenv,
+                                _fcgi_iterenv);
+  if (err)
+  {
+    nerr_log_error(err);
+    nerr_ignore(&err);
+    return NULL;
+  }
+
+  while (1)
+  {
+    /* after a shutdown, finish the requests already queued */
+    pthread_mutex_lock(&(pool->lock));
+    while (pool->ready == NULL && !pool->shutdown)
+      pthread_cond_wait(&(pool->cond), &(pool->lock));
+    req = pool->ready;
+    if (req != NULL)
+    {
+      pool->ready = req->next;
+      if (pool->ready == NULL)
+        pool->ready_tail = NULL;
+    }
+    pthread_mutex_unlock(&(pool->lock));
+    if (req == NULL) break;
+
+    if (req->reply.len)
+      _fcgi_send_reply(req);
+    else
+      _fcgi_handle(worker, req);
+    _fcgi_conn_release(pool, req->conn);
+    _fcgi_req_free(req);
+  }
+  return NULL;
+}
+
+static void _fcgi_dispatch(FCGI_POOL *pool, FCGI_REQ *req)
+{
+  req->next = NULL;
+  pthread_mutex_lock(&(pool->lock));
+  req->conn->refs++;
+  if (pool->ready_tail)
+    pool->ready_tail->next = req;
+  else
+    pool->ready = req;
+  pool->ready_tail = req;
+  pthread_cond_signal(&(pool->cond));
+  pthread_mutex_unlock(&(pool->lock));
+}
+
+/* Queues the len bytes of records at rec for a worker to send on conn,
+ * and with keep_conn unset to shut conn down after */
+static NEOERR *_fcgi_reply(FCGI_POOL *pool, FCGI_CONN *conn, void *rec,
+                           int len, int keep_conn)
+{
+  NEOERR *err;
+  FCGI_REQ *req;
+
+  req = (FCGI_REQ *) calloc(1, sizeof(FCGI_REQ));
+  if (req == NULL)
+    return nerr_raise(NERR_NOMEM, "Unable to allocate FastCGI reply");
+  req->conn = conn;
+  req->keep_conn = keep_conn;
+  string_init(&(req->params));
+  string_init(&(req->in));
+  string_init(&(req->reply));
+  err = string_appendn(&(req->reply), (char *)rec, len);
+  if (err)
+  {
+    _fcgi_req_free(req);
+    return nerr_pass(err);
+  }
+  _fcgi_dispatch(pool, req);
+  return STATUS_OK;
+}
+
+static NEOERR *_fcgi_end_request(FCGI_POOL *pool, FCGI_CONN *conn, int id,
+                                 int protocol_status, int keep_conn)
+{
+  UINT8 rec[16];
+
+  _fcgi_end_record(rec, id, 0, protocol_status);
+  return nerr_pass(_fcgi_reply(pool, conn, rec, sizeof(rec), keep_conn));
+}
+
+/* Takes req off conn and ends it with a 413, since it has sent more
+ * than max_request_size */
+static NEOERR *_fcgi_too_large(FCGI_POOL *pool, FCGI_REQ **prev)
+{
+  NEOERR *err;
+  FCGI_REQ *req = *prev;
+  FCGI_CONN *conn = req->conn;
+  UINT8 h[FCGI_HEADER_LEN + 16];
+  const char *page = "Status: 413 Request Entity Too Large\r\n"
+                     "Content-Type: text/plain\r\n\r\n"
+                     "Request Entity Too Large\n";
+  STRING str;
+  int id = req->id, keep_conn = req->keep_conn;
+
+  ne_warn("FastCGI request %d is larger than %d bytes", id,
+          pool->max_request_size);
+  *prev = req->next;
+  _fcgi_req_free(req);
+
+  string_init(&str);
+  _fcgi_header(h, FCGI_STDOUT, id, strlen(page));
+  err = string_appendn(&str, (char *)h, FCGI_HEADER_LEN);
+  if (err == STATUS_OK)
+    err = string_append(&str, page);
+  if (err == STATUS_OK)
+  {
+    _fcgi_header(h, FCGI_STDOUT, id, 0);
+    _fcgi_end_record(h + FCGI_HEADER_LEN, id, 1, FCGI_REQUEST_COMPLETE);
+    err = string_appendn(&str, (char *)h, sizeof(h));
+  }
+  if (err == STATUS_OK)
+    err = _fcgi_reply(pool, conn, str.buf, str.len, keep_conn);
+  string_clear(&str);
+  return nerr_pass(err);
+}
+
+/* Records with request id 0 */
+static NEOERR *_fcgi_management(FCGI_POOL *pool, FCGI_CONN *conn, int type,
+                                UINT8 *c, int clen)
+{
+  NEOERR *err = STATUS_OK;
+  FASTCGI *fcgi = pool->fcgi;
+  UINT8 h[FCGI_HEADER_LEN + 8];
+  UINT8 *p = c, *end = c + clen;
+  STRING str;
+  char name[32], value[32];
+  int nlen, vlen;
+
+  if (type != FCGI_GET_VALUES)
+  {
+    _fcgi_header(h, FCGI_UNKNOWN_TYPE, 0, 8);
+    memset(h + FCGI_HEADER_LEN, 0, 8);
+    h[FCGI_HEADER_LEN] = type;
+    return nerr_pass(_fcgi_reply(pool, conn, h, sizeof(h), 1));
+  }
+
+  /* the header is filled in once the length is known */
+  string_init(&str);
+  memset(h, 0, FCGI_HEADER_LEN);
+  err = string_appendn(&str, (char *)h, FCGI_HEADER_LEN);
+  while (err == STATUS_OK && p < end)
+  {
+    if (_fcgi_nv_len(&p, end, &nlen) || _fcgi_nv_len(&p, end, &vlen) ||
+        end - p < nlen || end - p - nlen < vlen)
+      break;
+    snprintf(name, sizeof(name), "%.*s", nlen, p);
+    p += nlen + vlen;
+    value[0] = '\0';
+    if (!strcmp(name, "FCGI_MPXS_CONNS"))
+      strcpy(value, "1");
+    else if (fcgi->max_conns && (!strcmp(name, "FCGI_MAX_CONNS") ||
+                                 !strcmp(name, "FCGI_MAX_REQS")))
+      snprintf(value, sizeof(value), "%d", fcgi->max_conns);
+    if (value[0])
+      err = _fcgi_nv_append(&str, name, value);
+  }
+  if (err == STATUS_OK)
+  {
+    _fcgi_header((UINT8 *)str.buf, FCGI_GET_VALUES_RESULT, 0,
+                 str.len - FCGI_HEADER_LEN);
+    err = _fcgi_reply(pool, conn, str.buf, str.len, 1);
+  }
+  string_clear(&str);
+  return nerr_pass(err);
+}
+
+/* Handles one record on conn, returns non-zero if the connection should
+ * be dropped */
+static int _fcgi_record(FCGI_POOL *pool, FCGI_CONN *conn, int type, int id,
+                        UINT8 *c, int clen)
+{
+  NEOERR *err = STATUS_OK;
+  FCGI_REQ *req, **prev;
+  int keep_conn;
+
+  if (id == 0)
+  {
+    err = _fcgi_management(pool, conn, type, c, clen);
+    if (err)
+    {
+      nerr_log_error(err);
+      nerr_ignore(&err);
+      return 1;
+    }
+    return 0;
+  }
+
+  for (prev = &(conn->reqs); (req = *prev) != NULL; prev = &(req->next))
+  {
+    if (req->id == id) break;
+  }
+
+  switch (type)
+  {
+    case FCGI_BEGIN_REQUEST:
+      if (clen < 8) return 1;
+      if (req != NULL) break;
+      if (((c[0] << 8) | c[1]) != FCGI_RESPONDER)
+      {
+        err = _fcgi_end_request(pool, conn, id, FCGI_UNKNOWN_ROLE, 1);
+        break;
+      }
+      req = (FCGI_REQ *) calloc(1, sizeof(FCGI_REQ));
+      if (req == NULL)
+      {
+        err = nerr_raise(NERR_NOMEM, "Unable to allocate FastCGI request");
+        break;
+      }
+      req->conn = conn;
+      req->id = id;
+      req->keep_conn = c[2] & FCGI_KEEP_CONN;
+      string_init(&(req->params));
+      string_init(&(req->in));
+      err = uListInit(&(req->env), 32, 0);
+      if (err)
+      {
+        free(req);
+        break;
+      }
+      req->next = conn->reqs;
+      conn->reqs = req;
+      break;
+    case FCGI_ABORT_REQUEST:
+      /* requests already given to a worker just finish */
+      if (req == NULL) break;
+      *prev = req->next;
+      keep_conn = req->keep_conn;
+      _fcgi_req_free(req);
+      err = _fcgi_end_request(pool, conn, id, FCGI_REQUEST_COMPLETE,
+                              keep_conn);
+      break;
+    case FCGI_PARAMS:
+      if (req == NULL || req->params_done) break;
+      req->size += clen;
+      if (req->size > pool->max_request_size)
+      {
+        err = _fcgi_too_large(pool, prev);
+      }
+      else if (clen)
+      {
+        err = string_appendn(&(req->params), (char *)c, clen);
+      }
+      else
+      {
+        err = _fcgi_parse_params(req);
+        req->params_done = 1;
+      }
+      break;
+    case FCGI_STDIN:
+      if (req == NULL) break;
+      req->size += clen;
+      if (req->size > pool->max_request_size)
+      {
+        err = _fcgi_too_large(pool, prev);
+        break;
+      }
+      if (clen)
+      {
+        err = string_appendn(&(req->in), (char *)c, clen);
+        break;
+      }
+      if (!req->params_done)
+      {
+        err = nerr_raise(NERR_PARSE, "FastCGI request %d has no params", id);
+        break;
+      }
+      *prev = req->next;
+      _fcgi_dispatch(pool, req);
+      break;
+    default:
+      /* FCGI_DATA is only for filters, and anything else isn't sent to
+       * applications */
+      break;
+  }
+  if (err)
+  {
+    nerr_log_error(err);
+    nerr_ignore(&err);
+    return 1;
+  }
+  return 0;
+}
+
+/* Reads what has arrived on conn and handles the complete records,
+ * returns non-zero if the connection should be dropped */
+static int _fcgi_conn_read(FCGI_POOL *pool, FCGI_CONN *conn)
+{
+  UINT8 *p;
+  int r, clen, rlen, used = 0;
+
+  r = read(conn->fd, conn->buf + conn->len, sizeof(conn->buf) - conn->len);
+  if (r < 0)
+    return !(errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK);
+  if (r == 0) return 1;
+  conn->len += r;
+
+  while (conn->len - used >= FCGI_HEADER_LEN)
+  {
+    p = conn->buf + used;
+    if (p[0] != FCGI_VERSION_1) return 1;
+    clen = (p[4] << 8) | p[5];
+    rlen = FCGI_HEADER_LEN + clen + p[6];
+    if (conn->len - used < rlen) break;
+    if (_fcgi_record(pool, conn, p[1], (p[2] << 8) | p[3],
+                     p + FCGI_HEADER_LEN, clen))
+      return 1;
+    used += rlen;
+  }
+  if (used)
+  {
+    memmove(conn->buf, conn->buf + used, conn->len - used);
+    conn->len -= used;
+  }
+  return 0;
+}
+
+static void _fcgi_conn_drop(FCGI_POOL *pool, FCGI_CONN *conn)
+{
+  FCGI_REQ *req;
+
+  while ((req = conn->reqs) != NULL)
+  {
+    conn->reqs = req->next;
+    _fcgi_req_free(req);
+  }
+  _fcgi_conn_release(pool, conn);
+}
+
+static NEOERR *_fcgi_accept(FCGI_POOL *pool)
+{
+  NEOERR *err;
+  FCGI_CONN *conn;
+  int fd;
+
+  while (1)
+  {
+    fd = accept(pool->listen_fd, NULL, NULL);
+    if (fd == -1)
+    {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) return STATUS_OK;
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      return nerr_raise_errno(NERR_IO, "Accept failed");
+    }
+    if (pool->fcgi->max_conns && pool->num_conns >= pool->fcgi->max_conns)
+    {
+      close(fd);
+      continue;
+    }
+    /* some systems pass the listen socket's O_NONBLOCK on */
+    err = ne_net_set_nonblock(fd, FALSE);
+    if (err)
+    {
+      close(fd);
+      return nerr_pass(err);
+    }
+    conn = (FCGI_CONN *) calloc(1, sizeof(FCGI_CONN));
+    if (conn == NULL)
+    {
+      close(fd);
+      return nerr_raise(NERR_NOMEM, "Unable to allocate FastCGI connection");
+    }
+    conn->fd = fd;
+    conn->refs = 1;
+    pthread_mutex_init(&(conn->write_lock), NULL);
+    conn->next = pool->conns;
+    pool->conns = conn;
+    pool->num_conns++;
+  }
+}
+
+static NEOERR *_fcgi_event_loop(FCGI_POOL *pool)
+{
+  NEOERR *err = STATUS_OK;
+  struct pollfd *fds = NULL, *new_fds;
+  FCGI_CONN *conn, **prev;
+  int max = 0, n, x, r;
+
+  while (!ShutdownPending)
+  {
+    if (pool->num_conns + 1 > max)
+    {
+      max = (pool->num_conns + 1) * 2;
+      new_fds = (struct pollfd *) realloc(fds, max * sizeof(struct pollfd));
+      if (new_fds == NULL)
+      {
+        err = nerr_raise(NERR_NOMEM, "Unable to allocate poll descriptors");
+        break;
+      }
+      fds = new_fds;
+    }
+    /* poll skips a negative fd, which keeps the connections' slots */
+    fds[0].fd = pool->accept_paused ? -1 : pool->listen_fd;
+    fds[0].events = POLLIN;
+    fds[0].revents = 0;
+    n = 1;
+    for (conn = pool->conns; conn != NULL; conn = conn->next)
+    {
+      fds[n].fd = conn->fd;
+      fds[n].events = POLLIN;
+      fds[n].revents = 0;
+      n++;
+    }
+
+    /* wake up at least once a second to check for a shutdown */
+    r = poll(fds, n, 1000);
+    if (r < 0)
+    {
+      if (errno == EINTR) continue;
+      err = nerr_raise_errno(NERR_SYSTEM, "poll failed");
+      break;
+    }
+
+    /* the connections are still in the order they were polled in */
+    x = 1;
+    prev = &(pool->conns);
+    while ((conn = *prev) != NULL)
+    {
+      if (fds[x++].revents && _fcgi_conn_read(pool, conn))
+      {
+        *prev = conn->next;
+        pool->num_conns--;
+        _fcgi_conn_drop(pool, conn);
+        pool->accept_resume = 0;
+      }
+      else
+      {
+        prev = &(conn->next);
+      }
+    }
+    if (fds[0].revents)
+    {
+      err = _fcgi_accept(pool);
+      /* Out of descriptors or memory shouldn't take down the server.
+       * The connection is still pending, so polling the listen socket
+       * would wake straight back up for it: leave it out until a
+       * connection is dropped, or for a second. */
+      if (err)
+      {
+        nerr_log_error(err);
+        nerr_ignore(&err);
+        pool->accept_paused = 1;
+        pool->accept_resume = time(NULL) + 1;
+      }
+    }
+    if (pool->accept_paused && time(NULL) >= pool->accept_resume)
+      pool->accept_paused = 0;
+  }
+  free(fds);
+  return nerr_pass(err);
+}
+
+NEOERR *cgi_fastcgi_run (FASTCGI *fcgi)
+{
+  NEOERR *err = STATUS_OK;
+  FCGI_POOL pool;
+  FCGI_WORKER *workers = NULL;
+  FCGI_CONN *conn;
+  FCGI_REQ *req;
+  sigset_t mask, old_mask;
+  int started = 0;
+  int x, r;
+
+  if (fcgi->req_cb == NULL)
+    return nerr_raise(NERR_ASSERT, "FastCGI requires a request callback");
+  if (fcgi->num_threads < 1)
+    return nerr_raise(NERR_ASSERT, "FastCGI requires at least one thread");
+
+  setup_signals();
+  ShutdownPending = 0;
+
+  memset(&pool, 0, sizeof(pool));
+  pool.fcgi = fcgi;
+  pool.listen_fd = -1;
+  pool.max_request_size = fcgi->max_request_size > 0 ?
+                          fcgi->max_request_size : FCGI_MAX_REQUEST_SIZE;
+  pthread_mutex_init(&(pool.lock), NULL);
+  pthread_cond_init(&(pool.cond), NULL);
+
+  do
+  {
+    workers = (FCGI_WORKER *) calloc(fcgi->num_threads, sizeof(FCGI_WORKER));
+    if (workers == NULL)
+    {
+      err = nerr_raise(NERR_NOMEM, "Unable to allocate FastCGI workers");
+      break;
+    }
+
+    if (fcgi->port)
+    {
+      err = ne_net_listen(fcgi->port, &(pool.listen_fd));
+      if (err) break;
+    }
+    else
+    {
+      pool.listen_fd = FCGI_LISTENSOCK_FILENO;
+    }
+    err = ne_net_set_nonblock(pool.listen_fd, TRUE);
+    if (err) break;
+
+    for (x = 0; x < fcgi->num_threads; x++)
+    {
+      workers[x].pool = &pool;
+      workers[x].num = x;
+      err = cgiwrap_ctx_init_emu(&(workers[x].wrap), &(workers[x]),
+                                 _fcgi_read, _fcgi_writef, _fcgi_write,
+                                 _fcgi_getenv, _fcgi_putenv, _fcgi_iterenv);
+      if (err) break;
+      err = hdf_init(&(workers[x].skel));
+      if (err) break;
+      err = hdf_set_value(workers[x].skel, "Config.TemplateCache", "1");
+      if (err) break;
+      if (fcgi->init_cb)
+      {
+        err = fcgi->init_cb(fcgi->data, x, workers[x].skel);
+        if (err) break;
+      }
+    }
+    if (err) break;
+
+    /* Only the event thread handles SIGTERM */
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
+    for (started = 0; started < fcgi->num_threads; started++)
+    {
+      r = pthread_create(&(workers[started].thread), NULL,
+                         _fcgi_worker_loop, &(workers[started]));
+      if (r)
+      {
+        errno = r;
+        err = nerr_raise_errno(NERR_SYSTEM, "Unable to create worker thread");
+        break;
+      }
+    }
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+    if (err) break;
+
+    err = _fcgi_event_loop(&pool);
+  } while (0);
+
+  pthread_mutex_lock(&(pool.lock));
+  pool.shutdown = 1;
+  pthread_cond_broadcast(&(pool.cond));
+  pthread_mutex_unlock(&(pool.lock));
+  for (x = 0; x < started; x++)
+    pthread_join(workers[x].thread, NULL);
+
+  /* only left if the workers didn't start */
+  while ((req = pool.ready) != NULL)
+  {
+    pool.ready = req->next;
+    _fcgi_conn_release(&pool, req->conn);
+    _fcgi_req_free(req);
+  }
+  while ((conn = pool.conns) != NULL)
+  {
+    pool.conns = conn->next;
+    _fcgi_conn_drop(&pool, conn);
+  }
+
+  if (workers)
+  {
+    for (x = 0; x < fcgi->num_threads; x++)
+    {
+      if (workers[x].skel)
+        hdf_destroy(&(workers[x].skel));
+      cgiwrap_ctx_destroy(&(workers[x].wrap));
+    }
+    free(workers);
+  }
+  if (fcgi->port && pool.listen_fd != -1)
+    close(pool.listen_fd);
+  pthread_mutex_destroy(&(pool.lock));
+  pthread_cond_destroy(&(pool.cond));
+  return nerr_pass(err);
+}
+
+#else
+
+NEOERR *cgi_fastcgi_run (FASTCGI *fcgi)
+{
+  return nerr_raise(NERR_ASSERT, "cgi_fastcgi_run requires pthreads");
+}
+
+#endif /* HAVE_PTHREADS */
@@ -0,0 +1,89 @@
+/*
+ * Copyright 2001-2004 Brandon Long
+ * All Rights Reserved.
+ *
+ * ClearSilver Templating System
+ *
+ * This code is made available under the terms of the ClearSilver License.
+ * http://www.clearsilver.net/license.hdf
+ *
+ */
+
+/*
+ * fastcgi.h
+ * A persistent FastCGI responder for ClearSilver CGIs, which speaks the
+ * FastCGI protocol itself (no libfcgi).  Requests are read by a single
+ * event thread and handled by a fixed pool of worker threads, each with
+ * its own cgiwrap context (see cgi_init_ctx), so requests from any
+ * number of connections, including several multiplexed over one
+ * connection, are handled at once.
+ */
+
+#ifndef __FASTCGI_H_
+#define __FASTCGI_H_ 1
+
+#include "util/neo_err.h"
+#include "util/neo_hdf.h"
+#include "cgi/cgi.h"
+
+__BEGIN_DECLS
+
+/* Called once for each worker num, before any requests, to load the
+ * worker's skeleton HDF */
+typedef NEOERR* (*FASTCGI_INIT_CB)(void *rock, int num, HDF *hdf);
+/* Called for each request, with a CGI from cgi_init whose HDF is an
+ * overlay of the worker's skeleton.  The request body hasn't been read,
+ * so the callback should call cgi_parse as a regular CGI would. */
+typedef NEOERR* (*FASTCGI_REQ_CB)(void *rock, int num, CGI *cgi);
+
+typedef struct _fastcgi
+{
+  /* callbacks */
+  FASTCGI_INIT_CB init_cb;
+  FASTCGI_REQ_CB req_cb;
+
+  void *data;
+
+  /* the number of worker threads */
+  int num_threads;
+  /* the port to listen on, or 0 to accept on the socket the web server
+   * passes as stdin (FCGI_LISTENSOCK_FILENO) */
+  int port;
+  /* reported to the web server as FCGI_MAX_CONNS, new connections over
+   * this are closed.  0 for no limit */
+  int max_conns;
+  /* the most bytes of params and stdin one request may send, larger
+   * requests are ended with a 413.  0 for 16MB */
+  int max_request_size;
+} FASTCGI;
+
+/*
+ * Function: cgi_fastcgi_run - serve CGI requests over FastCGI
+ * Description: cgi_fastcgi_run runs a FastCGI responder in this
+ *              process until it receives a SIGTERM.  Each worker
+ *              thread gets a skeleton HDF, with Config.TemplateCache
+ *              set so cgi_display uses the process wide template
+ *              cache, which init_cb can then load with whatever the
+ *              application reads at startup.  For each request, the
+ *              skeleton is overlaid with hdf_init_overlay, and req_cb
+ *              is called with a CGI created from it, as a regular CGI
+ *              main would after cgi_init.  If req_cb returns an error
+ *              (other than CGIFinished), it is displayed with
+ *              cgi_neo_error.  The request's parameters and body are
+ *              read completely before req_cb is called, up to
+ *              max_request_size, and its output is buffered and sent
+ *              in FastCGI records as it is written.  After a
+ *              SIGTERM, requests which have already arrived are
+ *              finished before this returns.
+ * Input: fcgi - the FASTCGI settings
+ * Output: None
+ * Return: NERR_ASSERT - invalid settings, or built without pthreads
+ *         NERR_IO - unable to listen on port
+ *         NERR_NOMEM - unable to allocate memory
+ *         NERR_SYSTEM - unable to start the worker threads
+ */
+NEOERR *cgi_fastcgi_run (FASTCGI *fcgi);
+
+__END_DECLS
+
+#endif /* __FASTCGI_H_ */
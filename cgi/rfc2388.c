@@ -25,6 +25,7 @@
 #include "util/neo_misc.h"
 #include "util/neo_err.h"
 #include "util/neo_str.h"
+#include "util/neo_files.h"
 #include "cgi.h"
 #include "cgiwrap.h"
 
@@ -122,38 +123,87 @@ static NEOERR * _header_attr (char *hdr, char *attr, char **val)
   return STATUS_OK;
 }
 
-static NEOERR * _read_line (CGI *cgi, char **s, int *l, int *done)
+/* The body is read into a large buffer, and each part's data is found
+ * by searching for the delimiter (the newline before the boundary line
+ * plus "--" boundary) with Boyer-Moore-Horspool, so data is handed on in
+ * large blocks however few newlines it has.  Only the part headers are
+ * read a line at a time. */
+#define MP_BUF_SIZE (64 * 1024)
+
+typedef struct _multipart
 {
-  int ofs = 0;
-  char *p;
-  int to_read;
+  CGI *cgi;
+  char *delim;          /* "\n--" boundary */
+  int dlen;
+  int skip[256];        /* the Horspool shift for each byte */
+  char *buf;            /* cgi->buf */
+  int start;            /* the next byte which hasn't been handled */
+  int search;           /* where the delimiter search resumes */
+  int end;              /* the end of the data in buf */
+  int eof;
+  BOOL unget;           /* return line again from _mp_read_line */
+  char *line;
+  int line_len;
+} MULTIPART;
+
+/* The part being read, data goes to fp, the part_cb or value */
+typedef struct _mp_part
+{
+  char *name;
+  char *filename;
+  char *type;
+  FILE *fp;
+  STRING value;
+} MP_PART;
 
-  if (cgi->buf == NULL)
+static NEOERR * _mp_init (MULTIPART *mp, CGI *cgi, const char *boundary)
+{
+  int x, bl;
+
+  memset (mp, 0, sizeof(MULTIPART));
+  mp->cgi = cgi;
+  bl = strlen(boundary);
+  if (bl == 0 || bl > 1024)
+    return nerr_raise (NERR_PARSE, "Invalid multipart boundary length %d", bl);
+  mp->dlen = bl + 3;
+  mp->delim = (char *) malloc (mp->dlen + 1);
+  if (mp->delim == NULL)
+    return nerr_raise (NERR_NOMEM, "Unable to allocate multipart delimiter");
+  snprintf (mp->delim, mp->dlen + 1, "\n--%s", boundary);
+  for (x = 0; x < 256; x++)
+    mp->skip[x] = mp->dlen;
+  for (x = 0; x < mp->dlen - 1; x++)
+    mp->skip[(UINT8)mp->delim[x]] = mp->dlen - 1 - x;
+
+  if (cgi->buf == NULL || cgi->buflen < MP_BUF_SIZE)
   {
-    cgi->buflen = 4096;
+    if (cgi->buf) free (cgi->buf);
+    cgi->buflen = MP_BUF_SIZE;
     cgi->buf = (char *) malloc (sizeof(char) * cgi->buflen);
     if (cgi->buf == NULL)
       return nerr_raise (NERR_NOMEM, "Unable to allocate cgi buf");
   }
-  if (cgi->unget)
-  {
-    cgi->unget = FALSE;
-    *s = cgi->last_start;
-    *l = cgi->last_length;
-    return STATUS_OK;
-  }
-  if (cgi->found_nl)
+  mp->buf = cgi->buf;
+  /* the first boundary needn't follow a newline */
+  mp->buf[0] = '\n';
+  mp->start = mp->end = 1;
+  return STATUS_OK;
+}
+
+/* Reads more of the body onto the end of buf, first moving the unhandled
+ * data (and the byte before it) to the front */
+static NEOERR * _mp_fill (MULTIPART *mp)
+{
+  CGI *cgi = mp->cgi;
+  int keep, to_read, r;
+
+  keep = mp->start - 1;
+  if (keep > 0)
   {
-    p = memchr (cgi->buf + cgi->nl, '\n', cgi->readlen - cgi->nl);
-    if (p) {
-      cgi->last_start = *s = cgi->buf + cgi->nl;
-      cgi->last_length = *l = p - (cgi->buf + cgi->nl) + 1;
-      cgi->found_nl = TRUE;
-      cgi->nl = p - cgi->buf + 1;
-      return STATUS_OK;
-    }
-    ofs = cgi->readlen - cgi->nl;
-    memmove(cgi->buf, cgi->buf + cgi->nl, ofs);
+    memmove (mp->buf, mp->buf + keep, mp->end - keep);
+    mp->start -= keep;
+    mp->search -= keep;
+    mp->end -= keep;
   }
   /* Read either as much buffer space as we have left, or up to
    * the amount of data remaining according to Content-Length
@@ -163,52 +213,83 @@ static NEOERR * _read_line (CGI *cgi, char **s, int *l, int *done)
    * will return if we ask for too much.  Techically, not including
    * Content-Length is against the HTTP spec, so we should consider failing
    * earlier if we don't have a length.  */
-  to_read = cgi->buflen - ofs;
-  if (cgi->data_expected && (to_read > cgi->data_expected - cgi->data_read))
+  to_read = cgi->buflen - mp->end;
+  if (cgi->data_expected > 0 &&
+      (to_read > cgi->data_expected - cgi->data_read))
   {
     to_read = cgi->data_expected - cgi->data_read;
   }
-  cgiwrap_read (cgi->buf + ofs, to_read, &(cgi->readlen));
-  if (cgi->readlen < 0)
+  r = 0;
+  if (to_read > 0)
+    cgiwrap_ctx_read (cgi->wrap, mp->buf + mp->end, to_read, &r);
+  if (r < 0)
   {
     return nerr_raise_errno (NERR_IO, "POST Read Error");
   }
-  if (cgi->readlen == 0)
+  if (r == 0)
   {
-    *done = 1;
+    mp->eof = 1;
     return STATUS_OK;
   }
-  cgi->data_read += cgi->readlen;
+  mp->end += r;
+  cgi->data_read += r;
   if (cgi->upload_cb)
   {
     if (cgi->upload_cb (cgi, cgi->data_read, cgi->data_expected))
       return nerr_raise (CGIUploadCancelled, "Upload Cancelled");
   }
-  cgi->readlen += ofs;
-  p = memchr (cgi->buf, '\n', cgi->readlen);
-  if (!p)
+  return STATUS_OK;
+}
+
+/* Returns the next line, including its newline, in place in buf.  A
+ * line longer than buf is returned in pieces, and l is 0 at the end. */
+static NEOERR * _mp_read_line (MULTIPART *mp, char **s, int *l)
+{
+  NEOERR *err;
+  char *p;
+
+  if (mp->unget)
   {
-    cgi->found_nl = FALSE;
-    cgi->last_start = *s = cgi->buf;
-    cgi->last_length = *l = cgi->readlen;
+    mp->unget = FALSE;
+    *s = mp->line;
+    *l = mp->line_len;
     return STATUS_OK;
   }
-  cgi->last_start = *s = cgi->buf;
-  cgi->last_length = *l = p - cgi->buf + 1;
-  cgi->found_nl = TRUE;
-  cgi->nl = *l;
+  while (1)
+  {
+    p = memchr (mp->buf + mp->start, '\n', mp->end - mp->start);
+    if (p != NULL)
+    {
+      *l = p - (mp->buf + mp->start) + 1;
+      break;
+    }
+    if (mp->eof || (mp->start <= 1 && mp->end == mp->cgi->buflen))
+    {
+      *l = mp->end - mp->start;
+      break;
+    }
+    err = _mp_fill (mp);
+    if (err) return nerr_pass (err);
+  }
+  mp->line = *s = mp->buf + mp->start;
+  mp->line_len = *l;
+  mp->start += *l;
   return STATUS_OK;
 }
 
-static NEOERR * _read_header_line (CGI *cgi, STRING *line, int *done)
+static NEOERR * _read_header_line (MULTIPART *mp, STRING *line, int *done)
 {
   NEOERR *err;
   char *s, *p;
   int l;
 
-  err = _read_line (cgi, &s, &l, done);
+  err = _mp_read_line (mp, &s, &l);
   if (err) return nerr_pass (err);
-  if (*done || (l == 0)) return STATUS_OK;
+  if (l == 0)
+  {
+    *done = 1;
+    return STATUS_OK;
+  }
   if (isspace (s[0])) return STATUS_OK;
   while (l && isspace(s[l-1])) l--;
   err = string_appendn (line, s, l);
@@ -216,13 +297,12 @@ static NEOERR * _read_header_line (CGI *cgi, STRING *line, int *done)
 
   while (1)
   {
-    err = _read_line (cgi, &s, &l, done);
+    err = _mp_read_line (mp, &s, &l);
     if (err) break;
     if (l == 0) break;
-    if (*done) break;
     if (!(s[0] == ' ' || s[0] == '\t'))
     {
-      cgi->unget = TRUE;
+      mp->unget = TRUE;
       break;
     }
     while (l && isspace(s[l-1])) l--;
@@ -241,55 +321,114 @@ static NEOERR * _read_header_line (CGI *cgi, STRING *line, int *done)
   return nerr_pass (err);
 }
 
-static BOOL _is_boundary (char *boundary, char *s, int l, int *done)
+/* Returns the offset of the first delimiter in buf at or after from,
+ * or -1 */
+static int _mp_find (MULTIPART *mp, int from)
 {
-  static char *old_boundary = NULL;
-  static int bl;
+  const UINT8 *b = (const UINT8 *) mp->buf;
+  const UINT8 *d = (const UINT8 *) mp->delim;
+  int last = mp->dlen - 1;
+  UINT8 c;
 
-  /* cache the boundary strlen... more pointless optimization by blong */
-  if (old_boundary != boundary)
+  while (from + last < mp->end)
   {
-    old_boundary = boundary;
-    bl = strlen(boundary);
+    c = b[from + last];
+    if (c == d[last] && !memcmp (b + from, d, last))
+      return from;
+    from += mp->skip[c];
   }
+  return -1;
+}
 
-  if (s[l-1] != '\n')
-    return FALSE;
-  l--;
-  if (s[l-1] == '\r')
-    l--;
-
-  if (bl+2 == l && s[0] == '-' && s[1] == '-' && !strncmp (s+2, boundary, bl))
-    return TRUE;
-  if (bl+4 == l && s[0] == '-' && s[1] == '-' && 
-      !strncmp (s+2, boundary, bl) &&
-      s[l-1] == '-' && s[l-2] == '-')
-  {
-    *done = 1;
-    return TRUE;
-  }
-  return FALSE;
+static NEOERR * _mp_emit (MULTIPART *mp, MP_PART *part, int from, int to)
+{
+  CGI *cgi = mp->cgi;
+  struct iovec iov;
+
+  if (part == NULL || to <= from) return STATUS_OK;
+  if (part->filename == NULL)
+    return nerr_pass (string_appendn (&(part->value), mp->buf + from,
+                                      to - from));
+  if (cgi->part_cb)
+    return nerr_pass (cgi->part_cb (cgi, part->name, part->filename,
+                                    part->type, mp->buf + from, to - from));
+  iov.iov_base = mp->buf + from;
+  iov.iov_len = to - from;
+  return nerr_pass (ne_writev (fileno(part->fp), &iov, 1));
 }
 
-static NEOERR * _find_boundary (CGI *cgi, char *boundary, int *done)
+/* Hands on the data up to the next boundary line to part (or drops it
+ * if part is NULL), and leaves start after the boundary line.  done is
+ * set at the closing boundary, or the end of the input. */
+static NEOERR * _mp_read_data (MULTIPART *mp, MP_PART *part, int *done)
 {
   NEOERR *err;
-  char *s;
-  int l;
+  char *b = mp->buf;
+  int pos, t, data_end;
 
-  *done = 0;
+  /* the newline before the boundary may have ended the headers */
+  mp->search = mp->start;
+  if (mp->start > 0 && b[mp->start - 1] == '\n')
+    mp->search = mp->start - 1;
   while (1)
   {
-    err = _read_line (cgi, &s, &l, done);
-    if (err) return nerr_pass (err);
-    if ((l == 0) || (*done)) {
-      *done = 1;
-      return STATUS_OK;
+    pos = _mp_find (mp, mp->search);
+    if (pos == -1)
+    {
+      if (mp->eof)
+      {
+	err = _mp_emit (mp, part, mp->start, mp->end);
+	mp->start = mp->end;
+	*done = 1;
+	return nerr_pass (err);
+      }
+      if (mp->end - mp->dlen + 1 > mp->search)
+	mp->search = mp->end - mp->dlen + 1;
     }
-    if (_is_boundary(boundary, s, l, done))
-      return STATUS_OK;
+    else
+    {
+      /* see what follows the boundary, which takes up to 4 bytes */
+      t = pos + mp->dlen;
+      if (mp->end - t >= 4 || mp->eof)
+      {
+	if (t < mp->end && b[t] == '\n')
+	  t += 1;
+	else if (t + 1 < mp->end && b[t] == '\r' && b[t+1] == '\n')
+	  t += 2;
+	else if (t + 1 < mp->end && b[t] == '-' && b[t+1] == '-' &&
+	         (t + 2 == mp->end ||
+	          b[t+2] == '\n' ||
+	          (t + 3 < mp->end && b[t+2] == '\r' && b[t+3] == '\n')))
+	{
+	  *done = 1;
+	  t = mp->end;
+	}
+	else
+	{
+	  /* just data which looks like the boundary */
+	  mp->search = pos + 1;
+	  continue;
+	}
+	data_end = pos;
+	if (data_end > mp->start && b[data_end - 1] == '\r')
+	  data_end--;
+	err = _mp_emit (mp, part, mp->start, data_end);
+	mp->start = t;
+	return nerr_pass (err);
+      }
+      mp->search = pos;
+    }
+    /* everything before the possible delimiter, and the \r before it,
+     * can go now */
+    if (mp->search - 1 > mp->start)
+    {
+      err = _mp_emit (mp, part, mp->start, mp->search - 1);
+      if (err) return nerr_pass (err);
+      mp->start = mp->search - 1;
+    }
+    err = _mp_fill (mp);
+    if (err) return nerr_pass (err);
   }
-  return STATUS_OK;
 }
 
 NEOERR *open_upload(CGI *cgi, int unlink_files, FILE **fpw)
@@ -354,24 +493,25 @@ NEOERR *open_upload(CGI *cgi, int unlink_files, FILE **fpw)
   return STATUS_OK;
 }
 
-static NEOERR * _read_part (CGI *cgi, char *boundary, int *done)
+static NEOERR * _read_part (MULTIPART *mp, int *done)
 {
   NEOERR *err = STATUS_OK;
+  CGI *cgi = mp->cgi;
+  MP_PART part;
   STRING str;
   HDF *child, *obj = NULL;
-  FILE *fp = NULL;
   char buf[256];
   char *p;
-  char *name = NULL, *filename = NULL;
-  char *type = NULL, *tmp = NULL;
-  char *last = NULL;
+  char *tmp = NULL;
   int unlink_files = hdf_get_int_value(cgi->hdf, "Config.Upload.Unlink", 1);
 
+  memset (&part, 0, sizeof(part));
+  string_init (&(part.value));
   string_init (&str);
 
   while (1)
   {
-    err = _read_header_line (cgi, &str, done);
+    err = _read_header_line (mp, &str, done);
     if (err) break;
     if (*done) break;
     if (str.buf == NULL || str.buf[0] == '\0') break;
@@ -381,14 +521,14 @@ static NEOERR * _read_part (CGI *cgi, char *boundary, int *done)
       *p = '\0';
       if (!strcasecmp(str.buf, "content-disposition"))
       {
-	err = _header_attr (p+1, "name", &name);
+	err = _header_attr (p+1, "name", &(part.name));
 	if (err) break;
-	err = _header_attr (p+1, "filename", &filename);
+	err = _header_attr (p+1, "filename", &(part.filename));
 	if (err) break;
       }
       else if (!strcasecmp(str.buf, "content-type"))
       {
-	err = _header_value (p+1, &type);
+	err = _header_value (p+1, &(part.type));
 	if (err) break;
       }
       else if (!strcasecmp(str.buf, "content-encoding"))
@@ -407,62 +547,27 @@ static NEOERR * _read_part (CGI *cgi, char *boundary, int *done)
     }
     string_set(&str, "");
   }
+  string_clear(&str);
   if (err) 
   {
-    string_clear(&str);
-    if (name) free(name);
-    if (filename) free(filename);
-    if (type) free(type);
+    if (part.name) free(part.name);
+    if (part.filename) free(part.filename);
+    if (part.type) free(part.type);
     return nerr_pass (err);
   }
 
   do
   {
-    if (filename)
-    {
-      err = open_upload(cgi, unlink_files, &fp);
-      if (err) break;
-    }
-
-    string_set(&str, "");
-    while (!(*done))
+    if (*done) break;
+    if (part.filename && !cgi->part_cb)
     {
-      char *s;
-      int l, w;
-
-      err = _read_line (cgi, &s, &l, done);
+      err = open_upload(cgi, unlink_files, &(part.fp));
       if (err) break;
-      if (*done || (l == 0)) break;
-      if (_is_boundary(boundary, s, l, done)) break;
-      if (filename)
-      {
-	if (last) fwrite (last, sizeof(char), strlen(last), fp);
-	if (l > 1 && s[l-1] == '\n' && s[l-2] == '\r')
-	{
-	  last = "\r\n";
-	  l-=2;
-	}
-	else if (l > 0 && s[l-1] == '\n')
-	{
-	  last = "\n";
-	  l--;
-	}
-	else last = NULL;
-	w = fwrite (s, sizeof(char), l, fp);
-	if (w != l)
-	{
-	  err = nerr_raise_errno (NERR_IO, 
-	      "Short write on file %s upload %d < %d", filename, w, l);
-	  break;
-	}
-      }
-      else
-      {
-	err = string_appendn(&str, s, l);
-	if (err) break;
-      }
     }
+    err = _mp_read_data (mp, &part, done);
     if (err) break;
+    if (part.filename && cgi->part_cb)
+      err = cgi->part_cb (cgi, part.name, part.filename, part.type, NULL, 0);
   } while (0);
 
   /* Set up the cgi data */
@@ -471,25 +576,26 @@ static NEOERR * _read_part (CGI *cgi, char *boundary, int *done)
     do {
       /* FIXME: Hmm, if we've seen the same name here before, what should we do?
        */
-      if (filename)
+      if (part.filename)
       {
-	fseek(fp, 0, SEEK_SET);
-	snprintf (buf, sizeof(buf), "Query.%s", name);
-	err = hdf_set_value (cgi->hdf, buf, filename);
-	if (!err && type)
+	snprintf (buf, sizeof(buf), "Query.%s", part.name);
+	err = hdf_set_value (cgi->hdf, buf, part.filename);
+	if (!err && part.type)
 	{
-	  snprintf (buf, sizeof(buf), "Query.%s.Type", name);
-	  err = hdf_set_value (cgi->hdf, buf, type);
+	  snprintf (buf, sizeof(buf), "Query.%s.Type", part.name);
+	  err = hdf_set_value (cgi->hdf, buf, part.type);
 	}
+	if (part.fp == NULL) break;
+	fseek(part.fp, 0, SEEK_SET);
 	if (!err)
 	{
-	  snprintf (buf, sizeof(buf), "Query.%s.FileHandle", name);
+	  snprintf (buf, sizeof(buf), "Query.%s.FileHandle", part.name);
 	  err = hdf_set_int_value (cgi->hdf, buf, uListLength(cgi->files));
 	}
 	if (!err && !unlink_files)
 	{
 	  char *path;
-	  snprintf (buf, sizeof(buf), "Query.%s.FileName", name);
+	  snprintf (buf, sizeof(buf), "Query.%s.FileName", part.name);
 	  err = uListGet(cgi->filenames, uListLength(cgi->filenames)-1, 
 	      (void *)&path);
 	  if (!err) err = hdf_set_value (cgi->hdf, buf, path);
@@ -497,13 +603,15 @@ static NEOERR * _read_part (CGI *cgi, char *boundary, int *done)
       }
       else
       {
-	snprintf (buf, sizeof(buf), "Query.%s", name);
-	while (str.len && isspace(str.buf[str.len-1]))
+	STRING *val = &(part.value);
+
+	snprintf (buf, sizeof(buf), "Query.%s", part.name);
+	while (val->len && isspace(val->buf[val->len-1]))
 	{
-	  str.buf[str.len-1] = '\0';
-	  str.len--;
+	  val->buf[val->len-1] = '\0';
+	  val->len--;
 	}
-	if (!(cgi->ignore_empty_form_vars && str.len == 0))
+	if (!(cgi->ignore_empty_form_vars && val->len == 0))
 	{
 	  /* If we've seen it before... we force it into a list */
 	  obj = hdf_get_obj (cgi->hdf, buf);
@@ -531,19 +639,19 @@ static NEOERR * _read_part (CGI *cgi, char *boundary, int *done)
 	      if (err != STATUS_OK) break;
 	    }
 	    snprintf (buf2, sizeof(buf2), "%d", i);
-	    err = hdf_set_value (obj, buf2, str.buf);
+	    err = hdf_set_value (obj, buf2, val->buf ? val->buf : "");
 	    if (err != STATUS_OK) break;
 	  }
-	  err = hdf_set_value (cgi->hdf, buf, str.buf);
+	  err = hdf_set_value (cgi->hdf, buf, val->buf ? val->buf : "");
 	}
       }
     } while (0);
   }
 
-  string_clear(&str);
-  if (name) free(name);
-  if (filename) free(filename);
-  if (type) free(type);
+  string_clear(&(part.value));
+  if (part.name) free(part.name);
+  if (part.filename) free(part.filename);
+  if (part.type) free(part.type);
 
   return nerr_pass (err);
 }
@@ -551,6 +659,7 @@ static NEOERR * _read_part (CGI *cgi, char *boundary, int *done)
 NEOERR * parse_rfc2388 (CGI *cgi)
 {
   NEOERR *err;
+  MULTIPART mp;
   char *ct_hdr;
   char *boundary = NULL;
   int l;
@@ -571,13 +680,19 @@ NEOERR * parse_rfc2388 (CGI *cgi)
 
   err = _header_attr (ct_hdr, "boundary", &boundary);
   if (err) return nerr_pass (err);
-  err = _find_boundary(cgi, boundary, &done);
+  if (boundary == NULL)
+    return nerr_raise (NERR_PARSE, "No multipart boundary in %s", ct_hdr);
+  err = _mp_init (&mp, cgi, boundary);
+  /* skip the preamble */
+  if (!err)
+    err = _mp_read_data (&mp, NULL, &done);
   while (!err && !done)
   {
-    err = _read_part (cgi, boundary, &done);
+    err = _read_part (&mp, &done);
   }
 
-  if (boundary) free(boundary);
+  if (mp.delim) free(mp.delim);
+  free(boundary);
   return nerr_pass(err);
 }
 
@@ -109,6 +109,9 @@ typedef struct _position CS_POSITION;
 typedef struct _error CS_ERROR;
 
 typedef struct _autoescape CS_AUTOESCAPE;
+typedef struct _template CS_TEMPLATE;
+typedef struct _prog CS_PROG;
+typedef struct _aot_module CS_AOT_MODULE;
 
 typedef enum
 {
@@ -127,12 +130,15 @@ typedef struct _arg
   CSESCAPE_STATUS escape_status;
   struct _funct *function;
   struct _macro *macro;
+  HDF_PATH *path;       /* The pre split name of a CS_TYPE_VAR, only valid
+                           while s still points at the parsed name */
   struct _arg *expr1;
   struct _arg *expr2;
   struct _arg *next;
 } CSARG;
 
 #define CSF_REQUIRED (1<<0)
+#define CSF_SHARED (1<<1)    /* case_0 belongs to another (cached) template */
 #define MAX_STACK_DEPTH 50
 
 typedef struct _tree
@@ -154,6 +160,9 @@ typedef struct _tree
   struct _tree *case_0;
   struct _tree *case_1;
   struct _tree *next;
+
+  CS_PROG *prog;      /* The compiled block starting at this node, only set
+                         on the trees of templates (see cs_template_init) */
 } CSTREE;
 
 typedef struct _local_map
@@ -175,10 +184,19 @@ typedef struct _local_map
   int first;  /* This local is the "first" item in an each/loop */
   int last;   /* This local is the "last" item in an loop, each is calculated
                explicitly based on hdf_obj_next() in _builtin_last() */
+  int is_child; /* The local of an each, h is a child of the node named s */
   struct _local_map *next;
   struct _local_map *next_scope;
 } CS_LOCAL_MAP;
 
+/* The locals of a macro call's arguments, one frame for each stack
+ * depth, see call_macro */
+typedef struct _call_frame
+{
+  CS_LOCAL_MAP *maps;
+  int size;
+} CS_CALL_FRAME;
+
 typedef struct _macro
 {
   char *name;
@@ -222,6 +240,12 @@ typedef NEOERR* (*CSSTRFUNC)(const char *str, char **ret);
 typedef NEOERR* (*CSFILELOAD)(void *ctx, HDF *hdf, const char *filename,
                               char **contents);
 
+/* CSINITFUNC is called by the template cache on every CSPARSE it creates,
+ * before parsing.  This is where you register your functions, ie
+ * cgi_register_strfuncs.  The cache assumes the function always sets up
+ * the CSPARSE the same way. */
+typedef NEOERR* (*CSINITFUNC)(CSPARSE *parse);
+
 struct _funct
 {
   char *name;
@@ -310,7 +334,10 @@ struct _parse
 
   char *tag;            /* Usually cs, but can be set via HDF Config.TagStart */
   int taglen;
+  char *frozen;         /* HDF prefixes from Config.FrozenPrefixes, see
+                           cs_parse_file */
   int stack_depth;      /* An integer keeping track of recursion depth */
+  int node_count;       /* Used to number the nodes of this parse */
 
   ULIST *stack;
   ULIST *alloc;         /* list of strings owned by CSPARSE and free'd when
@@ -326,6 +353,8 @@ struct _parse
                              scope in the future. */
 
   CS_LOCAL_MAP *locals;
+  CS_CALL_FRAME *call_frames; /* MAX_STACK_DEPTH + 1 frames, owned by the
+                                 outermost parse of a render */
   CS_MACRO *macros;
   CS_FUNCTION *functions;
 
@@ -341,6 +370,32 @@ struct _parse
   HDF *global_hdf;
 
   CS_AUTOESCAPE auto_ctx;
+
+  /* Template cache, see cs_template_cache_get */
+  int cached;             /* This parse is building a cached template */
+  int dynamic;            /* The parse depends on data in the hdf, ie evar */
+  CSINITFUNC cache_init;
+  ULIST *cache_files;     /* The stat of each file parsed */
+  ULIST *includes;        /* CS_TEMPLATEs included via the cache */
+};
+
+/* A CS_TEMPLATE owns a fully parsed CSPARSE.  The parse tree, the macros
+ * and the expressions in it are never modified once the template is
+ * created, all rendering happens against a separate render context.
+ */
+struct _template
+{
+  CSPARSE *parse;
+  int refcount;
+
+  /* Only set for templates created by the template cache */
+  char *key;
+  char *path;
+  time_t checked;     /* Last time the files were checked for changes */
+
+  /* Set if the template is rendered by a compiled module, see
+   * cs_template_cache_load.  The parse then has no parse tree. */
+  const CS_AOT_MODULE *module;
 };
 
 /*
@@ -369,6 +424,13 @@ NEOERR *cs_init (CSPARSE **parse, HDF *hdf);
  *              appended to the current parse tree stored in the CSPARSE
  *              structure.  The entire file is loaded into memory and
  *              parsed in place.
+ *              Once parsed, expressions with constant operands are
+ *              evaluated, and adjacent literal text is joined.  If
+ *              Config.FrozenPrefixes lists HDF names (separated by
+ *              commas or spaces), an if whose condition only depends on
+ *              constants and the values under those names is evaluated
+ *              now, and only the branch it takes is kept.  Those values
+ *              must not change for as long as the parse is rendered.
  * Input: parse - a CSPARSE structure created with cs_init
  *        path - the path to the file to parse
  * Output: None
@@ -390,7 +452,9 @@ NEOERR *cs_parse_file (CSPARSE *parse, const char *path);
  *              The parse information will be appended to the current
  *              parse tree.  During parse, the only HDF variables which
  *              are evaluated are those used in evar or include
- *              statements.
+ *              statements, or under Config.FrozenPrefixes (see
+ *              cs_parse_file).  The tree is optimized the same way as
+ *              by cs_parse_file.
  * Input: parse - a CSPARSE structure created with cs_init
  *        buf - the string to parse.  Embedded NULLs are not currently
  *              supported
@@ -411,6 +475,12 @@ NEOERR *cs_parse_string (CSPARSE *parse, char *buf, size_t blen);
  *              side-effects, it updates the HDF data used by the
  *              render.  Typically, you will call one of the cs_parse
  *              functions before calling this function.
+ *              The templates rendered by lvar and linclude are parsed
+ *              once, and kept in a process wide cache of the
+ *              Config.LvarCacheSize (default 100, 0 to disable) most
+ *              recently used ones.  An lvar is found by its value, and a
+ *              linclude by its file, which is reparsed when it changes
+ *              (see cs_template_cache_get).
  * Input: parse - the CSPARSE structure containing the CS parse tree
  *                that will be evaluated
  *        ctx - user data that will be passed as the first variable to
@@ -440,6 +510,29 @@ NEOERR *cs_render (CSPARSE *parse, void *ctx, CSOUTFUNC cb);
  */
 NEOERR *cs_dump (CSPARSE *parse, void *ctx, CSOUTFUNC cb);
 
+/*
+ * Function: cs_dump_c - write out a parse tree as C
+ * Description: cs_dump_c writes the parse tree in the parse struct
+ *              out as a C file, which can be built into a shared object
+ *              and loaded with cs_template_cache_load.  Each block of
+ *              the tree becomes a C function, with the control flow,
+ *              the literal text, the locals of each, loop and with and
+ *              the simpler conditions compiled directly, and the rest
+ *              of the expressions left as CSARGs for the library to
+ *              evaluate.  The parse should be the parse of a template
+ *              from cs_template_cache_get, so the file it was parsed
+ *              from and the stat of its files are known.  Templates
+ *              which depend on the hdf at parse time, or which use auto
+ *              escaping, can't be compiled.
+ * Input: parse - the CSPARSE structure of a template
+ *        path - the file to write to
+ * Output: None
+ * Return: NERR_ASSERT if there is no parse tree, or it can't be compiled
+ *         NERR_IO if the file can't be written
+ *         NERR_NOMEM
+ */
+NEOERR *cs_dump_c (CSPARSE *parse, const char *path);
+
 /*
  * Function: cs_destroy - clean up and dealloc a parse tree
  * Description: cs_destroy will clean up all the memory associated with
@@ -456,6 +549,181 @@ NEOERR *cs_dump (CSPARSE *parse, void *ctx, CSOUTFUNC cb);
  */
 void cs_destroy (CSPARSE **parse);
 
+/*
+ * Function: cs_template_init - create a reusable template from a parse
+ * Description: cs_template_init takes ownership of a CSPARSE which has
+ *              already been parsed with cs_parse_file or
+ *              cs_parse_string, and turns it into a CS_TEMPLATE which
+ *              can be rendered any number of times against different
+ *              HDF data sets with cs_template_render.  Any functions
+ *              must be registered on the CSPARSE before parsing.  Note
+ *              that everything which is evaluated at parse time (ie,
+ *              include, evar and the Config values read by cs_init) is
+ *              bound to the HDF the CSPARSE was created with.  The
+ *              parse tree is compiled into a linear list of ops for
+ *              each block, which cs_template_render runs in place of
+ *              walking the tree.
+ * Input: tmpl - a pointer to a CS_TEMPLATE pointer
+ *        parse - a pointer to a parsed CSPARSE structure
+ * Output: tmpl - the allocated CS_TEMPLATE
+ *         parse - will be NULL, the CSPARSE is now owned by the template
+ * Return: NERR_ASSERT - parse has no parse tree
+ *         NERR_NOMEM - unable to allocate the template or its code
+ */
+NEOERR *cs_template_init (CS_TEMPLATE **tmpl, CSPARSE **parse);
+
+/*
+ * Function: cs_template_render - render a template against an HDF
+ * Description: cs_template_render evaluates the parse tree of a
+ *              CS_TEMPLATE, calling the CSOUTFUNC passed to it for
+ *              output.  Unlike cs_render, the render state (locals,
+ *              escaping state and the auto escape parser) is kept in
+ *              a per call render context, so the template is not
+ *              modified by rendering it, and the same template can be
+ *              rendered by multiple threads at the same time, each with
+ *              its own hdf.  The set statement will still modify the
+ *              hdf passed in.
+ * Input: tmpl - the CS_TEMPLATE to render
+ *        hdf - the HDF data set to render against
+ *        ctx - user data that will be passed as the first variable to
+ *              the CSOUTFUNC.
+ *        cb - a CSOUTFUNC called to render the output.
+ * Output: None
+ * Return: NERR_NOMEM - Unable to allocate memory for CALL or SET
+ *                      functions
+ *         any error your callback functions returns
+ */
+NEOERR *cs_template_render (CS_TEMPLATE *tmpl, HDF *hdf, void *ctx,
+                            CSOUTFUNC cb);
+
+/*
+ * Function: cs_template_destroy - clean up and dealloc a template
+ * Description: cs_template_destroy frees the template and the CSPARSE
+ *              it owns.  It is safe to call this with a NULL pointer.
+ * Input: tmpl - a pointer to a CS_TEMPLATE pointer
+ * Output: tmpl - will be NULL
+ * Return: None
+ */
+void cs_template_destroy (CS_TEMPLATE **tmpl);
+
+/*
+ * Function: cs_template_cache_get - get a parsed template from the cache
+ * Description: cs_template_cache_get returns a CS_TEMPLATE for the
+ *              template file at path, from a process wide cache.  The
+ *              path is resolved against hdf.loadpaths, and the cached
+ *              template is reparsed when the stat of the file (or of
+ *              any file it includes) changes.  Config.TemplateCacheCheckInterval
+ *              limits the stat checks to once every that many seconds.
+ *              Files included by a cached template are themselves
+ *              cached and shared between the templates including them.
+ *              Templates which depend on the hdf at parse time (evar,
+ *              include of a variable, a CSFILELOAD, etc) are not put
+ *              in the cache, a new template is parsed for every call.
+ *              Templates loaded with cs_template_cache_load are used
+ *              in place of parsing the file.  The cache is safe to use
+ *              from multiple threads.
+ * Input: tmpl - a pointer to a CS_TEMPLATE pointer
+ *        hdf - the HDF dataset to use for the path search and the
+ *              Config values normally read by cs_init
+ *        path - the template file
+ *        init_cb - a CSINITFUNC to call on the CSPARSE before parsing,
+ *                  may be NULL
+ * Output: tmpl - a reference to the template, which must be released
+ *               with cs_template_destroy
+ * Return: NERR_NOT_FOUND - path wasn't found
+ *         NERR_PARSE - a parse error occured
+ *         NERR_NOMEM - unable to allocate memory
+ */
+NEOERR *cs_template_cache_get (CS_TEMPLATE **tmpl, HDF *hdf, const char *path,
+                               CSINITFUNC init_cb);
+
+/*
+ * Function: cs_template_cache_clear - empty the template cache
+ * Description: cs_template_cache_clear drops all templates from the
+ *              template cache, and the cache of lvar and linclude
+ *              templates.  Templates still referenced elsewhere are
+ *              freed when their last reference is released.
+ * Input: None
+ * Output: None
+ * Return: None
+ */
+void cs_template_cache_clear (void);
+
+/* Compiled templates.  The code cs_dump_c writes only calls back into the
+ * library through the CS_AOT_API it is passed, so the shared object it is
+ * built into doesn't need to be linked against the library.  The module
+ * is exported as cs_module. */
+#define CS_AOT_VERSION 2
+
+typedef struct _aot_api CS_AOT_API;
+typedef NEOERR* (*CS_AOT_BLOCK)(const CS_AOT_API *cs, CSPARSE *parse);
+
+struct _aot_api
+{
+  /* Output, output is var or uvar on an evaluated expression */
+  NEOERR* (*write)(CSPARSE *parse, const char *s);
+  NEOERR* (*output)(CSPARSE *parse, CSARG *val, NEOS_ESCAPE escape);
+  /* Evaluates a command without a block, ie name, set or lvar */
+  NEOERR* (*node)(CSPARSE *parse, int cmd, int flags, NEOS_ESCAPE escape,
+                  CSARG *arg1, CSARG *arg2);
+  NEOERR* (*call)(CSPARSE *parse, CS_MACRO *macro, CSARG *args,
+                  NEOS_ESCAPE escape, CS_AOT_BLOCK body);
+
+  /* Expressions */
+  NEOERR* (*eval)(CSPARSE *parse, CSARG *expr, CSARG *result);
+  long int (*eval_bool)(CSPARSE *parse, CSARG *val);
+  long int (*eval_num)(CSPARSE *parse, CSARG *val);
+  long int (*str_bool)(const char *s);
+  int (*str_equal)(const char *a, const char *b);
+
+  /* Variables, including locals */
+  char* (*lookup)(CSPARSE *parse, const char *name);
+  long int (*lookup_num)(CSPARSE *parse, const char *name);
+  HDF* (*lookup_obj)(CSPARSE *parse, const char *name);
+  HDF* (*obj_child)(HDF *hdf);
+  HDF* (*obj_next)(HDF *hdf);
+};
+
+typedef struct _aot_file
+{
+  const char *path;
+  time_t mtime;
+  off_t size;
+} CS_AOT_FILE;
+
+struct _aot_module
+{
+  int version;              /* CS_AOT_VERSION */
+  const char *path;         /* The template file, as found by the cache */
+  const char *settings;     /* The Config settings it was parsed with */
+  const CS_AOT_FILE *files; /* The files parsed, up to a NULL path */
+  const char **functions;   /* The functions called, NULL terminated */
+  CS_AOT_BLOCK render;
+};
+
+/* The expressions of a compiled template, with their functions by name */
+#define CS_AOT_ARG(type, escape_status, s, n, expr1, expr2, next) \
+  {type, NULL, s, n, 0, escape_status, NULL, NULL, NULL, expr1, expr2, next}
+
+/*
+ * Function: cs_template_cache_load - load a compiled template
+ * Description: cs_template_cache_load loads a shared object built from
+ *              the output of cs_dump_c into the template cache.  When
+ *              cs_template_cache_get next parses the template file the
+ *              module was compiled from, with the same Config settings,
+ *              it uses the module instead, as long as none of the files
+ *              the module was compiled from have changed and all the
+ *              functions it calls are registered.  The module stays
+ *              loaded for the life of the process.
+ * Input: path - the shared object to load
+ * Output: None
+ * Return: NERR_IO - unable to load path
+ *         NERR_ASSERT - path isn't a compiled template, or was built
+ *                       for another version of ClearSilver
+ *         NERR_NOMEM - unable to allocate memory
+ */
+NEOERR *cs_template_cache_load (const char *path);
+
 /*
  * Function: cs_register_fileload - register a fileload function
  * Description: cs_register_fileload registers a fileload function that
@@ -11,6 +11,7 @@
 
 #include "cs_config.h"
 #include <stdio.h>
+#include <string.h>
 #include "cs.h"
 #include "util/neo_misc.h"
 #include "util/neo_hdf.h"
@@ -26,31 +27,37 @@ static NEOERR *output (void *ctx, char *s)
 int main (int argc, char *argv[])
 {
   NEOERR *err;
-  CSPARSE *parse;
+  CS_TEMPLATE *tmpl = NULL;
   HDF *hdf;
+  char *hdf_file = NULL;
+  int arg_position = 1;
 
-  if (argc < 3)
+  if (argc > 2 && !strcmp(argv[1], "-hdf"))
   {
-    ne_warn ("Usage: csdump <file.cs> <output.c>");
-    return -1;
+    hdf_file = argv[2];
+    arg_position = 3;
   }
-
-  err = hdf_init(&hdf);
-  if (err != STATUS_OK)
+  if (arg_position + 1 >= argc)
   {
-    nerr_warn_error(err);
+    ne_warn ("Usage: csdump [-hdf <file.hdf>] <file.cs> <output.c>");
     return -1;
   }
 
-  ne_warn ("Parsing %s", argv[1]);
-  err = cs_init (&parse, hdf);
+  err = hdf_init(&hdf);
+  if (err == STATUS_OK && hdf_file != NULL)
+    err = hdf_read_file(hdf, hdf_file);
   if (err != STATUS_OK)
   {
     nerr_warn_error(err);
     return -1;
   }
 
-  err = cs_parse_file (parse, argv[1]);
+  /* The template comes from the cache, which knows the files it was
+   * parsed from */
+  ne_warn ("Parsing %s", argv[arg_position]);
+  err = cs_template_cache_get(&tmpl, hdf, argv[arg_position], NULL);
+  if (err == STATUS_OK)
+    err = cs_dump_c(tmpl->parse, argv[arg_position + 1]);
   if (err != STATUS_OK)
   {
     err = nerr_pass(err);
@@ -58,9 +65,9 @@ int main (int argc, char *argv[])
     return -1;
   }
 
-  err = cs_dump_c(parse, argv[2]);
-
-  cs_destroy (&parse);
+  cs_template_destroy(&tmpl);
+  cs_template_cache_clear();
+  hdf_destroy(&hdf);
 
   return 0;
 }
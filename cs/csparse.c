@@ -36,11 +36,16 @@
 #include <libintl.h>
 #endif
 
+#ifdef HAVE_DLOPEN
+#include <dlfcn.h>
+#endif
+
 #include "util/neo_misc.h"
 #include "util/neo_err.h"
 #include "util/neo_files.h"
 #include "util/neo_str.h"
 #include "util/ulist.h"
+#include "util/ulocks.h"
 #include "cs.h"
 
 /* turn on some debug output for expressions */
@@ -74,6 +79,16 @@ typedef struct _stack_entry
   int location;
 } STACK_ENTRY;
 
+/* Used by the template cache to check a template's files for changes */
+typedef struct _file_stat
+{
+  char *path;
+  time_t mtime;
+  off_t size;
+  ino_t ino;
+  dev_t dev;
+} CS_FILE_STAT;
+
 static NEOERR *literal_parse (CSPARSE *parse, int cmd, char *arg);
 static NEOERR *literal_eval (CSPARSE *parse, CSTREE *node, CSTREE **next);
 static NEOERR *name_parse (CSPARSE *parse, int cmd, char *arg);
@@ -93,6 +108,7 @@ static NEOERR *each_eval (CSPARSE *parse, CSTREE *node, CSTREE **next);
 static NEOERR *with_eval (CSPARSE *parse, CSTREE *node, CSTREE **next);
 static NEOERR *end_parse (CSPARSE *parse, int cmd, char *arg);
 static NEOERR *include_parse (CSPARSE *parse, int cmd, char *arg);
+static NEOERR *include_eval (CSPARSE *parse, CSTREE *node, CSTREE **next);
 static NEOERR *linclude_parse (CSPARSE *parse, int cmd, char *arg);
 static NEOERR *linclude_eval (CSPARSE *parse, CSTREE *node, CSTREE **next);
 static NEOERR *def_parse (CSPARSE *parse, int cmd, char *arg);
@@ -111,6 +127,9 @@ static NEOERR *contenttype_parse (CSPARSE *parse, int cmd, char *arg);
 static NEOERR *contenttype_eval (CSPARSE *parse, CSTREE *node, CSTREE **next);
 
 static NEOERR *render_node (CSPARSE *parse, CSTREE *node);
+static NEOERR *run_prog (CSPARSE *parse, CS_PROG *prog);
+static void dealloc_prog (CS_PROG **prog);
+static const CS_AOT_API AotApi;
 static NEOERR *increase_stack_depth (CSPARSE *parse);
 static NEOERR *decrease_stack_depth (CSPARSE *parse);
 static NEOERR *cs_init_internal (CSPARSE **parse, HDF *hdf, CSPARSE *parent);
@@ -118,6 +137,21 @@ static NEOERR *cs_render_internal (CSPARSE *parse, void *ctx, CSOUTFUNC cb);
 static NEOERR *cs_parse_string_internal (CSPARSE *parse, char *ibuf,
                                          size_t ibuf_len);
 static int rearrange_for_call(CSARG **args);
+static NEOERR *map_obj (CSPARSE *parse, CS_LOCAL_MAP *map, BOOL create,
+                        HDF **obj);
+static NEOERR *optimize_parse (CSPARSE *parse, int frozen);
+static CS_FUNCTION *lookup_function (CSPARSE *parse, const char *name);
+static NEOERR *cache_get (CS_TEMPLATE **tmpl, CSPARSE *includer, HDF *hdf,
+                          const char *path, CSINITFUNC init_cb);
+static void cache_lock (void);
+static void cache_unlock (void);
+static NEOERR *cache_parse_init (CSPARSE *parse, CSPARSE *includer,
+                                 CSINITFUNC init_cb);
+static NEOERR *lvar_cache_get (CSPARSE *parse, CSTREE *node, const char *kind,
+                               const char *s, char **key, CS_TEMPLATE **tmpl);
+static NEOERR *lvar_cache_add (CSPARSE *parse, char **key, CSPARSE **cs,
+                               CS_TEMPLATE **tmpl);
+static NEOERR *lvar_cache_render (CSPARSE *parse, CS_TEMPLATE *tmpl);
 
 #define ATTR_PROPAGATE_STATUS "escape_status"
 #define ATTR_TRUSTED "trusted"
@@ -167,7 +201,7 @@ CS_CMDS Commands[] = {
   {"/with",   sizeof("/with")-1,   ST_WITH,         ST_POP,
     end_parse, skip_eval, 0},
   {"include", sizeof("include")-1, ST_ANYWHERE,     ST_SAME,
-    include_parse, skip_eval, 1},
+    include_parse, include_eval, 1},
   {"linclude", sizeof("linclude")-1, ST_ANYWHERE,     ST_SAME,
     linclude_parse, linclude_eval, 1},
   {"def",     sizeof("def")-1,     ST_ANYWHERE,     ST_DEF,
@@ -214,8 +248,6 @@ CS_ESCAPE_MODES EscapeModes[] = {
 
 /* **** CS alloc/dealloc ******************************************** */
 
-static int NodeNumber = 0;
-
 static void init_node_pos(CSTREE *node, CSPARSE *parse)
 {
   CS_POSITION *pos = &parse->pos;
@@ -280,7 +312,7 @@ static NEOERR *alloc_node (CSTREE **node, CSPARSE *parse)
     return nerr_raise (NERR_NOMEM, "Unable to allocate memory for node");
 
   my_node->cmd = 0;
-  my_node->node_num = NodeNumber++;
+  my_node->node_num = parse->node_count++;
 
   *node = my_node;
 
@@ -305,6 +337,7 @@ static void dealloc_arg (CSARG **arg)
   if (p->next) dealloc_arg (&(p->next));
 
   if (p->argexpr) free(p->argexpr);
+  if (p->path) hdf_path_destroy(&(p->path));
 
   free(p);
   *arg = NULL;
@@ -316,7 +349,8 @@ static void dealloc_node (CSTREE **node)
 
   if (*node == NULL) return;
   my_node = *node;
-  if (my_node->case_0) dealloc_node (&(my_node->case_0));
+  if (my_node->case_0 && !(my_node->flags & CSF_SHARED))
+    dealloc_node (&(my_node->case_0));
   if (my_node->case_1) dealloc_node (&(my_node->case_1));
   if (my_node->next) dealloc_node (&(my_node->next));
   if (my_node->vargs) dealloc_arg (&(my_node->vargs));
@@ -329,7 +363,10 @@ static void dealloc_node (CSTREE **node)
 
   if (my_node->arg1.argexpr) free(my_node->arg1.argexpr);
   if (my_node->arg2.argexpr) free(my_node->arg2.argexpr);
+  if (my_node->arg1.path) hdf_path_destroy(&(my_node->arg1.path));
+  if (my_node->arg2.path) hdf_path_destroy(&(my_node->arg2.path));
   if (my_node->fname) free(my_node->fname);
+  if (my_node->prog) dealloc_prog(&(my_node->prog));
 
   free(my_node);
   *node = NULL;
@@ -348,6 +385,30 @@ static void dealloc_macro (CS_MACRO **macro)
   *macro = NULL;
 }
 
+/* Macros are either defined in this parse, or in one of the templates
+ * included via the template cache */
+static CS_MACRO *lookup_macro (CSPARSE *parse, const char *name)
+{
+  CS_MACRO *macro;
+  CS_TEMPLATE *tmpl;
+  int x;
+
+  for (macro = parse->macros; macro != NULL; macro = macro->next)
+  {
+    if (!strcmp(macro->name, name)) return macro;
+  }
+  if (parse->includes != NULL)
+  {
+    for (x = 0; x < uListLength(parse->includes); x++)
+    {
+      uListGet(parse->includes, x, (void *)&tmpl);
+      macro = lookup_macro(tmpl->parse, name);
+      if (macro != NULL) return macro;
+    }
+  }
+  return NULL;
+}
+
 static void dealloc_function (CS_FUNCTION **csf)
 {
   CS_FUNCTION *my_csf;
@@ -414,6 +475,37 @@ static NEOERR *_store_error (CSPARSE *parse, NEOERR *err)
 
 }
 
+static NEOERR *cache_add_file (CSPARSE *parse, const char *path)
+{
+  NEOERR *err;
+  CS_FILE_STAT *fs;
+  struct stat st;
+
+  if (stat(path, &st) == -1)
+  {
+    if (errno == ENOENT)
+      return nerr_raise (NERR_NOT_FOUND, "File %s not found", path);
+    return nerr_raise_errno (NERR_IO, "Unable to stat file %s", path);
+  }
+  fs = (CS_FILE_STAT *) malloc (sizeof(CS_FILE_STAT) + strlen(path) + 1);
+  if (fs == NULL)
+    return nerr_raise (NERR_NOMEM, "Unable to allocate memory for file stat");
+  fs->path = (char *)(fs + 1);
+  strcpy(fs->path, path);
+  fs->mtime = st.st_mtime;
+  fs->size = st.st_size;
+  fs->ino = st.st_ino;
+  fs->dev = st.st_dev;
+
+  err = uListAppend(parse->cache_files, fs);
+  if (err)
+  {
+    free(fs);
+    return nerr_pass(err);
+  }
+  return STATUS_OK;
+}
+
 static NEOERR *cs_parse_file_internal (CSPARSE *parse, const char *path)
 {
   NEOERR *err;
@@ -442,6 +534,11 @@ static NEOERR *cs_parse_file_internal (CSPARSE *parse, const char *path)
       path = fpath;
     }
 
+    if (parse->cached)
+    {
+      err = cache_add_file(parse, path);
+      if (err != STATUS_OK) return nerr_pass(err);
+    }
     err = ne_load_file (path, &ibuf);
   }
   if (err) return nerr_pass (err);
@@ -546,7 +643,10 @@ NEOERR *cs_parse_file (CSPARSE *parse, const char *path)
   err = read_auto_status(parse);
   if (err) return nerr_pass(err);
 
-  return nerr_pass(cs_parse_file_internal(parse, path));
+  err = cs_parse_file_internal(parse, path);
+  if (err) return nerr_pass(err);
+
+  return nerr_pass(optimize_parse(parse, 1));
 }
 
 static char *find_context (CSPARSE *parse, int offset, char *buf, size_t blen)
@@ -817,7 +917,10 @@ NEOERR *cs_parse_string (CSPARSE *parse, char *ibuf, size_t ibuf_len)
   err = read_auto_status(parse);
   if (err) return nerr_pass(err);
 
-  return nerr_pass(cs_parse_string_internal(parse, ibuf, ibuf_len));
+  err = cs_parse_string_internal(parse, ibuf, ibuf_len);
+  if (err) return nerr_pass(err);
+
+  return nerr_pass(optimize_parse(parse, 1));
 }
 
 /* Like strcmp but stops when either string contains a '.'. Used to compare HDF
@@ -881,12 +984,22 @@ static CS_LOCAL_MAP * lookup_map (CSPARSE *parse, char *name, char **rest)
    the code to behave differently, you should check all the callers as some make
    this assumption.
 */
+/* The path of an arg is only used while the arg still refers to the name it
+   was created from, ie not for names built at render time by the . and []
+   operators */
+#define ARG_PATH(arg) \
+  (((arg)->path != NULL && (arg)->path->name == (arg)->s) ? (arg)->path : NULL)
+
+/* When given, path is the pre split name (see ARG_PATH), and is used
+   instead of name for the HDF lookups. */
 static NEOERR *scoped_var_lookup_or_create_obj (CSPARSE *parse, char *name,
+                                                HDF_PATH *path,
                                                 BOOL create, CS_LOCAL_MAP *map,
                                                 HDF **ret_hdf)
 {
   NEOERR *err;
   char *rest;
+  HDF *obj;
 
   if (ret_hdf != NULL) *ret_hdf = NULL;
   if (name == NULL || name[0] == '\0') return STATUS_OK;
@@ -900,7 +1013,7 @@ static NEOERR *scoped_var_lookup_or_create_obj (CSPARSE *parse, char *name,
       if (map->h == NULL)
       {
         /* We don't have a pointer to the HDF node yet. Look it up. */
-        err = scoped_var_lookup_or_create_obj(parse, map->s, create,
+        err = scoped_var_lookup_or_create_obj(parse, map->s, NULL, create,
                                               map->next_scope, &(map->h));
         /* Check if there was an err. */
         if (err != STATUS_OK) {
@@ -912,35 +1025,61 @@ static NEOERR *scoped_var_lookup_or_create_obj (CSPARSE *parse, char *name,
         {
           return STATUS_OK;
         }
+        obj = map->h;
+      }
+      else
+      {
+        err = map_obj(parse, map, create, &obj);
+        if (err != STATUS_OK) {
+          return nerr_pass(err);
+        }
+        if (obj == NULL)
+        {
+          return STATUS_OK;
+        }
       }
       /* Now we have a pointer for this local variable */
       if (rest == NULL)
       {
         /* We decoded the full name, return the HDF node */
-        *ret_hdf = map->h;
+        *ret_hdf = obj;
         return STATUS_OK;
       }
       else
       {
         if (create)
         {
-          return nerr_pass(hdf_get_node(map->h, rest+1, ret_hdf));
+          return nerr_pass(hdf_get_node(obj, rest+1, ret_hdf));
+        }
+        else if (path != NULL)
+        {
+          *ret_hdf = hdf_peek_obj_path(obj, path, 1);
+          return STATUS_OK;
         }
         else
         {
-          *ret_hdf = hdf_get_obj(map->h, rest+1);
+          *ret_hdf = hdf_peek_obj(obj, rest+1);
           return STATUS_OK;
         }
       }
     }
   }
-  /* Look in local HDF */
-  *ret_hdf = hdf_get_obj (parse->hdf, name);
+  /* Look in local HDF, lookups which only read don't shadow the levels
+     of an overlay */
+  if (path != NULL)
+    *ret_hdf = create ? hdf_get_obj_path (parse->hdf, path, 0) :
+                        hdf_peek_obj_path (parse->hdf, path, 0);
+  else
+    *ret_hdf = create ? hdf_get_obj (parse->hdf, name) :
+                        hdf_peek_obj (parse->hdf, name);
   /* If not in local HDF, and we are not creating/setting a node,
      check global HDF */
   if (*ret_hdf == NULL && !create && parse->global_hdf != NULL)
   {
-    *ret_hdf = hdf_get_obj (parse->global_hdf, name);
+    if (path != NULL)
+      *ret_hdf = hdf_peek_obj_path (parse->global_hdf, path, 0);
+    else
+      *ret_hdf = hdf_peek_obj (parse->global_hdf, name);
   }
   if (*ret_hdf == NULL && create)
   {
@@ -952,13 +1091,47 @@ static NEOERR *scoped_var_lookup_or_create_obj (CSPARSE *parse, char *name,
   }
 }
 
-static HDF *var_lookup_obj (CSPARSE *parse, char *name)
+/* The HDF node of the local map, which must have type CS_TYPE_VAR and h
+   set.  Lookups which only read don't shadow the levels of an overlay
+   (see hdf_peek_obj), so h may be a node of the base of parse->hdf, which
+   is never modified and doesn't see the changes made to the overlay since.
+   Such a node is looked up again by the name in s (the parent of h for an
+   each), creating it in parse->hdf if create is set. */
+static NEOERR *map_obj (CSPARSE *parse, CS_LOCAL_MAP *map, BOOL create,
+                        HDF **obj)
+{
+  NEOERR *err = STATUS_OK;
+  HDF *h, *parent;
+
+  *obj = map->h;
+  if (map->s == NULL || !hdf_obj_is_base(parse->hdf, map->h))
+    return STATUS_OK;
+
+  err = scoped_var_lookup_or_create_obj (parse, map->s, NULL, create,
+                                         map->next_scope, &h);
+  if (err) return nerr_pass(err);
+  if (map->is_child && h != NULL)
+  {
+    /* The child itself, even if it is a link */
+    parent = h;
+    h = hdf_obj_find_child (parent, hdf_obj_name(map->h), create);
+    if (h == NULL && create)
+      err = hdf_get_node (parent, hdf_obj_name(map->h), &h);
+    if (err) return nerr_pass(err);
+  }
+  if (h != NULL) map->h = h;
+  *obj = h;
+  return STATUS_OK;
+}
+
+static HDF *var_lookup_obj (CSPARSE *parse, char *name, HDF_PATH *path)
 {
   HDF *ret_hdf;
         /* NOTE: We ignore the return value as it can only be STATUS_OK. That
            is what we always return from scoped_var_lookup_or_create_obj when
            create == FALSE */
-  scoped_var_lookup_or_create_obj (parse, name, FALSE, parse->locals, &ret_hdf);
+  scoped_var_lookup_or_create_obj (parse, name, path, FALSE, parse->locals,
+                                   &ret_hdf);
   return ret_hdf;
 }
 
@@ -984,7 +1157,8 @@ static NEOERR *var_set_value (CSPARSE *parse, char *name,
        a local or global HDF variable), or the local variable references
        an HDF variable. Either way, we lookup or create an HDF node to
        set the value of. */
-    err = scoped_var_lookup_or_create_obj(parse, name, TRUE, map, &set_hdf);
+    err = scoped_var_lookup_or_create_obj(parse, name, NULL, TRUE, map,
+                                          &set_hdf);
     if (err != STATUS_OK)
     {
       return nerr_pass(err);
@@ -1093,74 +1267,102 @@ int get_escape_status(CSPARSE *parse, HDF_ATTR* h)
   return s;
 }
 
-/* Returns the current escaping status in escape_status */
-static char *var_lookup (CSPARSE *parse, char *name, int *escape_status)
+/* The value of a name found in the local map by lookup_map, c is the rest
+   of the name after the local.  Returns the current escaping status in
+   escape_status.  path is the pre split name, or NULL */
+static char *map_var_lookup (CSPARSE *parse, CS_LOCAL_MAP *map, char *c,
+                             HDF_PATH *path, int *escape_status)
 {
-  CS_LOCAL_MAP *map;
-  char *c;
-  char* retval;
   HDF *obj;
 
   *escape_status = CS_ES_UNTRUSTED;
-  map = lookup_map (parse, name, &c);
-  if (map)
+  if (map->type == CS_TYPE_VAR)
   {
-    if (map->type == CS_TYPE_VAR)
+    if (map->h == NULL)
     {
-      if (map->h == NULL)
-      {
-        /* See if we can resolve the reference.
-           This trades off performance for correctness as we now traverse
-           the whole map list and do a lookup in the local (and perhaps global)
-           HDF for every variable that references a non-existent node. */
-        /* NOTE: We ignore the return value as it can only be STATUS_OK. That
-           is what we always return from scoped_var_lookup_or_create_obj when
-           create == FALSE */
-        scoped_var_lookup_or_create_obj (parse, map->s, FALSE, map->next_scope,
-                                         &(map->h));
-      }
-      if (c == NULL)
-      {
-        HDF_ATTR *h = hdf_obj_attr(map->h);
-        *escape_status = get_escape_status(parse, h);
-	return hdf_obj_value (map->h);
-      }
-      else
-      {
-        HDF_ATTR *h;
-        obj = hdf_get_obj(map->h, c+1);
-        if (!obj)
-          return NULL;
-        h = hdf_obj_attr(obj);
-        *escape_status = get_escape_status(parse, h);
-        return hdf_obj_value (obj);
-        /*return hdf_get_value (map->h, c+1, NULL);*/
-      }
+      /* See if we can resolve the reference.
+         This trades off performance for correctness as we now traverse
+         the whole map list and do a lookup in the local (and perhaps global)
+         HDF for every variable that references a non-existent node. */
+      /* NOTE: We ignore the return value as it can only be STATUS_OK. That
+         is what we always return from scoped_var_lookup_or_create_obj when
+         create == FALSE */
+      scoped_var_lookup_or_create_obj (parse, map->s, NULL, FALSE,
+                                       map->next_scope, &(map->h));
+      obj = map->h;
     }
-    /* Hmm, if c != NULL, they are asking for a sub member of something
-     * which isn't a var... right now we ignore them, I don't know what
-     * the right thing is */
-    /* hmm, its possible now that they are getting a reference to a
-     * string that will be deleted... where is it used? */
-    else if (map->type == CS_TYPE_STRING)
+    else
     {
-      *escape_status = map->escape_status;
-      return map->s;
+      /* Only fails when creating */
+      map_obj (parse, map, FALSE, &obj);
     }
-    else if (map->type == CS_TYPE_NUM)
+    if (c == NULL)
     {
-      char buf[40];
-      *escape_status = CS_ES_TRUSTED;
-      if (map->s) return map->s;
-      snprintf (buf, sizeof(buf), "%ld", map->n);
-      map->s = strdup(buf);
-      map->map_alloc = 1;
-      return map->s;
+      HDF_ATTR *h = hdf_obj_attr(obj);
+      *escape_status = get_escape_status(parse, h);
+      return hdf_obj_value (obj);
+    }
+    else
+    {
+      HDF_ATTR *h;
+      if (path != NULL)
+        obj = hdf_peek_obj_path(obj, path, 1);
+      else
+        obj = hdf_peek_obj(obj, c+1);
+      if (!obj)
+        return NULL;
+      h = hdf_obj_attr(obj);
+      *escape_status = get_escape_status(parse, h);
+      return hdf_obj_value (obj);
+      /*return hdf_get_value (map->h, c+1, NULL);*/
     }
   }
+  /* Hmm, if c != NULL, they are asking for a sub member of something
+   * which isn't a var... right now we ignore them, I don't know what
+   * the right thing is */
+  /* hmm, its possible now that they are getting a reference to a
+   * string that will be deleted... where is it used? */
+  else if (map->type == CS_TYPE_STRING)
+  {
+    *escape_status = map->escape_status;
+    return map->s;
+  }
+  else if (map->type == CS_TYPE_NUM)
+  {
+    char buf[40];
+    *escape_status = CS_ES_TRUSTED;
+    if (map->s) return map->s;
+    snprintf (buf, sizeof(buf), "%ld", map->n);
+    map->s = strdup(buf);
+    map->map_alloc = 1;
+    return map->s;
+  }
+  return NULL;
+}
+
+/* Returns the current escaping status in escape_status.  path is the
+   pre split name, or NULL */
+static char *var_lookup (CSPARSE *parse, char *name, HDF_PATH *path,
+                         int *escape_status)
+{
+  CS_LOCAL_MAP *map;
+  char *c;
+  char* retval;
+  HDF *obj;
+
+  *escape_status = CS_ES_UNTRUSTED;
+  map = lookup_map (parse, name, &c);
+  if (map && (map->type == CS_TYPE_VAR || map->type == CS_TYPE_STRING ||
+              map->type == CS_TYPE_NUM))
+  {
+    return map_var_lookup (parse, map, c, path, escape_status);
+  }
   /* smarti:  Added support for global hdf under local hdf */
   /* return hdf_get_value (parse->hdf, name, NULL); */
-  obj = hdf_get_obj(parse->hdf, name);
+  if (path != NULL)
+    obj = hdf_peek_obj_path(parse->hdf, path, 0);
+  else
+    obj = hdf_peek_obj(parse->hdf, name);
   if (obj)
   {
     HDF_ATTR *h;
@@ -1177,16 +1379,20 @@ static char *var_lookup (CSPARSE *parse, char *name, int *escape_status)
      for now, treat all values there as untrusted */
   if (retval == NULL && parse->global_hdf != NULL)
   {
-    retval = hdf_get_value (parse->global_hdf, name, NULL);
+    if (path != NULL)
+      retval = hdf_obj_value (hdf_peek_obj_path (parse->global_hdf, path, 0));
+    else
+      retval = hdf_get_value (parse->global_hdf, name, NULL);
   }
   return retval;
 }
 
-long int var_int_lookup (CSPARSE *parse, char *name)
+static long int var_int_lookup_path (CSPARSE *parse, char *name,
+                                     HDF_PATH *path)
 {
   char *vs;
   int ignore;
-  vs = var_lookup (parse, name, &ignore);
+  vs = var_lookup (parse, name, path, &ignore);
 
   if (vs == NULL)
     return 0;
@@ -1194,6 +1400,11 @@ long int var_int_lookup (CSPARSE *parse, char *name)
     return atoi(vs);
 }
 
+long int var_int_lookup (CSPARSE *parse, char *name)
+{
+  return var_int_lookup_path (parse, name, NULL);
+}
+
 typedef struct _token
 {
   CSTOKEN_TYPE type;
@@ -1499,6 +1710,12 @@ static NEOERR *parse_expr2 (CSPARSE *parse, CSTOKEN *tokens, int ntokens, int lv
 
       if (tokens[x].type == CS_TYPE_NUM)
 	arg->n = strtol(arg->s, NULL, 0);
+      /* Split variable names once here instead of on every lookup */
+      if (tokens[x].type & CS_TYPES_VAR)
+      {
+        err = hdf_path_init(&(arg->path), arg->s);
+        if (err) return nerr_pass(err);
+      }
       return STATUS_OK;
     }
     else
@@ -1700,16 +1917,10 @@ static NEOERR *parse_expr2 (CSPARSE *parse, CSTOKEN *tokens, int ntokens, int lv
       tokens[0].value[tokens[0].len] = '\0';
 
     arg->op_type = CS_TYPE_FUNCTION;
-    csf = parse->functions;
-    while (csf != NULL)
-    {
-      if (!strcmp(tokens[0].value, csf->name))
-      {
-	arg->function = csf;
-	break;
-      }
-      csf = csf->next;
-    }
+    csf = lookup_function(parse, tokens[0].value);
+    arg->function = csf;
+    /* For when the tree outlives the parse the function came from */
+    arg->s = tokens[0].value;
     if (csf == NULL)
     {
       return nerr_raise (NERR_PARSE, "%s Unknown function %s called",
@@ -2081,6 +2292,8 @@ static NEOERR *contenttype_parse (CSPARSE *parse, int cmd, char *arg)
     return nerr_raise (NERR_PARSE, "%s Invalid argument for content-type: %s",
       find_context(parse, -1, tmp, sizeof(tmp)), arg);
   }
+  /* Strip now, the tree is read-only during render */
+  node->arg1.s = neos_strip(node->arg1.s);
 
   *(parse->next) = node;
   parse->next = &(node->next);
@@ -2099,7 +2312,7 @@ static NEOERR *name_eval (CSPARSE *parse, CSTREE *node, CSTREE **next)
 
   if (node->arg1.op_type == CS_TYPE_VAR && node->arg1.s != NULL)
   {
-    obj = var_lookup_obj (parse, node->arg1.s);
+    obj = var_lookup_obj (parse, node->arg1.s, ARG_PATH(&(node->arg1)));
     if (obj != NULL)
     {
       v = hdf_obj_name(obj);
@@ -2281,6 +2494,8 @@ static NEOERR *evar_parse (CSPARSE *parse, int cmd, char *arg)
 	a, s[0]);
   }
 
+  /* The value is bound at parse time, so this parse can't be cached */
+  parse->dynamic = 1;
   err = hdf_get_copy (parse->hdf, a, &s, NULL);
   if (err)
   {
@@ -2355,7 +2570,7 @@ static char *arg_eval_with_escape_status (CSPARSE *parse, CSARG *arg,
       *escape_status = arg->escape_status;
       return arg->s;
     case CS_TYPE_VAR:
-      return var_lookup (parse, arg->s, escape_status);
+      return var_lookup (parse, arg->s, ARG_PATH(arg), escape_status);
     case CS_TYPE_NUM:
     case CS_TYPE_VAR_NUM:
     default:
@@ -2388,7 +2603,7 @@ long int arg_eval_num (CSPARSE *parse, CSARG *arg)
 
     case CS_TYPE_VAR:
     case CS_TYPE_VAR_NUM:
-      v = var_int_lookup (parse, arg->s);
+      v = var_int_lookup_path (parse, arg->s, ARG_PATH(arg));
       break;
     default:
       ne_warn ("Unsupported type %s in arg_eval_num", expand_token_type(arg->op_type, 1));
@@ -2398,6 +2613,21 @@ long int arg_eval_num (CSPARSE *parse, CSARG *arg)
   return v;
 }
 
+/* The truth of a string value, see arg_eval_bool */
+static long int str_eval_bool (char *s)
+{
+  long int v;
+  char *r;
+
+  if (!s || *s == '\0') return 0; /* non existance or empty is false(0) */
+  v = strtol(s, &r, 0);
+  if (*r == '\0') /* entire string converted, treat as number */
+    return v;
+  /* if the entire string didn't convert, then its non-numeric and
+   * exists, so its true (1) */
+  return 1;
+}
+
 /* This is different from arg_eval_num because we don't force strings to
  * numbers, a string is either a number (if it is all numeric) or we're
  * testing existance.  At least, that's what perl does and what dave
@@ -2405,7 +2635,7 @@ long int arg_eval_num (CSPARSE *parse, CSARG *arg)
 long int arg_eval_bool (CSPARSE *parse, CSARG *arg)
 {
   long int v = 0;
-  char *s, *r;
+  char *s;
   int ignore;
 
   switch ((arg->op_type & CS_TYPES))
@@ -2413,20 +2643,14 @@ long int arg_eval_bool (CSPARSE *parse, CSARG *arg)
     case CS_TYPE_STRING:
     case CS_TYPE_VAR:
       if (arg->op_type == CS_TYPE_VAR)
-        s = var_lookup(parse, arg->s, &ignore);
+        s = var_lookup(parse, arg->s, ARG_PATH(arg), &ignore);
       else
 	s = arg->s;
-      if (!s || *s == '\0') return 0; /* non existance or empty is false(0) */
-      v = strtol(s, &r, 0);
-      if (*r == '\0') /* entire string converted, treat as number */
-	return v;
-      /* if the entire string didn't convert, then its non-numeric and
-       * exists, so its true (1) */
-      return 1;
+      return str_eval_bool(s);
     case CS_TYPE_NUM:
       return arg->n;
     case CS_TYPE_VAR_NUM: /* this implies forced numeric evaluation */
-      return var_int_lookup (parse, arg->s);
+      return var_int_lookup_path (parse, arg->s, ARG_PATH(arg));
       break;
     default:
       ne_warn ("Unsupported type %s in arg_eval_bool", expand_token_type(arg->op_type, 1));
@@ -2449,7 +2673,7 @@ char *arg_eval_str_alloc (CSPARSE *parse, CSARG *arg)
       s = arg->s;
       break;
     case CS_TYPE_VAR:
-      s = var_lookup (parse, arg->s, &ignore);
+      s = var_lookup (parse, arg->s, ARG_PATH(arg), &ignore);
       break;
     case CS_TYPE_NUM:
     case CS_TYPE_VAR_NUM:
@@ -2489,7 +2713,7 @@ static void expand_arg (CSPARSE *parse, int depth, char *where, CSARG *arg)
   else if (arg->op_type & CS_TYPE_STRING)
     fprintf(stderr, "'%s'\n", arg->s);
   else if (arg->op_type & CS_TYPE_VAR)
-    fprintf(stderr, "%s = %s\n", arg->s, var_lookup(parse, arg->s, &ignore));
+    fprintf(stderr, "%s = %s\n", arg->s, var_lookup(parse, arg->s, NULL, &ignore));
   else if (arg->op_type & CS_TYPE_VAR_NUM)
     fprintf(stderr, "%s = %ld\n", arg->s, var_int_lookup(parse, arg->s));
   else
@@ -2497,16 +2721,19 @@ static void expand_arg (CSPARSE *parse, int depth, char *where, CSARG *arg)
 }
 #endif
 
-static NEOERR *eval_expr_string(CSPARSE *parse, CSARG *arg1, CSARG *arg2, CSTOKEN_TYPE op, CSARG *result)
+/* Binary operators which are always evaluated as numbers */
+#define NUM_OPS (CS_OP_AND | CS_OP_OR | CS_OP_SUB | CS_OP_MULT | CS_OP_DIV | \
+                 CS_OP_MOD | CS_OP_GT | CS_OP_GTE | CS_OP_LT | CS_OP_LTE)
+
+/* s1 and s2 are the values of arg1 and arg2, with their escaping status */
+static NEOERR *eval_string_op(CSARG *arg1, char *s1, int escape_status1,
+                              CSARG *arg2, char *s2, int escape_status2,
+                              CSTOKEN_TYPE op, CSARG *result)
 {
-  char *s1, *s2;
   int out;
-  int escape_status1, escape_status2;
 
   result->op_type = CS_TYPE_NUM;
   result->escape_status = CS_ES_TRUSTED;
-  s1 = arg_eval_with_escape_status (parse, arg1, &escape_status1);
-  s2 = arg_eval_with_escape_status (parse, arg2, &escape_status2);
 
   if ((s1 == NULL) || (s2 == NULL))
   {
@@ -2619,16 +2846,23 @@ static NEOERR *eval_expr_string(CSPARSE *parse, CSARG *arg1, CSARG *arg2, CSTOKE
   return STATUS_OK;
 }
 
-static NEOERR *eval_expr_num(CSPARSE *parse, CSARG *arg1, CSARG *arg2, CSTOKEN_TYPE op, CSARG *result)
+static NEOERR *eval_expr_string(CSPARSE *parse, CSARG *arg1, CSARG *arg2, CSTOKEN_TYPE op, CSARG *result)
 {
-  long int n1, n2;
+  char *s1, *s2;
+  int escape_status1, escape_status2;
+
+  s1 = arg_eval_with_escape_status (parse, arg1, &escape_status1);
+  s2 = arg_eval_with_escape_status (parse, arg2, &escape_status2);
+  return nerr_pass(eval_string_op(arg1, s1, escape_status1,
+                                  arg2, s2, escape_status2, op, result));
+}
 
+static void eval_num_op(long int n1, long int n2, CSTOKEN_TYPE op,
+                        CSARG *result)
+{
   result->op_type = CS_TYPE_NUM;
   result->escape_status = CS_ES_TRUSTED;
 
-  n1 = arg_eval_num (parse, arg1);
-  n2 = arg_eval_num (parse, arg2);
-
   switch (op)
   {
     case CS_OP_EQUAL:
@@ -2670,19 +2904,24 @@ static NEOERR *eval_expr_num(CSPARSE *parse, CSARG *arg1, CSARG *arg2, CSTOKEN_T
       ne_warn ("Unsupported op %s in eval_expr_num", expand_token_type(op, 1));
       break;
   }
-  return STATUS_OK;
 }
 
-static NEOERR *eval_expr_bool(CSPARSE *parse, CSARG *arg1, CSARG *arg2, CSTOKEN_TYPE op, CSARG *result)
+static NEOERR *eval_expr_num(CSPARSE *parse, CSARG *arg1, CSARG *arg2, CSTOKEN_TYPE op, CSARG *result)
 {
   long int n1, n2;
 
+  n1 = arg_eval_num (parse, arg1);
+  n2 = arg_eval_num (parse, arg2);
+  eval_num_op(n1, n2, op, result);
+  return STATUS_OK;
+}
+
+static void eval_bool_op(long int n1, long int n2, CSTOKEN_TYPE op,
+                         CSARG *result)
+{
   result->op_type = CS_TYPE_NUM;
   result->escape_status = CS_ES_TRUSTED;
 
-  n1 = arg_eval_bool (parse, arg1);
-  n2 = arg_eval_bool (parse, arg2);
-
   switch (op)
   {
     case CS_OP_AND:
@@ -2695,9 +2934,30 @@ static NEOERR *eval_expr_bool(CSPARSE *parse, CSARG *arg1, CSARG *arg2, CSTOKEN_
       ne_warn ("Unsupported op %s in eval_expr_bool", expand_token_type(op, 1));
       break;
   }
+}
+
+static NEOERR *eval_expr_bool(CSPARSE *parse, CSARG *arg1, CSARG *arg2, CSTOKEN_TYPE op, CSARG *result)
+{
+  long int n1, n2;
+
+  n1 = arg_eval_bool (parse, arg1);
+  n2 = arg_eval_bool (parse, arg2);
+  eval_bool_op(n1, n2, op, result);
   return STATUS_OK;
 }
 
+static CS_FUNCTION *lookup_function (CSPARSE *parse, const char *name)
+{
+  CS_FUNCTION *csf;
+
+  for (csf = parse->functions; csf != NULL; csf = csf->next)
+  {
+    if (!strcmp(name, csf->name))
+      return csf;
+  }
+  return NULL;
+}
+
 #if DEBUG_EXPR_EVAL
 static int _depth = 0;
 #endif
@@ -2753,22 +3013,27 @@ static NEOERR *eval_expr (CSPARSE *parse, CSARG *expr, CSARG *result)
   }
   if (expr->op_type & CS_TYPE_FUNCTION)
   {
-    if (expr->function == NULL || expr->function->function == NULL)
+    CS_FUNCTION *csf = expr->function;
+
+    /* The expressions of compiled templates only have the function name */
+    if (csf == NULL && expr->s != NULL)
+      csf = lookup_function(parse, expr->s);
+    if (csf == NULL || csf->function == NULL)
       return nerr_raise(NERR_ASSERT,
           "Function is NULL in attempt to evaluate function call %s",
-          (expr->function) ? expr->function->name : "");
+          (csf) ? csf->name : (expr->s ? expr->s : ""));
 
     /* The function evaluates all the arguments, so don't pre-evaluate
      * argument1 */
 
-    err = expr->function->function(parse, expr->function, expr->expr1, result);
+    err = csf->function(parse, csf, expr->expr1, result);
     if (err) return nerr_pass(err);
     /* Indicate whether or not an explicit escape call was made by
      * setting the mode (usually NONE or FUNCTION). This is ORed to
      * ensure that escaping calls within other functions do not get
      * double-escaped. E.g. slice(html_escape(foo), 10, 20) */
-    parse->escaping.current |= expr->function->escape;
-    if (expr->function->escape == NEOS_ESCAPE_FUNCTION)
+    parse->escaping.current |= csf->escape;
+    if (csf->escape == NEOS_ESCAPE_FUNCTION)
       result->escape_status = CS_ES_TRUSTED;
   }
   else
@@ -2926,7 +3191,7 @@ static NEOERR *eval_expr (CSPARSE *parse, CSARG *expr, CSARG *result)
       }
       else if ((arg1.op_type & (CS_TYPE_NUM | CS_TYPE_VAR_NUM)) ||
                (arg2.op_type & (CS_TYPE_NUM | CS_TYPE_VAR_NUM)) ||
-               (expr->op_type & (CS_OP_AND | CS_OP_OR | CS_OP_SUB | CS_OP_MULT | CS_OP_DIV | CS_OP_MOD | CS_OP_GT | CS_OP_GTE | CS_OP_LT | CS_OP_LTE)))
+               (expr->op_type & NUM_OPS))
       {
         /* eval as num */
         err = eval_expr_num(parse, &arg1, &arg2, expr->op_type, result);
@@ -2947,8 +3212,9 @@ static NEOERR *eval_expr (CSPARSE *parse, CSARG *expr, CSARG *result)
   return STATUS_OK;
 }
 
+/* map is the local a compiled template resolved val to, or NULL */
 static NEOERR *var_eval_helper (CSPARSE *parse, CSTREE *node, CSARG *val,
-                                char *argexpr)
+                                CS_LOCAL_MAP *map, char *argexpr)
 {
   NEOERR *err;
 
@@ -2965,10 +3231,16 @@ static NEOERR *var_eval_helper (CSPARSE *parse, CSTREE *node, CSARG *val,
   else
   {
     int escape_status;
-    char *s = arg_eval_with_escape_status (parse, val, &escape_status);
+    char *s;
+
+    if (map != NULL)
+      s = map_var_lookup (parse, map, strchr(val->s, '.'), ARG_PATH(val),
+                          &escape_status);
+    else
+      s = arg_eval_with_escape_status (parse, val, &escape_status);
     err = escape_and_output_variable(parse, node, argexpr, s, escape_status);
   }
-  return STATUS_OK;
+  return nerr_pass(err);
 }
 
 static NEOERR *var_eval (CSPARSE *parse, CSTREE *node, CSTREE **next)
@@ -2979,7 +3251,7 @@ static NEOERR *var_eval (CSPARSE *parse, CSTREE *node, CSTREE **next)
   parse->escaping.current = NEOS_ESCAPE_UNDEF;
   err = eval_expr(parse, &(node->arg1), &val);
   if (err) return nerr_pass(err);
-  err = var_eval_helper(parse, node, &val, node->arg1.argexpr);
+  err = var_eval_helper(parse, node, &val, NULL, node->arg1.argexpr);
   if (val.alloc) free(val.s);
   if (err) return nerr_pass(err);
 
@@ -3006,8 +3278,17 @@ static NEOERR *lvar_eval (CSPARSE *parse, CSTREE *node, CSTREE **next)
   else
   {
     char *s = arg_eval (parse, &val);
+    CS_TEMPLATE *tmpl = NULL;
+    char *key = NULL;
 
     if (s)
+      err = lvar_cache_get(parse, node, "lvar", s, &key, &tmpl);
+    if (tmpl != NULL)
+    {
+      err = lvar_cache_render(parse, tmpl);
+      cs_template_destroy(&tmpl);
+    }
+    else if (s && err == STATUS_OK)
     {
       CSPARSE *cs = NULL;
 
@@ -3029,6 +3310,11 @@ static NEOERR *lvar_eval (CSPARSE *parse, CSTREE *node, CSTREE **next)
         int tmp_idx = -1;
 	err = cs_init_internal(&cs, parse->hdf, parse);
 	if (err) break;
+        if (key != NULL)
+        {
+          err = cache_parse_init(cs, NULL, NULL);
+          if (err) break;
+        }
 
         if (cs->auto_ctx.log_changes)
         {
@@ -3057,11 +3343,21 @@ static NEOERR *lvar_eval (CSPARSE *parse, CSTREE *node, CSTREE **next)
           cs->cur_file_idx = tmp_idx;
         }
 
-        err = cs_render_internal(cs, parse->output_ctx, parse->output_cb);
+        if (key != NULL)
+        {
+          err = lvar_cache_add(parse, &key, &cs, &tmpl);
+          if (err) break;
+        }
+        if (tmpl != NULL)
+          err = lvar_cache_render(parse, tmpl);
+        else
+          err = cs_render_internal(cs, parse->output_ctx, parse->output_cb);
 	if (err) break;
       } while (0);      
       cs_destroy(&cs);
+      cs_template_destroy(&tmpl);
     }
+    if (key != NULL) free(key);
   }
   if (val.alloc) free(val.s);
 
@@ -3093,6 +3389,8 @@ static NEOERR *linclude_eval (CSPARSE *parse, CSTREE *node, CSTREE **next)
     if (s)
     {
       CSPARSE *cs = NULL;
+      CS_TEMPLATE *tmpl = NULL;
+      char *key = NULL;
       do {
   err = increase_stack_depth (parse);
   if (err)
@@ -3104,36 +3402,53 @@ static NEOERR *linclude_eval (CSPARSE *parse, CSTREE *node, CSTREE **next)
         s);
     break;
   }
-  err = cs_init_internal(&cs, parse->hdf, parse);
+  err = lvar_cache_get(parse, node, "linclude", s, &key, &tmpl);
   if (err) break;
-  if (node->escape != NEOS_ESCAPE_UNDEF)
+  if (tmpl == NULL)
   {
-    STACK_ENTRY *entry;
-
-    /* Pass on the currently active escape mode to the
-       linclude tree about to be parsed */
-    err = uListGet (cs->stack, -1, (void *)&entry);
+    err = cs_init_internal(&cs, parse->hdf, parse);
     if (err) break;
-    entry->escape = node->escape;
-    cs->escaping.next_stack = node->escape;
-  }
+    if (key != NULL)
+    {
+      err = cache_parse_init(cs, NULL, NULL);
+      if (err) break;
+    }
+    if (node->escape != NEOS_ESCAPE_UNDEF)
+    {
+      STACK_ENTRY *entry;
 
-  err = cs_parse_file_internal(cs, s);
-  if (!(node->flags & CSF_REQUIRED))
-  {
-    nerr_handle(&err, NERR_NOT_FOUND);
-  }
-  if (err)
-  {
-    err = nerr_pass_ctx(
-        err,
-        "%s failed to include '%s' while parsing.",
-        find_context(parse, -1, tmp, sizeof(tmp)),
-        s);
-    break;
+      /* Pass on the currently active escape mode to the
+         linclude tree about to be parsed */
+      err = uListGet (cs->stack, -1, (void *)&entry);
+      if (err) break;
+      entry->escape = node->escape;
+      cs->escaping.next_stack = node->escape;
+    }
+
+    err = cs_parse_file_internal(cs, s);
+    if (!(node->flags & CSF_REQUIRED))
+    {
+      nerr_handle(&err, NERR_NOT_FOUND);
+    }
+    if (err)
+    {
+      err = nerr_pass_ctx(
+          err,
+          "%s failed to include '%s' while parsing.",
+          find_context(parse, -1, tmp, sizeof(tmp)),
+          s);
+      break;
+    }
+    if (key != NULL)
+    {
+      err = lvar_cache_add(parse, &key, &cs, &tmpl);
+      if (err) break;
+    }
   }
-  if (err) break;
-  err = cs_render_internal(cs, parse->output_ctx, parse->output_cb);
+  if (tmpl != NULL)
+    err = lvar_cache_render(parse, tmpl);
+  else
+    err = cs_render_internal(cs, parse->output_ctx, parse->output_cb);
   if (err)
   {
     err = nerr_pass_ctx(
@@ -3147,6 +3462,8 @@ static NEOERR *linclude_eval (CSPARSE *parse, CSTREE *node, CSTREE **next)
   if (err) break;
       } while (0);
       cs_destroy(&cs);
+      cs_template_destroy(&tmpl);
+      if (key != NULL) free(key);
     }
   }
   if (val.alloc) free(val.s);
@@ -3169,7 +3486,7 @@ static NEOERR *alt_eval (CSPARSE *parse, CSTREE *node, CSTREE **next)
   eval_true = arg_eval_bool(parse, &val);
   if (eval_true)
   {
-    err = var_eval_helper(parse, node, &val, node->arg1.argexpr);
+    err = var_eval_helper(parse, node, &val, NULL, node->arg1.argexpr);
   }
   if (val.alloc) free(val.s);
   if (err) return nerr_pass(err);
@@ -3204,7 +3521,7 @@ static NEOERR *contenttype_eval (CSPARSE *parse, CSTREE *node, CSTREE **next)
 
   if (parse->auto_ctx.global_enabled == 1)
     err = neos_auto_set_content_type(parse->auto_ctx.parser_ctx,
-                                     neos_strip(node->arg1.s));
+                                     node->arg1.s);
 
   *next = node->next;
   return nerr_pass(err);
@@ -3364,7 +3681,7 @@ static NEOERR *each_eval (CSPARSE *parse, CSTREE *node, CSTREE **next)
 
   if (val.op_type == CS_TYPE_VAR)
   {
-    var = var_lookup_obj (parse, val.s);
+    var = var_lookup_obj (parse, val.s, ARG_PATH(&val));
 
     if (var != NULL)
     {
@@ -3375,11 +3692,14 @@ static NEOERR *each_eval (CSPARSE *parse, CSTREE *node, CSTREE **next)
       each_map.next_scope = parse->locals;
       each_map.first = 1;
       each_map.last = 0;
+      /* The name of var, to find the children again (see map_obj) */
+      each_map.s = val.s;
+      each_map.is_child = 1;
       parse->locals = &each_map;
 
       do
       {
-	child = hdf_obj_child (var);
+	child = hdf_obj_peek_child (var);
 	while (child != NULL)
 	{
           /* We don't explicitly set each_map.last here since checking
@@ -3426,7 +3746,7 @@ static NEOERR *with_eval (CSPARSE *parse, CSTREE *node, CSTREE **next)
 
   if (val.op_type == CS_TYPE_VAR)
   {
-    var = var_lookup_obj (parse, val.s);
+    var = var_lookup_obj (parse, val.s, ARG_PATH(&val));
 
     if (var != NULL)
     {
@@ -3434,6 +3754,8 @@ static NEOERR *with_eval (CSPARSE *parse, CSTREE *node, CSTREE **next)
       with_map.type = CS_TYPE_VAR;
       with_map.name = node->arg1.s;
       with_map.next = parse->locals;
+      with_map.next_scope = parse->locals;
+      with_map.s = val.s;
       with_map.h = var;
       /* Setting a dummy value. The real escape status is part of with_map->h
          and will be read from there */
@@ -3470,60 +3792,166 @@ static NEOERR *end_parse (CSPARSE *parse, int cmd, char *arg)
   return STATUS_OK;
 }
 
-static NEOERR *include_parse (CSPARSE *parse, int cmd, char *arg)
+/* Returns the first macro of the included parse which is already defined */
+static CS_MACRO *duplicate_macro (CSPARSE *parse, CSPARSE *included)
 {
-  NEOERR *err;
-  char *s;
-  char tmp[256];
-  int flags = 0;
-  CSARG arg1, val;
-
-  memset(&arg1, 0, sizeof(CSARG));
-  if (arg[0] == '!')
-    flags |= CSF_REQUIRED;
-  arg++;
-  /* Validate arg is a var (regex /^[#" ]$/) */
-  arg1.argexpr = NULL;
-  err = parse_expr (parse, arg, 0, &arg1);
-  if (err) return nerr_pass(err);
-  /* ne_warn ("include: %s", a); */
-
-  err = eval_expr(parse, &arg1, &val);
-  if (err) return nerr_pass(err);
+  CS_MACRO *macro;
+  CS_TEMPLATE *tmpl;
+  int x;
 
-  s = arg_eval (parse, &val);
-  if (s == NULL && !(flags & CSF_REQUIRED))
+  for (macro = included->macros; macro != NULL; macro = macro->next)
   {
-    if (arg1.argexpr != NULL)
-    {
-      free(arg1.argexpr);
-      arg1.argexpr = NULL;
-    }
-    return STATUS_OK;
+    if (lookup_macro(parse, macro->name) != NULL) return macro;
   }
-  do {
-    err = increase_stack_depth (parse);
-    if (err)
+  if (included->includes != NULL)
+  {
+    for (x = 0; x < uListLength(included->includes); x++)
     {
-      err = nerr_pass_ctx(
-          err,
-          "%s failed to include '%s'.",
-          find_context(parse, -1, tmp, sizeof(tmp)),
-          s);
-      break;
+      uListGet(included->includes, x, (void *)&tmpl);
+      macro = duplicate_macro(parse, tmpl->parse);
+      if (macro != NULL) return macro;
     }
-
-    err = cs_parse_file_internal(parse, s);
-    if (err)
+  }
+  return NULL;
+}
+
+/* Include a file through the template cache, as a CSF_SHARED node which
+ * points at the tree of the cached template.  If the file can't be parsed
+ * on its own (ie, it calls a macro defined by the including file, or
+ * closes a block it didn't open), included is left 0 and the caller falls
+ * back to parsing the file inline. */
+static NEOERR *include_template (CSPARSE *parse, int cmd, const char *path,
+                                 int *included)
+{
+  NEOERR *err;
+  CS_TEMPLATE *tmpl;
+  CS_MACRO *macro;
+  CSTREE *node;
+  char tmp[256];
+
+  *included = 0;
+  err = cache_get(&tmpl, parse, parse->hdf, path, parse->cache_init);
+  if (err != STATUS_OK)
+  {
+    if (!nerr_match(err, NERR_MAX_RECURSION) && nerr_handle(&err, NERR_PARSE))
+      return STATUS_OK;
+    return nerr_pass(err);
+  }
+  macro = duplicate_macro(parse, tmpl->parse);
+  if (macro != NULL)
+  {
+    cs_template_destroy(&tmpl);
+    return nerr_raise (NERR_PARSE, "%s Duplicate macro def for %s in %s",
+        find_context(parse, -1, tmp, sizeof(tmp)), macro->name, path);
+  }
+  if (parse->includes == NULL)
+  {
+    err = uListInit(&(parse->includes), 10, 0);
+    if (err)
+    {
+      cs_template_destroy(&tmpl);
+      return nerr_pass(err);
+    }
+  }
+  err = uListAppend(parse->includes, tmpl);
+  if (err)
+  {
+    cs_template_destroy(&tmpl);
+    return nerr_pass(err);
+  }
+  if (tmpl->parse->dynamic) parse->dynamic = 1;
+
+  err = alloc_node (&node, parse);
+  if (err) return nerr_pass(err);
+  node->cmd = cmd;
+  node->flags |= CSF_SHARED;
+  node->arg1.op_type = CS_TYPE_STRING;
+  node->arg1.s = tmpl->path;
+  node->case_0 = tmpl->parse->tree;
+  *(parse->next) = node;
+  parse->next = &(node->next);
+  parse->current = node;
+
+  *included = 1;
+  return STATUS_OK;
+}
+
+static NEOERR *include_parse (CSPARSE *parse, int cmd, char *arg)
+{
+  NEOERR *err;
+  char *s;
+  char tmp[256];
+  int flags = 0;
+  int included = 0;
+  CSARG arg1, val;
+
+  memset(&arg1, 0, sizeof(CSARG));
+  if (arg[0] == '!')
+    flags |= CSF_REQUIRED;
+  arg++;
+  /* Validate arg is a var (regex /^[#" ]$/) */
+  arg1.argexpr = NULL;
+  err = parse_expr (parse, arg, 0, &arg1);
+  if (err) return nerr_pass(err);
+  /* ne_warn ("include: %s", a); */
+
+  /* Including a variable binds the parse to the hdf */
+  if (arg1.op_type != CS_TYPE_STRING)
+    parse->dynamic = 1;
+
+  err = eval_expr(parse, &arg1, &val);
+  if (err) return nerr_pass(err);
+
+  s = arg_eval (parse, &val);
+  if (s == NULL && !(flags & CSF_REQUIRED))
+  {
+    if (arg1.argexpr != NULL)
+    {
+      free(arg1.argexpr);
+      arg1.argexpr = NULL;
+    }
+    hdf_path_destroy(&(arg1.path));
+    return STATUS_OK;
+  }
+  do {
+    err = increase_stack_depth (parse);
+    if (err)
     {
       err = nerr_pass_ctx(
           err,
-          "%s failed to include '%s' and parse it.",
+          "%s failed to include '%s'.",
           find_context(parse, -1, tmp, sizeof(tmp)),
           s);
       break;
     }
 
+    if (parse->cached && s != NULL)
+    {
+      err = include_template(parse, cmd, s, &included);
+      if (err)
+      {
+        err = nerr_pass_ctx(
+            err,
+            "%s failed to include '%s' and parse it.",
+            find_context(parse, -1, tmp, sizeof(tmp)),
+            s);
+        break;
+      }
+    }
+    if (!included)
+    {
+      err = cs_parse_file_internal(parse, s);
+      if (err)
+      {
+        err = nerr_pass_ctx(
+            err,
+            "%s failed to include '%s' and parse it.",
+            find_context(parse, -1, tmp, sizeof(tmp)),
+            s);
+        break;
+      }
+    }
+
     err = decrease_stack_depth (parse);
     if (err) break;
   } while (0);
@@ -3538,10 +3966,24 @@ static NEOERR *include_parse (CSPARSE *parse, int cmd, char *arg)
     free(arg1.argexpr);
     arg1.argexpr = NULL;
   }
+  hdf_path_destroy(&(arg1.path));
 
   return nerr_pass (err);
 }
 
+static NEOERR *include_eval (CSPARSE *parse, CSTREE *node, CSTREE **next)
+{
+  NEOERR *err = STATUS_OK;
+
+  /* Only includes through the template cache have a node, normal
+   * includes are parsed inline */
+  if (node->case_0 != NULL)
+    err = render_node(parse, node->case_0);
+
+  *next = node->next;
+  return nerr_pass(err);
+}
+
 static NEOERR *def_parse (CSPARSE *parse, int cmd, char *arg)
 {
   NEOERR *err;
@@ -3582,17 +4024,12 @@ static NEOERR *def_parse (CSPARSE *parse, int cmd, char *arg)
   }
   s++;
   /* Check to see if this is a redefinition */
-  macro = parse->macros;
-  while (macro != NULL)
+  if (lookup_macro(parse, name) != NULL)
   {
-    if (!strcmp(macro->name, name))
-    {
-      dealloc_node(&node);
-      return nerr_raise (NERR_PARSE,
-	  "%s Duplicate macro def for %s",
-	  find_context(parse, -1, tmp, sizeof(tmp)), arg);
-    }
-    macro = macro->next;
+    dealloc_node(&node);
+    return nerr_raise (NERR_PARSE,
+	"%s Duplicate macro def for %s",
+	find_context(parse, -1, tmp, sizeof(tmp)), arg);
   }
 
   macro = (CS_MACRO *) calloc (1, sizeof (CS_MACRO));
@@ -3757,12 +4194,7 @@ static NEOERR *call_parse (CSPARSE *parse, int cmd, char *arg)
   }
   s++;
   /* Check to see if this macro exists */
-  macro = parse->macros;
-  while (macro != NULL)
-  {
-    if (!strcmp(macro->name, name)) break;
-    macro = macro->next;
-  }
+  macro = lookup_macro(parse, name);
   if (macro == NULL)
   {
     dealloc_node(&node);
@@ -3834,11 +4266,69 @@ static NEOERR *call_parse (CSPARSE *parse, int cmd, char *arg)
   return STATUS_OK;
 }
 
-static NEOERR *call_eval (CSPARSE *parse, CSTREE *node, CSTREE **next)
+/* Returns in maps n cleared locals for the arguments of a macro called
+ * at the current stack depth.  The frames are kept by the outermost parse
+ * of the render, so the parses lvar and linclude create share them, and
+ * are reused by its following renders.  The body of a call runs one
+ * level deeper, so a frame is only used by one call at a time and
+ * growing it never moves the locals of a call still running. */
+static NEOERR *call_frame (CSPARSE *parse, int n, CS_LOCAL_MAP **maps)
+{
+  CSPARSE *root = parse;
+  CS_CALL_FRAME *frame;
+  CS_LOCAL_MAP *new_maps;
+
+  if (parse->stack_depth < 0 || parse->stack_depth > MAX_STACK_DEPTH)
+    return nerr_raise (NERR_MAX_RECURSION, "Stack depth too large.");
+
+  while (root->parent != NULL) root = root->parent;
+  if (root->call_frames == NULL)
+  {
+    root->call_frames = (CS_CALL_FRAME *) calloc (MAX_STACK_DEPTH + 1,
+                                                  sizeof(CS_CALL_FRAME));
+    if (root->call_frames == NULL)
+      return nerr_raise (NERR_NOMEM,
+                         "Unable to allocate memory for call frames");
+  }
+  frame = &(root->call_frames[parse->stack_depth]);
+  if (frame->size < n)
+  {
+    new_maps = (CS_LOCAL_MAP *) realloc (frame->maps,
+                                         n * sizeof(CS_LOCAL_MAP));
+    if (new_maps == NULL)
+      return nerr_raise (NERR_NOMEM,
+                         "Unable to allocate memory for call frame");
+    frame->maps = new_maps;
+    frame->size = n;
+  }
+  memset(frame->maps, 0, n * sizeof(CS_LOCAL_MAP));
+  *maps = frame->maps;
+  return STATUS_OK;
+}
+
+static void call_frames_destroy (CS_CALL_FRAME **frames)
+{
+  int x;
+
+  if (*frames == NULL) return;
+  for (x = 0; x <= MAX_STACK_DEPTH; x++)
+  {
+    if ((*frames)[x].maps != NULL) free((*frames)[x].maps);
+  }
+  free(*frames);
+  *frames = NULL;
+}
+
+/* Calls macro with the arguments vargs, from a call node with the
+ * escaping escape.  vals, if not NULL, are the already evaluated
+ * arguments, which are freed by the call, otherwise the arguments are
+ * evaluated here.  body, if not NULL, is the compiled body of the macro
+ * (see cs_dump_c) */
+static NEOERR *call_macro (CSPARSE *parse, CS_MACRO *macro, CSARG *vargs,
+                           NEOS_ESCAPE escape, CSARG *vals, CS_AOT_BLOCK body)
 {
   NEOERR *err = STATUS_OK;
   CS_LOCAL_MAP *call_map, *map;
-  CS_MACRO *macro;
   CSARG *carg, *darg;
   HDF *var;
   int x;
@@ -3848,25 +4338,26 @@ static NEOERR *call_eval (CSPARSE *parse, CSTREE *node, CSTREE **next)
    * the call.
    */
   NEOS_ESCAPE saved = parse->escaping.when_undef;
-  if (node->escape != NEOS_ESCAPE_UNDEF)
-    parse->escaping.when_undef = node->escape;
+  if (escape != NEOS_ESCAPE_UNDEF)
+    parse->escaping.when_undef = escape;
 
-  macro = node->arg1.macro;
+  call_map = NULL;
   if (macro->n_args)
   {
-    call_map = (CS_LOCAL_MAP *) calloc (macro->n_args, sizeof(CS_LOCAL_MAP));
-    if (call_map == NULL)
-      return nerr_raise (NERR_NOMEM,
-                "Unable to allocate memory for call_map in call_eval of %s",
-                         macro->name);
-  }
-  else
-  {
-    call_map = NULL;
+    err = call_frame (parse, macro->n_args, &call_map);
+    if (err)
+    {
+      for (x = 0; vals != NULL && x < macro->n_args; x++)
+      {
+        if (vals[x].alloc) free(vals[x].s);
+      }
+      parse->escaping.when_undef = saved;
+      return nerr_pass_ctx(err, "call of macro '%s' failed.", macro->name);
+    }
   }
 
   darg = macro->args;
-  carg = node->vargs;
+  carg = vargs;
 
   for (x = 0; x < macro->n_args; x++)
   {
@@ -3878,8 +4369,15 @@ static NEOERR *call_eval (CSPARSE *parse, CSTREE *node, CSTREE **next)
     call_map[x].next_scope = parse->locals;
 
     map->name = darg->s;
-    err = eval_expr(parse, carg, &val);
-    if (err) break;
+    if (vals != NULL)
+    {
+      val = vals[x];
+    }
+    else
+    {
+      err = eval_expr(parse, carg, &val);
+      if (err) break;
+    }
     if (val.op_type & CS_TYPE_STRING)
     {
       map->s = val.s;
@@ -3918,7 +4416,7 @@ static NEOERR *call_eval (CSPARSE *parse, CSTREE *node, CSTREE **next)
       }
       else
       {
-	var = var_lookup_obj (parse, val.s);
+	var = var_lookup_obj (parse, val.s, ARG_PATH(&val));
 	map->h = var;
         map->type = CS_TYPE_VAR;
         /* Setting a dummy value. The real escape status is part of map->h
@@ -3956,7 +4454,10 @@ static NEOERR *call_eval (CSPARSE *parse, CSTREE *node, CSTREE **next)
             macro->name);
         break;
       }
-      err = render_node (parse, macro->tree->case_0);
+      if (body != NULL)
+        err = body (&AotApi, parse);
+      else
+        err = render_node (parse, macro->tree->case_0);
       if(err) {
         err = nerr_pass_ctx(
             err,
@@ -3973,9 +4474,17 @@ static NEOERR *call_eval (CSPARSE *parse, CSTREE *node, CSTREE **next)
   {
     if (call_map[x].map_alloc) free(call_map[x].s);
   }
-  if (call_map) free (call_map);
 
   parse->escaping.when_undef = saved;
+  return nerr_pass(err);
+}
+
+static NEOERR *call_eval (CSPARSE *parse, CSTREE *node, CSTREE **next)
+{
+  NEOERR *err;
+
+  err = call_macro (parse, node->arg1.macro, node->vargs, node->escape, NULL,
+                    NULL);
   *next = node->next;
   return nerr_pass(err);
 }
@@ -4023,34 +4532,25 @@ static NEOERR *set_parse (CSPARSE *parse, int cmd, char *arg)
   return STATUS_OK;
 }
 
-static NEOERR *set_eval (CSPARSE *parse, CSTREE *node, CSTREE **next)
+/* Sets the evaluated lvalue set to val, and frees them both */
+static NEOERR *set_eval_value (CSPARSE *parse, CSARG *set, CSARG *val)
 {
   NEOERR *err = STATUS_OK;
-  CSARG val;
-  CSARG set;
-
-  err = eval_expr(parse, &(node->arg1), &set);
-  if (err) return nerr_pass (err);
-  err = eval_expr(parse, &(node->arg2), &val);
-  if (err) {
-    if (set.alloc) free(set.s);
-    return nerr_pass (err);
-  }
 
-  if (set.op_type != CS_TYPE_NUM)
+  if (set->op_type != CS_TYPE_NUM)
   {
     /* this allow for a weirdness where set:"foo"="bar"
      * actually sets the hdf var foo... */
-    if (val.op_type & (CS_TYPE_NUM | CS_TYPE_VAR_NUM))
+    if (val->op_type & (CS_TYPE_NUM | CS_TYPE_VAR_NUM))
     {
       char buf[256];
       long int n_val;
 
-      n_val = arg_eval_num (parse, &val);
+      n_val = arg_eval_num (parse, val);
       snprintf (buf, sizeof(buf), "%ld", n_val);
-      if (set.s)
+      if (set->s)
       {
-        err = var_set_value (parse, set.s, buf, CS_ES_TRUSTED);
+        err = var_set_value (parse, set->s, buf, CS_ES_TRUSTED);
       }
       else
       {
@@ -4061,11 +4561,11 @@ static NEOERR *set_eval (CSPARSE *parse, CSTREE *node, CSTREE **next)
     else
     {
       int escape_status;
-      char *s = arg_eval_with_escape_status (parse, &val, &escape_status);
+      char *s = arg_eval_with_escape_status (parse, val, &escape_status);
       /* Do we set it to blank if s == NULL? */
-      if (set.s)
+      if (set->s)
       {
-        err = var_set_value (parse, set.s, s, escape_status);
+        err = var_set_value (parse, set->s, s, escape_status);
       }
       else
       {
@@ -4075,8 +4575,26 @@ static NEOERR *set_eval (CSPARSE *parse, CSTREE *node, CSTREE **next)
       }
     }
   } /* else WARNING */
-  if (set.alloc) free(set.s);
-  if (val.alloc) free(val.s);
+  if (set->alloc) free(set->s);
+  if (val->alloc) free(val->s);
+
+  return nerr_pass (err);
+}
+
+static NEOERR *set_eval (CSPARSE *parse, CSTREE *node, CSTREE **next)
+{
+  NEOERR *err = STATUS_OK;
+  CSARG val;
+  CSARG set;
+
+  err = eval_expr(parse, &(node->arg1), &set);
+  if (err) return nerr_pass (err);
+  err = eval_expr(parse, &(node->arg2), &val);
+  if (err) {
+    if (set.alloc) free(set.s);
+    return nerr_pass (err);
+  }
+  err = set_eval_value (parse, &set, &val);
 
   *next = node->next;
   return nerr_pass (err);
@@ -4277,6 +4795,8 @@ static NEOERR *render_node (CSPARSE *parse, CSTREE *node)
 {
   NEOERR *err = STATUS_OK;
 
+  if (node != NULL && node->prog != NULL)
+    return nerr_pass(run_prog(parse, node->prog));
   while (node != NULL)
   {
     /* ne_warn ("%s %08x", Commands[node->cmd].cmd, node); */
@@ -4348,966 +4868,4095 @@ NEOERR *cs_render (CSPARSE *parse, void *ctx, CSOUTFUNC cb)
   return nerr_pass(cs_render_internal(parse, ctx, cb));
 }
 
-/* **** Functions ******************************************** */
+/* **** Tree optimization ******************************************** */
 
-NEOERR *cs_register_function(CSPARSE *parse, const char *funcname,
-                                  int n_args, CSFUNCTION function)
+/* The operators which can be evaluated when the parse is done, if their
+ * operands are constants */
+#define CS_OPS_FOLD (CS_OP_EXISTS | CS_OP_NOT | CS_OP_NUM | CS_OP_LPAREN | \
+                     CS_OP_EQUAL | CS_OP_NEQUAL | CS_OP_LT | CS_OP_LTE | \
+                     CS_OP_GT | CS_OP_GTE | CS_OP_AND | CS_OP_OR | \
+                     CS_OP_ADD | CS_OP_SUB | CS_OP_MULT | CS_OP_DIV | \
+                     CS_OP_MOD)
+
+static int arg_is_const (CSARG *arg)
 {
-  CS_FUNCTION *csf;
+  return (arg != NULL && arg->next == NULL &&
+          (arg->op_type == CS_TYPE_STRING || arg->op_type == CS_TYPE_NUM));
+}
 
-  /* Should we validate the parseability of the name? */
+static int arg_is_fold_op (CSARG *arg)
+{
+  return ((arg->op_type & CS_OPS_FOLD) && !(arg->op_type & ~CS_OPS_FOLD));
+}
 
-  csf = parse->functions;
-  while (csf != NULL)
+/* Replace each operator in the expression whose operands are constants
+ * with its value, as eval_expr would find it */
+static NEOERR *fold_expr (CSPARSE *parse, CSARG *arg)
+{
+  NEOERR *err;
+  CSARG val;
+
+  for (; arg != NULL; arg = arg->next)
   {
-    if (!strcmp(csf->name, funcname) && csf->function != function)
+    if (arg->expr1 != NULL)
     {
-      return nerr_raise(NERR_DUPLICATE,
-	  "Attempt to register duplicate function %s", funcname);
+      err = fold_expr (parse, arg->expr1);
+      if (err) return nerr_pass(err);
     }
-    csf = csf->next;
-  }
-  csf = (CS_FUNCTION *) calloc (1, sizeof(CS_FUNCTION));
-  if (csf == NULL)
-    return nerr_raise(NERR_NOMEM,
-	"Unable to allocate memory to register function %s", funcname);
-  csf->name = strdup(funcname);
-  if (csf->name == NULL)
-  {
-    free(csf);
-    return nerr_raise(NERR_NOMEM,
-	"Unable to allocate memory to register function %s", funcname);
-  }
-  csf->function = function;
-  csf->n_args = n_args;
-  csf->escape = NEOS_ESCAPE_UNDEF;
-  csf->next = parse->functions;
-  parse->functions = csf;
+    if (arg->expr2 != NULL)
+    {
+      err = fold_expr (parse, arg->expr2);
+      if (err) return nerr_pass(err);
+    }
+    if (!arg_is_fold_op(arg) || !arg_is_const(arg->expr1) ||
+        (!(arg->op_type & CS_OPS_UNARY) && !arg_is_const(arg->expr2)))
+      continue;
 
+    err = eval_expr (parse, arg, &val);
+    if (err) return nerr_pass(err);
+    if (val.alloc)
+    {
+      err = uListAppend(parse->alloc, val.s);
+      if (err)
+      {
+        free(val.s);
+        return nerr_pass(err);
+      }
+    }
+    dealloc_arg(&(arg->expr1));
+    dealloc_arg(&(arg->expr2));
+    arg->op_type = val.op_type;
+    arg->s = val.s;
+    arg->n = val.n;
+    arg->alloc = 0;
+  }
   return STATUS_OK;
 }
 
-NEOERR *cs_register_esc_function(CSPARSE *parse, const char *funcname,
-                                 int n_args, CSFUNCTION function)
+/* Whether name is one of the Config.FrozenPrefixes, or below one */
+static int frozen_name (CSPARSE *parse, const char *name)
 {
-  NEOERR *err;
-
-  err = cs_register_function(parse, funcname, n_args, function);
-  if (err) return nerr_pass(err);
-  parse->functions->escape = NEOS_ESCAPE_FUNCTION;
+  const char *p = parse->frozen;
+  size_t len;
 
-  return STATUS_OK;
+  if (p == NULL || name == NULL) return 0;
+  while (*p)
+  {
+    while (*p == ',' || isspace(*p)) p++;
+    len = 0;
+    while (p[len] && p[len] != ',' && !isspace(p[len])) len++;
+    if (len && !strncmp(name, p, len) &&
+        (name[len] == '\0' || name[len] == '.'))
+      return 1;
+    p += len;
+  }
+  return 0;
 }
 
-/* This is similar to python's PyArg_ParseTuple, :
- *   s - string (allocated)
- *   i - int
- *   A - arg ptr (maybe later)
- */
-NEOERR * cs_arg_parsev(CSPARSE *parse, CSARG *args, const char *fmt,
-                       va_list ap)
+/* Whether the expression only depends on constants and frozen values */
+static int expr_is_frozen (CSPARSE *parse, CSARG *arg)
 {
-  NEOERR *err = STATUS_OK;
-  char **s;
-  long int *i;
-  CSARG val;
+  if (arg == NULL) return 1;
+  if (arg->next != NULL) return 0;
+  if (arg->op_type == CS_TYPE_STRING || arg->op_type == CS_TYPE_NUM)
+    return 1;
+  if (arg->op_type == CS_TYPE_VAR || arg->op_type == CS_TYPE_VAR_NUM)
+    return frozen_name(parse, arg->s);
+  if (!arg_is_fold_op(arg)) return 0;
+  return (expr_is_frozen(parse, arg->expr1) &&
+          expr_is_frozen(parse, arg->expr2));
+}
 
-  while (*fmt)
+/* A macro points at its def node, so a branch with one can't be dropped */
+static int tree_has_def (CSTREE *node)
+{
+  for (; node != NULL; node = node->next)
   {
-    memset(&val, 0, sizeof(val));
-    err = eval_expr(parse, args, &val);
-    if (err) return nerr_pass(err);
-
-    switch (*fmt)
-    {
-      case 's':
-	s = va_arg(ap, char **);
-	if (s == NULL)
-	{
-	  err = nerr_raise(NERR_ASSERT,
-	      "Invalid number of arguments in call to cs_arg_parse");
-	  break;
-	}
-	*s = arg_eval_str_alloc(parse, &val);
-	break;
-      case 'i':
-	i = va_arg(ap, long int *);
-	if (i == NULL)
-	{
-	  err = nerr_raise(NERR_ASSERT,
-	      "Invalid number of arguments in call to cs_arg_parse");
-	  break;
-	}
-	*i = arg_eval_num(parse, &val);
-	break;
-      default:
-	break;
-    }
-    if (err) return nerr_pass(err);
-    fmt++;
-    args = args->next;
-    if (val.alloc) free(val.s);
+    if (Commands[node->cmd].parse_handler == def_parse)
+      return 1;
+    if (!(node->flags & CSF_SHARED) && tree_has_def(node->case_0))
+      return 1;
+    if (tree_has_def(node->case_1))
+      return 1;
   }
-  if (err) return nerr_pass(err);
-  return STATUS_OK;
+  return 0;
 }
 
-NEOERR * cs_arg_parse(CSPARSE *parse, CSARG *args, const char *fmt, ...)
+static int literal_can_merge (CSTREE *node, CSTREE *next)
 {
-  NEOERR *err;
-  va_list ap;
-
-  va_start(ap, fmt);
-  err = cs_arg_parsev(parse, args, fmt, ap);
-  va_end(ap);
-  return nerr_pass(err);
+  return (next != NULL &&
+          Commands[next->cmd].parse_handler == literal_parse &&
+          next->arg1.s != NULL &&
+          next->do_autoescape == node->do_autoescape &&
+          next->file_idx == node->file_idx);
 }
 
-static NEOERR * _builtin_subcount(CSPARSE *parse, CS_FUNCTION *csf, CSARG *args, CSARG *result)
+/* Join the literals following node into it */
+static NEOERR *merge_literals (CSPARSE *parse, CSTREE *node)
 {
   NEOERR *err;
-  HDF *obj;
-  int count = 0;
-  CSARG val;
-
-  memset(&val, 0, sizeof(val));
-  err = eval_expr(parse, args, &val);
-  if (err) return nerr_pass(err);
+  CSTREE *last, *next;
+  size_t len;
+  char *s, *p;
 
-  /* default for non-vars is 0 children */
-  result->op_type = CS_TYPE_NUM;
-  result->n = 0;
+  len = strlen(node->arg1.s);
+  for (last = node->next; literal_can_merge(node, last); last = last->next)
+    len += strlen(last->arg1.s);
+  if (last == node->next) return STATUS_OK;
 
-  if (val.op_type & CS_TYPE_VAR)
+  s = (char *) malloc (len + 1);
+  if (s == NULL)
+    return nerr_raise (NERR_NOMEM, "Unable to allocate memory to merge literals");
+  err = uListAppend(parse->alloc, s);
+  if (err)
   {
-    obj = var_lookup_obj (parse, val.s);
-    if (obj != NULL)
-    {
-      obj = hdf_obj_child(obj);
-      while (obj != NULL)
-      {
-	count++;
-	obj = hdf_obj_next(obj);
-      }
-    }
-    result->n = count;
+    free(s);
+    return nerr_pass(err);
   }
-  if (val.alloc) free(val.s);
-
+  p = s;
+  len = strlen(node->arg1.s);
+  memcpy(p, node->arg1.s, len);
+  p += len;
+  while (node->next != last)
+  {
+    next = node->next;
+    len = strlen(next->arg1.s);
+    memcpy(p, next->arg1.s, len);
+    p += len;
+    node->next = next->next;
+    next->next = NULL;
+    dealloc_node(&next);
+  }
+  *p = '\0';
+  node->arg1.s = s;
   return STATUS_OK;
 }
 
-static NEOERR * _builtin_str_length(CSPARSE *parse, CS_FUNCTION *csf, CSARG *args, CSARG *result)
+/* Optimize the list of nodes at *link.  frozen is 0 where a local (an
+ * each, with or loop variable, or a macro argument) could hide a frozen
+ * name. */
+static NEOERR *optimize_nodes (CSPARSE *parse, CSTREE **link, int frozen)
 {
   NEOERR *err;
+  CSTREE **start = link;
+  CSTREE *node, *branch;
+  CS_CMDS *cmd;
   CSARG val;
+  int eval_true;
 
-  memset(&val, 0, sizeof(val));
-  err = eval_expr(parse, args, &val);
-  if (err) return nerr_pass(err);
-
-  /* non var/string objects have 0 length */
-  result->op_type = CS_TYPE_NUM;
-  result->n = 0;
-
-  if (val.op_type & (CS_TYPE_VAR | CS_TYPE_STRING))
+  while ((node = *link) != NULL)
   {
-    char *s = arg_eval(parse, &val);
-    if (s) result->n = strlen(s);
-  }
-  if (val.alloc) free(val.s);
-  return STATUS_OK;
-}
+    cmd = &(Commands[node->cmd]);
+    err = fold_expr (parse, &(node->arg1));
+    if (err == STATUS_OK)
+      err = fold_expr (parse, &(node->arg2));
+    if (err == STATUS_OK)
+      err = fold_expr (parse, node->vargs);
+    if (err) return nerr_pass(err);
 
-static NEOERR * _builtin_str_crc(CSPARSE *parse, CS_FUNCTION *csf, CSARG *args,
-                                 CSARG *result)
-{
-  NEOERR *err;
-  CSARG val;
+    if (frozen && cmd->eval_handler == if_eval &&
+        expr_is_frozen(parse, &(node->arg1)))
+    {
+      err = eval_expr (parse, &(node->arg1), &val);
+      if (err) return nerr_pass(err);
+      eval_true = arg_eval_bool(parse, &val);
+      if (val.alloc) free(val.s);
 
-  memset(&val, 0, sizeof(val));
-  err = eval_expr(parse, args, &val);
-  if (err) return nerr_pass(err);
+      if (!tree_has_def(eval_true ? node->case_1 : node->case_0))
+      {
+        /* Splice in the branch taken, and look at it next */
+        if (eval_true)
+        {
+          branch = node->case_0;
+          node->case_0 = NULL;
+        }
+        else
+        {
+          branch = node->case_1;
+          node->case_1 = NULL;
+        }
+        if (branch != NULL)
+        {
+          *link = branch;
+          while (branch->next != NULL) branch = branch->next;
+          branch->next = node->next;
+        }
+        else
+        {
+          *link = node->next;
+        }
+        node->next = NULL;
+        dealloc_node(&node);
+        continue;
+      }
+    }
 
-  /* non var/string objects have 0 length */
-  result->op_type = CS_TYPE_NUM;
-  result->n = 0;
+    if (node->case_0 != NULL && !(node->flags & CSF_SHARED))
+    {
+      err = optimize_nodes (parse, &(node->case_0),
+          (cmd->eval_handler == each_eval || cmd->eval_handler == with_eval ||
+           cmd->eval_handler == loop_eval || cmd->parse_handler == def_parse)
+          ? 0 : frozen);
+      if (err) return nerr_pass(err);
+    }
+    if (node->case_1 != NULL)
+    {
+      err = optimize_nodes (parse, &(node->case_1), frozen);
+      if (err) return nerr_pass(err);
+    }
+    link = &(node->next);
+  }
 
-  if (val.op_type & (CS_TYPE_VAR | CS_TYPE_STRING))
+  /* Merge the literals once dropping branches has brought them together */
+  for (node = *start; node != NULL; node = node->next)
   {
-    char *s = arg_eval(parse, &val);
-    if (s) result->n = (INT32) ne_crc((unsigned char *)s, strlen(s));
+    if (Commands[node->cmd].parse_handler == literal_parse &&
+        node->arg1.s != NULL)
+    {
+      err = merge_literals (parse, node);
+      if (err) return nerr_pass(err);
+    }
   }
-  if (val.alloc) free(val.s);
   return STATUS_OK;
 }
 
-
-static NEOERR * _builtin_str_find(CSPARSE *parse, CS_FUNCTION *csf, CSARG *args, CSARG *result)
+/* Optimize a complete parse tree: constant expressions are folded, runs of
+ * literals become one node, and with frozen set, an if whose condition
+ * only depends on constants and Config.FrozenPrefixes is replaced with the
+ * branch it takes. */
+static NEOERR *optimize_parse (CSPARSE *parse, int frozen)
 {
   NEOERR *err;
-  char *s = NULL;
-  char *substr = NULL;
-  char *pstr = NULL;
+  CSTREE *node;
 
-  result->op_type = CS_TYPE_NUM;
-  result->n = -1;
+  /* Audit mode keeps the position of every node, and blocks still open
+   * after a parse point into the tree */
+  if (parse->audit_mode || uListLength(parse->stack) != 1)
+    return STATUS_OK;
 
-  err = cs_arg_parse(parse, args, "ss", &s, &substr);
+  err = optimize_nodes (parse, &(parse->tree->next), frozen);
   if (err) return nerr_pass(err);
-  /* If null arguments, return -1 index */
-  if (s == NULL || substr == NULL) {
-    if (s) free(s);
-    if (substr) free(substr);
-    return STATUS_OK;
-  }
-  pstr = strstr(s, substr);
-  if (pstr != NULL) {
-    result->n = (pstr - s) / sizeof(char);
-  }
-  free(s);
-  free(substr);
+
+  /* The last node may have been merged away */
+  for (node = parse->tree; node->next != NULL; node = node->next);
+  parse->current = node;
+  parse->next = &(node->next);
   return STATUS_OK;
 }
 
+/* **** Compiled templates ******************************************** */
 
-static NEOERR * _builtin_name(CSPARSE *parse, CS_FUNCTION *csf, CSARG *args, CSARG *result)
-{
-  NEOERR *err;
-  HDF *obj;
-  CSARG val;
+/* cs_template_init compiles each block of a template's tree into a
+ * linear list of ops, which run_prog runs with a stack of values in
+ * place of the recursive eval_expr.  Expressions are compiled down to
+ * their leaves, except for function calls and the . [] and , operators,
+ * which are left to eval_expr.  The locals of each, loop and with are
+ * kept in the frames of run_prog, and variables which name one of them
+ * are bound to its frame when compiling, instead of being looked up in
+ * parse->locals.  Any other command runs its eval_handler, with its
+ * child blocks compiled as blocks of their own. */
 
-  memset(&val, 0, sizeof(val));
-  err = eval_expr(parse, args, &val);
-  if (err) return nerr_pass(err);
+#define CS_VM_STACK 16    /* values on the stack of one run_prog */
+#define CS_VM_FRAMES 8    /* nested each, loop and with in one block */
 
-  result->op_type = CS_TYPE_STRING;
-  result->s = "";
+typedef enum
+{
+  CSI_END = 0,
+  CSI_NODE,         /* run the eval_handler of node */
+  CSI_LITERAL,      /* output the literal node */
+  CSI_ESCAPE,       /* reset the escaping state before a var or alt whose
+                       expression calls a function */
+  CSI_VAR,          /* output a value, b is set after a CSI_ESCAPE */
+  CSI_ALT,          /* output a value and jump to a if it is true */
+  CSI_IF,           /* jump to a if a value is false */
+  CSI_JUMP,         /* jump to a */
+  CSI_EACH,         /* start frame b on the first child, or jump to a */
+  CSI_EACH_NEXT,    /* move frame b to the next child and jump to a */
+  CSI_WITH,         /* start frame b, or jump to a */
+  CSI_WITH_END,     /* end frame b */
+  CSI_LOOP,         /* start frame b, or jump to a */
+  CSI_LOOP_NEXT,    /* step frame b and jump to a */
+  CSI_SET,          /* set the lvalue to the value */
+  CSI_CALL,         /* call the macro of node with its argument values */
+  CSI_PUSH,         /* push the leaf arg */
+  CSI_PUSH_LOCAL,   /* push the variable arg, the local of frame b */
+  CSI_EXPR,         /* push the value of arg, from eval_expr */
+  CSI_NOT,
+  CSI_EXISTS,
+  CSI_NUM,
+  CSI_NUM_OP,       /* the binary operator a on numbers */
+  CSI_STR_OP,       /* the binary operator a on strings */
+  CSI_BOOL_OP,      /* && and || */
+  CSI_BINARY        /* the binary operator a, typed by its values */
+} CS_OPCODE;
+
+typedef struct _op
+{
+  CS_OPCODE code;
+  int a;
+  int b;
+  CSTREE *node;
+  CSARG *arg;
+} CS_OP;
 
-  if (val.op_type & CS_TYPE_VAR)
-  {
-    obj = var_lookup_obj (parse, val.s);
-    if (obj != NULL)
-      result->s = hdf_obj_name(obj);
-  }
-  else if (val.op_type & CS_TYPE_STRING)
-  {
-    result->s = val.s;
-    result->alloc = val.alloc;
-    val.alloc = 0;
-  }
-  if (val.alloc) free(val.s);
-  return STATUS_OK;
-}
+struct _prog
+{
+  CS_OP *ops;
+  int len;
+};
 
-/* Check to see if a local variable is the first in an each/loop sequence */
-static NEOERR * _builtin_first(CSPARSE *parse, CS_FUNCTION *csf, CSARG *args,
-                               CSARG *result)
+typedef struct _frame
 {
-  NEOERR *err;
-  CS_LOCAL_MAP *map;
-  char *c;
-  CSARG val;
+  CS_LOCAL_MAP map;
+  HDF *child;               /* each */
+  int x, iter, var, step;   /* loop */
+} CS_FRAME;
 
-  memset(&val, 0, sizeof(val));
-  err = eval_expr(parse, args, &val);
-  if (err) return nerr_pass(err);
+typedef struct _compile
+{
+  CSPARSE *parse;
+  CS_OP *ops;
+  int len;
+  int size;
+  int sp;                       /* values on the stack after the ops */
+  int full;                     /* the stack would overflow */
+  int frames;                   /* frames in use */
+  char *names[CS_VM_FRAMES];    /* the name of the local of each frame */
+} CS_COMPILE;
+
+static void dealloc_prog (CS_PROG **prog)
+{
+  if (*prog == NULL) return;
+  free((*prog)->ops);
+  free(*prog);
+  *prog = NULL;
+}
 
-  /* default is "not first" */
-  result->op_type = CS_TYPE_NUM;
-  result->n = 0;
+/* push is the number of values the op leaves on the stack, less the
+ * number it takes off */
+static NEOERR *emit (CS_COMPILE *c, CS_OPCODE code, CSTREE *node, CSARG *arg,
+                     int push)
+{
+  CS_OP *op;
+
+  if (c->len == c->size)
+  {
+    int size = c->size ? c->size * 2 : 32;
+
+    op = (CS_OP *) realloc (c->ops, size * sizeof(CS_OP));
+    if (op == NULL)
+      return nerr_raise (NERR_NOMEM, "Unable to allocate memory for ops");
+    c->ops = op;
+    c->size = size;
+  }
+  op = &(c->ops[c->len++]);
+  op->code = code;
+  op->a = 0;
+  op->b = 0;
+  op->node = node;
+  op->arg = arg;
+  c->sp += push;
+  if (c->sp > CS_VM_STACK) c->full = 1;
+  return STATUS_OK;
+}
 
-  /* Only applies to possible local vars */
-  if ((val.op_type & CS_TYPE_VAR) && !strchr(val.s, '.'))
+static int expr_has_function (CSARG *expr)
+{
+  for (; expr != NULL; expr = expr->next)
   {
-    map = lookup_map (parse, val.s, &c);
-    if (map && map->first)
-      result->n = 1;
+    if (expr->op_type & CS_TYPE_FUNCTION) return 1;
+    if (expr_has_function(expr->expr1) || expr_has_function(expr->expr2))
+      return 1;
   }
-  if (val.alloc) free(val.s);
-  return STATUS_OK;
+  return 0;
 }
 
-/* Check to see if a local variable is the last in an each/loop sequence */
-/* TODO: consider making this work on regular HDF vars */
-static NEOERR * _builtin_last(CSPARSE *parse, CS_FUNCTION *csf, CSARG *args,
-                               CSARG *result)
+/* Leaves the value of expr on the stack.  kind is CS_TYPE_NUM if eval_expr
+ * would give a CS_TYPE_NUM or CS_TYPE_VAR_NUM, CS_TYPE_STRING if it would
+ * give a CS_TYPE_STRING or CS_TYPE_VAR, or 0 if that depends on the values */
+static NEOERR *compile_expr (CS_COMPILE *c, CSARG *expr, int *kind)
 {
   NEOERR *err;
-  CS_LOCAL_MAP *map;
-  char *c;
-  CSARG val;
-
-  memset(&val, 0, sizeof(val));
-  err = eval_expr(parse, args, &val);
-  if (err) return nerr_pass(err);
+  CSTOKEN_TYPE op = expr->op_type;
+  int x, kind1, kind2;
+  CS_OPCODE code;
 
-  /* default is "not last" */
-  result->op_type = CS_TYPE_NUM;
-  result->n = 0;
-
-  /* Only applies to possible local vars */
-  if ((val.op_type & CS_TYPE_VAR) && !strchr(val.s, '.'))
+  if (op & CS_TYPES)
   {
-    map = lookup_map (parse, val.s, &c);
-    if (map) {
-      if (map->last) {
-        result->n = 1;
-      } else if (map->type == CS_TYPE_VAR) {
-        if (hdf_obj_next(map->h) == NULL) {
-          result->n = 1;
+    *kind = (op & (CS_TYPE_NUM | CS_TYPE_VAR_NUM)) ? CS_TYPE_NUM :
+                                                     CS_TYPE_STRING;
+    if (op == CS_TYPE_VAR)
+    {
+      /* the innermost frame with this local, no other locals can be
+       * added between it and the ops of its body */
+      for (x = c->frames - 1; x >= 0; x--)
+      {
+        if (name_match(c->names[x], expr->s))
+        {
+          err = emit(c, CSI_PUSH_LOCAL, NULL, expr, 1);
+          if (err) return nerr_pass(err);
+          c->ops[c->len - 1].b = x;
+          return STATUS_OK;
         }
       }
     }
+    return nerr_pass(emit(c, CSI_PUSH, NULL, expr, 1));
   }
-  if (val.alloc) free(val.s);
-  return STATUS_OK;
-}
-
-/* returns the absolute value (ie, positive) of a number */
-static NEOERR * _builtin_abs (CSPARSE *parse, CS_FUNCTION *csf, CSARG *args,
-                              CSARG *result)
-{
-  NEOERR *err;
-  int n1 = 0;
-  CSARG val;
-
-  memset(&val, 0, sizeof(val));
-  err = eval_expr(parse, args, &val);
-  if (err) return nerr_pass(err);
-
-  result->op_type = CS_TYPE_NUM;
-  n1 = arg_eval_num(parse, &val);
-  result->n = abs(n1);
-
-  if (val.alloc) free(val.s);
-  return STATUS_OK;
-}
-
-/* returns the larger or two integers */
-static NEOERR * _builtin_max (CSPARSE *parse, CS_FUNCTION *csf, CSARG *args,
-                              CSARG *result)
-{
-  NEOERR *err;
-  long int n1 = 0;
-  long int n2 = 0;
-
-  result->op_type = CS_TYPE_NUM;
-  result->n = 0;
-
-  err = cs_arg_parse(parse, args, "ii", &n1, &n2);
-  if (err) return nerr_pass(err);
-  result->n = (n1 > n2) ? n1 : n2;
-
-  return STATUS_OK;
+  if (op == CS_OP_LPAREN && expr->expr1 != NULL)
+    return nerr_pass(compile_expr(c, expr->expr1, kind));
+  if ((op == CS_OP_NOT || op == CS_OP_EXISTS || op == CS_OP_NUM) &&
+      expr->expr1 != NULL)
+  {
+    err = compile_expr(c, expr->expr1, &kind1);
+    if (err) return nerr_pass(err);
+    *kind = CS_TYPE_NUM;
+    code = (op == CS_OP_NOT) ? CSI_NOT :
+           (op == CS_OP_EXISTS) ? CSI_EXISTS : CSI_NUM;
+    return nerr_pass(emit(c, code, NULL, expr, 0));
+  }
+  if ((op & (CS_OP_EQUAL | CS_OP_NEQUAL | CS_OP_ADD | NUM_OPS)) &&
+      !(op & (op - 1)) && expr->expr1 != NULL && expr->expr2 != NULL)
+  {
+    err = compile_expr(c, expr->expr1, &kind1);
+    if (err) return nerr_pass(err);
+    err = compile_expr(c, expr->expr2, &kind2);
+    if (err) return nerr_pass(err);
+    /* the same choice as eval_expr, made here if the types are known */
+    *kind = CS_TYPE_NUM;
+    if (op & (CS_OP_AND | CS_OP_OR))
+      code = CSI_BOOL_OP;
+    else if (kind1 == CS_TYPE_NUM || kind2 == CS_TYPE_NUM || (op & NUM_OPS))
+      code = CSI_NUM_OP;
+    else if (kind1 == CS_TYPE_STRING && kind2 == CS_TYPE_STRING)
+    {
+      code = CSI_STR_OP;
+      if (op == CS_OP_ADD) *kind = CS_TYPE_STRING;
+    }
+    else
+    {
+      code = CSI_BINARY;
+      if (op == CS_OP_ADD) *kind = 0;
+    }
+    err = emit(c, code, NULL, expr, -1);
+    if (err) return nerr_pass(err);
+    c->ops[c->len - 1].a = op;
+    return STATUS_OK;
+  }
+  /* Functions, the . [] and , operators, and anything eval_expr
+   * complains about */
+  *kind = (op == CS_OP_DOT || op == CS_OP_LBRACKET) ? CS_TYPE_STRING : 0;
+  return nerr_pass(emit(c, CSI_EXPR, NULL, expr, 1));
 }
 
-/* returns the smaller or two integers */
-static NEOERR * _builtin_min (CSPARSE *parse, CS_FUNCTION *csf, CSARG *args,
-                              CSARG *result)
-{
-  NEOERR *err;
-  long int n1 = 0;
-  long int n2 = 0;
-
-  result->op_type = CS_TYPE_NUM;
-  result->n = 0;
-
-  err = cs_arg_parse(parse, args, "ii", &n1, &n2);
-  if (err) return nerr_pass(err);
-  result->n = (n1 < n2) ? n1 : n2;
-
-  return STATUS_OK;
-}
+static NEOERR *compile_prog (CSPARSE *parse, CSTREE *node);
+static NEOERR *compile_block (CS_COMPILE *c, CSTREE *node);
 
-static NEOERR * _builtin_str_slice (CSPARSE *parse, CS_FUNCTION *csf, CSARG *args, CSARG *result)
+static NEOERR *compile_node (CS_COMPILE *c, CSTREE *node)
 {
-  NEOERR *err;
-  char *s = NULL;
-  char *slice;
-  long int b = 0;
-  long int e = 0;
-  size_t len;
-
-  result->op_type = CS_TYPE_STRING;
-  result->s = "";
+  NEOERR *err = STATUS_OK;
+  NEOERR* (*eval)(CSPARSE *, CSTREE *, CSTREE **);
+  CSARG *carg;
+  int start = c->len;
+  int x, n, kind, escape;
 
-  err = cs_arg_parse(parse, args, "sii", &s, &b, &e);
-  if (err) return nerr_pass(err);
-  /* If null, return empty string */
-  if (s == NULL) return STATUS_OK;
-  len = strlen(s);
-  if (b < 0 && e == 0) e = len;
-  if (b < 0) b += len;
-  if (b < 0) b = 0;
-  if (b > len) b = len;
-  if (e < 0) e += len;
-  if (e < 0) e = 0;
-  if (e > len) e = len;
-  /* Its the whole string */
-  if (b == 0 && e == len)
+  eval = Commands[node->cmd].eval_handler;
+  if (eval == literal_eval)
   {
-    result->s = s;
-    result->alloc = 1;
-    return STATUS_OK;
+    if (node->arg1.s == NULL) return STATUS_OK;
+    return nerr_pass(emit(c, CSI_LITERAL, node, NULL, 0));
   }
-  if (e < b) b = e;
-  if (b == e)
+  if (eval == skip_eval)
   {
-    /* If null, return empty string */
-    free(s);
+    /* def, the macro body is run by call */
+    if (node->case_0 != NULL && !(node->flags & CSF_SHARED))
+      return nerr_pass(compile_prog(c->parse, node->case_0));
     return STATUS_OK;
   }
-  slice = (char *) malloc (sizeof(char) * (e-b+1));
-  if (slice == NULL)
-    return nerr_raise(NERR_NOMEM, "Unable to allocate memory for string slice");
-  strncpy(slice, s + b, e-b);
-  free(s);
-  slice[e-b] = '\0';
-
-  result->s = slice;
-  result->alloc = 1;
-
-  return STATUS_OK;
-}
-
-static NEOERR * _builtin_str_tolower (CSPARSE *parse, CS_FUNCTION *csf, CSARG *args, CSARG *result)
-{
-  NEOERR *err;
-  char *s = NULL;
-
-  result->op_type = CS_TYPE_STRING;
-  result->s = "";
+  if (eval == escape_eval)
+    return nerr_pass(compile_block(c, node->case_0));
 
-  err = cs_arg_parse(parse, args, "s", &s);
+  do
+  {
+    if (eval == var_eval || eval == alt_eval)
+    {
+      escape = expr_has_function(&(node->arg1));
+      if (escape)
+      {
+        err = emit(c, CSI_ESCAPE, node, NULL, 0);
+        if (err) break;
+      }
+      err = compile_expr(c, &(node->arg1), &kind);
+      if (err || c->full) break;
+      err = emit(c, (eval == var_eval) ? CSI_VAR : CSI_ALT, node, NULL, -1);
+      if (err) break;
+      x = c->len - 1;
+      c->ops[x].b = escape;
+      if (eval == alt_eval)
+      {
+        err = compile_block(c, node->case_0);
+        if (err) break;
+        c->ops[x].a = c->len;
+      }
+      return STATUS_OK;
+    }
+    if (eval == if_eval)
+    {
+      err = compile_expr(c, &(node->arg1), &kind);
+      if (err || c->full) break;
+      err = emit(c, CSI_IF, node, NULL, -1);
+      if (err) break;
+      x = c->len - 1;
+      err = compile_block(c, node->case_0);
+      if (err) break;
+      if (node->case_1 != NULL)
+      {
+        err = emit(c, CSI_JUMP, node, NULL, 0);
+        if (err) break;
+        c->ops[x].a = c->len;
+        x = c->len - 1;
+        err = compile_block(c, node->case_1);
+        if (err) break;
+      }
+      c->ops[x].a = c->len;
+      return STATUS_OK;
+    }
+    if ((eval == each_eval || eval == with_eval || eval == loop_eval) &&
+        c->frames < CS_VM_FRAMES)
+    {
+      if (eval == loop_eval)
+      {
+        /* the loop arguments are numbers, evaluated in order */
+        for (n = 0, carg = node->vargs; carg != NULL; n++, carg = carg->next)
+        {
+          err = compile_expr(c, carg, &kind);
+          if (err) break;
+          err = emit(c, CSI_NUM, node, NULL, 0);
+          if (err) break;
+        }
+        if (err || c->full || n < 1 || n > 3) break;
+        err = emit(c, CSI_LOOP, node, NULL, -n);
+      }
+      else
+      {
+        err = compile_expr(c, &(node->arg2), &kind);
+        if (err || c->full) break;
+        err = emit(c, (eval == each_eval) ? CSI_EACH : CSI_WITH,
+                   node, NULL, -1);
+      }
+      if (err) break;
+      x = c->len - 1;
+      c->ops[x].b = c->frames;
+      c->names[c->frames++] = node->arg1.s;
+      err = compile_block(c, node->case_0);
+      c->frames--;
+      if (err) break;
+      err = emit(c, (eval == each_eval) ? CSI_EACH_NEXT :
+                    (eval == loop_eval) ? CSI_LOOP_NEXT : CSI_WITH_END,
+                 node, NULL, 0);
+      if (err) break;
+      c->ops[c->len - 1].a = x + 1;
+      c->ops[c->len - 1].b = c->frames;
+      c->ops[x].a = c->len;
+      return STATUS_OK;
+    }
+    if (eval == set_eval)
+    {
+      err = compile_expr(c, &(node->arg1), &kind);
+      if (err) break;
+      err = compile_expr(c, &(node->arg2), &kind);
+      if (err || c->full) break;
+      return nerr_pass(emit(c, CSI_SET, node, NULL, -2));
+    }
+    if (eval == call_eval)
+    {
+      for (n = 0, carg = node->vargs; carg != NULL; n++, carg = carg->next)
+      {
+        err = compile_expr(c, carg, &kind);
+        if (err) break;
+      }
+      if (err || c->full || n != node->arg1.macro->n_args) break;
+      return nerr_pass(emit(c, CSI_CALL, node, NULL, -n));
+    }
+  } while (0);
   if (err) return nerr_pass(err);
-  /* If null, return empty string */
-  if (s == NULL) return STATUS_OK;
-
-  neos_lower(s);
-  result->s = s;
-  result->alloc = 1;
 
+  /* Everything else, or the above if they don't fit on the stack */
+  c->len = start;
+  c->sp = 0;
+  c->full = 0;
+  err = emit(c, CSI_NODE, node, NULL, 0);
+  if (err) return nerr_pass(err);
+  if (node->case_0 != NULL && !(node->flags & CSF_SHARED))
+  {
+    err = compile_prog(c->parse, node->case_0);
+    if (err) return nerr_pass(err);
+  }
+  if (node->case_1 != NULL)
+  {
+    err = compile_prog(c->parse, node->case_1);
+    if (err) return nerr_pass(err);
+  }
   return STATUS_OK;
 }
 
-#ifdef ENABLE_GETTEXT
-static NEOERR * _builtin_gettext(CSPARSE *parse, CS_FUNCTION *csf, CSARG *args, CSARG *result)
+static NEOERR *compile_block (CS_COMPILE *c, CSTREE *node)
 {
   NEOERR *err;
-  char *s;
-  CSARG val;
-
-  memset(&val, 0, sizeof(val));
-  err = eval_expr(parse, args, &val);
-  if (err) return nerr_pass(err);
-
-  result->op_type = CS_TYPE_STRING;
-  result->s = "";
 
-  if (val.op_type & (CS_TYPE_VAR | CS_TYPE_STRING))
+  for (; node != NULL; node = node->next)
   {
-    s = arg_eval(parse, &val);
-    if (s)
-    {
-      result->s = gettext(s);
-    }
+    err = compile_node(c, node);
+    if (err) return nerr_pass(err);
   }
-  if (val.alloc) free(val.s);
   return STATUS_OK;
 }
-#endif
 
-static NEOERR * _str_func_wrapper (CSPARSE *parse, CS_FUNCTION *csf, CSARG *args, CSARG *result)
+/* Compiles the block starting at node into node->prog */
+static NEOERR *compile_prog (CSPARSE *parse, CSTREE *node)
 {
   NEOERR *err;
-  char *s;
-  CSARG val;
-
-  memset(&val, 0, sizeof(val));
-  err = eval_expr(parse, args, &val);
-  if (err) return nerr_pass(err);
+  CS_COMPILE c;
+  CS_PROG *prog;
 
-  if (val.op_type & (CS_TYPE_VAR | CS_TYPE_STRING))
+  if (node == NULL) return STATUS_OK;
+  memset(&c, 0, sizeof(c));
+  c.parse = parse;
+  err = compile_block(&c, node);
+  if (err == STATUS_OK)
+    err = emit(&c, CSI_END, NULL, NULL, 0);
+  if (err)
   {
-    result->op_type = CS_TYPE_STRING;
-    result->n = 0;
-
-    s = arg_eval(parse, &val);
-    if (s)
-    {
-      err = csf->str_func(s, &(result->s));
-      if (err) return nerr_pass(err);
-      result->alloc = 1;
-    }
+    free(c.ops);
+    return nerr_pass(err);
   }
-  else
+  prog = (CS_PROG *) calloc (1, sizeof(CS_PROG));
+  if (prog == NULL)
   {
-    result->op_type = val.op_type;
-    result->n = val.n;
-    result->s = val.s;
-    result->alloc = val.alloc;
-    val.alloc = 0;
+    free(c.ops);
+    return nerr_raise (NERR_NOMEM, "Unable to allocate memory for prog");
   }
-  if (val.alloc) free(val.s);
+  prog->ops = c.ops;
+  prog->len = c.len;
+  node->prog = prog;
   return STATUS_OK;
 }
 
-NEOERR *cs_register_strfunc(CSPARSE *parse, char *funcname, CSSTRFUNC str_func)
+/* The value of a stack entry, map is the local it was bound to or NULL */
+static char *vm_eval (CSPARSE *parse, CSARG *arg, CS_LOCAL_MAP *map,
+                      int *escape_status)
 {
-  NEOERR *err;
+  if (map != NULL)
+    return map_var_lookup (parse, map, strchr(arg->s, '.'), ARG_PATH(arg),
+                           escape_status);
+  return arg_eval_with_escape_status (parse, arg, escape_status);
+}
 
-  err = cs_register_function(parse, funcname, 1, _str_func_wrapper);
-  if (err) return nerr_pass(err);
-  parse->functions->str_func = str_func;
+static long int vm_eval_num (CSPARSE *parse, CSARG *arg, CS_LOCAL_MAP *map)
+{
+  char *s;
+  int ignore;
 
-  return STATUS_OK;
+  if (map == NULL) return arg_eval_num (parse, arg);
+  s = vm_eval (parse, arg, map, &ignore);
+  return (s == NULL) ? 0 : atoi(s);
 }
 
-NEOERR *cs_register_esc_strfunc(CSPARSE *parse, char *funcname,
-                                CSSTRFUNC str_func)
+static long int vm_eval_bool (CSPARSE *parse, CSARG *arg, CS_LOCAL_MAP *map)
 {
-  NEOERR *err;
-
-  err = cs_register_strfunc(parse, funcname, str_func);
-  if (err) return nerr_pass(err);
-  parse->functions->escape = NEOS_ESCAPE_FUNCTION;
+  int ignore;
 
-  return STATUS_OK;
+  if (map == NULL) return arg_eval_bool (parse, arg);
+  return str_eval_bool (vm_eval (parse, arg, map, &ignore));
 }
 
-/* **** CS Initialize/Destroy ************************************ */
-NEOERR *cs_init (CSPARSE **parse, HDF *hdf) {
-  return nerr_pass(cs_init_internal(parse, hdf, NULL));
+/* Starts a frame with a local map named after the node */
+static void vm_frame (CSPARSE *parse, CS_FRAME *frame, CSTREE *node,
+                      CSTOKEN_TYPE type)
+{
+  memset(&(frame->map), 0, sizeof(CS_LOCAL_MAP));
+  frame->map.type = type;
+  frame->map.name = node->arg1.s;
+  frame->map.next = parse->locals;
+  parse->locals = &(frame->map);
 }
 
-static NEOERR *cs_init_internal (CSPARSE **parse, HDF *hdf, CSPARSE *parent)
+static NEOERR *run_prog (CSPARSE *parse, CS_PROG *prog)
 {
   NEOERR *err = STATUS_OK;
-  CSPARSE *my_parse;
-  STACK_ENTRY *entry;
-  char *esc_value;
-  CS_ESCAPE_MODES *esc_cursor;
+  CS_OP *op = prog->ops;
+  CSARG stack[CS_VM_STACK];
+  CS_LOCAL_MAP *local[CS_VM_STACK];
+  CS_FRAME frames[CS_VM_FRAMES];
+  CS_LOCAL_MAP *locals = parse->locals;
+  CS_FRAME *frame;
+  CSTREE *next;
+  CSARG *v, *v2, *carg;
+  HDF *var;
+  char *s1, *s2;
+  int escape_status1, escape_status2;
+  int sp = 0, top = 0;
+  int x, start, end, step, t;
+  long int n;
 
-  err = nerr_init();
-  if (err != STATUS_OK) return nerr_pass (err);
+  while (err == STATUS_OK)
+  {
+    switch (op->code)
+    {
+      case CSI_END:
+        return STATUS_OK;
 
-  my_parse = (CSPARSE *) calloc (1, sizeof (CSPARSE));
-  if (my_parse == NULL)
-    return nerr_raise (NERR_NOMEM, "Unable to allocate memory for CSPARSE");
+      case CSI_NODE:
+        err = (*(Commands[op->node->cmd].eval_handler))(parse, op->node,
+                                                         &next);
+        op++;
+        break;
 
-  err = uListInit (&(my_parse->stack), 10, 0);
-  if (err != STATUS_OK)
+      case CSI_LITERAL:
+        if (op->node->do_autoescape == 1)
+          err = literal_eval (parse, op->node, &next);
+        else
+          err = parse->output_cb (parse->output_ctx, op->node->arg1.s);
+        op++;
+        break;
+
+      case CSI_ESCAPE:
+        parse->escaping.current = NEOS_ESCAPE_UNDEF;
+        op++;
+        break;
+
+      case CSI_VAR:
+        v = &stack[--sp];
+        if (!op->b) parse->escaping.current = NEOS_ESCAPE_UNDEF;
+        err = var_eval_helper (parse, op->node, v, local[sp],
+                               op->node->arg1.argexpr);
+        if (v->alloc) free(v->s);
+        op++;
+        break;
+
+      case CSI_ALT:
+        v = &stack[--sp];
+        if (!op->b) parse->escaping.current = NEOS_ESCAPE_UNDEF;
+        t = vm_eval_bool (parse, v, local[sp]);
+        if (t)
+          err = var_eval_helper (parse, op->node, v, local[sp],
+                                 op->node->arg1.argexpr);
+        if (v->alloc) free(v->s);
+        op = t ? prog->ops + op->a : op + 1;
+        break;
+
+      case CSI_IF:
+        v = &stack[--sp];
+        t = vm_eval_bool (parse, v, local[sp]);
+        if (v->alloc) free(v->s);
+        op = t ? op + 1 : prog->ops + op->a;
+        break;
+
+      case CSI_JUMP:
+        op = prog->ops + op->a;
+        break;
+
+      case CSI_EACH:
+      case CSI_WITH:
+        v = &stack[--sp];
+        var = NULL;
+        if (v->op_type == CS_TYPE_VAR)
+        {
+          /* var_lookup_obj, starting from the local v was bound to */
+          scoped_var_lookup_or_create_obj (parse, v->s, ARG_PATH(v), FALSE,
+              local[sp] ? local[sp] : parse->locals, &var);
+        }
+        else if (op->code == CSI_WITH)
+        {
+          ne_warn("Invalid op_type for with: %s",
+                  expand_token_type(v->op_type, 1));
+        }
+        frame = &frames[op->b];
+        if (var != NULL && op->code == CSI_EACH)
+          var = hdf_obj_peek_child (var);
+        if (var == NULL)
+        {
+          if (v->alloc) free(v->s);
+          op = prog->ops + op->a;
+          break;
+        }
+        vm_frame (parse, frame, op->node, CS_TYPE_VAR);
+        top++;
+        frame->map.h = var;
+        /* Setting a dummy value. The real escape status is part of the
+           hdf node and will be read from there */
+        frame->map.escape_status = CS_ES_UNTRUSTED;
+        /* The frame keeps the name to look the node up again (see
+           map_obj) */
+        frame->map.s = v->s;
+        frame->map.map_alloc = v->alloc;
+        frame->map.next_scope = local[sp] ? local[sp] : frame->map.next;
+        if (op->code == CSI_EACH)
+        {
+          frame->child = var;
+          frame->map.is_child = 1;
+          frame->map.first = 1;
+        }
+        op++;
+        break;
+
+      case CSI_EACH_NEXT:
+        frame = &frames[op->b];
+        frame->map.first = 0;
+        frame->child = hdf_obj_next (frame->child);
+        if (frame->child != NULL)
+        {
+          frame->map.h = frame->child;
+          frame->map.escape_status = CS_ES_UNTRUSTED;
+          op = prog->ops + op->a;
+          break;
+        }
+        if (frame->map.map_alloc) free(frame->map.s);
+        parse->locals = frame->map.next;
+        top--;
+        op++;
+        break;
+
+      case CSI_WITH_END:
+        frame = &frames[op->b];
+        if (frame->map.map_alloc) free(frame->map.s);
+        parse->locals = frame->map.next;
+        top--;
+        op++;
+        break;
+
+      case CSI_LOOP:
+        /* the same as loop_eval, the arguments are already numbers */
+        for (x = 0, carg = op->node->vargs; carg != NULL; carg = carg->next)
+          x++;
+        sp -= x;
+        start = 0;
+        end = stack[sp].n;
+        step = 1;
+        if (x > 1)
+        {
+          start = end;
+          end = stack[sp + 1].n;
+        }
+        if (x > 2) step = stack[sp + 2].n;
+        if (((step < 0) && (start < end)) ||
+            ((step > 0) && (end < start)) || step == 0)
+          t = 0;
+        else
+          t = abs((end - start) / step + 1);
+        if (t <= 0)
+        {
+          op = prog->ops + op->a;
+          break;
+        }
+        frame = &frames[op->b];
+        vm_frame (parse, frame, op->node, CS_TYPE_NUM);
+        top++;
+        frame->map.next_scope = frame->map.next;
+        frame->map.first = 1;
+        frame->iter = t;
+        frame->step = step;
+        frame->x = 0;
+        frame->var = start;
+        if (frame->iter == 1) frame->map.last = 1;
+        frame->map.n = start;
+        /* Loop arguments are always numerical. In keeping with our
+           convention, set escape_status TRUSTED */
+        frame->map.escape_status = CS_ES_TRUSTED;
+        op++;
+        break;
+
+      case CSI_LOOP_NEXT:
+        frame = &frames[op->b];
+        if (frame->map.map_alloc) {
+          free(frame->map.s);
+          frame->map.s = NULL;
+        }
+        frame->map.first = 0;
+        frame->x++;
+        frame->var += frame->step;
+        if (frame->x < frame->iter)
+        {
+          if (frame->x == frame->iter - 1) frame->map.last = 1;
+          frame->map.n = frame->var;
+          frame->map.escape_status = CS_ES_TRUSTED;
+          op = prog->ops + op->a;
+          break;
+        }
+        parse->locals = frame->map.next;
+        top--;
+        op++;
+        break;
+
+      case CSI_SET:
+        sp -= 2;
+        err = set_eval_value (parse, &stack[sp], &stack[sp + 1]);
+        op++;
+        break;
+
+      case CSI_CALL:
+        sp -= op->node->arg1.macro->n_args;
+        err = call_macro (parse, op->node->arg1.macro, op->node->vargs,
+                          op->node->escape, &stack[sp], NULL);
+        op++;
+        break;
+
+      case CSI_PUSH:
+      case CSI_PUSH_LOCAL:
+        /* the same as a leaf in eval_expr */
+        v = &stack[sp];
+        *v = *(op->arg);
+        if (v->op_type & (CS_TYPE_STRING | CS_TYPE_NUM | CS_TYPE_VAR_NUM))
+          v->escape_status = CS_ES_TRUSTED;
+        v->alloc = 0;
+        local[sp++] = (op->code == CSI_PUSH_LOCAL) ? &(frames[op->b].map) :
+                                                     NULL;
+        op++;
+        break;
+
+      case CSI_EXPR:
+        err = eval_expr (parse, op->arg, &stack[sp]);
+        if (err) break;
+        local[sp++] = NULL;
+        op++;
+        break;
+
+      case CSI_NOT:
+      case CSI_EXISTS:
+      case CSI_NUM:
+        v = &stack[sp - 1];
+        if (op->code == CSI_NOT)
+          n = vm_eval_bool (parse, v, local[sp - 1]) ? 0 : 1;
+        else if (op->code == CSI_NUM)
+          n = vm_eval_num (parse, v, local[sp - 1]);
+        else if (v->op_type & (CS_TYPE_VAR | CS_TYPE_VAR_NUM))
+          n = (vm_eval (parse, v, local[sp - 1], &escape_status1) != NULL);
+        else
+          n = 1; /* All numbers/strings exist */
+        if (v->alloc) free(v->s);
+        memset(v, 0, sizeof(CSARG));
+        v->op_type = CS_TYPE_NUM;
+        v->escape_status = CS_ES_TRUSTED;
+        v->n = n;
+        local[sp - 1] = NULL;
+        op++;
+        break;
+
+      case CSI_NUM_OP:
+      case CSI_STR_OP:
+      case CSI_BOOL_OP:
+      case CSI_BINARY:
+        {
+          CSARG result;
+          CS_OPCODE code = op->code;
+
+          sp--;
+          v = &stack[sp - 1];
+          v2 = &stack[sp];
+          memset(&result, 0, sizeof(CSARG));
+          if (code == CSI_BINARY)
+          {
+            if (op->a & (CS_OP_AND | CS_OP_OR))
+              code = CSI_BOOL_OP;
+            else if ((v->op_type & (CS_TYPE_NUM | CS_TYPE_VAR_NUM)) ||
+                     (v2->op_type & (CS_TYPE_NUM | CS_TYPE_VAR_NUM)))
+              code = CSI_NUM_OP;
+            else
+              code = CSI_STR_OP;
+          }
+          if (code == CSI_NUM_OP)
+          {
+            eval_num_op (vm_eval_num (parse, v, local[sp - 1]),
+                         vm_eval_num (parse, v2, local[sp]), op->a, &result);
+          }
+          else if (code == CSI_BOOL_OP)
+          {
+            eval_bool_op (vm_eval_bool (parse, v, local[sp - 1]),
+                          vm_eval_bool (parse, v2, local[sp]), op->a,
+                          &result);
+          }
+          else
+          {
+            s1 = vm_eval (parse, v, local[sp - 1], &escape_status1);
+            s2 = vm_eval (parse, v2, local[sp], &escape_status2);
+            err = eval_string_op (v, s1, escape_status1, v2, s2,
+                                  escape_status2, op->a, &result);
+          }
+          if (v->alloc) free(v->s);
+          if (v2->alloc) free(v2->s);
+          *v = result;
+          local[sp - 1] = NULL;
+          op++;
+        }
+        break;
+
+      default:
+        err = nerr_raise (NERR_ASSERT, "Unknown op %d", op->code);
+        break;
+    }
+  }
+
+  /* Unwind after an error */
+  while (sp > 0)
   {
-    free(my_parse);
-    return nerr_pass(err);
+    sp--;
+    if (stack[sp].alloc) free(stack[sp].s);
   }
-  err = uListInit (&(my_parse->alloc), 10, 0);
-  if (err != STATUS_OK)
+  while (top > 0)
   {
-    free(my_parse);
-    return nerr_pass(err);
+    top--;
+    if (frames[top].map.map_alloc) free(frames[top].map.s);
   }
-  err = alloc_node (&(my_parse->tree), my_parse);
-  if (err != STATUS_OK)
+  parse->locals = locals;
+  return nerr_pass(err);
+}
+
+/* **** Templates ******************************************** */
+
+NEOERR *cs_template_init (CS_TEMPLATE **tmpl, CSPARSE **parse)
+{
+  NEOERR *err;
+  CS_TEMPLATE *my_tmpl;
+  CSPARSE *my_parse = *parse;
+
+  *tmpl = NULL;
+  if (my_parse == NULL || my_parse->tree == NULL)
+    return nerr_raise (NERR_ASSERT, "No parse tree exists");
+  if (my_parse->parent != NULL)
+    return nerr_raise (NERR_ASSERT,
+        "Unable to create a template from an internal parse context");
+
+  err = compile_prog (my_parse, my_parse->tree);
+  if (err) return nerr_pass(err);
+
+  my_tmpl = (CS_TEMPLATE *) calloc (1, sizeof (CS_TEMPLATE));
+  if (my_tmpl == NULL)
+    return nerr_raise (NERR_NOMEM, "Unable to allocate memory for CS_TEMPLATE");
+
+  /* The auto escape parser state is per render, the template never
+   * renders using its own parse context */
+  if (my_parse->auto_ctx.parser_ctx)
+    neos_auto_destroy(&(my_parse->auto_ctx.parser_ctx));
+
+  my_tmpl->parse = my_parse;
+  my_tmpl->refcount = 1;
+  *parse = NULL;
+  *tmpl = my_tmpl;
+  return STATUS_OK;
+}
+
+static NEOERR *copy_file_list (ULIST **dest, ULIST *src)
+{
+  NEOERR *err;
+  char *name;
+  int x;
+
+  *dest = NULL;
+  err = uListInit(dest, uListLength(src) + 10, 0);
+  if (err) return nerr_pass(err);
+  for (x = 0; x < uListLength(src); x++)
   {
-    cs_destroy (&my_parse);
+    uListGet(src, x, (void *)&name);
+    name = strdup(name);
+    if (name == NULL)
+    {
+      err = nerr_raise (NERR_NOMEM, "Unable to allocate memory for file list");
+      break;
+    }
+    err = uListAppend(*dest, name);
+    if (err)
+    {
+      free(name);
+      break;
+    }
+  }
+  if (err) uListDestroy(dest, ULIST_FREE);
+  return nerr_pass(err);
+}
+
+/* Sets up a render context for the parse tree owned by parse.  The render
+ * context is a shallow copy which shares the tree, macros and functions
+ * with the template, and only owns the state which eval modifies: the
+ * hdf, the locals, the output callback and the escaping state.  None of
+ * the parse-time only structures are available to it. */
+static void cs_render_ctx_init (CSPARSE *ctx, CSPARSE *parse, HDF *hdf)
+{
+  *ctx = *parse;
+
+  ctx->hdf = hdf;
+  ctx->stack = NULL;
+  ctx->alloc = NULL;
+  ctx->err_list = NULL;
+  ctx->current = NULL;
+  ctx->next = NULL;
+
+  ctx->locals = NULL;
+  ctx->call_frames = NULL;
+  ctx->stack_depth = 0;
+  ctx->escaping.current = NEOS_ESCAPE_UNDEF;
+  ctx->escaping.when_undef = NEOS_ESCAPE_UNDEF;
+
+  ctx->output_ctx = NULL;
+  ctx->output_cb = NULL;
+  ctx->auto_ctx.parser_ctx = NULL;
+}
+
+NEOERR *cs_template_render (CS_TEMPLATE *tmpl, HDF *hdf, void *ctx,
+                            CSOUTFUNC cb)
+{
+  NEOERR *err = STATUS_OK;
+  CSPARSE render;
+
+  if (tmpl == NULL || tmpl->parse == NULL)
+    return nerr_raise (NERR_ASSERT, "No parse tree exists");
+
+  cs_render_ctx_init(&render, tmpl->parse, hdf);
+
+  do
+  {
+    if (render.auto_ctx.global_enabled == 1)
+    {
+      err = neos_auto_init(&(render.auto_ctx.parser_ctx));
+      if (err) break;
+    }
+    /* lvar and linclude add their names to the file list, so each
+     * render needs its own copy */
+    if (render.auto_ctx.log_changes)
+    {
+      err = copy_file_list(&(render.file_list), tmpl->parse->file_list);
+      if (err) break;
+    }
+
+    if (tmpl->module != NULL)
+    {
+      render.output_ctx = ctx;
+      render.output_cb = cb;
+      err = tmpl->module->render(&AotApi, &render);
+      break;
+    }
+    err = cs_render_internal(&render, ctx, cb);
+  } while (0);
+
+  if (render.auto_ctx.parser_ctx)
+    neos_auto_destroy(&(render.auto_ctx.parser_ctx));
+  if (render.auto_ctx.log_changes)
+    uListDestroy(&(render.file_list), ULIST_FREE);
+  call_frames_destroy(&(render.call_frames));
+
+  return nerr_pass(err);
+}
+
+void cs_template_destroy (CS_TEMPLATE **tmpl)
+{
+  CS_TEMPLATE *my_tmpl = *tmpl;
+  int refcount;
+
+  if (my_tmpl == NULL)
+    return;
+  *tmpl = NULL;
+
+  /* References can be held by other threads via the template cache */
+  cache_lock();
+  refcount = --(my_tmpl->refcount);
+  cache_unlock();
+  if (refcount > 0)
+    return;
+
+  cs_destroy(&(my_tmpl->parse));
+  if (my_tmpl->key) free(my_tmpl->key);
+  if (my_tmpl->path) free(my_tmpl->path);
+  free(my_tmpl);
+}
+
+/* **** Template Cache ******************************************** */
+
+static NE_HASH *TemplateCache = NULL;
+/* The CS_AOT_MODULEs by the path of their template, which are never
+ * unloaded */
+static NE_HASH *TemplateModules = NULL;
+#ifdef HAVE_PTHREADS
+static pthread_mutex_t TemplateCacheLock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static void cache_lock (void)
+{
+#ifdef HAVE_PTHREADS
+  NEOERR *err = mLock(&TemplateCacheLock);
+  if (err != STATUS_OK) nerr_log_error(err);
+  nerr_ignore(&err);
+#endif
+}
+
+static void cache_unlock (void)
+{
+#ifdef HAVE_PTHREADS
+  NEOERR *err = mUnlock(&TemplateCacheLock);
+  if (err != STATUS_OK) nerr_log_error(err);
+  nerr_ignore(&err);
+#endif
+}
+
+/* Must be called with the cache lock held */
+static int template_is_current (CS_TEMPLATE *tmpl, time_t now, int interval)
+{
+  CS_TEMPLATE *include;
+  CS_FILE_STAT *fs;
+  struct stat st;
+  int x;
+
+  if (interval > 0 && now - tmpl->checked < interval)
+    return 1;
+
+  for (x = 0; x < uListLength(tmpl->parse->cache_files); x++)
+  {
+    uListGet(tmpl->parse->cache_files, x, (void *)&fs);
+    if (stat(fs->path, &st) == -1)
+      return 0;
+    if (st.st_mtime != fs->mtime || st.st_size != fs->size ||
+        st.st_ino != fs->ino || st.st_dev != fs->dev)
+      return 0;
+  }
+
+  if (tmpl->parse->includes != NULL)
+  {
+    for (x = 0; x < uListLength(tmpl->parse->includes); x++)
+    {
+      uListGet(tmpl->parse->includes, x, (void *)&include);
+      if (!template_is_current(include, now, interval))
+        return 0;
+    }
+  }
+  tmpl->checked = now;
+  return 1;
+}
+
+/* The settings which change how a file is parsed, see cache_key */
+static char *cache_settings_alloc (const char *tag, NEOS_ESCAPE escape,
+                                   int auto_escape, int propagate,
+                                   const char *frozen)
+{
+  return sprintf_alloc("%s:%d:%d:%d:%s", tag, escape, auto_escape, propagate,
+                       frozen ? frozen : "");
+}
+
+/* Everything which changes how the file is parsed is part of the key:
+ * the parse settings from Config, or if this is an include, the settings
+ * and escape context of the including parse at the include. */
+static NEOERR *cache_settings (char **settings, CSPARSE *includer, HDF *hdf)
+{
+  STACK_ENTRY *entry;
+  CS_ESCAPE_MODES *esc_cursor;
+  char *esc_value;
+  const char *tag;
+  const char *frozen;
+  NEOS_ESCAPE escape;
+  int auto_escape, propagate;
+  NEOERR *err;
+
+  *settings = NULL;
+  if (includer != NULL)
+  {
+    err = uListGet(includer->stack, -1, (void *)&entry);
+    if (err) return nerr_pass(err);
+    tag = includer->tag;
+    escape = entry->escape;
+    auto_escape = includer->auto_ctx.enabled;
+    propagate = includer->auto_ctx.propagate_status;
+    frozen = includer->frozen;
+  }
+  else
+  {
+    tag = hdf_get_value(hdf, "Config.TagStart", "cs");
+    esc_value = hdf_get_value(hdf, "Config.VarEscapeMode", EscapeModes[0].mode);
+    escape = NEOS_ESCAPE_UNDEF;
+    for (esc_cursor = &EscapeModes[0];
+         esc_cursor->mode != NULL;
+         esc_cursor++)
+    {
+      if (!strcmp(esc_value, esc_cursor->mode))
+      {
+        escape = esc_cursor->context;
+        break;
+      }
+    }
+    auto_escape = hdf_get_int_value(hdf, "Config.AutoEscape", 0);
+    propagate = auto_escape ?
+        hdf_get_int_value(hdf, "Config.PropagateEscapeStatus", 0) : 0;
+    frozen = hdf_get_value(hdf, "Config.FrozenPrefixes", NULL);
+  }
+
+  *settings = cache_settings_alloc(tag, escape, auto_escape, propagate,
+                                   frozen);
+  if (*settings == NULL)
+    return nerr_raise (NERR_NOMEM, "Unable to allocate template settings");
+  return STATUS_OK;
+}
+
+static NEOERR *cache_key (char **key, const char *settings, const char *path,
+                          CSINITFUNC init_cb)
+{
+  *key = sprintf_alloc("%s:%p:%s", settings, (void *)init_cb, path);
+  if (*key == NULL)
+    return nerr_raise (NERR_NOMEM, "Unable to allocate template cache key");
+  return STATUS_OK;
+}
+
+/* Sets up a new parse for the cache, with the tag of includer if this is
+ * an include */
+static NEOERR *cache_parse_init (CSPARSE *parse, CSPARSE *includer,
+                                 CSINITFUNC init_cb)
+{
+  NEOERR *err;
+  char *tag;
+
+  parse->cached = 1;
+  parse->cache_init = init_cb;
+  err = uListInit(&(parse->cache_files), 10, 0);
+  if (err) return nerr_pass(err);
+
+  /* The tag is otherwise owned by the hdf, which the template outlives */
+  tag = strdup(includer ? includer->tag : parse->tag);
+  if (tag == NULL)
+    return nerr_raise (NERR_NOMEM, "Unable to allocate memory for tag");
+  err = uListAppend(parse->alloc, tag);
+  if (err)
+  {
+    free(tag);
     return nerr_pass(err);
   }
-  my_parse->current = my_parse->tree;
-  my_parse->next = &(my_parse->current->next);
+  parse->tag = tag;
+  parse->taglen = strlen(tag);
+
+  if (init_cb != NULL)
+  {
+    err = init_cb(parse);
+    if (err) return nerr_pass(err);
+  }
+  return STATUS_OK;
+}
+
+/* Parse a template for the cache.  The CSPARSE for an include is set up to
+ * look like the including parse at the point of the include. */
+static NEOERR *cache_parse (CS_TEMPLATE **tmpl, CSPARSE *includer, HDF *hdf,
+                            const char *path, CSINITFUNC init_cb)
+{
+  NEOERR *err;
+  CSPARSE *parse = NULL;
+  STACK_ENTRY *entry, *inc_entry;
+
+  *tmpl = NULL;
+  err = cs_init_internal(&parse, hdf, NULL);
+  if (err) return nerr_pass(err);
+
+  do
+  {
+    err = cache_parse_init(parse, includer, init_cb);
+    if (err) break;
+    /* We can't tell when the content from a fileload changes */
+    if (parse->fileload != NULL)
+      parse->dynamic = 1;
+
+    if (includer != NULL)
+    {
+      err = uListGet(includer->stack, -1, (void *)&inc_entry);
+      if (err) break;
+      err = uListGet(parse->stack, 0, (void *)&entry);
+      if (err) break;
+      entry->escape = inc_entry->escape;
+      parse->escaping.next_stack = inc_entry->escape;
+      parse->stack_depth = includer->stack_depth;
+      parse->audit_mode = includer->audit_mode;
+      parse->auto_ctx.global_enabled = includer->auto_ctx.global_enabled;
+      parse->auto_ctx.enabled = includer->auto_ctx.enabled;
+      parse->auto_ctx.propagate_status = includer->auto_ctx.propagate_status;
+      err = cs_parse_file_internal(parse, path);
+      /* The include is rendered within the scope of the includer, where
+       * a local could hide a frozen name */
+      if (err == STATUS_OK)
+        err = optimize_parse(parse, 0);
+    }
+    else
+    {
+      err = cs_parse_file(parse, path);
+    }
+    if (err) break;
+
+    /* Neither can be cached, since they depend on the including parse */
+    if (parse->audit_mode || parse->auto_ctx.log_changes)
+      parse->dynamic = 1;
+
+    /* The hdf is only valid for this call */
+    parse->hdf = NULL;
+    err = cs_template_init(tmpl, &parse);
+  } while (0);
+
+  cs_destroy(&parse);
+  return nerr_pass(err);
+}
+
+/* Sets up a template for the module loaded for path, if there is one
+ * which was compiled with settings, from files which haven't changed
+ * since, and which only calls functions init_cb registers.  Otherwise
+ * tmpl is left NULL, and the file is parsed as usual. */
+static NEOERR *cache_module (CS_TEMPLATE **tmpl, HDF *hdf, const char *path,
+                             const char *settings, CSINITFUNC init_cb)
+{
+  NEOERR *err;
+  const CS_AOT_MODULE *module = NULL;
+  const CS_AOT_FILE *file;
+  CS_FILE_STAT *fs;
+  CSPARSE *parse = NULL;
+  CS_TEMPLATE *my_tmpl;
+  int x;
+
+  *tmpl = NULL;
+  cache_lock();
+  if (TemplateModules != NULL)
+    module = (const CS_AOT_MODULE *) ne_hash_lookup(TemplateModules,
+                                                    (void *) path);
+  cache_unlock();
+  if (module == NULL || strcmp(module->settings, settings))
+    return STATUS_OK;
+
+  err = cs_init_internal(&parse, hdf, NULL);
+  if (err) return nerr_pass(err);
+
+  do
+  {
+    err = cache_parse_init(parse, NULL, init_cb);
+    if (err) break;
+    /* The module was compiled from the files on disk */
+    if (parse->fileload != NULL)
+      break;
+    for (x = 0; module->functions[x] != NULL; x++)
+    {
+      if (lookup_function(parse, module->functions[x]) == NULL)
+        break;
+    }
+    if (module->functions[x] != NULL)
+      break;
+    for (file = module->files; file->path != NULL; file++)
+    {
+      /* A missing file is left for the parse to report */
+      err = cache_add_file(parse, file->path);
+      if (err)
+      {
+        nerr_ignore(&err);
+        break;
+      }
+      uListGet(parse->cache_files, -1, (void *)&fs);
+      if (fs->mtime != file->mtime || fs->size != file->size)
+        break;
+    }
+    if (file->path != NULL)
+      break;
+
+    my_tmpl = (CS_TEMPLATE *) calloc (1, sizeof (CS_TEMPLATE));
+    if (my_tmpl == NULL)
+    {
+      err = nerr_raise (NERR_NOMEM, "Unable to allocate memory for CS_TEMPLATE");
+      break;
+    }
+    /* The hdf is only valid for this call */
+    parse->hdf = NULL;
+    my_tmpl->parse = parse;
+    my_tmpl->module = module;
+    my_tmpl->refcount = 1;
+    parse = NULL;
+    *tmpl = my_tmpl;
+  } while (0);
+
+  cs_destroy(&parse);
+  return nerr_pass(err);
+}
+
+static NEOERR *cache_get (CS_TEMPLATE **tmpl, CSPARSE *includer, HDF *hdf,
+                          const char *path, CSINITFUNC init_cb)
+{
+  NEOERR *err;
+  CS_TEMPLATE *my_tmpl = NULL;
+  CS_TEMPLATE *old = NULL;
+  char fpath[PATH_BUF_SIZE];
+  char *settings = NULL;
+  char *key = NULL;
+  time_t now;
+  int interval;
+
+  *tmpl = NULL;
+  if (path == NULL)
+    return nerr_raise (NERR_ASSERT, "path is NULL");
+
+  if (path[0] != '/')
+  {
+    err = hdf_search_path (hdf, path, fpath, PATH_BUF_SIZE);
+    if (err) return nerr_pass(err);
+    path = fpath;
+  }
+  err = cache_settings(&settings, includer, hdf);
+  if (err) return nerr_pass(err);
+  err = cache_key(&key, settings, path, init_cb);
+  if (err)
+  {
+    free(settings);
+    return nerr_pass(err);
+  }
+
+  now = time(NULL);
+  interval = hdf_get_int_value(hdf, "Config.TemplateCacheCheckInterval", 0);
+
+  cache_lock();
+  if (TemplateCache == NULL)
+  {
+    err = ne_hash_init(&TemplateCache, ne_hash_str_hash, ne_hash_str_comp);
+  }
+  if (err == STATUS_OK)
+  {
+    my_tmpl = (CS_TEMPLATE *) ne_hash_lookup(TemplateCache, key);
+    if (my_tmpl != NULL)
+    {
+      if (template_is_current(my_tmpl, now, interval))
+      {
+        my_tmpl->refcount++;
+      }
+      else
+      {
+        ne_hash_remove(TemplateCache, key);
+        old = my_tmpl;
+        my_tmpl = NULL;
+      }
+    }
+  }
+  cache_unlock();
+  /* Drop the cache reference to the stale version */
+  cs_template_destroy(&old);
+  if (err != STATUS_OK || my_tmpl != NULL)
+  {
+    free(settings);
+    free(key);
+    *tmpl = my_tmpl;
+    return nerr_pass(err);
+  }
+
+  /* Parse outside of the lock, includes will call back in here */
+  if (includer == NULL)
+    err = cache_module(&my_tmpl, hdf, path, settings, init_cb);
+  free(settings);
+  if (err == STATUS_OK && my_tmpl == NULL)
+    err = cache_parse(&my_tmpl, includer, hdf, path, init_cb);
+  if (err)
+  {
+    free(key);
+    return nerr_pass(err);
+  }
+  my_tmpl->path = strdup(path);
+  if (my_tmpl->path == NULL)
+  {
+    free(key);
+    cs_template_destroy(&my_tmpl);
+    return nerr_raise (NERR_NOMEM, "Unable to allocate memory for path");
+  }
+  my_tmpl->checked = now;
+
+  if (my_tmpl->parse->dynamic)
+  {
+    free(key);
+    *tmpl = my_tmpl;
+    return STATUS_OK;
+  }
+
+  cache_lock();
+  /* Someone else may have parsed it in the meantime, we just replace it */
+  old = (CS_TEMPLATE *) ne_hash_remove(TemplateCache, key);
+  if (old != NULL)
+  {
+    free(key);
+    key = old->key;
+    old->key = NULL;
+  }
+  err = ne_hash_insert(TemplateCache, key, my_tmpl);
+  if (err == STATUS_OK)
+  {
+    my_tmpl->key = key;
+    my_tmpl->refcount++;
+  }
+  else if (old == NULL)
+  {
+    free(key);
+  }
+  cache_unlock();
+  cs_template_destroy(&old);
+
+  *tmpl = my_tmpl;
+  return nerr_pass(err);
+}
+
+/* The templates parsed by lvar and linclude, by the key from
+ * lvar_cache_get, in a list from the most to the least recently used */
+typedef struct _lvar_cache_entry
+{
+  CS_TEMPLATE *tmpl;
+  struct _lvar_cache_entry *prev;
+  struct _lvar_cache_entry *next;
+} LVAR_CACHE_ENTRY;
+
+static NE_HASH *LvarCache = NULL;
+static LVAR_CACHE_ENTRY *LvarCacheHead = NULL;
+static LVAR_CACHE_ENTRY *LvarCacheTail = NULL;
+
+/* Must be called with the cache lock held */
+static void lvar_cache_unlink (LVAR_CACHE_ENTRY *entry)
+{
+  if (entry->prev) entry->prev->next = entry->next;
+  else LvarCacheHead = entry->next;
+  if (entry->next) entry->next->prev = entry->prev;
+  else LvarCacheTail = entry->prev;
+  entry->prev = entry->next = NULL;
+}
+
+/* Must be called with the cache lock held */
+static void lvar_cache_link (LVAR_CACHE_ENTRY *entry)
+{
+  entry->prev = NULL;
+  entry->next = LvarCacheHead;
+  if (LvarCacheHead) LvarCacheHead->prev = entry;
+  else LvarCacheTail = entry;
+  LvarCacheHead = entry;
+}
+
+/* Looks up the template for the lvar (kind "lvar", s is the value) or
+ * linclude (kind "linclude", s is the path) at node.  Everything which
+ * changes how s is parsed is part of the key.  If there is no template,
+ * *key is left for lvar_cache_add, unless the parse can't be cached:
+ * when the cache is off, the parse records where each node came from,
+ * or a CSFILELOAD loads the files. */
+static NEOERR *lvar_cache_get (CSPARSE *parse, CSTREE *node, const char *kind,
+                               const char *s, char **key, CS_TEMPLATE **tmpl)
+{
+  NEOERR *err;
+  LVAR_CACHE_ENTRY *entry = NULL;
+  CS_TEMPLATE *stale = NULL;
+  char fpath[PATH_BUF_SIZE];
+  time_t now;
+  int interval;
+
+  *key = NULL;
+  *tmpl = NULL;
+  if (hdf_get_int_value(parse->hdf, "Config.LvarCacheSize", 100) <= 0 ||
+      parse->audit_mode || parse->auto_ctx.log_changes ||
+      parse->fileload != NULL)
+    return STATUS_OK;
+
+  /* A missing file is left for the parse to report */
+  if (!strcmp(kind, "linclude") && s[0] != '/')
+  {
+    err = hdf_search_path (parse->hdf, s, fpath, PATH_BUF_SIZE);
+    if (parse->global_hdf && nerr_handle(&err, NERR_NOT_FOUND))
+      err = hdf_search_path(parse->global_hdf, s, fpath, PATH_BUF_SIZE);
+    if (nerr_handle(&err, NERR_NOT_FOUND))
+      return STATUS_OK;
+    if (err) return nerr_pass(err);
+    s = fpath;
+  }
+
+  *key = sprintf_alloc("%s:%s:%d:%d:%d:%d:%s:%s",
+      hdf_get_value(parse->hdf, "Config.TagStart", "cs"),
+      hdf_get_value(parse->hdf, "Config.VarEscapeMode", EscapeModes[0].mode),
+      node->escape, parse->auto_ctx.global_enabled, parse->auto_ctx.enabled,
+      parse->auto_ctx.propagate_status, kind, s);
+  if (*key == NULL)
+    return nerr_raise (NERR_NOMEM, "Unable to allocate %s cache key", kind);
+
+  now = time(NULL);
+  interval = hdf_get_int_value(parse->hdf, "Config.TemplateCacheCheckInterval",
+                               0);
+
+  cache_lock();
+  if (LvarCache != NULL)
+    entry = (LVAR_CACHE_ENTRY *) ne_hash_lookup(LvarCache, *key);
+  if (entry != NULL)
+  {
+    lvar_cache_unlink(entry);
+    if (template_is_current(entry->tmpl, now, interval))
+    {
+      lvar_cache_link(entry);
+      entry->tmpl->refcount++;
+      *tmpl = entry->tmpl;
+    }
+    else
+    {
+      ne_hash_remove(LvarCache, *key);
+      stale = entry->tmpl;
+      free(entry);
+    }
+  }
+  cache_unlock();
+  cs_template_destroy(&stale);
+
+  if (*tmpl != NULL)
+  {
+    free(*key);
+    *key = NULL;
+  }
+  return STATUS_OK;
+}
+
+/* The functions of the parse a template is rendered from are only known
+ * by name */
+static void unbind_functions (CSARG *arg)
+{
+  for (; arg != NULL; arg = arg->next)
+  {
+    if (arg->op_type & CS_TYPE_FUNCTION)
+      arg->function = NULL;
+    unbind_functions(arg->expr1);
+    unbind_functions(arg->expr2);
+  }
+}
+
+static void unbind_tree (CSTREE *node)
+{
+  for (; node != NULL; node = node->next)
+  {
+    unbind_functions(&(node->arg1));
+    unbind_functions(&(node->arg2));
+    unbind_functions(node->vargs);
+    if (!(node->flags & CSF_SHARED))
+      unbind_tree(node->case_0);
+    unbind_tree(node->case_1);
+  }
+}
+
+/* Turns the parse cs of an lvar or linclude, set up with cache_parse_init,
+ * into a template, and adds it to the cache under *key.  The least
+ * recently used templates beyond Config.LvarCacheSize are dropped.  If
+ * the parse depends on the hdf, *tmpl is left NULL and cs is rendered as
+ * usual. */
+static NEOERR *lvar_cache_add (CSPARSE *parse, char **key, CSPARSE **cs,
+                               CS_TEMPLATE **tmpl)
+{
+  NEOERR *err;
+  CSPARSE *my_cs = *cs;
+  CS_TEMPLATE *my_tmpl = NULL;
+  LVAR_CACHE_ENTRY *entry, *last, *evicted = NULL;
+  int size;
+
+  *tmpl = NULL;
+  if (my_cs->dynamic)
+    return STATUS_OK;
+
+  /* The includes of cs are rendered within the scope of the lvar */
+  err = optimize_parse(my_cs, 0);
+  if (err) return nerr_pass(err);
+
+  /* Everything cs borrowed from parse */
+  unbind_tree(my_cs->tree);
+  my_cs->parent = NULL;
+  my_cs->functions = NULL;
+  my_cs->locals = NULL;
+  my_cs->hdf = NULL;
+  my_cs->global_hdf = NULL;
+  my_cs->file_list = NULL;
+  my_cs->auto_ctx.parser_ctx = NULL;
+
+  entry = (LVAR_CACHE_ENTRY *) calloc (1, sizeof (LVAR_CACHE_ENTRY));
+  if (entry == NULL)
+    return nerr_raise (NERR_NOMEM, "Unable to allocate memory for cache entry");
+  err = cs_template_init(&my_tmpl, cs);
+  if (err)
+  {
+    free(entry);
+    return nerr_pass(err);
+  }
+  my_tmpl->key = *key;
+  *key = NULL;
+  my_tmpl->checked = time(NULL);
+  entry->tmpl = my_tmpl;
+  size = hdf_get_int_value(parse->hdf, "Config.LvarCacheSize", 100);
+
+  cache_lock();
+  if (LvarCache == NULL)
+    err = ne_hash_init(&LvarCache, ne_hash_str_hash, ne_hash_str_comp);
+  if (err == STATUS_OK)
+  {
+    /* Someone else may have parsed it in the meantime, we replace it */
+    evicted = (LVAR_CACHE_ENTRY *) ne_hash_remove(LvarCache, my_tmpl->key);
+    if (evicted != NULL)
+      lvar_cache_unlink(evicted);
+    err = ne_hash_insert(LvarCache, my_tmpl->key, entry);
+  }
+  if (err == STATUS_OK)
+  {
+    lvar_cache_link(entry);
+    my_tmpl->refcount++;
+    entry = NULL;
+    while (LvarCache->num > (UINT32) size)
+    {
+      last = LvarCacheTail;
+      ne_hash_remove(LvarCache, last->tmpl->key);
+      lvar_cache_unlink(last);
+      last->next = evicted;
+      evicted = last;
+    }
+  }
+  cache_unlock();
+
+  if (err) free(entry);
+  /* The dropped entries are chained through next once unlinked */
+  while (evicted != NULL)
+  {
+    last = evicted;
+    evicted = last->next;
+    cs_template_destroy(&(last->tmpl));
+    free(last);
+  }
+
+  *tmpl = my_tmpl;
+  return nerr_pass(err);
+}
+
+/* Renders the cached template of an lvar or linclude within parse, the
+ * way a parse made by cs_init_internal(&cs, parse->hdf, parse) would */
+static NEOERR *lvar_cache_render (CSPARSE *parse, CS_TEMPLATE *tmpl)
+{
+  CSPARSE render;
+
+  cs_render_ctx_init(&render, tmpl->parse, parse->hdf);
+  render.parent = parse;
+  render.functions = parse->functions;
+  render.global_hdf = parse->global_hdf;
+  render.fileload = parse->fileload;
+  render.fileload_ctx = parse->fileload_ctx;
+  render.locals = parse->locals;
+  render.stack_depth = parse->stack_depth;
+  render.file_list = parse->file_list;
+  render.cur_file_idx = parse->cur_file_idx;
+  render.auto_ctx.parser_ctx = parse->auto_ctx.parser_ctx;
+
+  return nerr_pass(cs_render_internal(&render, parse->output_ctx,
+                                      parse->output_cb));
+}
+
+NEOERR *cs_template_cache_get (CS_TEMPLATE **tmpl, HDF *hdf, const char *path,
+                               CSINITFUNC init_cb)
+{
+  NEOERR *err;
+
+  err = nerr_init();
+  if (err != STATUS_OK) return nerr_pass (err);
+
+  return nerr_pass(cache_get(tmpl, NULL, hdf, path, init_cb));
+}
+
+void cs_template_cache_clear (void)
+{
+  CS_TEMPLATE *tmpl;
+  LVAR_CACHE_ENTRY *entry;
+  ULIST *templates = NULL;
+  void *key;
+  NEOERR *err;
+
+  err = uListInit(&templates, 10, 0);
+  if (err)
+  {
+    nerr_log_error(err);
+    nerr_ignore(&err);
+    return;
+  }
+
+  cache_lock();
+  if (TemplateCache != NULL)
+  {
+    key = NULL;
+    while ((tmpl = (CS_TEMPLATE *) ne_hash_next(TemplateCache, &key)) != NULL)
+    {
+      err = uListAppend(templates, tmpl);
+      if (err) break;
+    }
+    if (err == STATUS_OK)
+      ne_hash_destroy(&TemplateCache);
+  }
+  while (err == STATUS_OK && LvarCacheHead != NULL)
+  {
+    entry = LvarCacheHead;
+    err = uListAppend(templates, entry->tmpl);
+    if (err) break;
+    lvar_cache_unlink(entry);
+    free(entry);
+  }
+  if (err == STATUS_OK)
+    ne_hash_destroy(&LvarCache);
+  cache_unlock();
+
+  if (err)
+  {
+    nerr_log_error(err);
+    nerr_ignore(&err);
+  }
+  else
+  {
+    while (uListLength(templates))
+    {
+      uListPop(templates, (void *)&tmpl);
+      cs_template_destroy(&tmpl);
+    }
+  }
+  uListDestroy(&templates, 0);
+}
+
+/* **** Template Modules ******************************************** */
+
+/* The library side of the code cs_dump_c writes, which the module only
+ * reaches through AotApi */
+
+static NEOERR *aot_write (CSPARSE *parse, const char *s)
+{
+  return nerr_pass(parse->output_cb(parse->output_ctx, (char *) s));
+}
+
+/* A node with the little the eval handlers read from a node which isn't
+ * part of a tree */
+static void aot_node_init (CSTREE *node, int cmd, int flags,
+                           NEOS_ESCAPE escape)
+{
+  memset(node, 0, sizeof(CSTREE));
+  node->cmd = cmd;
+  node->flags = flags;
+  node->escape = escape;
+  node->file_idx = -1;
+}
+
+static NEOERR *aot_output (CSPARSE *parse, CSARG *val, NEOS_ESCAPE escape)
+{
+  CSTREE node;
+
+  aot_node_init(&node, 0, 0, escape);
+  return nerr_pass(var_eval_helper(parse, &node, val, NULL, NULL));
+}
+
+static NEOERR *aot_node (CSPARSE *parse, int cmd, int flags,
+                         NEOS_ESCAPE escape, CSARG *arg1, CSARG *arg2)
+{
+  CSTREE node, *next;
+
+  if (cmd < 0 || cmd >= (int) (sizeof(Commands) / sizeof(Commands[0])) - 1)
+    return nerr_raise (NERR_ASSERT, "Invalid command %d in compiled template",
+                       cmd);
+  aot_node_init(&node, cmd, flags, escape);
+  if (arg1 != NULL) node.arg1 = *arg1;
+  if (arg2 != NULL) node.arg2 = *arg2;
+  return nerr_pass((*(Commands[cmd].eval_handler))(parse, &node, &next));
+}
+
+static NEOERR *aot_call (CSPARSE *parse, CS_MACRO *macro, CSARG *args,
+                         NEOS_ESCAPE escape, CS_AOT_BLOCK body)
+{
+  if (body == NULL)
+    return nerr_raise (NERR_ASSERT, "No body for macro %s", macro->name);
+  return nerr_pass(call_macro(parse, macro, args, escape, NULL, body));
+}
+
+static long int aot_str_bool (const char *s)
+{
+  return str_eval_bool((char *) s);
+}
+
+/* As the string == of eval_string_op */
+static int aot_str_equal (const char *a, const char *b)
+{
+  if (a == NULL || b == NULL)
+    return a == b;
+  return !strcmp(a, b);
+}
+
+static char *aot_lookup (CSPARSE *parse, const char *name)
+{
+  int ignore;
+
+  return var_lookup(parse, (char *) name, NULL, &ignore);
+}
+
+static long int aot_lookup_num (CSPARSE *parse, const char *name)
+{
+  return var_int_lookup_path(parse, (char *) name, NULL);
+}
+
+static HDF *aot_lookup_obj (CSPARSE *parse, const char *name)
+{
+  return var_lookup_obj(parse, (char *) name, NULL);
+}
+
+static const CS_AOT_API AotApi = {
+  aot_write,
+  aot_output,
+  aot_node,
+  aot_call,
+  eval_expr,
+  arg_eval_bool,
+  arg_eval_num,
+  aot_str_bool,
+  aot_str_equal,
+  aot_lookup,
+  aot_lookup_num,
+  aot_lookup_obj,
+  hdf_obj_peek_child,
+  hdf_obj_next
+};
+
+NEOERR *cs_template_cache_load (const char *path)
+{
+#ifdef HAVE_DLOPEN
+  NEOERR *err;
+  const CS_AOT_MODULE *module;
+  void *handle;
+
+  err = nerr_init();
+  if (err != STATUS_OK) return nerr_pass (err);
+
+  handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+  if (handle == NULL)
+    return nerr_raise (NERR_IO, "Unable to load %s: %s", path, dlerror());
+  module = (const CS_AOT_MODULE *) dlsym(handle, "cs_module");
+  if (module == NULL)
+  {
+    dlclose(handle);
+    return nerr_raise (NERR_ASSERT, "%s is not a compiled template", path);
+  }
+  if (module->version != CS_AOT_VERSION)
+  {
+    dlclose(handle);
+    return nerr_raise (NERR_ASSERT,
+        "%s is compiled template version %d, expected version %d", path,
+        module->version, CS_AOT_VERSION);
+  }
+
+  /* A template still in the cache may be rendering with a module loaded
+   * earlier for the same path, so none are ever closed */
+  cache_lock();
+  if (TemplateModules == NULL)
+    err = ne_hash_init(&TemplateModules, ne_hash_str_hash, ne_hash_str_comp);
+  if (err == STATUS_OK)
+    err = ne_hash_insert(TemplateModules, (void *) module->path,
+                         (void *) module);
+  cache_unlock();
+  return nerr_pass(err);
+#else
+  return nerr_raise (NERR_ASSERT,
+      "Unable to load %s, compiled templates aren't supported", path);
+#endif
+}
+
+/* **** Functions ******************************************** */
+
+NEOERR *cs_register_function(CSPARSE *parse, const char *funcname,
+                                  int n_args, CSFUNCTION function)
+{
+  CS_FUNCTION *csf;
+
+  /* Should we validate the parseability of the name? */
+
+  csf = parse->functions;
+  while (csf != NULL)
+  {
+    if (!strcmp(csf->name, funcname) && csf->function != function)
+    {
+      return nerr_raise(NERR_DUPLICATE,
+	  "Attempt to register duplicate function %s", funcname);
+    }
+    csf = csf->next;
+  }
+  csf = (CS_FUNCTION *) calloc (1, sizeof(CS_FUNCTION));
+  if (csf == NULL)
+    return nerr_raise(NERR_NOMEM,
+	"Unable to allocate memory to register function %s", funcname);
+  csf->name = strdup(funcname);
+  if (csf->name == NULL)
+  {
+    free(csf);
+    return nerr_raise(NERR_NOMEM,
+	"Unable to allocate memory to register function %s", funcname);
+  }
+  csf->function = function;
+  csf->n_args = n_args;
+  csf->escape = NEOS_ESCAPE_UNDEF;
+  csf->next = parse->functions;
+  parse->functions = csf;
+
+  return STATUS_OK;
+}
+
+NEOERR *cs_register_esc_function(CSPARSE *parse, const char *funcname,
+                                 int n_args, CSFUNCTION function)
+{
+  NEOERR *err;
+
+  err = cs_register_function(parse, funcname, n_args, function);
+  if (err) return nerr_pass(err);
+  parse->functions->escape = NEOS_ESCAPE_FUNCTION;
+
+  return STATUS_OK;
+}
+
+/* This is similar to python's PyArg_ParseTuple, :
+ *   s - string (allocated)
+ *   i - int
+ *   A - arg ptr (maybe later)
+ */
+NEOERR * cs_arg_parsev(CSPARSE *parse, CSARG *args, const char *fmt,
+                       va_list ap)
+{
+  NEOERR *err = STATUS_OK;
+  char **s;
+  long int *i;
+  CSARG val;
+
+  while (*fmt)
+  {
+    memset(&val, 0, sizeof(val));
+    err = eval_expr(parse, args, &val);
+    if (err) return nerr_pass(err);
+
+    switch (*fmt)
+    {
+      case 's':
+	s = va_arg(ap, char **);
+	if (s == NULL)
+	{
+	  err = nerr_raise(NERR_ASSERT,
+	      "Invalid number of arguments in call to cs_arg_parse");
+	  break;
+	}
+	*s = arg_eval_str_alloc(parse, &val);
+	break;
+      case 'i':
+	i = va_arg(ap, long int *);
+	if (i == NULL)
+	{
+	  err = nerr_raise(NERR_ASSERT,
+	      "Invalid number of arguments in call to cs_arg_parse");
+	  break;
+	}
+	*i = arg_eval_num(parse, &val);
+	break;
+      default:
+	break;
+    }
+    if (err) return nerr_pass(err);
+    fmt++;
+    args = args->next;
+    if (val.alloc) free(val.s);
+  }
+  if (err) return nerr_pass(err);
+  return STATUS_OK;
+}
+
+NEOERR * cs_arg_parse(CSPARSE *parse, CSARG *args, const char *fmt, ...)
+{
+  NEOERR *err;
+  va_list ap;
+
+  va_start(ap, fmt);
+  err = cs_arg_parsev(parse, args, fmt, ap);
+  va_end(ap);
+  return nerr_pass(err);
+}
+
+static NEOERR * _builtin_subcount(CSPARSE *parse, CS_FUNCTION *csf, CSARG *args, CSARG *result)
+{
+  NEOERR *err;
+  HDF *obj;
+  int count = 0;
+  CSARG val;
+
+  memset(&val, 0, sizeof(val));
+  err = eval_expr(parse, args, &val);
+  if (err) return nerr_pass(err);
+
+  /* default for non-vars is 0 children */
+  result->op_type = CS_TYPE_NUM;
+  result->n = 0;
+
+  if (val.op_type & CS_TYPE_VAR)
+  {
+    obj = var_lookup_obj (parse, val.s, ARG_PATH(&val));
+    if (obj != NULL)
+    {
+      obj = hdf_obj_peek_child(obj);
+      while (obj != NULL)
+      {
+	count++;
+	obj = hdf_obj_next(obj);
+      }
+    }
+    result->n = count;
+  }
+  if (val.alloc) free(val.s);
+
+  return STATUS_OK;
+}
+
+static NEOERR * _builtin_str_length(CSPARSE *parse, CS_FUNCTION *csf, CSARG *args, CSARG *result)
+{
+  NEOERR *err;
+  CSARG val;
+
+  memset(&val, 0, sizeof(val));
+  err = eval_expr(parse, args, &val);
+  if (err) return nerr_pass(err);
+
+  /* non var/string objects have 0 length */
+  result->op_type = CS_TYPE_NUM;
+  result->n = 0;
+
+  if (val.op_type & (CS_TYPE_VAR | CS_TYPE_STRING))
+  {
+    char *s = arg_eval(parse, &val);
+    if (s) result->n = strlen(s);
+  }
+  if (val.alloc) free(val.s);
+  return STATUS_OK;
+}
+
+static NEOERR * _builtin_str_crc(CSPARSE *parse, CS_FUNCTION *csf, CSARG *args,
+                                 CSARG *result)
+{
+  NEOERR *err;
+  CSARG val;
+
+  memset(&val, 0, sizeof(val));
+  err = eval_expr(parse, args, &val);
+  if (err) return nerr_pass(err);
+
+  /* non var/string objects have 0 length */
+  result->op_type = CS_TYPE_NUM;
+  result->n = 0;
+
+  if (val.op_type & (CS_TYPE_VAR | CS_TYPE_STRING))
+  {
+    char *s = arg_eval(parse, &val);
+    if (s) result->n = (INT32) ne_crc((unsigned char *)s, strlen(s));
+  }
+  if (val.alloc) free(val.s);
+  return STATUS_OK;
+}
+
+
+static NEOERR * _builtin_str_find(CSPARSE *parse, CS_FUNCTION *csf, CSARG *args, CSARG *result)
+{
+  NEOERR *err;
+  char *s = NULL;
+  char *substr = NULL;
+  char *pstr = NULL;
+
+  result->op_type = CS_TYPE_NUM;
+  result->n = -1;
+
+  err = cs_arg_parse(parse, args, "ss", &s, &substr);
+  if (err) return nerr_pass(err);
+  /* If null arguments, return -1 index */
+  if (s == NULL || substr == NULL) {
+    if (s) free(s);
+    if (substr) free(substr);
+    return STATUS_OK;
+  }
+  pstr = strstr(s, substr);
+  if (pstr != NULL) {
+    result->n = (pstr - s) / sizeof(char);
+  }
+  free(s);
+  free(substr);
+  return STATUS_OK;
+}
+
+
+static NEOERR * _builtin_name(CSPARSE *parse, CS_FUNCTION *csf, CSARG *args, CSARG *result)
+{
+  NEOERR *err;
+  HDF *obj;
+  CSARG val;
+
+  memset(&val, 0, sizeof(val));
+  err = eval_expr(parse, args, &val);
+  if (err) return nerr_pass(err);
+
+  result->op_type = CS_TYPE_STRING;
+  result->s = "";
+
+  if (val.op_type & CS_TYPE_VAR)
+  {
+    obj = var_lookup_obj (parse, val.s, ARG_PATH(&val));
+    if (obj != NULL)
+      result->s = hdf_obj_name(obj);
+  }
+  else if (val.op_type & CS_TYPE_STRING)
+  {
+    result->s = val.s;
+    result->alloc = val.alloc;
+    val.alloc = 0;
+  }
+  if (val.alloc) free(val.s);
+  return STATUS_OK;
+}
+
+/* Check to see if a local variable is the first in an each/loop sequence */
+static NEOERR * _builtin_first(CSPARSE *parse, CS_FUNCTION *csf, CSARG *args,
+                               CSARG *result)
+{
+  NEOERR *err;
+  CS_LOCAL_MAP *map;
+  char *c;
+  CSARG val;
+
+  memset(&val, 0, sizeof(val));
+  err = eval_expr(parse, args, &val);
+  if (err) return nerr_pass(err);
+
+  /* default is "not first" */
+  result->op_type = CS_TYPE_NUM;
+  result->n = 0;
+
+  /* Only applies to possible local vars */
+  if ((val.op_type & CS_TYPE_VAR) && !strchr(val.s, '.'))
+  {
+    map = lookup_map (parse, val.s, &c);
+    if (map && map->first)
+      result->n = 1;
+  }
+  if (val.alloc) free(val.s);
+  return STATUS_OK;
+}
+
+/* Check to see if a local variable is the last in an each/loop sequence */
+/* TODO: consider making this work on regular HDF vars */
+static NEOERR * _builtin_last(CSPARSE *parse, CS_FUNCTION *csf, CSARG *args,
+                               CSARG *result)
+{
+  NEOERR *err;
+  CS_LOCAL_MAP *map;
+  char *c;
+  CSARG val;
+
+  memset(&val, 0, sizeof(val));
+  err = eval_expr(parse, args, &val);
+  if (err) return nerr_pass(err);
+
+  /* default is "not last" */
+  result->op_type = CS_TYPE_NUM;
+  result->n = 0;
+
+  /* Only applies to possible local vars */
+  if ((val.op_type & CS_TYPE_VAR) && !strchr(val.s, '.'))
+  {
+    map = lookup_map (parse, val.s, &c);
+    if (map) {
+      if (map->last) {
+        result->n = 1;
+      } else if (map->type == CS_TYPE_VAR) {
+        if (hdf_obj_next(map->h) == NULL) {
+          result->n = 1;
+        }
+      }
+    }
+  }
+  if (val.alloc) free(val.s);
+  return STATUS_OK;
+}
+
+/* returns the absolute value (ie, positive) of a number */
+static NEOERR * _builtin_abs (CSPARSE *parse, CS_FUNCTION *csf, CSARG *args,
+                              CSARG *result)
+{
+  NEOERR *err;
+  int n1 = 0;
+  CSARG val;
+
+  memset(&val, 0, sizeof(val));
+  err = eval_expr(parse, args, &val);
+  if (err) return nerr_pass(err);
+
+  result->op_type = CS_TYPE_NUM;
+  n1 = arg_eval_num(parse, &val);
+  result->n = abs(n1);
+
+  if (val.alloc) free(val.s);
+  return STATUS_OK;
+}
+
+/* returns the larger or two integers */
+static NEOERR * _builtin_max (CSPARSE *parse, CS_FUNCTION *csf, CSARG *args,
+                              CSARG *result)
+{
+  NEOERR *err;
+  long int n1 = 0;
+  long int n2 = 0;
+
+  result->op_type = CS_TYPE_NUM;
+  result->n = 0;
+
+  err = cs_arg_parse(parse, args, "ii", &n1, &n2);
+  if (err) return nerr_pass(err);
+  result->n = (n1 > n2) ? n1 : n2;
+
+  return STATUS_OK;
+}
+
+/* returns the smaller or two integers */
+static NEOERR * _builtin_min (CSPARSE *parse, CS_FUNCTION *csf, CSARG *args,
+                              CSARG *result)
+{
+  NEOERR *err;
+  long int n1 = 0;
+  long int n2 = 0;
+
+  result->op_type = CS_TYPE_NUM;
+  result->n = 0;
+
+  err = cs_arg_parse(parse, args, "ii", &n1, &n2);
+  if (err) return nerr_pass(err);
+  result->n = (n1 < n2) ? n1 : n2;
+
+  return STATUS_OK;
+}
+
+static NEOERR * _builtin_str_slice (CSPARSE *parse, CS_FUNCTION *csf, CSARG *args, CSARG *result)
+{
+  NEOERR *err;
+  char *s = NULL;
+  char *slice;
+  long int b = 0;
+  long int e = 0;
+  size_t len;
+
+  result->op_type = CS_TYPE_STRING;
+  result->s = "";
+
+  err = cs_arg_parse(parse, args, "sii", &s, &b, &e);
+  if (err) return nerr_pass(err);
+  /* If null, return empty string */
+  if (s == NULL) return STATUS_OK;
+  len = strlen(s);
+  if (b < 0 && e == 0) e = len;
+  if (b < 0) b += len;
+  if (b < 0) b = 0;
+  if (b > len) b = len;
+  if (e < 0) e += len;
+  if (e < 0) e = 0;
+  if (e > len) e = len;
+  /* Its the whole string */
+  if (b == 0 && e == len)
+  {
+    result->s = s;
+    result->alloc = 1;
+    return STATUS_OK;
+  }
+  if (e < b) b = e;
+  if (b == e)
+  {
+    /* If null, return empty string */
+    free(s);
+    return STATUS_OK;
+  }
+  slice = (char *) malloc (sizeof(char) * (e-b+1));
+  if (slice == NULL)
+    return nerr_raise(NERR_NOMEM, "Unable to allocate memory for string slice");
+  strncpy(slice, s + b, e-b);
+  free(s);
+  slice[e-b] = '\0';
+
+  result->s = slice;
+  result->alloc = 1;
+
+  return STATUS_OK;
+}
+
+static NEOERR * _builtin_str_tolower (CSPARSE *parse, CS_FUNCTION *csf, CSARG *args, CSARG *result)
+{
+  NEOERR *err;
+  char *s = NULL;
+
+  result->op_type = CS_TYPE_STRING;
+  result->s = "";
+
+  err = cs_arg_parse(parse, args, "s", &s);
+  if (err) return nerr_pass(err);
+  /* If null, return empty string */
+  if (s == NULL) return STATUS_OK;
+
+  neos_lower(s);
+  result->s = s;
+  result->alloc = 1;
+
+  return STATUS_OK;
+}
+
+#ifdef ENABLE_GETTEXT
+static NEOERR * _builtin_gettext(CSPARSE *parse, CS_FUNCTION *csf, CSARG *args, CSARG *result)
+{
+  NEOERR *err;
+  char *s;
+  CSARG val;
+
+  memset(&val, 0, sizeof(val));
+  err = eval_expr(parse, args, &val);
+  if (err) return nerr_pass(err);
+
+  result->op_type = CS_TYPE_STRING;
+  result->s = "";
+
+  if (val.op_type & (CS_TYPE_VAR | CS_TYPE_STRING))
+  {
+    s = arg_eval(parse, &val);
+    if (s)
+    {
+      result->s = gettext(s);
+    }
+  }
+  if (val.alloc) free(val.s);
+  return STATUS_OK;
+}
+#endif
+
+static NEOERR * _str_func_wrapper (CSPARSE *parse, CS_FUNCTION *csf, CSARG *args, CSARG *result)
+{
+  NEOERR *err;
+  char *s;
+  CSARG val;
+
+  memset(&val, 0, sizeof(val));
+  err = eval_expr(parse, args, &val);
+  if (err) return nerr_pass(err);
+
+  if (val.op_type & (CS_TYPE_VAR | CS_TYPE_STRING))
+  {
+    result->op_type = CS_TYPE_STRING;
+    result->n = 0;
+
+    s = arg_eval(parse, &val);
+    if (s)
+    {
+      err = csf->str_func(s, &(result->s));
+      if (err) return nerr_pass(err);
+      result->alloc = 1;
+    }
+  }
+  else
+  {
+    result->op_type = val.op_type;
+    result->n = val.n;
+    result->s = val.s;
+    result->alloc = val.alloc;
+    val.alloc = 0;
+  }
+  if (val.alloc) free(val.s);
+  return STATUS_OK;
+}
+
+NEOERR *cs_register_strfunc(CSPARSE *parse, char *funcname, CSSTRFUNC str_func)
+{
+  NEOERR *err;
+
+  err = cs_register_function(parse, funcname, 1, _str_func_wrapper);
+  if (err) return nerr_pass(err);
+  parse->functions->str_func = str_func;
+
+  return STATUS_OK;
+}
+
+NEOERR *cs_register_esc_strfunc(CSPARSE *parse, char *funcname,
+                                CSSTRFUNC str_func)
+{
+  NEOERR *err;
+
+  err = cs_register_strfunc(parse, funcname, str_func);
+  if (err) return nerr_pass(err);
+  parse->functions->escape = NEOS_ESCAPE_FUNCTION;
+
+  return STATUS_OK;
+}
+
+/* **** CS Initialize/Destroy ************************************ */
+NEOERR *cs_init (CSPARSE **parse, HDF *hdf) {
+  return nerr_pass(cs_init_internal(parse, hdf, NULL));
+}
+
+static NEOERR *cs_init_internal (CSPARSE **parse, HDF *hdf, CSPARSE *parent)
+{
+  NEOERR *err = STATUS_OK;
+  CSPARSE *my_parse;
+  STACK_ENTRY *entry;
+  char *esc_value;
+  char *frozen;
+  CS_ESCAPE_MODES *esc_cursor;
+
+  err = nerr_init();
+  if (err != STATUS_OK) return nerr_pass (err);
+
+  my_parse = (CSPARSE *) calloc (1, sizeof (CSPARSE));
+  if (my_parse == NULL)
+    return nerr_raise (NERR_NOMEM, "Unable to allocate memory for CSPARSE");
+
+  err = uListInit (&(my_parse->stack), 10, 0);
+  if (err != STATUS_OK)
+  {
+    free(my_parse);
+    return nerr_pass(err);
+  }
+  err = uListInit (&(my_parse->alloc), 10, 0);
+  if (err != STATUS_OK)
+  {
+    free(my_parse);
+    return nerr_pass(err);
+  }
+  err = alloc_node (&(my_parse->tree), my_parse);
+  if (err != STATUS_OK)
+  {
+    cs_destroy (&my_parse);
+    return nerr_pass(err);
+  }
+  my_parse->current = my_parse->tree;
+  my_parse->next = &(my_parse->current->next);
+
+  entry = (STACK_ENTRY *) calloc (1, sizeof (STACK_ENTRY));
+  if (entry == NULL)
+  {
+    cs_destroy (&my_parse);
+    return nerr_raise (NERR_NOMEM,
+	"Unable to allocate memory for stack entry");
+  }
+  entry->state = ST_GLOBAL;
+  entry->tree = my_parse->current;
+  entry->location = 0;
+  entry->escape = NEOS_ESCAPE_UNDEF;
+  err = uListAppend(my_parse->stack, entry);
+  if (err != STATUS_OK) {
+    free (entry);
+    cs_destroy(&my_parse);
+    return nerr_pass(err);
+  }
+  my_parse->tag = hdf_get_value(hdf, "Config.TagStart", "cs");
+  my_parse->taglen = strlen(my_parse->tag);
+  my_parse->hdf = hdf;
+
+  /* Kept with the parse, since a cached template outlives the hdf */
+  frozen = hdf_get_value(hdf, "Config.FrozenPrefixes", NULL);
+  if (frozen != NULL && frozen[0])
+  {
+    my_parse->frozen = strdup(frozen);
+    if (my_parse->frozen == NULL)
+    {
+      cs_destroy (&my_parse);
+      return nerr_raise (NERR_NOMEM,
+          "Unable to allocate memory for Config.FrozenPrefixes");
+    }
+    err = uListAppend(my_parse->alloc, my_parse->frozen);
+    if (err != STATUS_OK)
+    {
+      free (my_parse->frozen);
+      cs_destroy (&my_parse);
+      return nerr_pass(err);
+    }
+  }
+
+  /* Let's set the default escape data */
+  my_parse->escaping.current = NEOS_ESCAPE_UNDEF;
+  my_parse->escaping.next_stack = NEOS_ESCAPE_UNDEF;
+  my_parse->escaping.when_undef = NEOS_ESCAPE_UNDEF;
+  my_parse->escaping.is_modified = 1;
+
+  /* See CS_ESCAPE_MODES. 0 is "undef" */
+  esc_value = hdf_get_value(hdf, "Config.VarEscapeMode", EscapeModes[0].mode);
+  /* Let's ensure the specified escape mode is valid and proceed */
+  for (esc_cursor = &EscapeModes[0];
+       esc_cursor->mode != NULL;
+       esc_cursor++)
+    if (!strcmp(esc_value, esc_cursor->mode))
+    {
+      my_parse->escaping.next_stack = esc_cursor->context;
+      entry->escape = esc_cursor->context;
+      break;
+    }
+  /* Didn't find an acceptable value we were looking for */
+  if (esc_cursor->mode == NULL) {
+    cs_destroy (&my_parse);
+    return nerr_raise (NERR_OUTOFRANGE,
+      "Invalid HDF value for Config.VarEscapeMode (none,html,js,url): %s",
+      esc_value);
+  }
+
+  /* Read configuration value to determine whether to enable audit mode */
+  my_parse->audit_mode = hdf_get_int_value(hdf, "Config.EnableAuditMode", 0);
+
+  my_parse->err_list = NULL;
+
+  if (parent == NULL)
+  {
+    static struct _builtin_functions {
+      const char *name;
+      int nargs;
+      CSFUNCTION function;
+    } Builtins[] = {
+      { "len", 1, _builtin_subcount },
+      { "subcount", 1, _builtin_subcount },
+      { "name", 1, _builtin_name },
+      { "first", 1, _builtin_first },
+      { "last", 1, _builtin_last },
+      { "abs", 1, _builtin_abs },
+      { "max", 2, _builtin_max },
+      { "min", 2, _builtin_min },
+      { "string.find", 2, _builtin_str_find },
+      { "string.slice", 3, _builtin_str_slice },
+      { "string.length", 1, _builtin_str_length },
+      { "string.crc", 1, _builtin_str_crc},
+      { "string.tolower", 1, _builtin_str_tolower},
+#ifdef ENABLE_GETTEXT
+      { "_", 1, _builtin_gettext },
+#endif
+      { NULL, 0, NULL },
+    };
+    int x = 0;
+    while (Builtins[x].name != NULL) {
+      err = cs_register_function(my_parse, Builtins[x].name, Builtins[x].nargs,
+                               Builtins[x].function);
+      if (err)
+      {
+        cs_destroy(&my_parse);
+        return nerr_pass(err);
+      }
+      x++;
+    }
+    /* Set global_hdf to be null */
+    my_parse->global_hdf = NULL;
+    my_parse->parent = NULL;
+    my_parse->stack_depth = 0;
+
+    my_parse->file_list = NULL;
+    my_parse->cur_file_idx = -1;
+
+    /* Set these variables to -1 to indicate "undefined" */
+    my_parse->auto_ctx.global_enabled = -1;
+    my_parse->auto_ctx.enabled = -1;
+    my_parse->auto_ctx.parser_ctx = NULL;
+    my_parse->auto_ctx.log_changes = 0;
+    my_parse->auto_ctx.propagate_status = 0;
+  }
+  else
+  {
+    /* TODO: macros and functions should actually not be duplicated, they
+     * should just be modified in lookup to walk the CS struct hierarchy we're
+     * creating here */
+    /* BUG: We currently can't copy the macros because they reference the parse
+     * tree, so if this sub-parse tree adds a macro, the macro reference will
+     * persist, but the parse tree it points to will be gone when the sub-parse
+     * is gone. */
+    my_parse->functions = parent->functions;
+    my_parse->global_hdf = parent->global_hdf;
+    my_parse->fileload = parent->fileload;
+    my_parse->fileload_ctx = parent->fileload_ctx;
+    /* This should be safe since locals handling is done entirely local to the
+     * eval functions, not globally by the parse handling.  This should
+     * pass the locals down to the new parse context to make locals work with
+     * lvar */
+    my_parse->locals = parent->locals;
+    my_parse->parent = parent;
+    my_parse->stack_depth = parent->stack_depth;
+
+    my_parse->file_list = parent->file_list;
+    my_parse->cur_file_idx = parent->cur_file_idx;
+
+    /* Copy the audit flag from parent */
+    my_parse->audit_mode = parent->audit_mode;
+
+    my_parse->auto_ctx.global_enabled = parent->auto_ctx.global_enabled;
+    my_parse->auto_ctx.enabled = parent->auto_ctx.enabled;
+    my_parse->auto_ctx.parser_ctx = parent->auto_ctx.parser_ctx;
+    my_parse->auto_ctx.log_changes = parent->auto_ctx.log_changes;
+    my_parse->auto_ctx.propagate_status = parent->auto_ctx.propagate_status;
+  }
+
+  *parse = my_parse;
+  return STATUS_OK;
+}
+
+void cs_register_fileload(CSPARSE *parse, void *ctx, CSFILELOAD fileload) {
+  if (parse != NULL) {
+    parse->fileload_ctx = ctx;
+    parse->fileload = fileload;
+  }
+}
+
+void cs_destroy (CSPARSE **parse)
+{
+  CSPARSE *my_parse = *parse;
+
+  if (my_parse == NULL)
+    return;
+
+  uListDestroy (&(my_parse->stack), ULIST_FREE);
+  uListDestroy (&(my_parse->alloc), ULIST_FREE);
+
+  dealloc_macro(&my_parse->macros);
+  dealloc_node(&(my_parse->tree));
+  uListDestroy(&(my_parse->cache_files), ULIST_FREE);
+  if (my_parse->includes != NULL)
+  {
+    CS_TEMPLATE *tmpl;
+
+    while (uListLength(my_parse->includes))
+    {
+      uListPop(my_parse->includes, (void *)&tmpl);
+      cs_template_destroy(&tmpl);
+    }
+    uListDestroy(&(my_parse->includes), 0);
+  }
+  if (my_parse->parent == NULL) {
+    dealloc_function(&(my_parse->functions));
+    call_frames_destroy(&(my_parse->call_frames));
+
+    if (my_parse->auto_ctx.log_changes)
+      uListDestroy (&(my_parse->file_list), ULIST_FREE);
+
+    if (my_parse->auto_ctx.parser_ctx)
+      neos_auto_destroy(&(my_parse->auto_ctx.parser_ctx));
+  }
+
+  /* Free list of errors */
+  if (my_parse->err_list != NULL) {
+    CS_ERROR *ptr;
+
+    while (my_parse->err_list) {
+      ptr = my_parse->err_list->next;
+      free(my_parse->err_list->err);
+      free(my_parse->err_list);
+      my_parse->err_list = ptr;
+    }
+  }
+
+  free(my_parse);
+  *parse = NULL;
+}
+
+/* **** CS Debug Dumps ******************************************** */
+static NEOERR *dump_node (CSPARSE *parse, CSTREE *node, int depth, void *ctx,
+    CSOUTFUNC cb, char *buf, int blen)
+{
+  NEOERR *err;
+
+  while (node != NULL)
+  {
+    snprintf (buf, blen, "%*s %s ", depth, "", Commands[node->cmd].cmd);
+    err = cb (ctx, buf);
+    if (err) return nerr_pass (err);
+    if (node->cmd)
+    {
+      if (node->arg1.op_type)
+      {
+	if (node->arg1.op_type == CS_TYPE_NUM)
+	{
+	  snprintf (buf, blen, "%ld ", node->arg1.n);
+	}
+	else if (node->arg1.op_type == CS_TYPE_MACRO)
+	{
+	  snprintf (buf, blen, "%s ", node->arg1.macro->name);
+	}
+	else
+	{
+	  snprintf (buf, blen, "%s ", node->arg1.s);
+	}
+	err = cb (ctx, buf);
+	if (err) return nerr_pass (err);
+      }
+      if (node->arg2.op_type)
+      {
+	if (node->arg2.op_type == CS_TYPE_NUM)
+	{
+	  snprintf (buf, blen, "%ld", node->arg2.n);
+	}
+	else
+	{
+	  snprintf (buf, blen, "%s", node->arg2.s);
+	}
+	err = cb (ctx, buf);
+	if (err) return nerr_pass (err);
+      }
+      if (node->vargs)
+      {
+	CSARG *arg;
+	arg = node->vargs;
+	while (arg)
+	{
+	  if (arg->op_type == CS_TYPE_NUM)
+	  {
+	    snprintf (buf, blen, "%ld ", arg->n);
+	  }
+	  else
+	  {
+	    snprintf (buf, blen, "%s ", arg->s);
+	  }
+	  err = cb (ctx, buf);
+	  if (err) return nerr_pass (err);
+	  arg = arg->next;
+	}
+      }
+    }
+    err = cb (ctx, "\n");
+    if (err) return nerr_pass (err);
+    if (node->case_0)
+    {
+      snprintf (buf, blen, "%*s %s\n", depth, "", "Case 0");
+      err = cb (ctx, buf);
+      if (err) return nerr_pass (err);
+      err = dump_node (parse, node->case_0, depth+1, ctx, cb, buf, blen);
+      if (err) return nerr_pass (err);
+    }
+    if (node->case_1)
+    {
+      snprintf (buf, blen, "%*s %s\n", depth, "", "Case 1");
+      err = cb (ctx, buf);
+      if (err) return nerr_pass (err);
+      err = dump_node (parse, node->case_1, depth+1, ctx, cb, buf, blen);
+      if (err) return nerr_pass (err);
+    }
+    node = node->next;
+  }
+  return STATUS_OK;
+}
+
+NEOERR *cs_dump (CSPARSE *parse, void *ctx, CSOUTFUNC cb)
+{
+  CSTREE *node;
+  char buf[4096];
+
+  if (parse->tree == NULL)
+    return nerr_raise (NERR_ASSERT, "No parse tree exists");
+
+  node = parse->tree;
+  return nerr_pass (dump_node (parse, node, 0, ctx, cb, buf, sizeof(buf)));
+}
+
+/* cs_dump_c writes each list of nodes which is rendered on its own (the
+ * template, the body of an each, with, loop or macro, and each cached
+ * include) as a C function, block_N.  The arguments of the nodes are
+ * written as the CSARGs E[N], and the macros as the CS_MACROs M_N. */
+typedef struct _dump_c
+{
+  CSPARSE *parse;
+  STRING args;          /* The initializers of E */
+  STRING macros;        /* The CS_MACROs */
+  STRING blocks;        /* The block functions */
+  int num_args;
+  int eval_val;         /* Set when an expression is left to the library */
+  ULIST *trees;         /* The list of nodes of each block, by number */
+  ULIST *called;        /* The macros written, by number */
+  ULIST *functions;     /* The names of the functions the module calls */
+} CS_DUMP_C;
+
+static NEOERR *dump_c_block (CS_DUMP_C *dc, CSTREE *tree, int *num);
+
+/* Appends a line indented by depth */
+static NEOERR *dump_c_line (STRING *out, int depth, const char *fmt, ...)
+                            ATTRIBUTE_PRINTF(3,4);
+static NEOERR *dump_c_line (STRING *out, int depth, const char *fmt, ...)
+{
+  NEOERR *err;
+  va_list ap;
+
+  err = string_appendf(out, "%*s", depth * 2, "");
+  if (err) return nerr_pass(err);
+  va_start(ap, fmt);
+  err = string_appendvf(out, fmt, ap);
+  va_end(ap);
+  if (err) return nerr_pass(err);
+  return nerr_pass(string_append_char(out, '\n'));
+}
+
+/* Appends s as a C string constant, broken after each newline onto a line
+ * indented by depth */
+static NEOERR *dump_c_string (STRING *out, const char *s, int depth)
+{
+  NEOERR *err;
+  const char *p;
+  char buf[8];
+
+  if (s == NULL)
+    return nerr_pass(string_append(out, "NULL"));
+  err = string_append_char(out, '"');
+  if (err) return nerr_pass(err);
+  for (p = s; *p; p++)
+  {
+    switch (*p)
+    {
+      case '"': strcpy(buf, "\\\""); break;
+      case '\\': strcpy(buf, "\\\\"); break;
+      case '\n': strcpy(buf, "\\n"); break;
+      case '\r': strcpy(buf, "\\r"); break;
+      case '\t': strcpy(buf, "\\t"); break;
+      case '?':
+        /* Not the start of a trigraph */
+        strcpy(buf, (p > s && p[-1] == '?') ? "\\?" : "?");
+        break;
+      default:
+        if ((unsigned char) *p < 0x20 || (unsigned char) *p >= 0x7f)
+          snprintf(buf, sizeof(buf), "\\%03o", (unsigned char) *p);
+        else
+        {
+          buf[0] = *p;
+          buf[1] = '\0';
+        }
+        break;
+    }
+    err = string_append(out, buf);
+    if (err) return nerr_pass(err);
+    if (*p == '\n' && p[1] != '\0')
+    {
+      err = string_appendf(out, "\"\n%*s\"", depth * 2, "");
+      if (err) return nerr_pass(err);
+    }
+  }
+  return nerr_pass(string_append_char(out, '"'));
+}
+
+static NEOERR *dump_c_long (STRING *out, long int n)
+{
+  if (n == LONG_MIN)
+    return nerr_pass(string_appendf(out, "(%ldL - 1)", LONG_MIN + 1));
+  if (n < 0)
+    return nerr_pass(string_appendf(out, "(%ldL)", n));
+  return nerr_pass(string_appendf(out, "%ldL", n));
+}
+
+static NEOERR *dump_c_ref (STRING *out, int idx)
+{
+  if (idx < 0)
+    return nerr_pass(string_append(out, "NULL"));
+  return nerr_pass(string_appendf(out, "&E[%d]", idx));
+}
+
+static NEOERR *dump_c_function (CS_DUMP_C *dc, const char *name)
+{
+  char *s;
+  int x;
+
+  for (x = 0; x < uListLength(dc->functions); x++)
+  {
+    uListGet(dc->functions, x, (void *)&s);
+    if (!strcmp(s, name))
+      return STATUS_OK;
+  }
+  return nerr_pass(uListAppend(dc->functions, (void *) name));
+}
+
+/* Writes arg, and the args it points to, to E.  Sets idx to the index of
+ * arg in E, or -1 if arg is NULL */
+static NEOERR *dump_c_arg (CS_DUMP_C *dc, CSARG *arg, int *idx)
+{
+  NEOERR *err;
+  int expr1, expr2, next;
+  char *s = arg ? arg->s : NULL;
+
+  *idx = -1;
+  if (arg == NULL)
+    return STATUS_OK;
+  err = dump_c_arg(dc, arg->expr1, &expr1);
+  if (err) return nerr_pass(err);
+  err = dump_c_arg(dc, arg->expr2, &expr2);
+  if (err) return nerr_pass(err);
+  err = dump_c_arg(dc, arg->next, &next);
+  if (err) return nerr_pass(err);
+
+  /* The function is looked up by name when the module is rendered */
+  if (arg->op_type & CS_TYPE_FUNCTION)
+  {
+    if (arg->function == NULL)
+      return nerr_raise (NERR_ASSERT, "Function without a name");
+    s = arg->function->name;
+    err = dump_c_function(dc, s);
+    if (err) return nerr_pass(err);
+  }
+
+  *idx = dc->num_args++;
+  err = string_appendf(&(dc->args), "  /* %d */ CS_AOT_ARG(0x%x /* %s */, %d, ",
+                       *idx, (unsigned int) arg->op_type,
+                       expand_token_type(arg->op_type, 1), arg->escape_status);
+  if (err) return nerr_pass(err);
+  err = dump_c_string(&(dc->args), s, 2);
+  if (err) return nerr_pass(err);
+  err = string_append(&(dc->args), ", ");
+  if (err) return nerr_pass(err);
+  err = dump_c_long(&(dc->args), arg->n);
+  if (err) return nerr_pass(err);
+  err = string_append(&(dc->args), ", ");
+  if (err) return nerr_pass(err);
+  err = dump_c_ref(&(dc->args), expr1);
+  if (err) return nerr_pass(err);
+  err = string_append(&(dc->args), ", ");
+  if (err) return nerr_pass(err);
+  err = dump_c_ref(&(dc->args), expr2);
+  if (err) return nerr_pass(err);
+  err = string_append(&(dc->args), ", ");
+  if (err) return nerr_pass(err);
+  err = dump_c_ref(&(dc->args), next);
+  if (err) return nerr_pass(err);
+  return nerr_pass(string_append(&(dc->args), "),\n"));
+}
+
+/* The type of the value eval_expr returns for arg, or 0 if that's only
+ * known at render time */
+static int dump_c_type (CSARG *arg)
+{
+  int t1, t2;
+
+  if (arg->op_type & CS_TYPES)
+    return arg->op_type & CS_TYPES;
+  if (arg->op_type == CS_OP_LPAREN)
+    return dump_c_type(arg->expr1);
+  if (arg->op_type & CS_OPS_UNARY)
+    return CS_TYPE_NUM;
+  if (arg->op_type & (CS_OP_DOT | CS_OP_LBRACKET))
+    return CS_TYPE_VAR;
+  if (arg->op_type & (CS_OP_AND | CS_OP_OR))
+    return CS_TYPE_NUM;
+  if (arg->op_type & (CS_TYPE_FUNCTION | CS_OP_COMMA) ||
+      arg->expr1 == NULL || arg->expr2 == NULL)
+    return 0;
+  t1 = dump_c_type(arg->expr1);
+  t2 = dump_c_type(arg->expr2);
+  if (!t1 || !t2)
+    return 0;
+  if (((t1 | t2) & (CS_TYPE_NUM | CS_TYPE_VAR_NUM)) ||
+      (arg->op_type & NUM_OPS))
+    return CS_TYPE_NUM;
+  return (arg->op_type == CS_OP_ADD) ? CS_TYPE_STRING : CS_TYPE_NUM;
+}
+
+/* Appends C for the value of arg as arg_eval_bool ('b'), arg_eval_num
+ * ('n') or arg_eval ('s') would see it after eval_expr.  ok is cleared if
+ * arg can't be written as C, and must be evaluated by the library. */
+static NEOERR *dump_c_value (CSARG *arg, int as, STRING *out, int *ok)
+{
+  NEOERR *err;
+  const char *op = NULL;
+  int t1, t2;
+
+  if (!*ok)
+    return STATUS_OK;
+  switch (arg->op_type & CS_TYPES)
+  {
+    case CS_TYPE_STRING:
+      if (as == 's')
+        return nerr_pass(dump_c_string(out, arg->s, 0));
+      if (as == 'b')
+        return nerr_pass(dump_c_long(out, str_eval_bool(arg->s)));
+      return nerr_pass(dump_c_long(out, (arg->s == NULL || *(arg->s) == '\0')
+                                   ? 0 : strtol(arg->s, NULL, 0)));
+    case CS_TYPE_NUM:
+      if (as == 's')
+        break;
+      return nerr_pass(dump_c_long(out, arg->n));
+    case CS_TYPE_VAR:
+    case CS_TYPE_VAR_NUM:
+      if (as == 's' && (arg->op_type & CS_TYPE_VAR_NUM))
+        break;
+      if (as == 's')
+        err = string_append(out, "cs->lookup(parse, ");
+      else if (as == 'b' && (arg->op_type & CS_TYPE_VAR))
+        err = string_append(out, "cs->str_bool(cs->lookup(parse, ");
+      else
+        err = string_append(out, "cs->lookup_num(parse, ");
+      if (err) return nerr_pass(err);
+      err = dump_c_string(out, arg->s, 0);
+      if (err) return nerr_pass(err);
+      if (as == 'b' && (arg->op_type & CS_TYPE_VAR))
+        return nerr_pass(string_append(out, "))"));
+      return nerr_pass(string_append(out, ")"));
+    case 0:
+      if (arg->op_type == CS_OP_LPAREN)
+        return nerr_pass(dump_c_value(arg->expr1, as, out, ok));
+      if (as == 's' || dump_c_type(arg) != CS_TYPE_NUM)
+        break;
+      if (arg->op_type == CS_OP_NOT)
+      {
+        err = string_append(out, "(!");
+        if (err) return nerr_pass(err);
+        err = dump_c_value(arg->expr1, 'b', out, ok);
+        if (err) return nerr_pass(err);
+        return nerr_pass(string_append(out, ")"));
+      }
+      if (arg->op_type == CS_OP_NUM)
+        return nerr_pass(dump_c_value(arg->expr1, 'n', out, ok));
+      if (arg->op_type == CS_OP_EXISTS)
+      {
+        if (arg->expr1->op_type & (CS_TYPE_VAR | CS_TYPE_VAR_NUM))
+        {
+          err = string_append(out, "(cs->lookup(parse, ");
+          if (err) return nerr_pass(err);
+          err = dump_c_string(out, arg->expr1->s, 0);
+          if (err) return nerr_pass(err);
+          return nerr_pass(string_append(out, ") != NULL)"));
+        }
+        /* All numbers/strings exist */
+        if (arg->expr1->op_type & CS_TYPES)
+          return nerr_pass(string_append(out, "1L"));
+        break;
+      }
+
+      t1 = dump_c_type(arg->expr1);
+      t2 = dump_c_type(arg->expr2);
+      if (arg->op_type & (CS_OP_AND | CS_OP_OR))
+      {
+        as = 'b';
+        op = (arg->op_type == CS_OP_AND) ? "&&" : "||";
+      }
+      else if (((t1 | t2) & (CS_TYPE_NUM | CS_TYPE_VAR_NUM)) ||
+               (arg->op_type & NUM_OPS))
+      {
+        as = 'n';
+        switch (arg->op_type)
+        {
+          case CS_OP_EQUAL: op = "=="; break;
+          case CS_OP_NEQUAL: op = "!="; break;
+          case CS_OP_LT: op = "<"; break;
+          case CS_OP_LTE: op = "<="; break;
+          case CS_OP_GT: op = ">"; break;
+          case CS_OP_GTE: op = ">="; break;
+          case CS_OP_ADD: op = "+"; break;
+          case CS_OP_SUB: op = "-"; break;
+          case CS_OP_MULT: op = "*"; break;
+          default: break;
+        }
+      }
+      else if (arg->op_type & (CS_OP_EQUAL | CS_OP_NEQUAL))
+      {
+        /* The string compare of eval_string_op */
+        as = 's';
+        op = ", ";
+        err = string_append(out, (arg->op_type == CS_OP_EQUAL) ?
+                            "cs->str_equal(" : "!cs->str_equal(");
+        if (err) return nerr_pass(err);
+      }
+      if (op == NULL)
+        break;
+      if (as != 's')
+      {
+        err = string_append_char(out, '(');
+        if (err) return nerr_pass(err);
+      }
+      err = dump_c_value(arg->expr1, as, out, ok);
+      if (err) return nerr_pass(err);
+      err = string_appendf(out, (as == 's') ? "%s" : " %s ", op);
+      if (err) return nerr_pass(err);
+      err = dump_c_value(arg->expr2, as, out, ok);
+      if (err) return nerr_pass(err);
+      return nerr_pass(string_append_char(out, ')'));
+    default:
+      break;
+  }
+  *ok = 0;
+  return STATUS_OK;
+}
+
+/* Writes the statements which evaluate the expression arg to a long int
+ * as arg_eval_bool ('b') or arg_eval_num ('n') would, storing it in var */
+static NEOERR *dump_c_eval_long (CS_DUMP_C *dc, CSARG *arg, int as,
+                                 const char *var, STRING *out, int depth)
+{
+  NEOERR *err;
+  STRING value;
+  int ok = 1;
+  int idx;
+
+  string_init(&value);
+  err = dump_c_value(arg, as, &value, &ok);
+  if (err == STATUS_OK && ok)
+    err = dump_c_line(out, depth, "%s = %s;", var, value.buf);
+  string_clear(&value);
+  if (err || ok) return nerr_pass(err);
+
+  dc->eval_val = 1;
+  err = dump_c_arg(dc, arg, &idx);
+  if (err) return nerr_pass(err);
+  err = dump_c_line(out, depth, "err = cs->eval(parse, &E[%d], &val);", idx);
+  if (err) return nerr_pass(err);
+  err = dump_c_line(out, depth, "if (err) return err;");
+  if (err) return nerr_pass(err);
+  err = dump_c_line(out, depth, "%s = cs->eval_%s(parse, &val);", var,
+                    (as == 'b') ? "bool" : "num");
+  if (err) return nerr_pass(err);
+  return nerr_pass(dump_c_line(out, depth, "if (val.alloc) free(val.s);"));
+}
+
+/* Writes the statements which look up the HDF object of an each or with
+ * into obj.  For an expression, the name stays in val for the local (see
+ * map_obj), and is free'd by the caller */
+static NEOERR *dump_c_eval_obj (CS_DUMP_C *dc, CSARG *arg, STRING *out,
+                                int depth)
+{
+  NEOERR *err;
+  int idx;
+
+  if (arg->op_type == CS_TYPE_VAR)
+  {
+    err = string_appendf(out, "%*sobj = cs->lookup_obj(parse, ", depth * 2, "");
+    if (err) return nerr_pass(err);
+    err = dump_c_string(out, arg->s, 0);
+    if (err) return nerr_pass(err);
+    return nerr_pass(string_append(out, ");\n"));
+  }
+  err = dump_c_arg(dc, arg, &idx);
+  if (err) return nerr_pass(err);
+  err = dump_c_line(out, depth, "err = cs->eval(parse, &E[%d], &val);", idx);
+  if (err) return nerr_pass(err);
+  err = dump_c_line(out, depth, "if (err) return err;");
+  if (err) return nerr_pass(err);
+  err = dump_c_line(out, depth, "obj = (val.op_type == CS_TYPE_VAR) ?");
+  if (err) return nerr_pass(err);
+  return nerr_pass(dump_c_line(out, depth,
+                               "    cs->lookup_obj(parse, val.s) : NULL;"));
+}
+
+/* Writes the statements installing the local map of an each, with or
+ * loop, named name */
+static NEOERR *dump_c_map (STRING *out, int depth, const char *type,
+                           const char *name, int scope)
+{
+  NEOERR *err;
+
+  err = dump_c_line(out, depth, "memset(&map, 0, sizeof(map));");
+  if (err) return nerr_pass(err);
+  err = dump_c_line(out, depth, "map.type = %s;", type);
+  if (err) return nerr_pass(err);
+  err = string_appendf(out, "%*smap.name = ", depth * 2, "");
+  if (err) return nerr_pass(err);
+  err = dump_c_string(out, name, 0);
+  if (err) return nerr_pass(err);
+  err = string_append(out, ";\n");
+  if (err) return nerr_pass(err);
+  err = dump_c_line(out, depth, "map.next = parse->locals;");
+  if (err) return nerr_pass(err);
+  err = dump_c_line(out, depth, "map.next_scope = parse->locals;");
+  if (err) return nerr_pass(err);
+  /* with has no first */
+  if (scope)
+  {
+    err = dump_c_line(out, depth, "map.first = 1;");
+    if (err) return nerr_pass(err);
+  }
+  return nerr_pass(dump_c_line(out, depth, "parse->locals = &map;"));
+}
+
+/* The statements after each render of the body of an each or loop */
+static NEOERR *dump_c_map_next (STRING *out, int depth)
+{
+  NEOERR *err;
+
+  err = dump_c_line(out, depth, "if (map.map_alloc)");
+  if (err) return nerr_pass(err);
+  err = dump_c_line(out, depth, "{");
+  if (err) return nerr_pass(err);
+  err = dump_c_line(out, depth + 1, "free(map.s);");
+  if (err) return nerr_pass(err);
+  err = dump_c_line(out, depth + 1, "map.s = NULL;");
+  if (err) return nerr_pass(err);
+  err = dump_c_line(out, depth, "}");
+  if (err) return nerr_pass(err);
+  err = dump_c_line(out, depth, "map.first = 0;");
+  if (err) return nerr_pass(err);
+  return nerr_pass(dump_c_line(out, depth, "if (err) break;"));
+}
+
+static NEOERR *dump_c_nodes (CS_DUMP_C *dc, CSTREE *node, STRING *out,
+                             int depth);
+
+/* Writes an if, with any elif as an else if */
+static NEOERR *dump_c_if (CS_DUMP_C *dc, CSTREE *node, STRING *out, int depth,
+                          int is_else)
+{
+  NEOERR *err;
+  STRING cond;
+  int ok = 1;
+  CSTREE *elif;
+
+  string_init(&cond);
+  err = dump_c_value(&(node->arg1), 'b', &cond, &ok);
+  if (err == STATUS_OK)
+  {
+    if (ok)
+      err = dump_c_line(out, depth, "%sif (%s)", is_else ? "else " : "",
+                        cond.buf);
+    else if (is_else)
+      err = dump_c_line(out, depth, "else");
+  }
+  string_clear(&cond);
+  if (err) return nerr_pass(err);
+
+  if (!ok)
+  {
+    /* The library evaluates the condition */
+    if (is_else)
+    {
+      err = dump_c_line(out, depth++, "{");
+      if (err) return nerr_pass(err);
+    }
+    err = dump_c_line(out, depth, "{");
+    if (err) return nerr_pass(err);
+    err = dump_c_line(out, depth + 1, "CSARG val;");
+    if (err) return nerr_pass(err);
+    err = dump_c_line(out, depth + 1, "long int t;");
+    if (err) return nerr_pass(err);
+    err = string_append_char(out, '\n');
+    if (err) return nerr_pass(err);
+    err = dump_c_eval_long(dc, &(node->arg1), 'b', "t", out, depth + 1);
+    if (err) return nerr_pass(err);
+    err = dump_c_line(out, depth + 1, "if (t)");
+    if (err) return nerr_pass(err);
+    depth++;
+  }
 
-  entry = (STACK_ENTRY *) calloc (1, sizeof (STACK_ENTRY));
-  if (entry == NULL)
+  err = dump_c_line(out, depth, "{");
+  if (err) return nerr_pass(err);
+  err = dump_c_nodes(dc, node->case_0, out, depth + 1);
+  if (err) return nerr_pass(err);
+  err = dump_c_line(out, depth, "}");
+  if (err) return nerr_pass(err);
+
+  elif = node->case_1;
+  if (elif != NULL && elif->next == NULL &&
+      Commands[elif->cmd].eval_handler == if_eval)
   {
-    cs_destroy (&my_parse);
-    return nerr_raise (NERR_NOMEM,
-	"Unable to allocate memory for stack entry");
+    err = dump_c_if(dc, elif, out, depth, 1);
+    if (err) return nerr_pass(err);
   }
-  entry->state = ST_GLOBAL;
-  entry->tree = my_parse->current;
-  entry->location = 0;
-  entry->escape = NEOS_ESCAPE_UNDEF;
-  err = uListAppend(my_parse->stack, entry);
-  if (err != STATUS_OK) {
-    free (entry);
-    cs_destroy(&my_parse);
-    return nerr_pass(err);
+  else if (elif != NULL)
+  {
+    err = dump_c_line(out, depth, "else");
+    if (err) return nerr_pass(err);
+    err = dump_c_line(out, depth, "{");
+    if (err) return nerr_pass(err);
+    err = dump_c_nodes(dc, elif, out, depth + 1);
+    if (err) return nerr_pass(err);
+    err = dump_c_line(out, depth, "}");
+    if (err) return nerr_pass(err);
   }
-  my_parse->tag = hdf_get_value(hdf, "Config.TagStart", "cs");
-  my_parse->taglen = strlen(my_parse->tag);
-  my_parse->hdf = hdf;
-
-  /* Let's set the default escape data */
-  my_parse->escaping.current = NEOS_ESCAPE_UNDEF;
-  my_parse->escaping.next_stack = NEOS_ESCAPE_UNDEF;
-  my_parse->escaping.when_undef = NEOS_ESCAPE_UNDEF;
-  my_parse->escaping.is_modified = 1;
 
-  /* See CS_ESCAPE_MODES. 0 is "undef" */
-  esc_value = hdf_get_value(hdf, "Config.VarEscapeMode", EscapeModes[0].mode);
-  /* Let's ensure the specified escape mode is valid and proceed */
-  for (esc_cursor = &EscapeModes[0];
-       esc_cursor->mode != NULL;
-       esc_cursor++)
-    if (!strcmp(esc_value, esc_cursor->mode))
+  if (!ok)
+  {
+    err = dump_c_line(out, --depth, "}");
+    if (err) return nerr_pass(err);
+    if (is_else)
     {
-      my_parse->escaping.next_stack = esc_cursor->context;
-      entry->escape = esc_cursor->context;
-      break;
+      err = dump_c_line(out, --depth, "}");
+      if (err) return nerr_pass(err);
     }
-  /* Didn't find an acceptable value we were looking for */
-  if (esc_cursor->mode == NULL) {
-    cs_destroy (&my_parse);
-    return nerr_raise (NERR_OUTOFRANGE,
-      "Invalid HDF value for Config.VarEscapeMode (none,html,js,url): %s",
-      esc_value);
   }
+  return STATUS_OK;
+}
 
-  /* Read configuration value to determine whether to enable audit mode */
-  my_parse->audit_mode = hdf_get_int_value(hdf, "Config.EnableAuditMode", 0);
-
-  my_parse->err_list = NULL;
+/* Writes the statements outputting the value of the expression arg, as
+ * var_eval_helper.  If alt is set, runs the body of the alt node instead
+ * if the value is false. */
+static NEOERR *dump_c_var (CS_DUMP_C *dc, CSTREE *node, STRING *out,
+                           int depth, int alt)
+{
+  NEOERR *err;
+  int idx;
 
-  if (parent == NULL)
+  err = dump_c_arg(dc, &(node->arg1), &idx);
+  if (err) return nerr_pass(err);
+  if (!alt && (node->arg1.op_type & CS_TYPES))
   {
-    static struct _builtin_functions {
-      const char *name;
-      int nargs;
-      CSFUNCTION function;
-    } Builtins[] = {
-      { "len", 1, _builtin_subcount },
-      { "subcount", 1, _builtin_subcount },
-      { "name", 1, _builtin_name },
-      { "first", 1, _builtin_first },
-      { "last", 1, _builtin_last },
-      { "abs", 1, _builtin_abs },
-      { "max", 2, _builtin_max },
-      { "min", 2, _builtin_min },
-      { "string.find", 2, _builtin_str_find },
-      { "string.slice", 3, _builtin_str_slice },
-      { "string.length", 1, _builtin_str_length },
-      { "string.crc", 1, _builtin_str_crc},
-      { "string.tolower", 1, _builtin_str_tolower},
-#ifdef ENABLE_GETTEXT
-      { "_", 1, _builtin_gettext },
-#endif
-      { NULL, 0, NULL },
-    };
-    int x = 0;
-    while (Builtins[x].name != NULL) {
-      err = cs_register_function(my_parse, Builtins[x].name, Builtins[x].nargs,
-                               Builtins[x].function);
-      if (err)
-      {
-        cs_destroy(&my_parse);
-        return nerr_pass(err);
-      }
-      x++;
-    }
-    /* Set global_hdf to be null */
-    my_parse->global_hdf = NULL;
-    my_parse->parent = NULL;
-    my_parse->stack_depth = 0;
-
-    my_parse->file_list = NULL;
-    my_parse->cur_file_idx = -1;
+    err = dump_c_line(out, depth, "parse->escaping.current = NEOS_ESCAPE_UNDEF;");
+    if (err) return nerr_pass(err);
+    err = dump_c_line(out, depth, "err = cs->output(parse, &E[%d], %d);", idx,
+                      node->escape);
+    if (err) return nerr_pass(err);
+    return nerr_pass(dump_c_line(out, depth, "if (err) return err;"));
+  }
 
-    /* Set these variables to -1 to indicate "undefined" */
-    my_parse->auto_ctx.global_enabled = -1;
-    my_parse->auto_ctx.enabled = -1;
-    my_parse->auto_ctx.parser_ctx = NULL;
-    my_parse->auto_ctx.log_changes = 0;
-    my_parse->auto_ctx.propagate_status = 0;
+  err = dump_c_line(out, depth, "{");
+  if (err) return nerr_pass(err);
+  err = dump_c_line(out, depth + 1, "CSARG val;");
+  if (err) return nerr_pass(err);
+  if (alt)
+  {
+    err = dump_c_line(out, depth + 1, "long int t;");
+    if (err) return nerr_pass(err);
+  }
+  err = string_append_char(out, '\n');
+  if (err) return nerr_pass(err);
+  err = dump_c_line(out, depth + 1, "parse->escaping.current = NEOS_ESCAPE_UNDEF;");
+  if (err) return nerr_pass(err);
+  err = dump_c_line(out, depth + 1, "err = cs->eval(parse, &E[%d], &val);", idx);
+  if (err) return nerr_pass(err);
+  err = dump_c_line(out, depth + 1, "if (err) return err;");
+  if (err) return nerr_pass(err);
+  if (alt)
+  {
+    err = dump_c_line(out, depth + 1, "t = cs->eval_bool(parse, &val);");
+    if (err) return nerr_pass(err);
+    err = dump_c_line(out, depth + 1, "if (t) err = cs->output(parse, &val, %d);",
+                      node->escape);
   }
   else
   {
-    /* TODO: macros and functions should actually not be duplicated, they
-     * should just be modified in lookup to walk the CS struct hierarchy we're
-     * creating here */
-    /* BUG: We currently can't copy the macros because they reference the parse
-     * tree, so if this sub-parse tree adds a macro, the macro reference will
-     * persist, but the parse tree it points to will be gone when the sub-parse
-     * is gone. */
-    my_parse->functions = parent->functions;
-    my_parse->global_hdf = parent->global_hdf;
-    my_parse->fileload = parent->fileload;
-    my_parse->fileload_ctx = parent->fileload_ctx;
-    /* This should be safe since locals handling is done entirely local to the
-     * eval functions, not globally by the parse handling.  This should
-     * pass the locals down to the new parse context to make locals work with
-     * lvar */
-    my_parse->locals = parent->locals;
-    my_parse->parent = parent;
-    my_parse->stack_depth = parent->stack_depth;
-
-    my_parse->file_list = parent->file_list;
-    my_parse->cur_file_idx = parent->cur_file_idx;
-
-    /* Copy the audit flag from parent */
-    my_parse->audit_mode = parent->audit_mode;
-
-    my_parse->auto_ctx.global_enabled = parent->auto_ctx.global_enabled;
-    my_parse->auto_ctx.enabled = parent->auto_ctx.enabled;
-    my_parse->auto_ctx.parser_ctx = parent->auto_ctx.parser_ctx;
-    my_parse->auto_ctx.log_changes = parent->auto_ctx.log_changes;
-    my_parse->auto_ctx.propagate_status = parent->auto_ctx.propagate_status;
+    err = dump_c_line(out, depth + 1, "err = cs->output(parse, &val, %d);",
+                      node->escape);
   }
-
-  *parse = my_parse;
-  return STATUS_OK;
-}
-
-void cs_register_fileload(CSPARSE *parse, void *ctx, CSFILELOAD fileload) {
-  if (parse != NULL) {
-    parse->fileload_ctx = ctx;
-    parse->fileload = fileload;
+  if (err) return nerr_pass(err);
+  err = dump_c_line(out, depth + 1, "if (val.alloc) free(val.s);");
+  if (err) return nerr_pass(err);
+  err = dump_c_line(out, depth + 1, "if (err) return err;");
+  if (err) return nerr_pass(err);
+  if (alt && node->case_0 != NULL)
+  {
+    err = dump_c_line(out, depth + 1, "if (!t)");
+    if (err) return nerr_pass(err);
+    err = dump_c_line(out, depth + 1, "{");
+    if (err) return nerr_pass(err);
+    err = dump_c_nodes(dc, node->case_0, out, depth + 2);
+    if (err) return nerr_pass(err);
+    err = dump_c_line(out, depth + 1, "}");
+    if (err) return nerr_pass(err);
   }
+  return nerr_pass(dump_c_line(out, depth, "}"));
 }
 
-void cs_destroy (CSPARSE **parse)
+/* Writes an each or a with */
+static NEOERR *dump_c_each (CS_DUMP_C *dc, CSTREE *node, STRING *out,
+                            int depth, int each)
 {
-  CSPARSE *my_parse = *parse;
+  NEOERR *err;
+  int body;
 
-  if (my_parse == NULL)
-    return;
+  err = dump_c_block(dc, node->case_0, &body);
+  if (err) return nerr_pass(err);
 
-  uListDestroy (&(my_parse->stack), ULIST_FREE);
-  uListDestroy (&(my_parse->alloc), ULIST_FREE);
+  err = dump_c_line(out, depth++, "{");
+  if (err) return nerr_pass(err);
+  err = dump_c_line(out, depth, "CS_LOCAL_MAP map;");
+  if (err) return nerr_pass(err);
+  err = dump_c_line(out, depth, "HDF *obj;");
+  if (err) return nerr_pass(err);
+  if (node->arg2.op_type != CS_TYPE_VAR)
+  {
+    err = dump_c_line(out, depth, "CSARG val;");
+    if (err) return nerr_pass(err);
+  }
+  err = string_append_char(out, '\n');
+  if (err) return nerr_pass(err);
+  err = dump_c_eval_obj(dc, &(node->arg2), out, depth);
+  if (err) return nerr_pass(err);
+  err = dump_c_line(out, depth, "if (obj != NULL)");
+  if (err) return nerr_pass(err);
+  err = dump_c_line(out, depth++, "{");
+  if (err) return nerr_pass(err);
+  err = dump_c_map(out, depth, "CS_TYPE_VAR", node->arg1.s, each);
+  if (err) return nerr_pass(err);
+  /* the name to look the node up again by, see map_obj */
+  if (node->arg2.op_type == CS_TYPE_VAR)
+  {
+    err = string_appendf(out, "%*smap.s = (char *) ", depth * 2, "");
+    if (err) return nerr_pass(err);
+    err = dump_c_string(out, node->arg2.s, 0);
+    if (err) return nerr_pass(err);
+    err = string_append(out, ";\n");
+  }
+  else
+  {
+    err = dump_c_line(out, depth, "map.s = val.s;");
+  }
+  if (err) return nerr_pass(err);
+  if (each)
+  {
+    err = dump_c_line(out, depth, "map.is_child = 1;");
+    if (err) return nerr_pass(err);
+    err = dump_c_line(out, depth, "for (obj = cs->obj_child(obj); obj != NULL; obj = cs->obj_next(obj))");
+    if (err) return nerr_pass(err);
+    err = dump_c_line(out, depth++, "{");
+    if (err) return nerr_pass(err);
+  }
+  err = dump_c_line(out, depth, "map.h = obj;");
+  if (err) return nerr_pass(err);
+  err = dump_c_line(out, depth, "map.escape_status = CS_ES_UNTRUSTED;");
+  if (err) return nerr_pass(err);
+  err = dump_c_line(out, depth, "err = block_%d(cs, parse);", body);
+  if (err) return nerr_pass(err);
+  if (each)
+  {
+    err = dump_c_map_next(out, depth);
+    if (err) return nerr_pass(err);
+    err = dump_c_line(out, --depth, "}");
+    if (err) return nerr_pass(err);
+  }
+  else
+  {
+    err = dump_c_line(out, depth, "if (map.map_alloc) free(map.s);");
+    if (err) return nerr_pass(err);
+  }
+  err = dump_c_line(out, depth, "parse->locals = map.next;");
+  if (err) return nerr_pass(err);
+  err = dump_c_line(out, --depth, "}");
+  if (err) return nerr_pass(err);
+  if (node->arg2.op_type != CS_TYPE_VAR)
+  {
+    err = dump_c_line(out, depth, "if (val.alloc) free(val.s);");
+    if (err) return nerr_pass(err);
+  }
+  err = dump_c_line(out, depth, "if (err) return err;");
+  if (err) return nerr_pass(err);
+  return nerr_pass(dump_c_line(out, --depth, "}"));
+}
 
-  dealloc_macro(&my_parse->macros);
-  dealloc_node(&(my_parse->tree));
-  if (my_parse->parent == NULL) {
-    dealloc_function(&(my_parse->functions));
+static NEOERR *dump_c_loop (CS_DUMP_C *dc, CSTREE *node, STRING *out,
+                            int depth)
+{
+  NEOERR *err;
+  STRING args;
+  CSARG *carg;
+  int body;
 
-    if (my_parse->auto_ctx.log_changes)
-      uListDestroy (&(my_parse->file_list), ULIST_FREE);
+  carg = node->vargs;
+  if (carg == NULL)
+    return nerr_raise (NERR_ASSERT, "No arguments in loop");
+  err = dump_c_block(dc, node->case_0, &body);
+  if (err) return nerr_pass(err);
 
-    if (my_parse->auto_ctx.parser_ctx)
-      neos_auto_destroy(&(my_parse->auto_ctx.parser_ctx));
+  /* The arguments first, to know if val is needed */
+  string_init(&args);
+  dc->eval_val = 0;
+  err = dump_c_eval_long(dc, carg, 'n', "end", &args, depth + 1);
+  if (err == STATUS_OK && carg->next)
+  {
+    carg = carg->next;
+    err = dump_c_line(&args, depth + 1, "start = end;");
+    if (err == STATUS_OK)
+      err = dump_c_eval_long(dc, carg, 'n', "end", &args, depth + 1);
+    if (err == STATUS_OK && carg->next)
+      err = dump_c_eval_long(dc, carg->next, 'n', "step", &args, depth + 1);
   }
+  if (err == STATUS_OK)
+    err = dump_c_line(out, depth++, "{");
+  if (err == STATUS_OK)
+    err = dump_c_line(out, depth, "CS_LOCAL_MAP map;");
+  if (err == STATUS_OK && dc->eval_val)
+    err = dump_c_line(out, depth, "CSARG val;");
+  if (err == STATUS_OK)
+    err = dump_c_line(out, depth, "int start = 0, end = 0, step = 1;");
+  if (err == STATUS_OK)
+    err = dump_c_line(out, depth, "int x, var, iter;\n");
+  if (err == STATUS_OK)
+    err = string_append(out, args.buf);
+  string_clear(&args);
+  if (err) return nerr_pass(err);
+  err = dump_c_line(out, depth, "if (((step < 0) && (start < end)) || ((step > 0) && (end < start)) || step == 0)");
+  if (err) return nerr_pass(err);
+  err = dump_c_line(out, depth + 1, "iter = 0;");
+  if (err) return nerr_pass(err);
+  err = dump_c_line(out, depth, "else");
+  if (err) return nerr_pass(err);
+  err = dump_c_line(out, depth + 1, "iter = abs((end - start) / step + 1);");
+  if (err) return nerr_pass(err);
+  err = dump_c_line(out, depth, "if (iter > 0)");
+  if (err) return nerr_pass(err);
+  err = dump_c_line(out, depth++, "{");
+  if (err) return nerr_pass(err);
+  err = dump_c_map(out, depth, "CS_TYPE_NUM", node->arg1.s, 1);
+  if (err) return nerr_pass(err);
+  err = dump_c_line(out, depth, "for (x = 0, var = start; x < iter; x++, var += step)");
+  if (err) return nerr_pass(err);
+  err = dump_c_line(out, depth++, "{");
+  if (err) return nerr_pass(err);
+  err = dump_c_line(out, depth, "if (x == iter - 1) map.last = 1;");
+  if (err) return nerr_pass(err);
+  err = dump_c_line(out, depth, "map.n = var;");
+  if (err) return nerr_pass(err);
+  err = dump_c_line(out, depth, "map.escape_status = CS_ES_TRUSTED;");
+  if (err) return nerr_pass(err);
+  err = dump_c_line(out, depth, "err = block_%d(cs, parse);", body);
+  if (err) return nerr_pass(err);
+  err = dump_c_map_next(out, depth);
+  if (err) return nerr_pass(err);
+  err = dump_c_line(out, --depth, "}");
+  if (err) return nerr_pass(err);
+  err = dump_c_line(out, depth, "parse->locals = map.next;");
+  if (err) return nerr_pass(err);
+  err = dump_c_line(out, depth, "if (err) return err;");
+  if (err) return nerr_pass(err);
+  err = dump_c_line(out, --depth, "}");
+  if (err) return nerr_pass(err);
+  return nerr_pass(dump_c_line(out, --depth, "}"));
+}
 
-  /* Free list of errors */
-  if (my_parse->err_list != NULL) {
-    CS_ERROR *ptr;
+/* Writes the CS_MACRO for macro, if it hasn't been yet, and sets num to
+ * its number.  body is the number of the block of its body. */
+static NEOERR *dump_c_macro (CS_DUMP_C *dc, CS_MACRO *macro, int *num,
+                             int *body)
+{
+  NEOERR *err;
+  CS_MACRO *m;
+  int x, args;
 
-    while (my_parse->err_list) {
-      ptr = my_parse->err_list->next;
-      free(my_parse->err_list->err);
-      free(my_parse->err_list);
-      my_parse->err_list = ptr;
+  for (x = 0; x < uListLength(dc->called); x++)
+  {
+    uListGet(dc->called, x, (void *)&m);
+    if (m == macro)
+    {
+      *num = x;
+      return nerr_pass(dump_c_block(dc, macro->tree->case_0, body));
     }
   }
-
-  free(my_parse);
-  *parse = NULL;
+  *num = x;
+  err = uListAppend(dc->called, macro);
+  if (err) return nerr_pass(err);
+  err = dump_c_arg(dc, macro->args, &args);
+  if (err) return nerr_pass(err);
+  err = string_appendf(&(dc->macros), "static CS_MACRO M_%d = {", *num);
+  if (err) return nerr_pass(err);
+  err = dump_c_string(&(dc->macros), macro->name, 0);
+  if (err) return nerr_pass(err);
+  err = string_appendf(&(dc->macros), ", %d, ", macro->n_args);
+  if (err) return nerr_pass(err);
+  err = dump_c_ref(&(dc->macros), args);
+  if (err) return nerr_pass(err);
+  err = string_append(&(dc->macros), ", NULL, NULL};\n");
+  if (err) return nerr_pass(err);
+  /* After the macro is recorded, it may call itself */
+  return nerr_pass(dump_c_block(dc, macro->tree->case_0, body));
 }
 
-/* **** CS Debug Dumps ******************************************** */
-static NEOERR *dump_node (CSPARSE *parse, CSTREE *node, int depth, void *ctx,
-    CSOUTFUNC cb, char *buf, int blen)
+static NEOERR *dump_c_nodes (CS_DUMP_C *dc, CSTREE *node, STRING *out,
+                             int depth)
 {
-  NEOERR *err;
+  NEOERR *err = STATUS_OK;
+  NEOERR* (*eval)(CSPARSE *parse, CSTREE *node, CSTREE **next);
+  int arg1, arg2, num, body;
 
-  while (node != NULL)
+  for (; node != NULL; node = node->next)
   {
-    snprintf (buf, blen, "%*s %s ", depth, "", Commands[node->cmd].cmd);
-    err = cb (ctx, buf);
-    if (err) return nerr_pass (err);
-    if (node->cmd)
+    eval = Commands[node->cmd].eval_handler;
+    if (eval == skip_eval)
+      continue;
+
+    if (eval == literal_eval)
     {
-      if (node->arg1.op_type)
-      {
-	if (node->arg1.op_type == CS_TYPE_NUM)
-	{
-	  snprintf (buf, blen, "%ld ", node->arg1.n);
-	}
-	else if (node->arg1.op_type == CS_TYPE_MACRO)
-	{
-	  snprintf (buf, blen, "%s ", node->arg1.macro->name);
-	}
-	else
-	{
-	  snprintf (buf, blen, "%s ", node->arg1.s);
-	}
-	err = cb (ctx, buf);
-	if (err) return nerr_pass (err);
-      }
-      if (node->arg2.op_type)
-      {
-	if (node->arg2.op_type == CS_TYPE_NUM)
-	{
-	  snprintf (buf, blen, "%ld", node->arg2.n);
-	}
-	else
-	{
-	  snprintf (buf, blen, "%s", node->arg2.s);
-	}
-	err = cb (ctx, buf);
-	if (err) return nerr_pass (err);
-      }
-      if (node->vargs)
-      {
-	CSARG *arg;
-	arg = node->vargs;
-	while (arg)
-	{
-	  if (arg->op_type == CS_TYPE_NUM)
-	  {
-	    snprintf (buf, blen, "%ld ", arg->n);
-	  }
-	  else
-	  {
-	    snprintf (buf, blen, "%s ", arg->s);
-	  }
-	  err = cb (ctx, buf);
-	  if (err) return nerr_pass (err);
-	  arg = arg->next;
-	}
-      }
+      if (node->arg1.s == NULL)
+        continue;
+      err = string_appendf(out, "%*serr = cs->write(parse, ", depth * 2, "");
+      if (err) return nerr_pass(err);
+      err = dump_c_string(out, node->arg1.s, depth + 2);
+      if (err) return nerr_pass(err);
+      err = string_append(out, ");\n");
+      if (err) return nerr_pass(err);
+      err = dump_c_line(out, depth, "if (err) return err;");
     }
-    err = cb (ctx, "\n");
-    if (err) return nerr_pass (err);
-    if (node->case_0)
+    else if (eval == var_eval)
     {
-      snprintf (buf, blen, "%*s %s\n", depth, "", "Case 0");
-      err = cb (ctx, buf);
-      if (err) return nerr_pass (err);
-      err = dump_node (parse, node->case_0, depth+1, ctx, cb, buf, blen);
-      if (err) return nerr_pass (err);
+      err = dump_c_var(dc, node, out, depth, 0);
     }
-    if (node->case_1)
+    else if (eval == alt_eval)
     {
-      snprintf (buf, blen, "%*s %s\n", depth, "", "Case 1");
-      err = cb (ctx, buf);
-      if (err) return nerr_pass (err);
-      err = dump_node (parse, node->case_1, depth+1, ctx, cb, buf, blen);
-      if (err) return nerr_pass (err);
+      err = dump_c_var(dc, node, out, depth, 1);
     }
-    node = node->next;
+    else if (eval == if_eval)
+    {
+      err = dump_c_if(dc, node, out, depth, 0);
+    }
+    else if (eval == each_eval || eval == with_eval)
+    {
+      err = dump_c_each(dc, node, out, depth, eval == each_eval);
+    }
+    else if (eval == loop_eval)
+    {
+      err = dump_c_loop(dc, node, out, depth);
+    }
+    else if (eval == escape_eval)
+    {
+      err = dump_c_line(out, depth, "{");
+      if (err) return nerr_pass(err);
+      err = dump_c_nodes(dc, node->case_0, out, depth + 1);
+      if (err) return nerr_pass(err);
+      err = dump_c_line(out, depth, "}");
+    }
+    else if (eval == include_eval)
+    {
+      /* Only cached includes have a tree, which is shared by every
+       * include of the file */
+      if (node->case_0 == NULL)
+        continue;
+      err = dump_c_block(dc, node->case_0, &body);
+      if (err) return nerr_pass(err);
+      err = dump_c_line(out, depth, "err = block_%d(cs, parse);", body);
+      if (err) return nerr_pass(err);
+      err = dump_c_line(out, depth, "if (err) return err;");
+    }
+    else if (eval == call_eval)
+    {
+      err = dump_c_macro(dc, node->arg1.macro, &num, &body);
+      if (err) return nerr_pass(err);
+      err = dump_c_arg(dc, node->vargs, &arg1);
+      if (err) return nerr_pass(err);
+      err = string_appendf(out, "%*serr = cs->call(parse, &M_%d, ", depth * 2,
+                           "", num);
+      if (err) return nerr_pass(err);
+      err = dump_c_ref(out, arg1);
+      if (err) return nerr_pass(err);
+      err = string_appendf(out, ", %d, block_%d);\n", node->escape, body);
+      if (err) return nerr_pass(err);
+      err = dump_c_line(out, depth, "if (err) return err;");
+    }
+    else if (eval == name_eval || eval == set_eval || eval == lvar_eval ||
+             eval == linclude_eval || eval == contenttype_eval)
+    {
+      /* The library evaluates the node on its own */
+      err = dump_c_arg(dc, node->arg1.op_type ? &(node->arg1) : NULL, &arg1);
+      if (err) return nerr_pass(err);
+      err = dump_c_arg(dc, node->arg2.op_type ? &(node->arg2) : NULL, &arg2);
+      if (err) return nerr_pass(err);
+      err = string_appendf(out, "%*serr = cs->node(parse, %d /* %s */, %d, %d, ",
+                           depth * 2, "", node->cmd, Commands[node->cmd].cmd,
+                           node->flags, node->escape);
+      if (err) return nerr_pass(err);
+      err = dump_c_ref(out, arg1);
+      if (err) return nerr_pass(err);
+      err = string_append(out, ", ");
+      if (err) return nerr_pass(err);
+      err = dump_c_ref(out, arg2);
+      if (err) return nerr_pass(err);
+      err = string_append(out, ");\n");
+      if (err) return nerr_pass(err);
+      err = dump_c_line(out, depth, "if (err) return err;");
+    }
+    else
+    {
+      return nerr_raise (NERR_ASSERT, "Unable to compile %s",
+                         Commands[node->cmd].cmd);
+    }
+    if (err) return nerr_pass(err);
   }
   return STATUS_OK;
 }
 
-NEOERR *cs_dump (CSPARSE *parse, void *ctx, CSOUTFUNC cb)
-{
-  CSTREE *node;
-  char buf[4096];
-
-  if (parse->tree == NULL)
-    return nerr_raise (NERR_ASSERT, "No parse tree exists");
-
-  node = parse->tree;
-  return nerr_pass (dump_node (parse, node, 0, ctx, cb, buf, sizeof(buf)));
-}
-
-#if 0
-static char *node_name (CSTREE *node)
+/* Writes the block function for the list of nodes tree, if it hasn't been
+ * yet, and sets num to its number */
+static NEOERR *dump_c_block (CS_DUMP_C *dc, CSTREE *tree, int *num)
 {
-  static char buf[256];
+  NEOERR *err;
+  STRING body;
+  CSTREE *t;
+  int x;
 
-  if (node == NULL)
-    snprintf (buf, sizeof(buf), "NULL");
-  else
-    snprintf (buf, sizeof(buf), "%s_%08x", Commands[node->cmd].cmd,
-	node->node_num);
+  for (x = 0; x < uListLength(dc->trees); x++)
+  {
+    uListGet(dc->trees, x, (void *)&t);
+    if (t == tree)
+    {
+      *num = x;
+      return STATUS_OK;
+    }
+  }
+  *num = x;
+  err = uListAppend(dc->trees, tree);
+  if (err) return nerr_pass(err);
 
-  return buf;
+  string_init(&body);
+  err = dump_c_nodes(dc, tree, &body, 1);
+  if (err == STATUS_OK)
+    err = string_appendf(&(dc->blocks),
+        "static NEOERR *block_%d (const CS_AOT_API *cs, CSPARSE *parse)\n"
+        "{\n  NEOERR *err = STATUS_OK;\n\n%s  return err;\n}\n\n",
+        *num, body.buf ? body.buf : "");
+  string_clear(&body);
+  return nerr_pass(err);
 }
 
-static NEOERR *dump_node_pre_c (CSPARSE *parse, CSTREE *node, FILE *fp)
+/* Adds the files parse was parsed from, and the files of its cached
+ * includes, to files */
+static NEOERR *dump_c_files (CSPARSE *parse, ULIST *files)
 {
   NEOERR *err;
+  CS_FILE_STAT *fs, *other;
+  CS_TEMPLATE *include;
+  int x, y;
 
-  while (node != NULL)
+  for (x = 0; x < uListLength(parse->cache_files); x++)
   {
-    fprintf (fp, "CSTREE %s;\n", node_name(node));
-    if (node->case_0)
-    {
-      err = dump_node_pre_c (parse, node->case_0, fp);
-      if (err != STATUS_OK) nerr_pass (err);
-    }
-    if (node->case_1)
+    uListGet(parse->cache_files, x, (void *)&fs);
+    for (y = 0; y < uListLength(files); y++)
     {
-      err = dump_node_pre_c (parse, node->case_1, fp);
-      if (err != STATUS_OK) nerr_pass (err);
+      uListGet(files, y, (void *)&other);
+      if (!strcmp(fs->path, other->path))
+        break;
     }
-    node = node->next;
+    if (y < uListLength(files))
+      continue;
+    err = uListAppend(files, fs);
+    if (err) return nerr_pass(err);
+  }
+  for (x = 0; parse->includes && x < uListLength(parse->includes); x++)
+  {
+    uListGet(parse->includes, x, (void *)&include);
+    err = dump_c_files(include->parse, files);
+    if (err) return nerr_pass(err);
   }
   return STATUS_OK;
 }
 
-static NEOERR *dump_node_c (CSPARSE *parse, CSTREE *node, FILE *fp)
+static NEOERR *dump_c_module (CS_DUMP_C *dc, STRING *out)
 {
   NEOERR *err;
-  char *s;
+  CSPARSE *parse = dc->parse;
+  STACK_ENTRY *entry;
+  CS_FILE_STAT *fs;
+  ULIST *files = NULL;
+  char *settings, *name;
+  int x, render;
 
-  while (node != NULL)
+  if (parse->cache_files == NULL || uListLength(parse->cache_files) == 0)
+    return nerr_raise (NERR_ASSERT,
+        "Only templates from the template cache can be compiled");
+  if (parse->dynamic || parse->audit_mode)
+    return nerr_raise (NERR_ASSERT,
+        "Unable to compile a template which depends on the hdf");
+  if (parse->auto_ctx.global_enabled == 1)
+    return nerr_raise (NERR_ASSERT,
+        "Unable to compile a template which uses auto escaping");
+  err = uListGet(parse->stack, 0, (void *)&entry);
+  if (err) return nerr_pass(err);
+
+  err = dump_c_block(dc, parse->tree, &render);
+  if (err) return nerr_pass(err);
+
+  err = string_append(out,
+      "/* Auto-generated file: DO NOT EDIT */\n"
+      "#include <stdlib.h>\n"
+      "#include <string.h>\n\n"
+      "#include \"cs/cs.h\"\n\n");
+  if (err) return nerr_pass(err);
+  if (dc->num_args)
   {
-    fprintf (fp, "CSTREE %s =\n\t{%d, %d, %d, ", node_name(node), node->node_num,
-	node->cmd, node->flags);
-    s = repr_string_alloc (node->arg1.s);
-    if (s == NULL)
-      return nerr_raise(NERR_NOMEM, "Unable to allocate space for repr");
-    fprintf (fp, "\n\t  { %d, %s, %ld }, ", node->arg1.op_type, s, node->arg1.n);
-    free(s);
-    s = repr_string_alloc (node->arg2.s);
-    if (s == NULL)
-      return nerr_raise(NERR_NOMEM, "Unable to allocate space for repr");
-    fprintf (fp, "\n\t  { %d, %s, %ld }, ", node->arg2.op_type, s, node->arg2.n);
-    free(s);
-    if (node->case_0)
-      fprintf (fp, "\n\t%d, &%s, ", node->op, node_name(node->case_0));
-    else
-      fprintf (fp, "\n\t%d, NULL, ", node->op);
-    if (node->case_1)
-      fprintf (fp, "&%s, ", node_name(node->case_1));
-    else
-      fprintf (fp, "NULL, ");
-    if (node->next)
-      fprintf (fp, "&%s};\n\n", node_name(node->next));
-    else
-      fprintf (fp, "NULL};\n\n");
-    if (node->case_0)
-    {
-      err = dump_node_c (parse, node->case_0, fp);
-      if (err != STATUS_OK) nerr_pass (err);
-    }
-    if (node->case_1)
+    err = string_appendf(out, "static CSARG E[%d];\n\n", dc->num_args);
+    if (err) return nerr_pass(err);
+    err = string_appendf(out, "static CSARG E[%d] = {\n%s};\n\n",
+                         dc->num_args, dc->args.buf);
+    if (err) return nerr_pass(err);
+  }
+  if (dc->macros.len)
+  {
+    err = string_appendf(out, "%s\n", dc->macros.buf);
+    if (err) return nerr_pass(err);
+  }
+  for (x = 0; x < uListLength(dc->trees); x++)
+  {
+    err = string_appendf(out,
+        "static NEOERR *block_%d (const CS_AOT_API *cs, CSPARSE *parse);\n", x);
+    if (err) return nerr_pass(err);
+  }
+  err = string_appendf(out, "\n%s", dc->blocks.buf);
+  if (err) return nerr_pass(err);
+
+  err = uListInit(&files, 10, 0);
+  if (err) return nerr_pass(err);
+  do
+  {
+    err = dump_c_files(parse, files);
+    if (err) break;
+    err = string_append(out, "static const CS_AOT_FILE Files[] = {\n");
+    if (err) break;
+    for (x = 0; x < uListLength(files); x++)
     {
-      err = dump_node_c (parse, node->case_1, fp);
-      if (err != STATUS_OK) nerr_pass (err);
+      uListGet(files, x, (void *)&fs);
+      err = string_append(out, "  {");
+      if (err) break;
+      err = dump_c_string(out, fs->path, 0);
+      if (err) break;
+      err = string_appendf(out, ", %ld, %ld},\n", (long int) fs->mtime,
+                           (long int) fs->size);
+      if (err) break;
     }
-    node = node->next;
+    if (err) break;
+    err = string_append(out, "  {NULL, 0, 0}\n};\n\n");
+  } while (0);
+  uListDestroy(&files, 0);
+  if (err) return nerr_pass(err);
+
+  err = string_append(out, "static const char *Functions[] = {\n");
+  if (err) return nerr_pass(err);
+  for (x = 0; x < uListLength(dc->functions); x++)
+  {
+    uListGet(dc->functions, x, (void *)&name);
+    err = string_append(out, "  ");
+    if (err) return nerr_pass(err);
+    err = dump_c_string(out, name, 0);
+    if (err) return nerr_pass(err);
+    err = string_append(out, ",\n");
+    if (err) return nerr_pass(err);
   }
-  return STATUS_OK;
+  err = string_append(out, "  NULL\n};\n\n");
+  if (err) return nerr_pass(err);
+
+  /* The settings the template cache would look for, modules never auto
+   * escape */
+  settings = cache_settings_alloc(parse->tag, entry->escape, 0, 0,
+                                  parse->frozen);
+  if (settings == NULL)
+    return nerr_raise (NERR_NOMEM, "Unable to allocate template settings");
+  uListGet(parse->cache_files, 0, (void *)&fs);
+  err = string_appendf(out, "const CS_AOT_MODULE cs_module = {\n"
+                       "  CS_AOT_VERSION,\n  ");
+  if (err == STATUS_OK)
+    err = dump_c_string(out, fs->path, 0);
+  if (err == STATUS_OK)
+    err = string_append(out, ",\n  ");
+  if (err == STATUS_OK)
+    err = dump_c_string(out, settings, 0);
+  free(settings);
+  if (err) return nerr_pass(err);
+  return nerr_pass(string_appendf(out,
+        ",\n  Files,\n  Functions,\n  block_%d\n};\n", render));
 }
 
-NEOERR *cs_dump_c (CSPARSE *parse, char *path)
+NEOERR *cs_dump_c (CSPARSE *parse, const char *path)
 {
-  CSTREE *node;
-  FILE *fp;
   NEOERR *err;
+  CS_DUMP_C dc;
+  STRING out;
+  FILE *fp;
 
   if (parse->tree == NULL)
     return nerr_raise (NERR_ASSERT, "No parse tree exists");
 
-  fp = fopen(path, "w");
-  if (fp == NULL)
+  memset(&dc, 0, sizeof(dc));
+  dc.parse = parse;
+  string_init(&(dc.args));
+  string_init(&(dc.macros));
+  string_init(&(dc.blocks));
+  string_init(&out);
+
+  do
   {
-    return nerr_raise (NERR_SYSTEM,
-	"Unable to open file %s for writing: [%d] %s", path, errno,
-	strerror(errno));
-  }
+    err = uListInit(&(dc.trees), 10, 0);
+    if (err) break;
+    err = uListInit(&(dc.called), 10, 0);
+    if (err) break;
+    err = uListInit(&(dc.functions), 10, 0);
+    if (err) break;
+    err = dump_c_module(&dc, &out);
+    if (err) break;
 
-  fprintf(fp, "/* Auto-generated file: DO NOT EDIT */\n");
-  fprintf(fp, "#include <stdlib.h>\n\n");
-  fprintf(fp, "#include \"cs.h\"\n");
-  node = parse->tree;
-  err = dump_node_pre_c (parse, node, fp);
-  fprintf(fp, "\n");
-  err = dump_node_c (parse, node, fp);
-  fclose(fp);
-  return nerr_pass (err);
+    fp = fopen(path, "w");
+    if (fp == NULL)
+    {
+      err = nerr_raise_errno (NERR_IO, "Unable to open %s for writing", path);
+      break;
+    }
+    if (fwrite(out.buf, 1, out.len, fp) != (size_t) out.len)
+      err = nerr_raise_errno (NERR_IO, "Unable to write %s", path);
+    if (fclose(fp) && err == STATUS_OK)
+      err = nerr_raise_errno (NERR_IO, "Unable to write %s", path);
+  } while (0);
+
+  uListDestroy(&(dc.trees), 0);
+  uListDestroy(&(dc.called), 0);
+  uListDestroy(&(dc.functions), 0);
+  string_clear(&(dc.args));
+  string_clear(&(dc.macros));
+  string_clear(&(dc.blocks));
+  string_clear(&out);
+  return nerr_pass(err);
 }
-#endif
@@ -40,9 +40,18 @@ NEOERR *test_strfunc(const char *str, char **ret)
   return STATUS_OK;
 }
 
+static HDF *GlobalHdf = NULL;
+
+static NEOERR *cache_init (CSPARSE *parse)
+{
+  parse->global_hdf = GlobalHdf;
+  return nerr_pass(cs_register_strfunc(parse, "test_strfunc", test_strfunc));
+}
+
 void usage(char *argv0)
 {
-  ne_warn("Usage: %s [-v] [-parse_must_fail] [-global_hdf <file.hdf>] "
+  ne_warn("Usage: %s [-v] [-parse_must_fail] [-template] [-cache] "
+          "[-overlay] [-module <file.so>] [-global_hdf <file.hdf>] "
           "<file.hdf> <file.cs>", argv0);
 }
 
@@ -144,14 +153,39 @@ int hdf_compare(HDF *hdf_a, HDF *hdf_b)
   return 0;
 }
 
+/* Checks that hdf still has the contents of filename */
+static int hdf_unchanged(HDF *hdf, char *filename)
+{
+  HDF *hdf_again;
+
+  if (hdf_init_load_file_or_err(&hdf_again, filename) != 0)
+  {
+    return -1;
+  }
+  if (hdf_compare(hdf, hdf_again) != 0)
+  {
+    ne_warn("HDF trees don't match");
+    hdf_destroy(&hdf_again);
+    return -1;
+  }
+  hdf_destroy(&hdf_again);
+  return 0;
+}
+
 int main (int argc, char *argv[])
 {
   NEOERR *err;
   CSPARSE *parse;
+  CS_TEMPLATE *tmpl = NULL;
   HDF *global_hdf = NULL;
   HDF *hdf;
+  HDF *base_hdf = NULL;
   int verbose = 0;
   int parse_must_fail = 0;
+  int use_template = 0;
+  int use_cache = 0;
+  int use_overlay = 0;
+  char *module_file = NULL;
   char *global_hdf_file = NULL;
   char *hdf_file, *cs_file;
   int arg_position = 1;
@@ -165,6 +199,28 @@ int main (int argc, char *argv[])
     {
       parse_must_fail = 1;
     }
+    else if (!strcmp(argv[arg_position], "-template"))
+    {
+      use_template = 1;
+    }
+    else if (!strcmp(argv[arg_position], "-cache"))
+    {
+      use_cache = 1;
+    }
+    else if (!strcmp(argv[arg_position], "-overlay"))
+    {
+      use_overlay = 1;
+    }
+    else if (!strcmp(argv[arg_position], "-module"))
+    {
+      if (++arg_position >= argc) {
+        usage(argv[0]);
+        return -1;
+      }
+      /* The module is only used through the cache */
+      module_file = argv[arg_position];
+      use_cache = 1;
+    }
     else if (!strcmp(argv[arg_position], "-global_hdf"))
     {
       if (++arg_position >= argc) {
@@ -192,6 +248,17 @@ int main (int argc, char *argv[])
   {
     return -1;
   }
+  if (use_overlay)
+  {
+    /* Render over an overlay of the data, which must leave it as it was */
+    base_hdf = hdf;
+    err = hdf_init_overlay(&hdf, base_hdf, 0);
+    if (err != STATUS_OK)
+    {
+      nerr_warn_error(err);
+      return -1;
+    }
+  }
 
   if (global_hdf_file)
   {
@@ -202,6 +269,51 @@ int main (int argc, char *argv[])
   }
 
   printf ("Parsing %s\n", cs_file);
+  if (use_cache)
+  {
+    /* Get the template twice, the second time should come from the
+     * cache */
+    GlobalHdf = global_hdf;
+    err = STATUS_OK;
+    if (module_file != NULL)
+      err = cs_template_cache_load(module_file);
+    if (err == STATUS_OK)
+      err = cs_template_cache_get(&tmpl, hdf, cs_file, cache_init);
+    if (err == STATUS_OK)
+    {
+      cs_template_destroy(&tmpl);
+      err = cs_template_cache_get(&tmpl, hdf, cs_file, cache_init);
+    }
+    if (err == STATUS_OK && module_file != NULL && tmpl->module == NULL)
+      err = nerr_raise(NERR_ASSERT, "%s wasn't used for %s", module_file,
+                       cs_file);
+    if (err == STATUS_OK)
+      err = cs_template_render(tmpl, hdf, NULL, output);
+    if (err != STATUS_OK)
+    {
+      if (parse_must_fail)
+        return 0;
+      err = nerr_pass(err);
+      nerr_warn_error(err);
+      return -1;
+    }
+    if (verbose)
+    {
+      printf ("\n-----------------------\nCS DUMP\n");
+      err = cs_dump(tmpl->parse, NULL, output);
+    }
+    cs_template_destroy(&tmpl);
+    cs_template_cache_clear();
+    hdf_destroy(&hdf);
+    hdf_destroy(&global_hdf);
+    if (base_hdf != NULL && hdf_unchanged(base_hdf, hdf_file) != 0)
+    {
+      return -1;
+    }
+    hdf_destroy(&base_hdf);
+    return parse_must_fail ? -1 : 0;
+  }
+
   err = cs_init (&parse, hdf);
   if (err != STATUS_OK)
   {
@@ -233,7 +345,19 @@ int main (int argc, char *argv[])
     }
   }
 
-  err = cs_render(parse, NULL, output);
+  if (use_template)
+  {
+    err = cs_template_init(&tmpl, &parse);
+    if (err == STATUS_OK)
+    {
+      parse = tmpl->parse;
+      err = cs_template_render(tmpl, hdf, NULL, output);
+    }
+  }
+  else
+  {
+    err = cs_render(parse, NULL, output);
+  }
   if (err != STATUS_OK)
   {
     if ( !parse_must_fail)
@@ -254,7 +378,10 @@ int main (int argc, char *argv[])
     err = cs_dump(parse, NULL, output);
   }
 
-  cs_destroy (&parse);
+  if (tmpl != NULL)
+    cs_template_destroy (&tmpl);
+  else
+    cs_destroy (&parse);
 
   if (verbose)
   {
@@ -268,23 +395,17 @@ int main (int argc, char *argv[])
   }
   hdf_destroy(&hdf);
 
-  if (global_hdf)
+  /* validate that the global hdf didn't change */
+  if (global_hdf && hdf_unchanged(global_hdf, global_hdf_file) != 0)
   {
-    /* validate that the global hdf didn't change */
-    HDF *global_hdf_again;
-
-    if (hdf_init_load_file_or_err(&global_hdf_again, global_hdf_file) != 0)
-    {
-      return -1;
-    }
-    if (hdf_compare(global_hdf, global_hdf_again) != 0)
-    {
-      ne_warn("HDF trees don't match");
-      return -1;
-    }
-    hdf_destroy(&global_hdf_again);
+    return -1;
   }
   hdf_destroy(&global_hdf);
+  if (base_hdf != NULL && hdf_unchanged(base_hdf, hdf_file) != 0)
+  {
+    return -1;
+  }
+  hdf_destroy(&base_hdf);
 
   if (parse_must_fail)
   {
@@ -0,0 +1,183 @@
+/*
+ * Copyright 2001-2004 Brandon Long
+ * All Rights Reserved.
+ *
+ * ClearSilver Templating System
+ *
+ * This code is made available under the terms of the ClearSilver License.
+ * http://www.clearsilver.net/license.hdf
+ *
+ */
+
+/* Renders templates over an overlay (see hdf_init_overlay) of a data set
+ * with a wide level, both with cs_render and with a CS_TEMPLATE.  A render
+ * which only reads must leave the levels of the base unshadowed, and the
+ * changes made through locals bound to nodes of the base must end up in
+ * the overlay. */
+
+#include "cs_config.h"
+
+#include <stdio.h>
+#include <string.h>
+#include "util/neo_misc.h"
+#include "util/neo_hdf.h"
+#include "util/neo_str.h"
+#include "cs.h"
+
+#define WIDE 5000
+
+/* Only reads Lang, through var, each, with, call and functions */
+static char *ReadCs =
+  "<?cs var:Lang.k7 ?>|"
+  "<?cs each:l = Lang ?><?cs if:name(l) == \"k4999\" ?><?cs var:l ?>"
+  "<?cs /if ?><?cs /each ?>|"
+  "<?cs with:w = Lang ?><?cs var:w.k8 ?><?cs /with ?>|"
+  "<?cs def:show(x) ?><?cs var:x.k9 ?><?cs /def ?><?cs call:show(Lang) ?>|"
+  "<?cs var:subcount(Lang) ?>";
+static char *ReadGold = "v7|v4999|v8|v9|5000";
+
+/* Writes through locals bound to nodes of the base, and reads a local
+ * bound before its level was shadowed */
+static char *WriteCs =
+  "<?cs each:i = Items ?><?cs set:i.Seen = #1 ?><?cs /each ?>"
+  "<?cs with:w = Lang ?><?cs set:Lang.k7 = \"new\" ?>"
+  "<?cs var:w.k7 ?><?cs /with ?>|"
+  "<?cs each:i = Items ?><?cs var:i.Seen ?><?cs /each ?>";
+static char *WriteGold = "new|111";
+
+static NEOERR *render_cb (void *ctx, char *s)
+{
+  return nerr_pass(string_append((STRING *)ctx, s));
+}
+
+static NEOERR *build (HDF *hdf)
+{
+  NEOERR *err;
+  char name[64], value[64];
+  int i;
+
+  for (i = 0; i < WIDE; i++)
+  {
+    snprintf(name, sizeof(name), "Lang.k%d", i);
+    snprintf(value, sizeof(value), "v%d", i);
+    err = hdf_set_value(hdf, name, value);
+    if (err) return nerr_pass(err);
+  }
+  for (i = 0; i < 3; i++)
+  {
+    snprintf(name, sizeof(name), "Items.%d.Name", i);
+    err = hdf_set_value(hdf, name, "item");
+    if (err) return nerr_pass(err);
+  }
+  return STATUS_OK;
+}
+
+/* Renders cs over a new overlay of base, into out */
+static NEOERR *render (HDF *base, char *cs, int use_template, HDF **overlay,
+                       STRING *out)
+{
+  NEOERR *err;
+  CSPARSE *parse = NULL;
+  CS_TEMPLATE *tmpl = NULL;
+  char *ibuf;
+
+  err = hdf_init_overlay(overlay, base, 0);
+  if (err) return nerr_pass(err);
+  err = cs_init(&parse, *overlay);
+  if (err) return nerr_pass(err);
+  ibuf = strdup(cs);
+  if (ibuf == NULL)
+  {
+    cs_destroy(&parse);
+    return nerr_raise(NERR_NOMEM, "Unable to copy template");
+  }
+  err = cs_parse_string(parse, ibuf, strlen(ibuf));
+  if (err == STATUS_OK && use_template)
+  {
+    err = cs_template_init(&tmpl, &parse);
+    if (err == STATUS_OK)
+      err = cs_template_render(tmpl, *overlay, out, render_cb);
+  }
+  else if (err == STATUS_OK)
+  {
+    err = cs_render(parse, out, render_cb);
+  }
+  cs_template_destroy(&tmpl);
+  cs_destroy(&parse);
+  return nerr_pass(err);
+}
+
+static int check (int ok, const char *what, int use_template)
+{
+  if (!ok)
+    ne_warn("FAIL: %s (%s)", what, use_template ? "template" : "render");
+  return ok ? 0 : 1;
+}
+
+static int run (HDF *base, int use_template)
+{
+  NEOERR *err;
+  HDF *overlay = NULL;
+  STRING out;
+  int failed = 0;
+
+  string_init(&out);
+  err = render(base, ReadCs, use_template, &overlay, &out);
+  if (err)
+  {
+    nerr_log_error(err);
+    return 1;
+  }
+  failed += check(out.buf != NULL && !strcmp(out.buf, ReadGold),
+                  "read output", use_template);
+  failed += check(hdf_obj_is_base(overlay, hdf_peek_obj(overlay, "Lang")),
+                  "reading shadowed the top level", use_template);
+  failed += check(hdf_obj_is_base(overlay, hdf_peek_obj(overlay, "Lang.k7")),
+                  "reading shadowed Lang", use_template);
+  hdf_destroy(&overlay);
+  string_clear(&out);
+
+  err = render(base, WriteCs, use_template, &overlay, &out);
+  if (err)
+  {
+    nerr_log_error(err);
+    return 1;
+  }
+  failed += check(out.buf != NULL && !strcmp(out.buf, WriteGold),
+                  "write output", use_template);
+  failed += check(!strcmp(hdf_get_value(overlay, "Items.2.Seen", ""), "1"),
+                  "set through an each local", use_template);
+  failed += check(!hdf_obj_is_base(overlay,
+                                   hdf_peek_obj(overlay, "Items.0.Seen")),
+                  "set in the base", use_template);
+  hdf_destroy(&overlay);
+  string_clear(&out);
+
+  failed += check(hdf_get_obj(base, "Items.0.Seen") == NULL &&
+                  !strcmp(hdf_get_value(base, "Lang.k7", ""), "v7"),
+                  "base changed", use_template);
+  return failed;
+}
+
+int main (int argc, char *argv[])
+{
+  NEOERR *err;
+  HDF *base;
+  int failed = 0;
+
+  err = hdf_init(&base);
+  if (err == STATUS_OK)
+    err = build(base);
+  if (err)
+  {
+    nerr_log_error(err);
+    return -1;
+  }
+  failed += run(base, 0);
+  failed += run(base, 1);
+  hdf_destroy(&base);
+
+  if (failed) return -1;
+  printf("Passed overlay tests\n");
+  return 0;
+}
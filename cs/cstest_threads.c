@@ -0,0 +1,277 @@
+/*
+ * Copyright 2001-2004 Brandon Long
+ * All Rights Reserved.
+ *
+ * ClearSilver Templating System
+ *
+ * This code is made available under the terms of the ClearSilver License.
+ * http://www.clearsilver.net/license.hdf
+ *
+ */
+
+/* Renders each test template from multiple threads at once, using a
+ * single CS_TEMPLATE per test, and compares the output of every render
+ * against the .gold file.  Each thread renders against its own copy of
+ * the test hdf. */
+
+#include "cs_config.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#ifdef HAVE_PTHREADS
+#include <pthread.h>
+#endif
+#include "util/neo_misc.h"
+#include "util/neo_hdf.h"
+#include "util/neo_files.h"
+#include "util/neo_str.h"
+#include "cs.h"
+
+#define DEFAULT_THREADS 8
+#define DEFAULT_ITERATIONS 10
+
+typedef struct _test
+{
+  char *cs_file;
+  char *gold;       /* The expected render output, without the header */
+  CS_TEMPLATE *tmpl;
+} CS_THREAD_TEST;
+
+static char *HdfFile = NULL;
+static HDF *GlobalHdf = NULL;
+static CS_THREAD_TEST *Tests = NULL;
+static int NumTests = 0;
+static int Iterations = DEFAULT_ITERATIONS;
+
+static NEOERR *render_cb (void *ctx, char *s)
+{
+  return nerr_pass(string_append((STRING *)ctx, s));
+}
+
+static NEOERR *test_strfunc(const char *str, char **ret)
+{
+  char *s = strdup(str);
+  int x = 0;
+
+  if (s == NULL)
+    return nerr_raise(NERR_NOMEM, "Unable to duplicate string in test_strfunc");
+
+  while (s[x]) {
+    s[x] = tolower(s[x]);
+    x++;
+  }
+  *ret = s;
+  return STATUS_OK;
+}
+
+static NEOERR *load_test (CS_THREAD_TEST *test, HDF *hdf)
+{
+  NEOERR *err;
+  CSPARSE *parse = NULL;
+  char gold_file[PATH_BUF_SIZE];
+  char header[PATH_BUF_SIZE + 20];
+  char *gold;
+
+  snprintf(gold_file, sizeof(gold_file), "%s.gold", test->cs_file);
+  err = ne_load_file(gold_file, &gold);
+  if (err) return nerr_pass(err);
+
+  /* The gold files start with the header printed by cstest */
+  snprintf(header, sizeof(header), "Parsing %s\n", test->cs_file);
+  if (strncmp(gold, header, strlen(header)))
+  {
+    free(gold);
+    return nerr_raise(NERR_ASSERT, "%s doesn't start with %s", gold_file,
+                      header);
+  }
+  test->gold = strdup(gold + strlen(header));
+  free(gold);
+  if (test->gold == NULL)
+    return nerr_raise(NERR_NOMEM, "Unable to allocate gold output");
+
+  do
+  {
+    err = cs_init(&parse, hdf);
+    if (err) break;
+    parse->global_hdf = GlobalHdf;
+    err = cs_register_strfunc(parse, "test_strfunc", test_strfunc);
+    if (err) break;
+    err = cs_parse_file(parse, test->cs_file);
+    if (err) break;
+    err = cs_template_init(&(test->tmpl), &parse);
+  } while (0);
+  cs_destroy(&parse);
+  return nerr_pass(err);
+}
+
+static NEOERR *run_tests (int thread)
+{
+  NEOERR *err = STATUS_OK;
+  HDF *hdf = NULL;
+  STRING str;
+  int x, i;
+
+  string_init(&str);
+  for (i = 0; i < Iterations && err == STATUS_OK; i++)
+  {
+    for (x = 0; x < NumTests; x++)
+    {
+      /* set modifies the hdf, so each render starts with a fresh copy */
+      err = hdf_init(&hdf);
+      if (err) break;
+      err = hdf_read_file(hdf, HdfFile);
+      if (err) break;
+
+      string_clear(&str);
+      err = cs_template_render(Tests[x].tmpl, hdf, &str, render_cb);
+      if (err) break;
+      if (strcmp(str.buf ? str.buf : "", Tests[x].gold))
+      {
+        err = nerr_raise(NERR_ASSERT, "Thread %d: %s output doesn't match",
+                         thread, Tests[x].cs_file);
+        break;
+      }
+      hdf_destroy(&hdf);
+    }
+  }
+  hdf_destroy(&hdf);
+  string_clear(&str);
+  return nerr_pass(err);
+}
+
+#ifdef HAVE_PTHREADS
+static void *thread_start (void *arg)
+{
+  return (void *) run_tests((int)(long) arg);
+}
+#endif
+
+void usage(char *argv0)
+{
+  ne_warn("Usage: %s [-threads <n>] [-iterations <n>] [-global_hdf <file.hdf>] "
+          "<file.hdf> <file.cs> ...", argv0);
+}
+
+int main (int argc, char *argv[])
+{
+  NEOERR *err;
+  HDF *hdf;
+  int nthreads = DEFAULT_THREADS;
+  int arg_position = 1;
+  int failed = 0;
+  int x;
+#ifdef HAVE_PTHREADS
+  pthread_t *threads;
+  void *result;
+#endif
+
+  while (arg_position < argc) {
+    if (!strcmp(argv[arg_position], "-threads") && arg_position + 1 < argc)
+    {
+      nthreads = atoi(argv[++arg_position]);
+    }
+    else if (!strcmp(argv[arg_position], "-iterations") &&
+             arg_position + 1 < argc)
+    {
+      Iterations = atoi(argv[++arg_position]);
+    }
+    else if (!strcmp(argv[arg_position], "-global_hdf") &&
+             arg_position + 1 < argc)
+    {
+      err = hdf_init(&GlobalHdf);
+      if (err == STATUS_OK)
+        err = hdf_read_file(GlobalHdf, argv[++arg_position]);
+      if (err != STATUS_OK)
+      {
+        nerr_warn_error(err);
+        return -1;
+      }
+    }
+    else
+    {
+      break;
+    }
+    arg_position++;
+  }
+
+  if (arg_position + 1 >= argc || nthreads < 1)
+  {
+    usage(argv[0]);
+    return -1;
+  }
+  HdfFile = argv[arg_position++];
+
+  NumTests = argc - arg_position;
+  Tests = (CS_THREAD_TEST *) calloc(NumTests, sizeof(CS_THREAD_TEST));
+  if (Tests == NULL)
+  {
+    ne_warn("Unable to allocate tests");
+    return -1;
+  }
+
+  /* Parse all the templates up front, on the main thread */
+  err = hdf_init(&hdf);
+  if (err == STATUS_OK)
+    err = hdf_read_file(hdf, HdfFile);
+  for (x = 0; x < NumTests && err == STATUS_OK; x++)
+  {
+    Tests[x].cs_file = argv[arg_position + x];
+    err = load_test(&(Tests[x]), hdf);
+  }
+  if (err != STATUS_OK)
+  {
+    nerr_warn_error(err);
+    return -1;
+  }
+
+#ifdef HAVE_PTHREADS
+  threads = (pthread_t *) calloc(nthreads, sizeof(pthread_t));
+  if (threads == NULL)
+  {
+    ne_warn("Unable to allocate threads");
+    return -1;
+  }
+  for (x = 0; x < nthreads; x++)
+  {
+    if (pthread_create(&(threads[x]), NULL, thread_start, (void *)(long) x))
+    {
+      ne_warn("Unable to create thread %d", x);
+      return -1;
+    }
+  }
+  for (x = 0; x < nthreads; x++)
+  {
+    pthread_join(threads[x], &result);
+    err = (NEOERR *) result;
+    if (err != STATUS_OK)
+    {
+      nerr_warn_error(err);
+      failed = 1;
+    }
+  }
+  free(threads);
+#else
+  err = run_tests(0);
+  if (err != STATUS_OK)
+  {
+    nerr_warn_error(err);
+    failed = 1;
+  }
+#endif
+
+  for (x = 0; x < NumTests; x++)
+  {
+    cs_template_destroy(&(Tests[x].tmpl));
+    free(Tests[x].gold);
+  }
+  free(Tests);
+  hdf_destroy(&hdf);
+  hdf_destroy(&GlobalHdf);
+
+  if (failed)
+    return -1;
+  printf("Rendered %d templates %d times from %d threads\n", NumTests,
+         Iterations, nthreads);
+  return 0;
+}
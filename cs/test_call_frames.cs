@@ -0,0 +1,21 @@
+<?cs def:one(a) ?><?cs var:a ?><?cs /def ?>
+<?cs def:three(x, y, z) ?>(<?cs var:x ?><?cs var:y ?><?cs var:z ?>)<?cs /def ?>
+<?cs def:outer(a, b) ?>[<?cs var:a ?><?cs call:three(b, a, "x") ?><?cs var:b ?>]<?cs /def ?>
+Arguments keep their values while deeper calls run:
+<?cs call:outer("1", "2") ?>
+
+Calls with more arguments at the same depth:
+<?cs call:one("a") ?><?cs call:three("b", "c", "d") ?><?cs call:one("e") ?>
+
+Recursion:
+<?cs def:count(n, s) ?><?cs if:n > #0 ?><?cs call:count(n - #1, s + n) ?><?cs /if ?> <?cs var:s ?><?cs /def ?>
+<?cs call:count(#5, "-") ?>
+
+Numbers read as strings:
+<?cs loop:i = #1, #3 ?><?cs call:one(i) ?><?cs call:one(#7 + i) ?><?cs /loop ?>
+
+An lvar calling a macro from a macro:
+<?cs def:lv(d) ?><?cs lvar:Lvar.Macro ?><?cs /def ?><?cs each:d = Days ?><?cs call:lv(d) ?> <?cs /each ?>
+
+Variables and names built at render time:
+<?cs def:abbr(v) ?><?cs var:v.Abbr ?><?cs /def ?><?cs call:abbr(Days.0) ?> <?cs loop:i = #0, #2 ?><?cs call:abbr(Days[i]) ?><?cs /loop ?>
@@ -0,0 +1,28 @@
+Locals which shadow each other:
+<?cs each:x = Days ?><?cs each:x = Outside ?><?cs var:x ?>.<?cs /each ?><?cs var:x.Abbr ?> <?cs /each ?>
+
+Compares on locals:
+<?cs each:d = Days ?><?cs if:d.Abbr == "Wed" || d > #4 ?>[<?cs var:d.Abbr ?>]<?cs elif:!d ?>(<?cs var:d ?>)<?cs else ?><?cs var:d + 1 ?>/<?cs var:d.Abbr + d ?>/<?cs var:#d.Abbr ?> <?cs /if ?><?cs /each ?>
+
+Exists on locals:
+<?cs each:o = Outside ?><?cs var:?o.Inside ?><?cs var:?o.Missing ?><?cs alt:o.Inside.3 ?>-<?cs /alt ?> <?cs /each ?>
+
+Each over a local:
+<?cs each:o = Outside ?><?cs each:i = o.Inside ?><?cs var:i ?><?cs /each ?>,<?cs /each ?>
+
+Set on a loop local:
+<?cs loop:i = #1, #5 ?><?cs var:i ?><?cs if:i == #3 ?><?cs set:i = "three" ?><?cs var:i ?><?cs /if ?> <?cs /loop ?>
+
+Function results, typed when evaluated:
+<?cs each:d = Days ?><?cs var:len(d.Abbr) + d ?>/<?cs var:string.slice(d.Abbr, 0, 2) + d ?>/<?cs var:len(d.Abbr) == string.length(d.Abbr) ?> <?cs /each ?>
+
+A deep expression:
+<?cs var:#1 + (#2 + (#3 + (#4 + (#5 + (#6 + (#7 + (#8 + (#9 + (#10 + (#11 + (#12 + (#13 + (#14 + (#15 + (#16 + (#17 + (#18 + #19))))))))))))))))) ?>
+
+Deeply nested locals:
+<?cs loop:a = #1, #2 ?><?cs loop:b = #1, #1 ?><?cs loop:c = #1, #1 ?><?cs loop:d = #1, #1 ?><?cs loop:e = #1, #1 ?><?cs loop:f = #1, #1 ?><?cs loop:g = #1, #1 ?><?cs loop:h = #1, #1 ?><?cs loop:i = #1, #2 ?><?cs loop:j = #1, #2 ?><?cs var:a + b + c + d + e + f + g + h + i + j ?>,<?cs /loop ?><?cs /loop ?><?cs /loop ?><?cs /loop ?><?cs /loop ?><?cs /loop ?><?cs /loop ?><?cs /loop ?><?cs /loop ?><?cs /loop ?>
+
+Macros called with locals:
+<?cs def:show(v, n) ?><?cs var:n ?>=<?cs var:v ?><?cs each:x = Outside ?><?cs if:first(x) ?>:<?cs var:n ?><?cs /if ?><?cs /each ?> <?cs /def ?>
+<?cs each:d = Days ?><?cs with:w = d.Abbr ?><?cs call:show(w, d) ?><?cs /with ?><?cs /each ?>
+<?cs loop:i = #6, #0, #-2 ?><?cs call:show(Days[i].Abbr, i + #0) ?><?cs /loop ?>
@@ -0,0 +1,21 @@
+Constant expressions:
+<?cs var:"a" + "b" ?> <?cs var:3 * 4 ?> <?cs var:"1" + "2" ?> <?cs var:#12 + "1" ?> <?cs var:#7 / #0 ?> <?cs var:#7 % #0 ?> <?cs var:!"" ?> <?cs var:?"x" ?> <?cs var:("a" + "b") + A ?> <?cs var:"x" == "x" ?> <?cs var:#1 && #0 ?> <?cs var:string.length("abc" + "de") ?> <?cs var:Days[1 + 1].Abbr ?>
+<?cs set:Fold.s = "a" + "<b>" ?><?cs var:Fold.s ?> <?cs loop:i = 2 - 1, 1 + 2 ?><?cs var:i ?><?cs /loop ?>
+
+Literals <?cs # a comment ?>split <?cs if:#1 ?>by <?cs /if ?>tags
+
+Frozen conditions:
+<?cs if:Frozen.On ?>on<?cs else ?>off<?cs /if ?>
+<?cs if:#1 && Frozen.Off ?>1<?cs elif:Frozen.Name == "fold" ?>2<?cs else ?>3<?cs /if ?>
+<?cs if:?Frozen.Missing ?>missing<?cs elif:#Frozen.On + 1 == 2 ?>two<?cs /if ?>
+<?cs if:Frozen.On && A ?>not frozen<?cs /if ?>
+
+Frozen values are read once, when the parse is done:
+<?cs set:Frozen.On = 0 ?><?cs if:Frozen.On ?>still on<?cs /if ?> <?cs var:Frozen.On ?>
+
+Locals hide frozen names:
+<?cs each:Frozen = Days ?><?cs if:Frozen.Abbr == "Wed" ?>[wed]<?cs /if ?><?cs /each ?>
+<?cs def:frozen_arg(Frozen) ?><?cs if:Frozen.Abbr ?>[arg]<?cs /if ?><?cs /def ?><?cs call:frozen_arg(Days.0) ?>
+
+Macros defined in a dropped branch:
+<?cs if:Frozen.Off ?><?cs def:frozen_mac() ?>mac<?cs /def ?><?cs /if ?><?cs call:frozen_mac() ?>
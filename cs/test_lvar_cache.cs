@@ -0,0 +1,17 @@
+An lvar in a loop sees the locals of each pass:
+<?cs each:d = Days ?><?cs lvar:Lvar.Local ?> <?cs /each ?>
+
+Macros in an lvar:
+<?cs each:d = Days ?><?cs lvar:Lvar.Macro ?> <?cs /each ?>
+
+Functions in an lvar:
+<?cs each:d = Days ?><?cs lvar:Lvar.Func ?><?cs /each ?>
+
+Sets in an lvar:
+<?cs loop:i = #1, #3 ?><?cs lvar:Lvar.Set ?><?cs /loop ?><?cs var:Lvar.Count ?>
+
+A value which changes:
+<?cs each:d = Days ?><?cs set:Lvar.Changing = "<" + d.Abbr + ">" ?><?cs lvar:Lvar.Changing ?><?cs /each ?>
+
+A linclude in a loop:
+<?cs loop:i = #1, #3 ?><?cs linclude:"test_lincluded_macro.cs" ?> <?cs /loop ?>
@@ -37,18 +37,45 @@ static struct _neos_content_map
   {NULL, -1},
 };
 
+#define IS_SPACE(c) ( (c == ' ' || c == '\t' || c == '\n' || \
+                       c == '\v' || c == '\f' || c == '\r') )
+
+/* All control chars except the following space characters defined by HTML 5.0:
+   space(0x20), tab(0x9), line feed(0xa), vertical tab(0xb), form feed(0xc),
+   return(0xd)
+*/
+#define IS_CTRL_CHAR(c) ( (c > 0x00 && c <= 0x08) || (c >= 0x0e && c <= 0x1f) \
+                          || (c == 0x7f) )
+
 /* Characters to escape when html escaping is needed */
-static char *HTML_CHARS_LIST    = "&<>\"'\r";
+#define HTML_CHARS(c) ((c) == '&' || (c) == '<' || (c) == '>' || \
+                       (c) == '"' || (c) == '\'' || (c) == '\r')
+static const NEOS_CHARSET HtmlChars = NEOS_CHARSET_INIT(HTML_CHARS);
 
 /* Characters to escape when html escaping an unquoted
-   attribute value */
-static char *HTML_UNQUOTED_LIST = "&<>\"'=";
+   attribute value, along with the control and space characters which are
+   removed */
+#define HTML_UNQUOTED(c) ((c) == '&' || (c) == '<' || (c) == '>' || \
+                          (c) == '"' || (c) == '\'' || (c) == '=' || \
+                          IS_CTRL_CHAR(c) || IS_SPACE(c))
+static const NEOS_CHARSET HtmlUnquotedChars = NEOS_CHARSET_INIT(HTML_UNQUOTED);
 
 /* Characters to escape when javascript escaping is needed */
-static char *JS_CHARS_LIST       = "&<>\"'\r\n\t/\\;";
+#define JS_CHARS(c) ((c) == '&' || (c) == '<' || (c) == '>' || \
+                     (c) == '"' || (c) == '\'' || (c) == '\r' || \
+                     (c) == '\n' || (c) == '\t' || (c) == '/' || \
+                     (c) == '\\' || (c) == ';' || \
+                     ((c) > 0 && (c) < 32) || (c) == 0x7f)
+static const NEOS_CHARSET JsChars = NEOS_CHARSET_INIT(JS_CHARS);
 
 /* Characters to escape when unquoted javascript attribute is escaped */
-static char *JS_ATTR_UNQUOTED_LIST = "&<>\"'/\\;=\t\n\v\f\r ";
+#define JS_ATTR_UNQUOTED(c) ((c) == '&' || (c) == '<' || (c) == '>' || \
+                             (c) == '"' || (c) == '\'' || (c) == '/' || \
+                             (c) == '\\' || (c) == ';' || (c) == '=' || \
+                             (c) == ' ' || ((c) > 0 && (c) < 32) || \
+                             (c) == 0x7f)
+static const NEOS_CHARSET JsAttrUnquotedChars =
+  NEOS_CHARSET_INIT(JS_ATTR_UNQUOTED);
 
 
 /*  The html escaping routine uses this map to lookup the appropriate
@@ -81,16 +108,6 @@ static char *CSS_SAFE_CHARS = "_.,!#%-";
 
 #define IN_LIST(l, c) ( ((unsigned char)c < 0x80) && (strchr(l, c) != NULL) )
 
-#define IS_SPACE(c) ( (c == ' ' || c == '\t' || c == '\n' || \
-                       c == '\v' || c == '\f' || c == '\r') )
-
-/* All control chars except the following space characters defined by HTML 5.0:
-   space(0x20), tab(0x9), line feed(0xa), vertical tab(0xb), form feed(0xc),
-   return(0xd)
-*/
-#define IS_CTRL_CHAR(c) ( (c > 0x00 && c <= 0x08) || (c >= 0x0e && c <= 0x1f) \
-                          || (c == 0x7f) )
-
 /* neo_str.c already has all these escaping routines.
  * But since with auto escaping, the escaping routines will be called for every
  * variable, these new functions do an initial pass to determine if escaping is
@@ -116,43 +133,43 @@ static NEOERR *neos_auto_html_escape (const char *in, char **esc,
                                       int quoted, int *do_free)
 {
   unsigned int newlen = 0;
-  int modify = 0;
-  unsigned int l = 0;
+  int len;
+  int l = 0;
+  int x;
   char *tmp = NULL;
-  char *metachars = HTML_CHARS_LIST;
+  const NEOS_CHARSET *metachars = &HtmlChars;
 
   *do_free = 0;
 
   if (!quoted)
-    metachars = HTML_UNQUOTED_LIST;
+    metachars = &HtmlUnquotedChars;
 
   /*
      Check if there are any characters that need escaping. In the majority of
      cases, this will be false and we can just quit the function immediately
   */
-  while (in[l])
+  len = strlen(in);
+  l = neos_charset_span(metachars, in, len);
+  if (l == len) {
+    *esc = (char *)in;
+    return STATUS_OK;
+  }
+
+  newlen = l;
+  while (l < len)
   {
     if (!quoted && (IS_CTRL_CHAR(in[l]) || IS_SPACE(in[l])))
     {
-      modify = 1;
+      /* This character will be removed */
     }
     else
     {
-      if (IN_LIST(metachars, in[l]))
-      {
-        newlen += strlen(HTML_CHAR_MAP[(int)in[l]]);
-        modify = 1;
-      }
-      else
-        newlen += 1;
+      newlen += strlen(HTML_CHAR_MAP[(int)in[l]]);
     }
-
     l++;
-  }
-
-  if (!modify) {
-    *esc = (char *)in;
-    return STATUS_OK;
+    x = neos_charset_span(metachars, in + l, len - l);
+    newlen += x;
+    l += x;
   }
 
   /*
@@ -167,24 +184,23 @@ static NEOERR *neos_auto_html_escape (const char *in, char **esc,
 
   tmp = *esc;
   l = 0;
-  while (in[l])
+  while (l < len)
   {
+    x = neos_charset_span(metachars, in + l, len - l);
+    memcpy(tmp, in + l, x);
+    tmp += x;
+    l += x;
+    if (l == len) break;
+
     if (!quoted && (IS_CTRL_CHAR(in[l]) || IS_SPACE(in[l])))
     {
       /* Ignore this character */
     }
     else
     {
-      if (IN_LIST(metachars, in[l]))
-      {
-        strncpy(tmp, HTML_CHAR_MAP[(int)in[l]],
-                strlen(HTML_CHAR_MAP[(int)in[l]]));
-        tmp += strlen(HTML_CHAR_MAP[(int)in[l]]);
-      }
-      else
-      {
-        *tmp++ = in[l];
-      }
+      x = strlen(HTML_CHAR_MAP[(int)in[l]]);
+      memcpy(tmp, HTML_CHAR_MAP[(int)in[l]], x);
+      tmp += x;
     }
     l++;
   }
@@ -424,8 +440,10 @@ static NEOERR *neos_auto_js_escape (const char *in, char **esc,
 {
   int nl = 0;
   int l = 0;
+  int x;
+  int len;
   char *s;
-  char *metachars = JS_CHARS_LIST;
+  const NEOS_CHARSET *metachars = &JsChars;
 
   *do_free = 0;
   /*
@@ -436,24 +454,23 @@ static NEOERR *neos_auto_js_escape (const char *in, char **esc,
     The variable could be used to inject additional attributes on the tag.
   */
   if (!attr_quoted)
-    metachars = JS_ATTR_UNQUOTED_LIST;
+    metachars = &JsAttrUnquotedChars;
 
-  while (in[l])
-  {
-    if (IN_LIST(metachars, in[l]) || (in[l] > 0 && in[l] < 32) ||
-        (in[l] == 0x7f))
-    {
-      nl += 3;
-    }
-    l++;
-  }
-
-  if (nl == 0) {
+  len = strlen(in);
+  l = neos_charset_span(metachars, in, len);
+  if (l == len) {
     *esc = (char *)in;
     return STATUS_OK;
   }
 
-  nl += l;
+  nl = len;
+  while (l < len)
+  {
+    nl += 3;
+    l++;
+    l += neos_charset_span(metachars, in + l, len - l);
+  }
+
   s = (char *) malloc(nl + 1);
   if (s == NULL)
     return nerr_raise (NERR_NOMEM, "Unable to allocate memory to escape %s",
@@ -461,21 +478,19 @@ static NEOERR *neos_auto_js_escape (const char *in, char **esc,
 
   l = 0;
   nl = 0;
-  while (in[l])
+  while (l < len)
   {
-    if (IN_LIST(metachars, in[l]) || (in[l] > 0 && in[l] < 32) ||
-        (in[l] == 0x7f))
-    {
-      s[nl++] = '\\';
-      s[nl++] = 'x';
-      s[nl++] = "0123456789ABCDEF"[(in[l] >> 4) & 0xF];
-      s[nl++] = "0123456789ABCDEF"[in[l] & 0xF];
-      l++;
-    }
-    else
-    {
-      s[nl++] = in[l++];
-    }
+    x = neos_charset_span(metachars, in + l, len - l);
+    memcpy(s + nl, in + l, x);
+    nl += x;
+    l += x;
+    if (l == len) break;
+
+    s[nl++] = '\\';
+    s[nl++] = 'x';
+    s[nl++] = "0123456789ABCDEF"[(in[l] >> 4) & 0xF];
+    s[nl++] = "0123456789ABCDEF"[in[l] & 0xF];
+    l++;
   }
   s[nl] = '\0';
 
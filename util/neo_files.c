@@ -21,6 +21,10 @@
 #include <limits.h>
 #include <dirent.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#ifdef HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
 
 #include "neo_misc.h"
 #include "neo_err.h"
@@ -144,6 +148,86 @@ NEOERR *ne_save_file (const char *path, char *str)
   return STATUS_OK;
 }
 
+int ne_iov_advance (struct iovec **iov, int iovcnt, size_t w)
+{
+  struct iovec *v = *iov;
+
+  while (iovcnt > 0 && w >= v->iov_len)
+  {
+    w -= v->iov_len;
+    v++;
+    iovcnt--;
+  }
+  if (iovcnt > 0)
+  {
+    v->iov_base = (char *)v->iov_base + w;
+    v->iov_len -= w;
+  }
+  *iov = v;
+  return iovcnt;
+}
+
+NEOERR *ne_writev (int fd, struct iovec *iov, int iovcnt)
+{
+  ssize_t w;
+
+  while (iovcnt > 0)
+  {
+    w = writev (fd, iov, iovcnt > IOV_MAX ? IOV_MAX : iovcnt);
+    if (w < 0)
+    {
+      if (errno == EINTR) continue;
+      return nerr_raise_errno (NERR_IO, "Unable to write to fd %d", fd);
+    }
+    iovcnt = ne_iov_advance (&iov, iovcnt, w);
+  }
+  return STATUS_OK;
+}
+
+NEOERR *ne_sendfile (int out_fd, int in_fd, off_t offset, off_t count)
+{
+  NEOERR *err;
+  char buf[8192];
+  struct iovec iov;
+  ssize_t r;
+
+#ifdef HAVE_SYS_SENDFILE_H
+  while (count > 0)
+  {
+    r = sendfile (out_fd, in_fd, &offset, count);
+    if (r < 0)
+    {
+      if (errno == EINTR) continue;
+      /* not supported for these descriptors, copy it below */
+      if (errno == EINVAL || errno == ENOSYS) break;
+      return nerr_raise_errno (NERR_IO, "Unable to sendfile fd %d to %d",
+                               in_fd, out_fd);
+    }
+    if (r == 0)
+      return nerr_raise (NERR_IO, "Unexpected end of file on fd %d", in_fd);
+    count -= r;
+  }
+#endif
+  while (count > 0)
+  {
+    r = pread (in_fd, buf, count < sizeof(buf) ? count : sizeof(buf), offset);
+    if (r < 0)
+    {
+      if (errno == EINTR) continue;
+      return nerr_raise_errno (NERR_IO, "Unable to read fd %d", in_fd);
+    }
+    if (r == 0)
+      return nerr_raise (NERR_IO, "Unexpected end of file on fd %d", in_fd);
+    iov.iov_base = buf;
+    iov.iov_len = r;
+    err = ne_writev (out_fd, &iov, 1);
+    if (err) return nerr_pass (err);
+    offset += r;
+    count -= r;
+  }
+  return STATUS_OK;
+}
+
 NEOERR *ne_remove_dir (const char *path)
 {
   NEOERR *err;
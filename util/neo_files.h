@@ -15,9 +15,20 @@
 __BEGIN_DECLS
 
 #include <stdarg.h>
+#include <limits.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include "util/ulist.h"
 
+/* the most iovecs a single writev() will take */
+#ifndef IOV_MAX
+#ifdef UIO_MAXIOV
+#define IOV_MAX UIO_MAXIOV
+#else
+#define IOV_MAX 16
+#endif
+#endif
+
 
 
 typedef int (* MATCH_FUNC)(void *rock, const char *filename);
@@ -27,6 +38,20 @@ NEOERR *ne_load_file (const char *path, char **str);
 NEOERR *ne_load_file_len (const char *path, char **str, int *len);
 NEOERR *ne_save_file (const char *path, char *str);
 NEOERR *ne_remove_dir (const char *path);
+
+/* Writes all of the iovecs to fd (blocking), retrying short writes.
+ * The iov array is used as scratch space and is modified */
+NEOERR *ne_writev (int fd, struct iovec *iov, int iovcnt);
+
+/* Skips the first w bytes of iov after a short writev(), which can end
+ * part way through an iovec.  Moves *iov forward and trims the first
+ * remaining iovec, returning how many iovecs are left */
+int ne_iov_advance (struct iovec **iov, int iovcnt, size_t w);
+
+/* Writes count bytes of in_fd starting at offset to out_fd (blocking),
+ * using sendfile where the system has it and it works for out_fd, and
+ * read/write otherwise.  The file offset of in_fd isn't changed. */
+NEOERR *ne_sendfile (int out_fd, int in_fd, off_t offset, off_t count);
 NEOERR *ne_listdir(const char *path, ULIST **files);
 NEOERR *ne_listdir_match(const char *path, ULIST **files, const char *match);
 NEOERR *ne_listdir_fmatch(const char *path, ULIST **files, MATCH_FUNC fmatch, 
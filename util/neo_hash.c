@@ -271,6 +271,299 @@ static NEOERR *_hash_resize(NE_HASH *hash)
   return STATUS_OK;
 }
 
+#define NE_OHASH_EMPTY 0
+#define NE_OHASH_REMOVED 1
+#define NE_OHASH_MARK(h) ((h) | 0x80000000U)
+#define NE_OHASH_MIN_SIZE 16
+/* The number of slots of the old table moved by each insert or remove
+ * while resizing.  A table is resized when it is half used, which
+ * keeps the probes for a missing key short, into one at least twice as
+ * large, so this finishes well before the new table needs to resize in
+ * turn. */
+#define NE_OHASH_MOVE_STEP 32
+
+/* Fibonacci hashing, so hashes which only differ in their high bits
+ * (like pointers) still spread over the table */
+#define NE_OHASH_SLOT(t, h) (((UINT32)(h) * 2654435769U) >> (t)->shift)
+
+static NEOERR *_ohash_table_init (NE_OHASH_TABLE *t, UINT32 size)
+{
+  UINT32 bits = 0;
+  void *mem;
+
+  while ((1U << bits) < size) bits++;
+  size = 1U << bits;
+  /* the entries and their hashes in one allocation */
+  mem = calloc (size, sizeof(NE_OHASH_ENTRY) + sizeof(UINT32));
+  if (mem == NULL)
+    return nerr_raise(NERR_NOMEM,
+        "Unable to allocate memory for NE_OHASH of size %d", size);
+  t->entries = (NE_OHASH_ENTRY *) mem;
+  t->hashv = (UINT32 *) (t->entries + size);
+  t->size = size;
+  t->shift = 32 - bits;
+  t->used = 0;
+  t->live = 0;
+  return STATUS_OK;
+}
+
+NEOERR *ne_ohash_init (NE_OHASH **hash, NE_HASH_FUNC hash_func, NE_COMP_FUNC comp_func)
+{
+  NEOERR *err;
+  NE_OHASH *my_hash;
+
+  my_hash = (NE_OHASH *) calloc(1, sizeof(NE_OHASH));
+  if (my_hash == NULL)
+    return nerr_raise(NERR_NOMEM, "Unable to allocate memory for NE_OHASH");
+
+  my_hash->hash_func = hash_func;
+  my_hash->comp_func = comp_func;
+
+  err = _ohash_table_init(&(my_hash->cur), NE_OHASH_MIN_SIZE);
+  if (err)
+  {
+    free(my_hash);
+    return nerr_pass(err);
+  }
+
+  *hash = my_hash;
+
+  return STATUS_OK;
+}
+
+void ne_ohash_destroy (NE_OHASH **hash)
+{
+  if (hash == NULL || *hash == NULL)
+    return;
+
+  free((*hash)->cur.entries);
+  free((*hash)->old.entries);
+  free(*hash);
+  *hash = NULL;
+}
+
+/* Returns the slot of key in t, or -1.  If slot isn't NULL, it's set to
+ * the slot key would be added at when it isn't found */
+static int _ohash_find (NE_OHASH *hash, NE_OHASH_TABLE *t, void *key,
+                        UINT32 hashv, UINT32 *slot)
+{
+  UINT32 x, mask, hv;
+  int removed = -1;
+
+  if (t->size == 0) return -1;
+  mask = t->size - 1;
+  for (x = NE_OHASH_SLOT(t, hashv); (hv = t->hashv[x]) != NE_OHASH_EMPTY;
+       x = (x + 1) & mask)
+  {
+    if (hv != hashv)
+    {
+      if (hv == NE_OHASH_REMOVED && removed < 0) removed = x;
+      continue;
+    }
+    if (hash->comp_func ? hash->comp_func(t->entries[x].key, key) :
+        (t->entries[x].key == key))
+      return x;
+  }
+  if (slot) *slot = (removed >= 0) ? removed : x;
+  return -1;
+}
+
+/* Returns the slot of key, and sets *table to the table it's in */
+static int _ohash_locate (NE_OHASH *hash, void *key, NE_OHASH_TABLE **table)
+{
+  UINT32 hashv;
+  int x;
+
+  hashv = NE_OHASH_MARK(hash->hash_func(key));
+  *table = &(hash->cur);
+  x = _ohash_find(hash, *table, key, hashv, NULL);
+  if (x < 0)
+  {
+    *table = &(hash->old);
+    x = _ohash_find(hash, *table, key, hashv, NULL);
+  }
+  return x;
+}
+
+/* Sets slot x of t, which is empty or removed */
+static void _ohash_set (NE_OHASH_TABLE *t, UINT32 x, void *key, void *value,
+                        UINT32 hashv)
+{
+  if (t->hashv[x] == NE_OHASH_EMPTY)
+    t->used++;
+  t->hashv[x] = hashv;
+  t->entries[x].key = key;
+  t->entries[x].value = value;
+  t->live++;
+}
+
+/* Adds an entry which isn't in t, t must have an empty slot left */
+static void _ohash_place (NE_OHASH_TABLE *t, void *key, void *value,
+                          UINT32 hashv)
+{
+  UINT32 x, mask;
+
+  mask = t->size - 1;
+  x = NE_OHASH_SLOT(t, hashv);
+  while (t->hashv[x] > NE_OHASH_REMOVED)
+    x = (x + 1) & mask;
+  _ohash_set(t, x, key, value, hashv);
+}
+
+/* Moves up to count slots of the old table into the current one.  The
+ * moved slots are marked removed, so lookups in the old table still
+ * probe past them */
+static void _ohash_move (NE_OHASH *hash, UINT32 count)
+{
+  NE_OHASH_TABLE *old = &(hash->old);
+  UINT32 x;
+
+  if (old->size == 0) return;
+  while (count > 0 && old->live > 0 && hash->moved < old->size)
+  {
+    x = hash->moved++;
+    if (old->hashv[x] > NE_OHASH_REMOVED)
+    {
+      _ohash_place(&(hash->cur), old->entries[x].key, old->entries[x].value,
+                   old->hashv[x]);
+      old->hashv[x] = NE_OHASH_REMOVED;
+      old->live--;
+    }
+    count--;
+  }
+  if (old->live == 0)
+  {
+    free(old->entries);
+    memset(old, 0, sizeof(NE_OHASH_TABLE));
+    hash->moved = 0;
+  }
+}
+
+static NEOERR *_ohash_grow (NE_OHASH *hash)
+{
+  NEOERR *err;
+  NE_OHASH_TABLE t;
+  UINT32 size;
+
+  /* finish the last resize first */
+  _ohash_move(hash, hash->old.size);
+
+  /* A table which is mostly removed entries is just cleaned up */
+  size = hash->cur.size;
+  if (hash->cur.live >= size / 4)
+    size *= 2;
+  err = _ohash_table_init(&t, size);
+  if (err) return nerr_pass(err);
+
+  hash->old = hash->cur;
+  hash->cur = t;
+  hash->moved = 0;
+  return STATUS_OK;
+}
+
+NEOERR *ne_ohash_insert(NE_OHASH *hash, void *key, void *value)
+{
+  NEOERR *err;
+  NE_OHASH_TABLE *t;
+  UINT32 hashv, slot = 0;
+  int x;
+
+  _ohash_move(hash, NE_OHASH_MOVE_STEP);
+
+  hashv = NE_OHASH_MARK(hash->hash_func(key));
+  t = &(hash->cur);
+  x = _ohash_find(hash, t, key, hashv, &slot);
+  if (x < 0 && hash->old.size)
+  {
+    t = &(hash->old);
+    x = _ohash_find(hash, t, key, hashv, NULL);
+  }
+  if (x >= 0)
+  {
+    t->entries[x].value = value;
+    return STATUS_OK;
+  }
+
+  /* the entries still to be moved need room as well */
+  if ((hash->cur.used + hash->old.live + 1) * 2 > hash->cur.size)
+  {
+    err = _ohash_grow(hash);
+    if (err) return nerr_pass(err);
+    _ohash_place(&(hash->cur), key, value, hashv);
+  }
+  else
+  {
+    _ohash_set(&(hash->cur), slot, key, value, hashv);
+  }
+  hash->num++;
+
+  return STATUS_OK;
+}
+
+void *ne_ohash_lookup(NE_OHASH *hash, void *key)
+{
+  NE_OHASH_TABLE *t;
+  int x;
+
+  x = _ohash_locate(hash, key, &t);
+
+  return (x >= 0) ? t->entries[x].value : NULL;
+}
+
+int ne_ohash_has_key(NE_OHASH *hash, void *key)
+{
+  NE_OHASH_TABLE *t;
+
+  return _ohash_locate(hash, key, &t) >= 0;
+}
+
+void *ne_ohash_remove(NE_OHASH *hash, void *key)
+{
+  NE_OHASH_TABLE *t;
+  int x;
+
+  _ohash_move(hash, NE_OHASH_MOVE_STEP);
+
+  x = _ohash_locate(hash, key, &t);
+  if (x < 0) return NULL;
+
+  t->hashv[x] = NE_OHASH_REMOVED;
+  t->live--;
+  hash->num--;
+  return t->entries[x].value;
+}
+
+void *ne_ohash_next(NE_OHASH *hash, void **key)
+{
+  NE_OHASH_TABLE *t = &(hash->old);
+  UINT32 x = 0;
+  int found;
+
+  if (*key)
+  {
+    found = _ohash_locate(hash, *key, &t);
+    if (found < 0) return NULL;
+    x = found + 1;
+  }
+
+  while (1)
+  {
+    for (; x < t->size; x++)
+    {
+      if (t->hashv[x] > NE_OHASH_REMOVED)
+      {
+        *key = t->entries[x].key;
+        return t->entries[x].value;
+      }
+    }
+    if (t == &(hash->cur)) break;
+    t = &(hash->cur);
+    x = 0;
+  }
+
+  return NULL;
+}
+
 int ne_hash_str_comp(const void *a, const void *b)
 {
   return !strcmp((const char *)a, (const char *)b);
@@ -281,6 +574,19 @@ UINT32 ne_hash_str_hash(const void *a)
   return ne_crc((unsigned char *)a, strlen((const char *)a));
 }
 
+UINT32 ne_hash_str_fnv(const void *a)
+{
+  const char *s = (const char *)a;
+  UINT32 h = NE_FNV_INIT;
+
+  while (*s)
+  {
+    h = NE_FNV_STEP(h, *s);
+    s++;
+  }
+  return h;
+}
+
 int ne_hash_int_comp(const void *a, const void *b)
 {
   if (a == b) return 1;
@@ -52,6 +52,61 @@ UINT32 ne_hash_str_hash(const void *a);
 int ne_hash_int_comp(const void *a, const void *b);
 UINT32 ne_hash_int_hash(const void *a);
 
+/* FNV-1a, a much cheaper hash than ne_crc for short keys.  The macros
+ * let callers hash a key as they scan it. */
+#define NE_FNV_INIT 2166136261U
+#define NE_FNV_STEP(h, c) (((h) ^ (UINT8)(c)) * 16777619U)
+
+UINT32 ne_hash_str_fnv(const void *a);
+
+/* An open addressing hash, for tables which are mostly looked up.  The
+ * hash of each entry is kept in an array of its own, so probing only
+ * touches the entries whose hash matches, and removed entries are
+ * marked until the table is next resized.  A resize moves the entries a
+ * few at a time as part of the following inserts and removes, so no one
+ * insert pays for the whole table.  Lookups never change the table, so
+ * any number of threads can look up in a table no one is changing. */
+typedef struct _NE_OHASH_ENTRY
+{
+  void *key;
+  void *value;
+} NE_OHASH_ENTRY;
+
+typedef struct _NE_OHASH_TABLE
+{
+  UINT32 size;      /* a power of 2, or 0 for no table */
+  UINT32 shift;     /* 32 - log2(size) */
+  UINT32 used;      /* slots which aren't empty, including removed ones */
+  UINT32 live;
+  /* for each slot: 0 if empty, 1 if removed, or the entry's hash with
+   * the top bit set */
+  UINT32 *hashv;
+  NE_OHASH_ENTRY *entries;
+} NE_OHASH_TABLE;
+
+typedef struct _NE_OHASH
+{
+  UINT32 num;
+
+  NE_OHASH_TABLE cur;
+  /* while resizing, the table being moved into cur, and how many of its
+   * slots have been moved */
+  NE_OHASH_TABLE old;
+  UINT32 moved;
+
+  NE_HASH_FUNC hash_func;
+  NE_COMP_FUNC comp_func;
+} NE_OHASH;
+
+NEOERR *ne_ohash_init (NE_OHASH **hash, NE_HASH_FUNC hash_func, NE_COMP_FUNC comp_func);
+void ne_ohash_destroy (NE_OHASH **hash);
+NEOERR *ne_ohash_insert(NE_OHASH *hash, void *key, void *value);
+void *ne_ohash_lookup(NE_OHASH *hash, void *key);
+int ne_ohash_has_key(NE_OHASH *hash, void *key);
+void *ne_ohash_remove(NE_OHASH *hash, void *key);
+/* *key must be NULL to start, or a key in the hash */
+void *ne_ohash_next(NE_OHASH *hash, void **key);
+
 __END_DECLS
 
 #endif /* __NEO_HASH_H_ */
@@ -20,6 +20,8 @@
 #include <limits.h>
 #include <stdarg.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
 #include "neo_misc.h"
 #include "neo_err.h"
 #include "neo_rand.h"
@@ -30,6 +32,9 @@
 
 static NEOERR* hdf_read_file_internal (HDF *hdf, const char *path,
                                        int include_handle);
+static NEOERR * _copy_attr (HDF_ATTR **dest, HDF_ATTR *src);
+static HDF *_hdf_level (HDF *hdf);
+NEOERR* _hdf_hash_level(HDF *hdf);
 
 /* Ok, in order to use the hash, we have to support n-len strings
  * instead of null terminated strings (since in set_value and walk_hdf
@@ -47,19 +52,182 @@ static int hash_hdf_comp(const void *a, const void *b)
   HDF *ha = (HDF *)a;
   HDF *hb = (HDF *)b;
 
-  return (ha->name_len == hb->name_len) && !strncmp(ha->name, hb->name, ha->name_len);
+  return (ha->name_hash == hb->name_hash) && (ha->name_len == hb->name_len)
+    && !memcmp(ha->name, hb->name, ha->name_len);
 }
 
 static UINT32 hash_hdf_hash(const void *a)
 {
   HDF *ha = (HDF *)a;
-  return ne_crc((UINT8 *)(ha->name), ha->name_len);
+  return ha->name_hash;
+}
+
+/* Every node stores the hash of its name, computed once when the node is
+ * created.  Lookups hash each component of the dotted name while they
+ * scan for the next '.', so walking a level is an integer compare per
+ * child, and hashed levels never rehash the stored names.  This is
+ * FNV-1a (see neo_hash.h), which is much cheaper than ne_crc for the
+ * short names HDF uses. */
+
+static UINT32 _hdf_name_hash (const char *name, int len)
+{
+  UINT32 h = NE_FNV_INIT;
+
+  while (len--)
+  {
+    h = NE_FNV_STEP(h, *name);
+    name++;
+  }
+  return h;
+}
+
+/* Find the next component of the dotted name n.  Returns the length of
+ * the component, sets hash to its name hash and s to the '.' following
+ * it, or NULL if this is the last component */
+static int _hdf_name_next (const char *n, UINT32 *hash, const char **s)
+{
+  UINT32 h = NE_FNV_INIT;
+  const char *p = n;
+
+  while (*p && *p != '.')
+  {
+    h = NE_FNV_STEP(h, *p);
+    p++;
+  }
+  *hash = h;
+  *s = (*p == '.') ? p : NULL;
+  return p - n;
+}
+
+#define HDF_NAME_MATCH(hp, n, x, h) \
+  ((hp)->name_hash == (h) && (hp)->name_len == (x) && (hp)->name && \
+   !memcmp((hp)->name, (n), (x)))
+
+/* The arena is a list of chunks, allocations are bumped off the first
+ * chunk in the list.  Allocations which are large compared to the chunk
+ * size get a chunk of their own, which is linked in behind the current
+ * chunk so we don't abandon its free space. */
+#define HDF_ARENA_MIN_CHUNK 16384
+#define HDF_ARENA_MAX_CHUNK (1024*1024)
+#define HDF_ARENA_ALIGN(x) (((x) + 7) & ~((size_t)7))
+
+typedef struct _hdf_arena_chunk
+{
+  struct _hdf_arena_chunk *next;
+  size_t size;
+  size_t used;
+} HDF_ARENA_CHUNK;
+
+struct _hdf_arena
+{
+  HDF_ARENA_CHUNK *chunks;
+  size_t chunk_size;
+  /* the file mapped by hdf_map_binary, unmapped with the arena */
+  void *map;
+  size_t map_len;
+  /* the top of the data set an overlay was created over */
+  HDF *base;
+};
+
+#define HDF_ARENA_DATA(c) \
+  ((char *)(c) + HDF_ARENA_ALIGN(sizeof(HDF_ARENA_CHUNK)))
+
+static HDF_ARENA_CHUNK *_arena_new_chunk (size_t size)
+{
+  HDF_ARENA_CHUNK *chunk;
+
+  chunk = (HDF_ARENA_CHUNK *) malloc (HDF_ARENA_ALIGN(sizeof(HDF_ARENA_CHUNK))
+                                      + size);
+  if (chunk == NULL) return NULL;
+  chunk->next = NULL;
+  chunk->size = size;
+  chunk->used = 0;
+  return chunk;
+}
+
+static void *_arena_alloc (HDF_ARENA *arena, size_t size)
+{
+  HDF_ARENA_CHUNK *chunk = arena->chunks;
+  void *p;
+
+  size = HDF_ARENA_ALIGN(size);
+  if (chunk->size - chunk->used < size)
+  {
+    if (size > arena->chunk_size / 4)
+    {
+      chunk = _arena_new_chunk (size);
+      if (chunk == NULL) return NULL;
+      chunk->used = size;
+      chunk->next = arena->chunks->next;
+      arena->chunks->next = chunk;
+      return HDF_ARENA_DATA(chunk);
+    }
+    if (arena->chunk_size < HDF_ARENA_MAX_CHUNK)
+      arena->chunk_size *= 2;
+    chunk = _arena_new_chunk (arena->chunk_size);
+    if (chunk == NULL) return NULL;
+    chunk->next = arena->chunks;
+    arena->chunks = chunk;
+  }
+  p = HDF_ARENA_DATA(chunk) + chunk->used;
+  chunk->used += size;
+  return p;
+}
+
+static char *_arena_strndup (HDF_ARENA *arena, const char *s, size_t len)
+{
+  char *p;
+
+  p = (char *) _arena_alloc (arena, len + 1);
+  if (p == NULL) return NULL;
+  memcpy (p, s, len);
+  p[len] = '\0';
+  return p;
+}
+
+static void _arena_destroy (HDF_ARENA **arena)
+{
+  HDF_ARENA_CHUNK *chunk, *next;
+
+  if (*arena == NULL) return;
+  for (chunk = (*arena)->chunks; chunk; chunk = next)
+  {
+    next = chunk->next;
+    free (chunk);
+  }
+  if ((*arena)->map != NULL)
+    munmap ((*arena)->map, (*arena)->map_len);
+  free (*arena);
+  *arena = NULL;
+}
+
+/* Duplicate a value for storage in the data set of top, alloc_value is
+ * set to whether the copy has to be free'd by _dealloc_hdf */
+static char *_dup_value (HDF *top, const char *value, int *alloc_value)
+{
+  if (top != NULL && top->arena != NULL)
+  {
+    *alloc_value = 0;
+    return _arena_strndup (top->arena, value, strlen(value));
+  }
+  *alloc_value = 1;
+  return strdup (value);
 }
 
 static NEOERR *_alloc_hdf (HDF **hdf, const char *name, size_t nlen,
                            const char *value, int dupl, int wf, HDF *top)
 {
-  *hdf = calloc (1, sizeof (HDF));
+  HDF_ARENA *arena = (top != NULL) ? top->arena : NULL;
+
+  if (arena != NULL)
+  {
+    *hdf = (HDF *) _arena_alloc (arena, sizeof (HDF));
+    if (*hdf != NULL) memset (*hdf, 0, sizeof (HDF));
+  }
+  else
+  {
+    *hdf = calloc (1, sizeof (HDF));
+  }
   if (*hdf == NULL)
   {
     return nerr_raise (NERR_NOMEM, "Unable to allocate memory for hdf element");
@@ -70,27 +238,43 @@ static NEOERR *_alloc_hdf (HDF **hdf, const char *name, size_t nlen,
   if (name != NULL)
   {
     (*hdf)->name_len = nlen;
-    (*hdf)->name = (char *) malloc (nlen + 1);
-    if ((*hdf)->name == NULL)
+    (*hdf)->name_hash = _hdf_name_hash (name, nlen);
+    if (arena != NULL)
     {
-      free((*hdf));
-      (*hdf) = NULL;
-      return nerr_raise (NERR_NOMEM,
-	  "Unable to allocate memory for hdf element: %s", name);
+      (*hdf)->name = _arena_strndup (arena, name, nlen);
+      if ((*hdf)->name == NULL)
+      {
+        (*hdf) = NULL;
+        return nerr_raise (NERR_NOMEM,
+            "Unable to allocate memory for hdf element: %s", name);
+      }
+    }
+    else
+    {
+      (*hdf)->name = (char *) malloc (nlen + 1);
+      if ((*hdf)->name == NULL)
+      {
+        free((*hdf));
+        (*hdf) = NULL;
+        return nerr_raise (NERR_NOMEM,
+            "Unable to allocate memory for hdf element: %s", name);
+      }
+      strncpy((*hdf)->name, name, nlen);
+      (*hdf)->name[nlen] = '\0';
     }
-    strncpy((*hdf)->name, name, nlen);
-    (*hdf)->name[nlen] = '\0';
   }
   if (value != NULL)
   {
     if (dupl)
     {
-      (*hdf)->alloc_value = 1;
-      (*hdf)->value = strdup(value);
+      (*hdf)->value = _dup_value (top, value, &((*hdf)->alloc_value));
       if ((*hdf)->value == NULL)
       {
-	free((*hdf)->name);
-	free((*hdf));
+        if (arena == NULL)
+        {
+          free((*hdf)->name);
+          free((*hdf));
+        }
 	(*hdf) = NULL;
 	return nerr_raise (NERR_NOMEM,
 	    "Unable to allocate memory for hdf element %s", name);
@@ -144,7 +328,8 @@ static void _dealloc_hdf (HDF **hdf)
   }
   if (myhdf->name != NULL)
   {
-    free (myhdf->name);
+    if (myhdf->top->arena == NULL)
+      free (myhdf->name);
     myhdf->name = NULL;
   }
   if (myhdf->value != NULL)
@@ -159,9 +344,10 @@ static void _dealloc_hdf (HDF **hdf)
   }
   if (myhdf->hash != NULL)
   {
-    ne_hash_destroy(&myhdf->hash);
+    ne_ohash_destroy(&myhdf->hash);
   }
-  free(myhdf);
+  if (myhdf->top->arena == NULL)
+    free(myhdf);
   *hdf = NULL;
 }
 
@@ -187,21 +373,187 @@ NEOERR* hdf_init (HDF **hdf)
   return STATUS_OK;
 }
 
+NEOERR* hdf_init_arena (HDF **hdf, size_t hint)
+{
+  NEOERR *err;
+  HDF_ARENA *arena;
+  HDF *my_hdf;
+
+  *hdf = NULL;
+
+  err = nerr_init();
+  if (err != STATUS_OK)
+    return nerr_pass (err);
+
+  arena = (HDF_ARENA *) calloc (1, sizeof (HDF_ARENA));
+  if (arena == NULL)
+    return nerr_raise (NERR_NOMEM, "Unable to allocate memory for hdf arena");
+  arena->chunk_size = HDF_ARENA_MIN_CHUNK;
+  if (hint > HDF_ARENA_MIN_CHUNK)
+    arena->chunk_size = HDF_ARENA_ALIGN(hint);
+  arena->chunks = _arena_new_chunk (arena->chunk_size);
+  if (arena->chunks == NULL)
+  {
+    free (arena);
+    return nerr_raise (NERR_NOMEM, "Unable to allocate memory for hdf arena");
+  }
+
+  my_hdf = (HDF *) _arena_alloc (arena, sizeof (HDF));
+  memset (my_hdf, 0, sizeof (HDF));
+  my_hdf->top = my_hdf;
+  my_hdf->arena = arena;
+
+  *hdf = my_hdf;
+
+  return STATUS_OK;
+}
+
+NEOERR* hdf_init_overlay (HDF **hdf, HDF *base, size_t hint)
+{
+  NEOERR *err;
+
+  *hdf = NULL;
+  if (base == NULL)
+    return nerr_raise (NERR_ASSERT, "Unable to overlay NULL hdf");
+
+  err = hdf_init_arena (hdf, hint);
+  if (err != STATUS_OK)
+    return nerr_pass (err);
+
+  (*hdf)->arena->base = base->top;
+  if (_hdf_level(base)->child != NULL)
+    (*hdf)->base = base;
+
+  return STATUS_OK;
+}
+
 void hdf_destroy (HDF **hdf)
 {
+  HDF_ARENA *arena;
+
   if (*hdf == NULL) return;
   if ((*hdf)->top == (*hdf))
   {
+    /* The top node itself lives in the arena, so hold on to it until
+     * the whole tree has been walked */
+    arena = (*hdf)->arena;
     _dealloc_hdf(hdf);
+    _arena_destroy(&arena);
+  }
+}
+
+/* Find the child named n (of length x and name hash h) of parent, hp is
+ * the first child of parent */
+static HDF *_find_child (HDF *parent, HDF *hp, const char *n, int x, UINT32 h)
+{
+  HDF hash_key;
+
+  if (parent && parent->hash)
+  {
+    hash_key.name = (char *)n;
+    hash_key.name_len = x;
+    hash_key.name_hash = h;
+    return ne_ohash_lookup(parent->hash, &hash_key);
   }
+  while (hp != NULL && !HDF_NAME_MATCH(hp, n, x, h))
+  {
+    hp = hp->next;
+  }
+  return hp;
 }
 
-static int _walk_hdf (HDF *hdf, const char *name, HDF **node)
+/* A node of an overlay data set (see hdf_init_overlay) with base set
+ * has no children of its own yet, its children are still those of the
+ * base node (or of the base's base, when overlaying an overlay).
+ * Lookups which only read look through to that level, anything which
+ * hands out or changes the children first shadows the whole level. */
+static HDF *_hdf_level (HDF *hdf)
+{
+  while (hdf->base != NULL)
+    hdf = hdf->base;
+  return hdf;
+}
+
+static NEOERR *_overlay_shadow (HDF *hdf)
+{
+  NEOERR *err;
+  HDF *bp, *hp, *first = NULL, *last = NULL;
+  int count = 0;
+
+  if (hdf->base == NULL) return STATUS_OK;
+
+  for (bp = _hdf_level(hdf)->child; bp != NULL; bp = bp->next)
+  {
+    /* names and values are shared with the base, which outlives us,
+     * and as the overlay is an arena data set they're never free'd */
+    err = _alloc_hdf (&hp, NULL, 0, bp->value, 0, 0, hdf->top);
+    if (err == STATUS_OK && bp->attr != NULL)
+      err = _copy_attr (&(hp->attr), bp->attr);
+    if (err)
+    {
+      _dealloc_hdf (&first);
+      return nerr_pass(err);
+    }
+    hp->name = bp->name;
+    hp->name_len = bp->name_len;
+    hp->name_hash = bp->name_hash;
+    hp->link = bp->link;
+    if (_hdf_level(bp)->child != NULL)
+      hp->base = bp;
+    if (last != NULL)
+      last->next = hp;
+    else
+      first = hp;
+    last = hp;
+    count++;
+  }
+  hdf->child = first;
+  hdf->last_child = last;
+  hdf->base = NULL;
+  if (count > FORCE_HASH_AT)
+  {
+    err = _hdf_hash_level(hdf);
+    if (err) return nerr_pass(err);
+  }
+  return STATUS_OK;
+}
+
+/* Returns the first child of *parent, if shadow is set the level is
+ * shadowed first, otherwise *parent may be moved to the base level */
+static HDF *_first_child (HDF **parent, int shadow)
+{
+  NEOERR *err;
+
+  if ((*parent)->base != NULL)
+  {
+    if (!shadow)
+    {
+      *parent = _hdf_level (*parent);
+    }
+    else
+    {
+      err = _overlay_shadow (*parent);
+      if (err)
+      {
+        /* there's no way to pass it on, so this looks like a miss */
+        nerr_ignore (&err);
+        return NULL;
+      }
+    }
+  }
+  return (*parent)->child;
+}
+
+/* Walk to the node name below hdf.  If shadow is set, the levels of an
+ * overlay walked through are shadowed so the node found belongs to the
+ * overlay and can be modified, otherwise it may be a node of the base */
+static int _walk_hdf (HDF *hdf, const char *name, HDF **node, int shadow)
 {
   HDF *parent = NULL;
   HDF *hp = hdf;
-  HDF hash_key;
+  HDF *top;
   int x = 0;
+  UINT32 h;
   const char *s, *n;
   int r;
 
@@ -214,20 +566,23 @@ static int _walk_hdf (HDF *hdf, const char *name, HDF **node)
     return 0;
   }
 
+  /* links are resolved from the top of the data set we were called on,
+   * not the one of the base nodes we may be looking through */
+  top = hdf->top;
   if (hdf->link)
   {
-    r = _walk_hdf (hdf->top, hdf->value, &hp);
+    r = _walk_hdf (top, hdf->value, &hp, shadow);
     if (r) return r;
     if (hp)
     {
       parent = hp;
-      hp = hp->child;
+      hp = _first_child (&parent, shadow);
     }
   }
   else
   {
     parent = hdf;
-    hp = hdf->child;
+    hp = _first_child (&parent, shadow);
   }
   if (hp == NULL)
   {
@@ -235,31 +590,11 @@ static int _walk_hdf (HDF *hdf, const char *name, HDF **node)
   }
 
   n = name;
-  s = strchr (n, '.');
-  x = (s == NULL) ? strlen(n) : s - n;
+  x = _hdf_name_next (n, &h, &s);
 
   while (1)
   {
-    if (parent && parent->hash)
-    {
-      hash_key.name = (char *)n;
-      hash_key.name_len = x;
-      hp = ne_hash_lookup(parent->hash, &hash_key);
-    }
-    else
-    {
-      while (hp != NULL)
-      {
-	if (hp->name && (x == hp->name_len) && !strncmp(hp->name, n, x))
-	{
-	  break;
-	}
-	else
-	{
-	  hp = hp->next;
-	}
-      }
-    }
+    hp = _find_child (parent, hp, n, x, h);
     if (hp == NULL)
     {
       return -1;
@@ -268,38 +603,167 @@ static int _walk_hdf (HDF *hdf, const char *name, HDF **node)
 
     if (hp->link)
     {
-      r = _walk_hdf (hp->top, hp->value, &hp);
+      r = _walk_hdf (top, hp->value, &hp, shadow);
       if (r) {
 	return r;
       }
       parent = hp;
-      hp = hp->child;
+      hp = _first_child (&parent, shadow);
     }
     else
     {
       parent = hp;
-      hp = hp->child;
+      hp = _first_child (&parent, shadow);
     }
     n = s + 1;
-    s = strchr (n, '.');
-    x = (s == NULL) ? strlen(n) : s - n;
+    x = _hdf_name_next (n, &h, &s);
   }
   if (hp->link)
   {
-    return _walk_hdf (hp->top, hp->value, node);
+    return _walk_hdf (top, hp->value, node, shadow);
   }
 
   *node = hp;
   return 0;
 }
 
+/* Same as _walk_hdf, but walks the already split components of a
+ * HDF_PATH */
+static int _walk_hdf_path (HDF *hdf, HDF_PATH_ELEM *elem, int count,
+                           HDF **node, int shadow)
+{
+  HDF *parent = NULL;
+  HDF *hp = hdf;
+  HDF *top;
+  int r;
+
+  *node = NULL;
+
+  if (hdf == NULL) return -1;
+  if (count <= 0)
+  {
+    *node = hdf;
+    return 0;
+  }
+
+  top = hdf->top;
+  if (hdf->link)
+  {
+    r = _walk_hdf (top, hdf->value, &hp, shadow);
+    if (r) return r;
+    if (hp)
+    {
+      parent = hp;
+      hp = _first_child (&parent, shadow);
+    }
+  }
+  else
+  {
+    parent = hdf;
+    hp = _first_child (&parent, shadow);
+  }
+  if (hp == NULL)
+  {
+    return -1;
+  }
+
+  while (1)
+  {
+    hp = _find_child (parent, hp, elem->name, elem->len, elem->hash);
+    if (hp == NULL)
+    {
+      return -1;
+    }
+    if (--count == 0) break;
+
+    if (hp->link)
+    {
+      r = _walk_hdf (top, hp->value, &hp, shadow);
+      if (r) {
+	return r;
+      }
+    }
+    parent = hp;
+    hp = _first_child (&parent, shadow);
+    elem++;
+  }
+  if (hp->link)
+  {
+    return _walk_hdf (top, hp->value, node, shadow);
+  }
+
+  *node = hp;
+  return 0;
+}
+
+NEOERR* hdf_path_init (HDF_PATH **path, const char *name)
+{
+  HDF_PATH *my_path;
+  const char *n, *s;
+  int count = 1;
+
+  *path = NULL;
+  if (name == NULL)
+    return nerr_raise(NERR_ASSERT, "Unable to create path for NULL name");
+
+  for (n = name; *n; n++)
+  {
+    if (*n == '.') count++;
+  }
+  my_path = (HDF_PATH *) malloc (sizeof(HDF_PATH) +
+                                 (count - 1) * sizeof(HDF_PATH_ELEM));
+  if (my_path == NULL)
+    return nerr_raise(NERR_NOMEM, "Unable to allocate path for %s", name);
+
+  my_path->name = name;
+  my_path->count = 0;
+  if (name[0] != '\0')
+  {
+    n = name;
+    while (1)
+    {
+      HDF_PATH_ELEM *elem = &(my_path->elem[my_path->count++]);
+
+      elem->name = n;
+      elem->len = _hdf_name_next (n, &(elem->hash), &s);
+      if (s == NULL) break;
+      n = s + 1;
+    }
+  }
+  *path = my_path;
+  return STATUS_OK;
+}
+
+void hdf_path_destroy (HDF_PATH **path)
+{
+  if (*path == NULL) return;
+  free (*path);
+  *path = NULL;
+}
+
+HDF* hdf_get_obj_path (HDF *hdf, HDF_PATH *path, int start)
+{
+  HDF *obj;
+
+  _walk_hdf_path(hdf, path->elem + start, path->count - start, &obj, 1);
+  return obj;
+}
+
+HDF* hdf_peek_obj_path (HDF *hdf, HDF_PATH *path, int start)
+{
+  HDF *obj;
+
+  _walk_hdf_path(hdf, path->elem + start, path->count - start, &obj, 0);
+  return obj;
+}
+
 int hdf_get_int_value (HDF *hdf, const char *name, int defval)
 {
   HDF *node;
   int v;
   char *n;
 
-  if ((_walk_hdf(hdf, name, &node) == 0) && (node->value != NULL))
+  if ((_walk_hdf(hdf, name, &node, 0) == 0) && (node->value != NULL))
   {
     v = strtol (node->value, &n, 10);
     if (node->value == n) v = defval;
@@ -314,7 +778,7 @@ char* hdf_get_value (HDF *hdf, const char *name, const char *defval)
 {
   HDF *node;
 
-  if ((_walk_hdf(hdf, name, &node) == 0) && (node->value != NULL))
+  if ((_walk_hdf(hdf, name, &node, 0) == 0) && (node->value != NULL))
   {
     return node->value;
   }
@@ -328,7 +792,7 @@ char* hdf_get_valuevf (HDF *hdf, const char *namefmt, va_list ap)
 
   name = vsprintf_alloc(namefmt, ap);
   if (name == NULL) return NULL;
-  if ((_walk_hdf(hdf, name, &node) == 0) && (node->value != NULL))
+  if ((_walk_hdf(hdf, name, &node, 0) == 0) && (node->value != NULL))
   {
     free(name);
     return node->value;
@@ -353,7 +817,7 @@ NEOERR* hdf_get_copy (HDF *hdf, const char *name, char **value,
 {
   HDF *node;
 
-  if ((_walk_hdf(hdf, name, &node) == 0) && (node->value != NULL))
+  if ((_walk_hdf(hdf, name, &node, 0) == 0) && (node->value != NULL))
   {
     *value = strdup(node->value);
     if (*value == NULL)
@@ -381,22 +845,30 @@ HDF* hdf_get_obj (HDF *hdf, const char *name)
 {
   HDF *obj;
 
-  _walk_hdf(hdf, name, &obj);
+  _walk_hdf(hdf, name, &obj, 1);
+  return obj;
+}
+
+HDF* hdf_peek_obj (HDF *hdf, const char *name)
+{
+  HDF *obj;
+
+  _walk_hdf(hdf, name, &obj, 0);
   return obj;
 }
 
 HDF* hdf_get_child (HDF *hdf, const char *name)
 {
   HDF *obj;
-  _walk_hdf(hdf, name, &obj);
-  if (obj != NULL) return obj->child;
+  _walk_hdf(hdf, name, &obj, 1);
+  if (obj != NULL) return _first_child(&obj, 1);
   return obj;
 }
 
 HDF_ATTR* hdf_get_attr (HDF *hdf, const char *name)
 {
   HDF *obj;
-  _walk_hdf(hdf, name, &obj);
+  _walk_hdf(hdf, name, &obj, 0);
   if (obj != NULL) return obj->attr;
   return NULL;
 }
@@ -407,7 +879,7 @@ NEOERR* hdf_set_attr (HDF *hdf, const char *name, const char *key,
   HDF *obj;
   HDF_ATTR *attr, *last;
 
-  _walk_hdf(hdf, name, &obj);
+  _walk_hdf(hdf, name, &obj, 1);
   if (obj == NULL)
     return nerr_raise(NERR_ASSERT, "Unable to set attribute on non-existent node");
 
@@ -466,11 +938,57 @@ HDF* hdf_obj_child (HDF *hdf)
   if (hdf == NULL) return NULL;
   if (hdf->link)
   {
-    if (_walk_hdf(hdf->top, hdf->value, &obj))
+    if (_walk_hdf(hdf->top, hdf->value, &obj, 1))
+      return NULL;
+    return _first_child(&obj, 1);
+  }
+  return _first_child(&hdf, 1);
+}
+
+HDF* hdf_obj_peek_child (HDF *hdf)
+{
+  HDF *obj;
+  if (hdf == NULL) return NULL;
+  if (hdf->link)
+  {
+    if (_walk_hdf(hdf->top, hdf->value, &obj, 0))
+      return NULL;
+    return _first_child(&obj, 0);
+  }
+  return _first_child(&hdf, 0);
+}
+
+HDF* hdf_obj_find_child (HDF *hdf, const char *name, int shadow)
+{
+  HDF *hp;
+  const char *s;
+  UINT32 h;
+  int x;
+
+  if (hdf == NULL || name == NULL) return NULL;
+  if (hdf->link)
+  {
+    if (_walk_hdf(hdf->top, hdf->value, &hdf, shadow))
       return NULL;
-    return obj->child;
   }
-  return hdf->child;
+  hp = _first_child(&hdf, shadow);
+  if (hp == NULL) return NULL;
+  x = _hdf_name_next (name, &h, &s);
+  return _find_child (hdf, hp, name, x, h);
+}
+
+int hdf_obj_is_base (HDF *hdf, HDF *obj)
+{
+  HDF *top;
+
+  if (hdf == NULL || obj == NULL) return 0;
+  top = hdf->top;
+  while (top->arena != NULL && top->arena->base != NULL)
+  {
+    top = top->arena->base;
+    if (obj->top == top) return 1;
+  }
+  return 0;
 }
 
 HDF* hdf_obj_next (HDF *hdf)
@@ -504,7 +1022,7 @@ char* hdf_obj_value (HDF *hdf)
   if (hdf == NULL) return NULL;
   while (hdf->link && count < 100)
   {
-    if (_walk_hdf (hdf->top, hdf->value, &hdf))
+    if (_walk_hdf (hdf->top, hdf->value, &hdf, 0))
       return NULL;
     count++;
   }
@@ -559,13 +1077,13 @@ NEOERR* _hdf_hash_level(HDF *hdf)
   NEOERR *err;
   HDF *child;
 
-  err = ne_hash_init(&(hdf->hash), hash_hdf_hash, hash_hdf_comp);
+  err = ne_ohash_init(&(hdf->hash), hash_hdf_hash, hash_hdf_comp);
   if (err) return nerr_pass(err);
 
   child = hdf->child;
   while (child)
   {
-    err = ne_hash_insert(hdf->hash, child, child);
+    err = ne_ohash_insert(hdf->hash, child, child);
     if (err) return nerr_pass(err);
     child = child->next;
   }
@@ -580,6 +1098,7 @@ static NEOERR* _set_value (HDF *hdf, const char *name, const char *value,
   HDF *hn, *hp, *hs;
   HDF hash_key;
   int x = 0;
+  UINT32 h;
   const char *s = name;
   const char *n = name;
   int count = 0;
@@ -623,8 +1142,7 @@ static NEOERR* _set_value (HDF *hdf, const char *name, const char *value,
     }
     else if (dupl)
     {
-      hdf->alloc_value = 1;
-      hdf->value = strdup(value);
+      hdf->value = _dup_value(hdf->top, value, &(hdf->alloc_value));
       if (hdf->value == NULL)
 	return nerr_raise (NERR_NOMEM, "Unable to duplicate value %s for %s",
 	    value, name);
@@ -639,8 +1157,7 @@ static NEOERR* _set_value (HDF *hdf, const char *name, const char *value,
   }
 
   n = name;
-  s = strchr (n, '.');
-  x = (s != NULL) ? s - n : strlen(n);
+  x = _hdf_name_next (n, &h, &s);
   if (x == 0)
   {
     return nerr_raise(NERR_ASSERT, "Unable to set Empty component %s", name);
@@ -667,6 +1184,12 @@ static NEOERR* _set_value (HDF *hdf, const char *name, const char *value,
 
   while (1)
   {
+    if (hn->base != NULL)
+    {
+      err = _overlay_shadow (hn);
+      if (err) return nerr_pass(err);
+    }
+
     /* examine cache to see if we have a match */
     count = 0;
     hp = hn->last_hp;
@@ -674,7 +1197,7 @@ static NEOERR* _set_value (HDF *hdf, const char *name, const char *value,
 
     if ((hs == NULL && hp == hn->child) || (hs && hs->next == hp))
     {
-      if (hp && hp->name && (x == hp->name_len) && !strncmp (hp->name, n, x))
+      if (hp && HDF_NAME_MATCH(hp, n, x, h))
       {
 	goto skip_search;
       }
@@ -688,14 +1211,15 @@ static NEOERR* _set_value (HDF *hdf, const char *name, const char *value,
     {
       hash_key.name = (char *)n;
       hash_key.name_len = x;
-      hp = ne_hash_lookup(hn->hash, &hash_key);
+      hash_key.name_hash = h;
+      hp = ne_ohash_lookup(hn->hash, &hash_key);
       hs = hn->last_child;
     }
     else
     {
       while (hp != NULL)
       {
-	if (hp->name && (x == hp->name_len) && !strncmp(hp->name, n, x))
+	if (HDF_NAME_MATCH(hp, n, x, h))
 	{
 	  break;
 	}
@@ -747,7 +1271,7 @@ skip_search:
       }
       else if (hn->hash != NULL)
       {
-	err = ne_hash_insert(hn->hash, hp, hp);
+	err = ne_ohash_insert(hn->hash, hp, hp);
 	if (err) return nerr_pass(err);
       }
     }
@@ -778,8 +1302,7 @@ skip_search:
 	}
 	else if (dupl)
 	{
-	  hp->alloc_value = 1;
-	  hp->value = strdup(value);
+	  hp->value = _dup_value(hp->top, value, &(hp->alloc_value));
 	  if (hp->value == NULL)
 	    return nerr_raise (NERR_NOMEM, "Unable to duplicate value %s for %s",
 		value, name);
@@ -812,8 +1335,7 @@ skip_search:
       break;
     /* Otherwise, we need to find the next part of the namespace */
     n = s + 1;
-    s = strchr (n, '.');
-    x = (s != NULL) ? s - n : strlen(n);
+    x = _hdf_name_next (n, &h, &s);
     if (x == 0)
     {
       return nerr_raise(NERR_ASSERT, "Unable to set Empty component %s", name);
@@ -856,7 +1378,7 @@ NEOERR* hdf_set_buf (HDF *hdf, const char *name, char *value)
 NEOERR* hdf_set_copy (HDF *hdf, const char *dest, const char *src)
 {
   HDF *node;
-  if ((_walk_hdf(hdf, src, &node) == 0) && (node->value != NULL))
+  if ((_walk_hdf(hdf, src, &node, 0) == 0) && (node->value != NULL))
   {
     return nerr_pass(_set_value (hdf, dest, node->value, 0, 0, 0, NULL, NULL));
   }
@@ -900,7 +1422,7 @@ NEOERR* hdf_set_valuef (HDF *hdf, const char *fmt, ...)
 
 NEOERR* hdf_get_node (HDF *hdf, const char *name, HDF **ret)
 {
-  _walk_hdf(hdf, name, ret);
+  _walk_hdf(hdf, name, ret, 1);
   if (*ret == NULL)
   {
     return nerr_pass(_set_value (hdf, name, NULL, 0, 1, 0, NULL, ret));
@@ -919,6 +1441,8 @@ NEOERR *hdf_sort_obj (HDF *h, int (*compareFunc)(const void *, const void *))
   int x;
 
   if (h == NULL) return STATUS_OK;
+  err = _overlay_shadow(h);
+  if (err) return nerr_pass(err);
   c = h->child;
   if (c == NULL) return STATUS_OK;
 
@@ -948,14 +1472,18 @@ NEOERR *hdf_sort_obj (HDF *h, int (*compareFunc)(const void *, const void *))
 
 NEOERR* hdf_remove_tree (HDF *hdf, const char *name)
 {
+  NEOERR *err;
   HDF *hp = hdf;
   HDF *lp = NULL, *ln = NULL; /* last parent, last node */
   int x = 0;
+  UINT32 h;
   const char *s = name;
   const char *n = name;
 
   if (hdf == NULL) return STATUS_OK;
 
+  err = _overlay_shadow(hdf);
+  if (err) return nerr_pass(err);
   hp = hdf->child;
   if (hp == NULL)
   {
@@ -966,14 +1494,13 @@ NEOERR* hdf_remove_tree (HDF *hdf, const char *name)
   ln = NULL;
 
   n = name;
-  s = strchr (n, '.');
-  x = (s == NULL) ? strlen(n) : s - n;
+  x = _hdf_name_next (n, &h, &s);
 
   while (1)
   {
     while (hp != NULL)
     {
-      if (hp->name && (x == hp->name_len) && !strncmp(hp->name, n, x))
+      if (HDF_NAME_MATCH(hp, n, x, h))
       {
       break;
       }
@@ -991,16 +1518,21 @@ NEOERR* hdf_remove_tree (HDF *hdf, const char *name)
 
     lp = hp;
     ln = NULL;
+    err = _overlay_shadow(hp);
+    if (err) return nerr_pass(err);
     hp = hp->child;
     n = s + 1;
-    s = strchr (n, '.');
-    x = (s == NULL) ? strlen(n) : s - n;
+    x = _hdf_name_next (n, &h, &s);
   }
 
   if (lp->hash != NULL)
   {
-    ne_hash_remove(lp->hash, hp);
+    ne_ohash_remove(lp->hash, hp);
   }
+  /* the lookup cache of _set_value may point at the node or its
+   * predecessor */
+  lp->last_hp = NULL;
+  lp->last_hs = NULL;
   if (ln)
   {
     ln->next = hp->next;
@@ -1060,7 +1592,7 @@ static NEOERR * _copy_nodes (HDF *dest, HDF *src)
   HDF *dt, *st;
   HDF_ATTR *attr_copy;
 
-  st = src->child;
+  st = _hdf_level(src)->child;
   while (st != NULL)
   {
     err = _copy_attr(&attr_copy, st->attr);
@@ -1070,7 +1602,7 @@ static NEOERR * _copy_nodes (HDF *dest, HDF *src)
       _dealloc_hdf_attr(&attr_copy);
       return nerr_pass(err);
     }
-    if (src->child)
+    if (_hdf_level(st)->child)
     {
       err = _copy_nodes (dt, st);
       if (err) return nerr_pass(err);
@@ -1085,7 +1617,7 @@ NEOERR* hdf_copy (HDF *dest, const char *name, HDF *src)
   NEOERR *err;
   HDF *node;
 
-  if (_walk_hdf(dest, name, &node) == -1)
+  if (_walk_hdf(dest, name, &node, 1) == -1)
   {
     err = _set_value (dest, name, NULL, 0, 0, 0, NULL, &node);
     if (err) return nerr_pass (err);
@@ -1162,7 +1694,7 @@ static NEOERR* hdf_dump_cb(HDF *hdf, const char *prefix, int dtype, int lvl,
     whsp[lvl*2] = '\0';
   }
 
-  if (hdf != NULL) hdf = hdf->child;
+  if (hdf != NULL) hdf = _hdf_level(hdf)->child;
 
   while (hdf != NULL)
   {
@@ -1230,7 +1762,7 @@ static NEOERR* hdf_dump_cb(HDF *hdf, const char *prefix, int dtype, int lvl,
       }
       if (err) return nerr_pass (err);
     }
-    if (hdf->child)
+    if (_hdf_level(hdf)->child)
     {
       if (prefix && (dtype == DUMP_TYPE_DOTTED))
       {
@@ -1355,53 +1887,429 @@ NEOERR *hdf_write_string (HDF *hdf, char **s)
   return STATUS_OK;
 }
 
+/* The binary format written by hdf_write_binary and mapped by
+ * hdf_map_binary is a header, followed by the node table, the attribute
+ * table and the string table.  The integers are in the byte order of the
+ * writer, which is checked with the magic number.  Nodes are stored in
+ * depth first order starting with the top node, so the children and next
+ * sibling of a node always come after it, and are referred to by their
+ * index in the node table, with 0 meaning none.  Names, values and
+ * attributes are offsets of NUL terminated strings in the string table. */
+#define HDF_BIN_MAGIC 0x48444642
+#define HDF_BIN_MAGIC_SWAPPED 0x42464448
+#define HDF_BIN_VERSION 1
+#define HDF_BIN_NONE 0xffffffff
+#define HDF_BIN_LINK 1
+
+typedef struct _hdf_bin_header
+{
+  UINT32 magic;
+  UINT32 version;
+  UINT32 node_count;
+  UINT32 attr_count;
+  UINT32 strings_len;
+  UINT32 reserved;
+} HDF_BIN_HEADER;
+
+typedef struct _hdf_bin_node
+{
+  UINT32 name;
+  UINT32 name_len;
+  UINT32 name_hash;
+  UINT32 value;
+  UINT32 child;
+  UINT32 next;
+  UINT32 attr;
+  UINT32 attr_count;
+  UINT32 flags;
+} HDF_BIN_NODE;
+
+typedef struct _hdf_bin_attr
+{
+  UINT32 key;
+  UINT32 value;
+} HDF_BIN_ATTR;
 
-#define SKIPWS(s) while (*s && isspace(*s)) s++;
-
-static int _copy_line (const char **s, char *buf, size_t buf_len)
+typedef struct _hdf_bin_writer
 {
-  int x = 0;
-  const char *st = *s;
+  HDF_BIN_NODE *nodes;
+  UINT32 node_count;
+  UINT32 node_max;
+  HDF_BIN_ATTR *attrs;
+  UINT32 attr_count;
+  UINT32 attr_max;
+  STRING strings;
+} HDF_BIN_WRITER;
+
+static NEOERR *_bin_add_string (HDF_BIN_WRITER *w, const char *s, UINT32 *off)
+{
+  NEOERR *err;
 
-  while (*st && x < buf_len-1)
+  if (s == NULL)
   {
-    buf[x++] = *st;
-    if (*st++ == '\n') break;
+    *off = HDF_BIN_NONE;
+    return STATUS_OK;
   }
-  buf[x] = '\0';
-  *s = st;
-
-  return x;
+  *off = w->strings.len;
+  err = string_appendn (&(w->strings), s, strlen(s) + 1);
+  return nerr_pass(err);
 }
 
-/* Copy the characters in the file (up to the next newline) into line
- * and advance s to the next line */
-static NEOERR *_copy_line_advance(const char **s, STRING *line)
+static NEOERR *_bin_add_node (HDF_BIN_WRITER *w, HDF *hdf, UINT32 *index)
 {
   NEOERR *err;
-  int x = 0;
-  const char *st = *s;
-  const char *nl;
+  HDF_BIN_NODE node;
+  HDF_ATTR *attr;
+  HDF *child;
+  UINT32 i, ci, prev = 0;
+  void *new_ptr;
+
+  if (w->node_count == w->node_max)
+  {
+    w->node_max = w->node_max ? w->node_max * 2 : 256;
+    new_ptr = realloc (w->nodes, w->node_max * sizeof(HDF_BIN_NODE));
+    if (new_ptr == NULL)
+      return nerr_raise (NERR_NOMEM, "Unable to allocate binary hdf nodes");
+    w->nodes = (HDF_BIN_NODE *) new_ptr;
+  }
+  i = w->node_count++;
 
-  nl = strchr(st, '\n');
-  if (nl == NULL)
+  memset (&node, 0, sizeof(node));
+  err = _bin_add_string (w, hdf->name, &(node.name));
+  if (err) return nerr_pass(err);
+  node.name_len = hdf->name_len;
+  node.name_hash = hdf->name_hash;
+  err = _bin_add_string (w, hdf->value, &(node.value));
+  if (err) return nerr_pass(err);
+  if (hdf->link) node.flags |= HDF_BIN_LINK;
+  node.attr = w->attr_count;
+  for (attr = hdf->attr; attr != NULL; attr = attr->next)
   {
-    x = strlen(st);
-    err = string_appendn(line, st, x);
+    if (w->attr_count == w->attr_max)
+    {
+      w->attr_max = w->attr_max ? w->attr_max * 2 : 64;
+      new_ptr = realloc (w->attrs, w->attr_max * sizeof(HDF_BIN_ATTR));
+      if (new_ptr == NULL)
+        return nerr_raise (NERR_NOMEM, "Unable to allocate binary hdf attrs");
+      w->attrs = (HDF_BIN_ATTR *) new_ptr;
+    }
+    err = _bin_add_string (w, attr->key, &(w->attrs[w->attr_count].key));
+    if (err) return nerr_pass(err);
+    err = _bin_add_string (w, attr->value, &(w->attrs[w->attr_count].value));
     if (err) return nerr_pass(err);
-    *s = st + x;
+    w->attr_count++;
+    node.attr_count++;
   }
-  else
+  /* w->nodes moves as the children are added */
+  w->nodes[i] = node;
+
+  for (child = _hdf_level(hdf)->child; child != NULL; child = child->next)
   {
-    x = nl - st;
-    err = string_appendn(line, st, x);
+    err = _bin_add_node (w, child, &ci);
     if (err) return nerr_pass(err);
-    *s = nl + 1;
+    if (prev)
+      w->nodes[prev].next = ci;
+    else
+      w->nodes[i].child = ci;
+    prev = ci;
+  }
+  *index = i;
+  return STATUS_OK;
+}
+
+NEOERR *hdf_write_binary (HDF *hdf, const char *path)
+{
+  NEOERR *err;
+  HDF_BIN_WRITER w;
+  HDF_BIN_HEADER header;
+  FILE *fp;
+  char tpath[PATH_BUF_SIZE];
+  static int count = 0;
+  UINT32 top;
+
+  memset (&w, 0, sizeof(w));
+  string_init (&(w.strings));
+
+  err = _bin_add_node (&w, hdf, &top);
+  if (err == STATUS_OK)
+  {
+    /* the node written becomes the top of the mapped data set */
+    w.nodes[0].name = HDF_BIN_NONE;
+    w.nodes[0].name_len = 0;
+    w.nodes[0].name_hash = 0;
+    w.nodes[0].flags = 0;
+
+    memset (&header, 0, sizeof(header));
+    header.magic = HDF_BIN_MAGIC;
+    header.version = HDF_BIN_VERSION;
+    header.node_count = w.node_count;
+    header.attr_count = w.attr_count;
+    header.strings_len = w.strings.len;
+
+    snprintf(tpath, sizeof(tpath), "%s.%5.5f.%d", path, ne_timef(), count++);
+    fp = fopen(tpath, "wb");
+    if (fp == NULL)
+    {
+      err = nerr_raise_errno (NERR_IO, "Unable to open %s for writing", tpath);
+    }
+    else
+    {
+      if (fwrite (&header, sizeof(header), 1, fp) != 1 ||
+          fwrite (w.nodes, sizeof(HDF_BIN_NODE), w.node_count, fp) !=
+            w.node_count ||
+          (w.attr_count &&
+           fwrite (w.attrs, sizeof(HDF_BIN_ATTR), w.attr_count, fp) !=
+             w.attr_count) ||
+          fwrite (w.strings.buf, 1, w.strings.len, fp) != w.strings.len)
+      {
+        err = nerr_raise_errno (NERR_IO, "Unable to write to %s", tpath);
+      }
+      if (fclose (fp) && err == STATUS_OK)
+        err = nerr_raise_errno (NERR_IO, "Unable to write to %s", tpath);
+      if (err == STATUS_OK && rename(tpath, path) == -1)
+      {
+        err = nerr_raise_errno (NERR_IO, "Unable to rename file %s to %s",
+            tpath, path);
+      }
+      if (err) unlink (tpath);
+    }
+  }
+
+  if (w.nodes != NULL) free (w.nodes);
+  if (w.attrs != NULL) free (w.attrs);
+  string_clear (&(w.strings));
+  return nerr_pass(err);
+}
+
+/* Check that a mapped binary data set is well formed, so building the
+ * tree from it can't go outside the mapping, or link a node twice */
+static NEOERR *_bin_check (const char *path, const char *map, size_t len)
+{
+  HDF_BIN_HEADER *header = (HDF_BIN_HEADER *) map;
+  HDF_BIN_NODE *nodes, *node;
+  HDF_BIN_ATTR *attrs;
+  const char *strings;
+  double total;
+  UINT32 i, a;
+
+  if (len < sizeof(HDF_BIN_HEADER))
+    return nerr_raise (NERR_PARSE, "%s is not a binary hdf file", path);
+  if (header->magic == HDF_BIN_MAGIC_SWAPPED)
+    return nerr_raise (NERR_PARSE, "%s was written with another byte order",
+        path);
+  if (header->magic != HDF_BIN_MAGIC)
+    return nerr_raise (NERR_PARSE, "%s is not a binary hdf file", path);
+  if (header->version != HDF_BIN_VERSION)
+    return nerr_raise (NERR_PARSE, "%s is binary hdf version %d, expected %d",
+        path, header->version, HDF_BIN_VERSION);
+
+  total = (double) sizeof(HDF_BIN_HEADER) +
+    (double) header->node_count * sizeof(HDF_BIN_NODE) +
+    (double) header->attr_count * sizeof(HDF_BIN_ATTR) +
+    (double) header->strings_len;
+  if (header->node_count == 0 || total != (double) len)
+    return nerr_raise (NERR_PARSE, "%s is truncated or corrupt", path);
+
+  nodes = (HDF_BIN_NODE *) (map + sizeof(HDF_BIN_HEADER));
+  attrs = (HDF_BIN_ATTR *) (nodes + header->node_count);
+  strings = (const char *) (attrs + header->attr_count);
+  if (header->strings_len && strings[header->strings_len - 1] != '\0')
+    return nerr_raise (NERR_PARSE, "%s is truncated or corrupt", path);
+
+#define BIN_BAD_STR(o) ((o) != HDF_BIN_NONE && (o) >= header->strings_len)
+#define BIN_BAD_NODE(x) ((x) != 0 && ((x) <= i || (x) >= header->node_count))
+  for (i = 0; i < header->node_count; i++)
+  {
+    node = nodes + i;
+    if (BIN_BAD_STR(node->name) || BIN_BAD_STR(node->value) ||
+        BIN_BAD_NODE(node->child) || BIN_BAD_NODE(node->next) ||
+        node->attr > header->attr_count ||
+        node->attr_count > header->attr_count - node->attr ||
+        (node->flags & ~HDF_BIN_LINK) ||
+        ((node->flags & HDF_BIN_LINK) && node->value == HDF_BIN_NONE) ||
+        (i && node->name == HDF_BIN_NONE))
+      return nerr_raise (NERR_PARSE, "%s has a corrupt node %d", path, i);
+    if (node->name != HDF_BIN_NONE &&
+        (node->name_len >= header->strings_len - node->name ||
+         strings[node->name + node->name_len] != '\0'))
+      return nerr_raise (NERR_PARSE, "%s has a corrupt node %d", path, i);
+    for (a = node->attr; a < node->attr + node->attr_count; a++)
+    {
+      if (attrs[a].key == HDF_BIN_NONE || BIN_BAD_STR(attrs[a].key) ||
+          BIN_BAD_STR(attrs[a].value))
+        return nerr_raise (NERR_PARSE, "%s has a corrupt node %d", path, i);
+    }
   }
+#undef BIN_BAD_STR
+#undef BIN_BAD_NODE
+  if (nodes[0].next != 0)
+    return nerr_raise (NERR_PARSE, "%s has a corrupt node 0", path);
+  return STATUS_OK;
+}
 
+/* Point hdf at the node with index x, marking it as linked from a parent
+ * or sibling so a node linked twice is caught */
+static NEOERR *_bin_link (const char *path, HDF *top, HDF *hnodes, UINT32 x,
+                          HDF **hdf)
+{
+  *hdf = NULL;
+  if (x == 0) return STATUS_OK;
+  *hdf = hnodes + x - 1;
+  if ((*hdf)->top != NULL)
+    return nerr_raise (NERR_PARSE, "%s has a corrupt node %d", path, x);
+  (*hdf)->top = top;
   return STATUS_OK;
 }
 
+NEOERR *hdf_map_binary (HDF **hdf, const char *path)
+{
+  NEOERR *err;
+  HDF *my_hdf, *hnodes = NULL, *hp, *child;
+  HDF_BIN_HEADER *header;
+  HDF_BIN_NODE *nodes, *node;
+  HDF_BIN_ATTR *attrs;
+  HDF_ATTR *attr, **last_attr;
+  const char *strings;
+  struct stat s;
+  void *map;
+  int fd;
+  UINT32 i, a, count;
+
+  *hdf = NULL;
+
+  fd = open (path, O_RDONLY);
+  if (fd == -1)
+    return nerr_raise_errno (NERR_IO, "Unable to open file %s", path);
+  if (fstat (fd, &s) == -1)
+  {
+    close (fd);
+    return nerr_raise_errno (NERR_IO, "Unable to stat file %s", path);
+  }
+  if (s.st_size < (off_t) sizeof(HDF_BIN_HEADER))
+  {
+    close (fd);
+    return nerr_raise (NERR_PARSE, "%s is not a binary hdf file", path);
+  }
+  /* Pages are shared with every other process mapping the file, unless
+   * somebody writes into a value in place, which gets a private copy */
+  map = mmap (NULL, s.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close (fd);
+  if (map == MAP_FAILED)
+    return nerr_raise_errno (NERR_IO, "Unable to map file %s", path);
+
+  err = _bin_check (path, (const char *) map, s.st_size);
+  if (err == STATUS_OK)
+    err = hdf_init_arena (&my_hdf, 0);
+  if (err)
+  {
+    munmap (map, s.st_size);
+    return nerr_pass(err);
+  }
+  my_hdf->arena->map = map;
+  my_hdf->arena->map_len = s.st_size;
+
+  header = (HDF_BIN_HEADER *) map;
+  nodes = (HDF_BIN_NODE *) ((char *) map + sizeof(HDF_BIN_HEADER));
+  attrs = (HDF_BIN_ATTR *) (nodes + header->node_count);
+  strings = (const char *) (attrs + header->attr_count);
+
+  /* All the nodes but the top are allocated at once, node x is
+   * hnodes[x - 1] */
+  if (header->node_count > 1)
+  {
+    hnodes = (HDF *) _arena_alloc (my_hdf->arena,
+        (header->node_count - 1) * sizeof(HDF));
+    if (hnodes == NULL)
+    {
+      hdf_destroy (&my_hdf);
+      return nerr_raise (NERR_NOMEM, "Unable to allocate memory for %s", path);
+    }
+    memset (hnodes, 0, (header->node_count - 1) * sizeof(HDF));
+  }
+
+  for (i = 0; i < header->node_count; i++)
+  {
+    node = nodes + i;
+    hp = i ? hnodes + i - 1 : my_hdf;
+    if (hp->top == NULL)
+    {
+      /* not linked from anywhere */
+      hdf_destroy (&my_hdf);
+      return nerr_raise (NERR_PARSE, "%s has a corrupt node %d", path, i);
+    }
+    if (node->name != HDF_BIN_NONE)
+    {
+      hp->name = (char *) strings + node->name;
+      hp->name_len = node->name_len;
+      hp->name_hash = node->name_hash;
+    }
+    if (node->value != HDF_BIN_NONE)
+      hp->value = (char *) strings + node->value;
+    hp->link = (node->flags & HDF_BIN_LINK) ? 1 : 0;
+
+    last_attr = &(hp->attr);
+    for (a = node->attr; a < node->attr + node->attr_count; a++)
+    {
+      attr = (HDF_ATTR *) calloc (1, sizeof(HDF_ATTR));
+      if (attr == NULL)
+      {
+        hdf_destroy (&my_hdf);
+        return nerr_raise (NERR_NOMEM, "Unable to allocate memory for %s",
+            path);
+      }
+      *last_attr = attr;
+      last_attr = &(attr->next);
+      attr->key = strdup (strings + attrs[a].key);
+      if (attrs[a].value != HDF_BIN_NONE)
+        attr->value = strdup (strings + attrs[a].value);
+      if (attr->key == NULL ||
+          (attrs[a].value != HDF_BIN_NONE && attr->value == NULL))
+      {
+        hdf_destroy (&my_hdf);
+        return nerr_raise (NERR_NOMEM, "Unable to allocate memory for %s",
+            path);
+      }
+    }
+
+    err = _bin_link (path, my_hdf, hnodes, node->child, &(hp->child));
+    if (err == STATUS_OK)
+      err = _bin_link (path, my_hdf, hnodes, node->next, &(hp->next));
+    if (err)
+    {
+      hdf_destroy (&my_hdf);
+      return nerr_pass(err);
+    }
+  }
+
+  /* Now that the levels are linked up, hash the wide ones */
+  for (i = 0; i < header->node_count; i++)
+  {
+    hp = i ? hnodes + i - 1 : my_hdf;
+    if (hp->child == NULL) continue;
+    count = 0;
+    for (child = hp->child; child != NULL; child = child->next)
+    {
+      hp->last_child = child;
+      count++;
+    }
+    if (count > FORCE_HASH_AT)
+    {
+      err = _hdf_hash_level (hp);
+      if (err)
+      {
+        hdf_destroy (&my_hdf);
+        return nerr_pass(err);
+      }
+    }
+  }
+
+  *hdf = my_hdf;
+  return STATUS_OK;
+}
+
+
+#define SKIPWS(s) while (*s && isspace(*s)) s++;
+
 /* attributes are of the form [key1, key2, key3=value, key4="repr"] */
 static NEOERR* parse_attr(char **str, HDF_ATTR **attr)
 {
@@ -1547,25 +2455,139 @@ static NEOERR* parse_attr(char **str, HDF_ATTR **attr)
 #define INCLUDE_FILE 0
 #define INCLUDE_MAX_DEPTH 50
 
-static NEOERR* _hdf_read_string (HDF *hdf, const char **str, STRING *line,
-                                 const char *path, int *lineno,
-                                 int include_handle)
+/* Valid hdf name is [0-9a-zA-Z_.]+ */
+#define HDF_NAME_CHAR(c) (((c) >= '0' && (c) <= '9') || \
+    ((c) >= 'a' && (c) <= 'z') || ((c) >= 'A' && (c) <= 'Z') || \
+    (c) == '_' || (c) == '.')
+static const NEOS_CHARSET HdfNameChars = NEOS_CHARSET_INIT(HDF_NAME_CHAR);
+
+/* The parent of the node set by the last assignment at a scope, so a run
+ * of lines like a.b.c = 1, a.b.d = 2 only looks up a.b once.  Only paths
+ * without links are cached, and the cache is dropped on anything which
+ * could turn one of its nodes into a link: a link assignment, an include
+ * or a nested scope. */
+typedef struct _hdf_parse_cache
+{
+  const char *prefix;   /* in the buffer being parsed */
+  int len;
+  HDF *parent;
+} HDF_PARSE_CACHE;
+
+/* Find or create the node named by the first len bytes of name (which is
+ * followed by a '.') below hdf.  Returns NULL in node if that would go
+ * through a link. */
+static NEOERR *_parse_parent (HDF *hdf, char *name, int len, HDF **node)
+{
+  NEOERR *err;
+  HDF *hp = hdf, *child;
+  const char *n = name, *s;
+  UINT32 h;
+  int x;
+
+  *node = NULL;
+  while (1)
+  {
+    if (hp->link) return STATUS_OK;
+    x = _hdf_name_next (n, &h, &s);
+    child = _find_child (hp, _first_child (&hp, 1), n, x, h);
+    if (child == NULL)
+    {
+      /* the rest of the path is new, so it can't have links */
+      name[len] = '\0';
+      err = _set_value (hp, n, NULL, 0, 0, 0, NULL, node);
+      name[len] = '.';
+      return nerr_pass(err);
+    }
+    hp = child;
+    if (s == name + len) break;
+    n = s + 1;
+  }
+  if (!hp->link) *node = hp;
+  return STATUS_OK;
+}
+
+/* Set name below hdf, using and updating cache.  value is copied */
+static NEOERR *_parse_set (HDF *hdf, HDF_PARSE_CACHE *cache, char *name,
+                           const char *value, HDF_ATTR *attr)
+{
+  NEOERR *err;
+  char *last = NULL, *p;
+
+  /* Names with empty components are left to _set_value to complain
+   * about */
+  if (name[0] != '.')
+  {
+    for (p = name; *p; p++)
+    {
+      if (*p == '.')
+      {
+        if (p[1] == '.' || p[1] == '\0')
+        {
+          last = NULL;
+          break;
+        }
+        last = p;
+      }
+    }
+  }
+  if (last == NULL)
+    return nerr_pass(_set_value (hdf, name, value, 1, 1, 0, attr, NULL));
+
+  if (cache->parent == NULL || cache->len != last - name ||
+      memcmp (cache->prefix, name, cache->len))
+  {
+    err = _parse_parent (hdf, name, last - name, &(cache->parent));
+    if (err) return nerr_pass(err);
+    if (cache->parent == NULL)
+      return nerr_pass(_set_value (hdf, name, value, 1, 1, 0, attr, NULL));
+    cache->prefix = name;
+    cache->len = last - name;
+  }
+  return nerr_pass(_set_value (cache->parent, last + 1, value, 1, 1, 0,
+                               attr, NULL));
+}
+
+/* Strip the white space around s, which ends at end */
+static char *_parse_strip (char *s, char *end)
+{
+  while (s < end && isspace(*s)) s++;
+  while (end > s && isspace(end[-1])) end--;
+  *end = '\0';
+  return s;
+}
+
+/* Parses the buffer at *str in place: each line is split up by writing
+ * NULs over its delimiters, so nothing is copied before it's set in hdf,
+ * and multi-line values are terminated where they end in the buffer.
+ * Recurses for each { } scope with the scope's node as hdf. */
+static NEOERR* _hdf_read_string (HDF *hdf, char **str, const char *path,
+                                 int *lineno, int include_handle)
 {
   NEOERR *err;
   HDF *lower;
-  char *s;
+  char *s, *line, *eol;
   char *name, *value;
   HDF_ATTR *attr = NULL;
+  HDF_PARSE_CACHE cache;
 
+  cache.parent = NULL;
   while (**str != '\0')
   {
-    /* Reset string length, but don't free the reserved buffer */
-    line->len = 0;
-    err = _copy_line_advance(str, line);
-    if (err) return nerr_pass(err);
+    line = *str;
+    eol = strchr (line, '\n');
+    if (eol == NULL)
+    {
+      eol = line + strlen(line);
+      *str = eol;
+    }
+    else
+    {
+      *eol = '\0';
+      *str = eol + 1;
+    }
     attr = NULL;
     (*lineno)++;
-    s = line->buf;
+    s = line;
     SKIPWS(s);
     if (!strncmp(s, "#include ", 9) && include_handle != INCLUDE_IGNORE)
     {
@@ -1586,6 +2608,7 @@ static NEOERR* _hdf_read_string (HDF *hdf, const char **str, STRING *line,
           name[l-1] = '\0';
           name++;
         }
+        cache.parent = NULL;
         err = hdf_read_file_internal(hdf, name, include_handle + 1);
         if (err != STATUS_OK)
         {
@@ -1606,27 +2629,26 @@ static NEOERR* _hdf_read_string (HDF *hdf, const char **str, STRING *line,
     }
     else if (s[0] == '}') /* up */
     {
-      s = neos_strip(s);
+      s = _parse_strip(s, eol);
       if (strcmp(s, "}"))
       {
         err = nerr_raise(NERR_PARSE,
 	    "[%s:%d] Trailing garbage on line following }: %s", path, *lineno,
-	    line->buf);
+	    line);
         return err;
       }
       return STATUS_OK;
     }
     else if (s[0])
     {
-      /* Valid hdf name is [0-9a-zA-Z_.]+ */
       name = s;
-      while (*s && (isalnum(*s) || *s == '_' || *s == '.')) s++;
+      while (NEOS_CHARSET_HAS(&HdfNameChars, *s)) s++;
+      value = s;
       SKIPWS(s);
 
       if (s[0] == '[') /* attributes */
       {
-	*s = '\0';
-	name = neos_strip(name);
+	*value = '\0';
 	s++;
 	err = parse_attr(&s, &attr);
 	if (err)
@@ -1637,11 +2659,9 @@ static NEOERR* _hdf_read_string (HDF *hdf, const char **str, STRING *line,
       }
       if (s[0] == '=') /* assignment */
       {
-	*s = '\0';
-	name = neos_strip(name);
-	s++;
-	value = neos_strip(s);
-	err = _set_value (hdf, name, value, 1, 1, 0, attr, NULL);
+	*value = '\0';
+	value = _parse_strip(s + 1, eol);
+	err = _parse_set (hdf, &cache, name, value, attr);
 	if (err != STATUS_OK)
         {
           return nerr_pass_ctx(err, "In file %s:%d", path, *lineno);
@@ -1649,12 +2669,10 @@ static NEOERR* _hdf_read_string (HDF *hdf, const char **str, STRING *line,
       }
       else if (s[0] == ':' && s[1] == '=') /* copy */
       {
-	*s = '\0';
-	name = neos_strip(name);
-	s+=2;
-	value = neos_strip(s);
+	*value = '\0';
+	value = _parse_strip(s + 2, eol);
 	value = hdf_get_value(hdf->top, value, "");
-	err = _set_value (hdf, name, value, 1, 1, 0, attr, NULL);
+	err = _parse_set (hdf, &cache, name, value, attr);
 	if (err != STATUS_OK)
         {
           return nerr_pass_ctx(err, "In file %s:%d", path, *lineno);
@@ -1662,10 +2680,9 @@ static NEOERR* _hdf_read_string (HDF *hdf, const char **str, STRING *line,
       }
       else if (s[0] == ':') /* link */
       {
-	*s = '\0';
-	name = neos_strip(name);
-	s++;
-	value = neos_strip(s);
+	*value = '\0';
+	value = _parse_strip(s + 1, eol);
+	cache.parent = NULL;
 	err = _set_value (hdf, name, value, 1, 1, 1, attr, NULL);
 	if (err != STATUS_OK)
         {
@@ -1674,8 +2691,7 @@ static NEOERR* _hdf_read_string (HDF *hdf, const char **str, STRING *line,
       }
       else if (s[0] == '{') /* deeper */
       {
-	*s = '\0';
-	name = neos_strip(name);
+	*value = '\0';
 	lower = hdf_get_obj (hdf, name);
 	if (lower == NULL)
 	{
@@ -1689,7 +2705,8 @@ static NEOERR* _hdf_read_string (HDF *hdf, const char **str, STRING *line,
         {
           return nerr_pass_ctx(err, "In file %s:%d", path, *lineno);
         }
-	err = _hdf_read_string (lower, str, line, path, lineno, include_handle);
+	cache.parent = NULL;
+	err = _hdf_read_string (lower, str, path, lineno, include_handle);
 	if (err != STATUS_OK)
         {
           return nerr_pass_ctx(err, "In file %s:%d", path, *lineno);
@@ -1697,66 +2714,47 @@ static NEOERR* _hdf_read_string (HDF *hdf, const char **str, STRING *line,
       }
       else if (s[0] == '<' && s[1] == '<') /* multi-line assignment */
       {
-	char *m;
-	int msize = 0;
-	int mmax = 128;
+	char *marker, *m;
 	int l;
 
-	*s = '\0';
-	name = neos_strip(name);
-	s+=2;
-	value = neos_strip(s);
-	l = strlen(value);
+	*value = '\0';
+	marker = _parse_strip(s + 2, eol);
+	l = strlen(marker);
 	if (l == 0)
         {
 	  err = nerr_raise(NERR_PARSE,
 	      "[%s:%d] No multi-assignment terminator given: %s", path, *lineno,
-	      line->buf);
+	      line);
           return err;
         }
-	m = (char *) malloc (mmax * sizeof(char));
-	if (m == NULL)
-        {
-	  return nerr_raise(NERR_NOMEM,
-	    "[%s:%d] Unable to allocate memory for multi-line assignment to %s",
-	    path, *lineno, name);
-        }
-	while (_copy_line (str, m+msize, mmax-msize) != 0)
+	/* The value runs up to the line starting with the marker followed
+	 * by white space, or the end of the buffer */
+	value = *str;
+	m = *str;
+	while (*m != '\0')
 	{
           (*lineno)++;
-	  if (!strncmp(value, m+msize, l) && isspace(m[msize+l]))
+	  if (!strncmp(marker, m, l) && isspace(m[l]))
 	  {
-	    m[msize] = '\0';
+	    eol = strchr (m + l, '\n');
+	    *str = eol ? eol + 1 : m + l + strlen(m + l);
+	    *m = '\0';
 	    break;
 	  }
-	  msize += strlen(m+msize);
-	  if (msize + l + 10 > mmax)
-	  {
-            void *new_ptr;
-	    mmax += 128;
-	    new_ptr = realloc (m, mmax * sizeof(char));
-	    if (new_ptr == NULL)
-            {
-              free(m);
-	      return nerr_raise(NERR_NOMEM,
-		  "[%s:%d] Unable to allocate memory for multi-line assignment to %s: size=%d",
-		  path, *lineno, name, mmax);
-            }
-            m = (char *) new_ptr;
-	  }
+	  eol = strchr (m, '\n');
+	  m = eol ? eol + 1 : m + strlen(m);
+	  *str = m;
 	}
-	err = _set_value (hdf, name, m, 0, 1, 0, attr, NULL);
+	err = _parse_set (hdf, &cache, name, value, attr);
 	if (err != STATUS_OK)
 	{
-	  free (m);
           return nerr_pass_ctx(err, "In file %s:%d", path, *lineno);
 	}
-
       }
       else
       {
 	err = nerr_raise(NERR_PARSE, "[%s:%d] Unable to parse line %s", path,
-	    *lineno, line->buf);
+	    *lineno, line);
         return err;
       }
     }
@@ -1764,27 +2762,32 @@ static NEOERR* _hdf_read_string (HDF *hdf, const char **str, STRING *line,
   return STATUS_OK;
 }
 
-NEOERR * hdf_read_string (HDF *hdf, const char *str)
+/* hdf_read_string parses a copy of str, since the parser works in place */
+static NEOERR * _hdf_read_string_copy (HDF *hdf, const char *str,
+                                       int include_handle)
 {
   NEOERR *err;
   int lineno = 0;
-  STRING line;
-  string_init(&line);
-  err = _hdf_read_string(hdf, &str, &line, "<string>", &lineno, INCLUDE_ERROR);
-  string_clear(&line);
+  char *ibuf, *ptr;
+
+  ibuf = strdup(str);
+  if (ibuf == NULL)
+    return nerr_raise(NERR_NOMEM, "Unable to allocate copy of hdf string");
+  ptr = ibuf;
+  err = _hdf_read_string(hdf, &ptr, "<string>", &lineno, include_handle);
+  free(ibuf);
   return nerr_pass(err);
 }
 
+NEOERR * hdf_read_string (HDF *hdf, const char *str)
+{
+  return nerr_pass(_hdf_read_string_copy(hdf, str, INCLUDE_ERROR));
+}
+
 NEOERR * hdf_read_string_ignore (HDF *hdf, const char *str, int ignore)
 {
-  NEOERR *err;
-  int lineno = 0;
-  STRING line;
-  string_init(&line);
-  err = _hdf_read_string(hdf, &str, &line, "<string>", &lineno,
-                         (ignore ? INCLUDE_IGNORE : INCLUDE_ERROR));
-  string_clear(&line);
-  return nerr_pass(err);
+  return nerr_pass(_hdf_read_string_copy(hdf, str,
+                   (ignore ? INCLUDE_IGNORE : INCLUDE_ERROR)));
 }
 
 /* The search path is part of the HDF by convention */
@@ -1828,11 +2831,8 @@ static NEOERR* hdf_read_file_internal (HDF *hdf, const char *path,
   int lineno = 0;
   char fpath[PATH_BUF_SIZE];
   char *ibuf = NULL;
-  const char *ptr = NULL;
+  char *ptr = NULL;
   HDF *top = hdf->top;
-  STRING line;
-
-  string_init(&line);
 
   if (path == NULL)
     return nerr_raise(NERR_ASSERT, "Can't read NULL file");
@@ -1855,9 +2855,8 @@ static NEOERR* hdf_read_file_internal (HDF *hdf, const char *path,
   if (err) return nerr_pass(err);
 
   ptr = ibuf;
-  err = _hdf_read_string(hdf, &ptr, &line, path, &lineno, include_handle);
+  err = _hdf_read_string(hdf, &ptr, path, &lineno, include_handle);
   free(ibuf);
-  string_clear(&line);
   return nerr_pass(err);
 }
 
@@ -66,6 +66,10 @@ __BEGIN_DECLS
 
 typedef struct _hdf HDF;
 
+/* An HDF_ARENA is the slab allocator backing a data set created with
+ * hdf_init_arena.  Its layout is private to neo_hdf.c */
+typedef struct _hdf_arena HDF_ARENA;
+
 /* HDFFILELOAD is a callback function to intercept file load requests and
  * provide templates via another mechanism.  This way you can load templates
  * that you compiled-into your binary, from in-memory caches, or from a
@@ -94,6 +98,8 @@ struct _hdf
   int alloc_value;
   char *name;
   int name_len;
+  /* hash of name, used to speed up lookups of children by name */
+  UINT32 name_hash;
   char *value;
   struct _attr *attr;
   struct _hdf *top;
@@ -106,7 +112,7 @@ struct _hdf
 
   /* the following HASH is used when we reach more than FORCE_HASH_AT
    * elements */
-  NE_HASH *hash;
+  NE_OHASH *hash;
   /* When using the HASH, we need to know where to append new children */
   struct _hdf *last_child;
 
@@ -114,8 +120,32 @@ struct _hdf
    * load method */
   void *fileload_ctx;
   HDFFILELOAD fileload;
+
+  /* Should only be set on the head node, when set all nodes, names and
+   * copied values of the data set are allocated from the arena */
+  HDF_ARENA *arena;
+
+  /* Only set in an overlay data set, on nodes whose children are still
+   * those of this node of the base data set.  See hdf_init_overlay */
+  struct _hdf *base;
 };
 
+/* An HDF_PATH is a dotted HDF name split into its components, with the
+ * name hash of each component precomputed.  See hdf_path_init. */
+typedef struct _hdf_path_elem
+{
+  const char *name;
+  int len;
+  UINT32 hash;
+} HDF_PATH_ELEM;
+
+typedef struct _hdf_path
+{
+  const char *name;   /* the name the path was created from */
+  int count;
+  HDF_PATH_ELEM elem[1];
+} HDF_PATH;
+
 /*
  * Function: hdf_init - Initialize an HDF data set
  * Description: hdf_init initializes an HDF data set and returns the
@@ -126,6 +156,50 @@ struct _hdf
  */
 NEOERR* hdf_init (HDF **hdf);
 
+/*
+ * Function: hdf_init_arena - Initialize an arena allocated HDF data set
+ * Description: hdf_init_arena is similar to hdf_init, except that the
+ *              nodes, names and copied values of the data set are
+ *              allocated from chunked slabs owned by the top node
+ *              instead of being malloc'd one by one, and are all freed
+ *              at once by hdf_destroy.  Memory of nodes removed with
+ *              hdf_remove_tree and of overwritten values is not reused
+ *              until the data set is destroyed, so this is intended for
+ *              short lived data sets like the per request HDF of a CGI.
+ *              Values handed over with hdf_set_buf are still owned by the
+ *              data set and free'd by hdf_destroy.
+ * Input: hdf - pointer to an HDF pointer
+ *        hint - expected size in bytes of the data set, used to size the
+ *               first slab, or 0 to use the default
+ * Output: hdf - allocated hdf node
+ * Returns: NERR_NOMEM - unable to allocate memory for dataset
+ */
+NEOERR* hdf_init_arena (HDF **hdf, size_t hint);
+
+/*
+ * Function: hdf_init_overlay - Initialize an HDF data set over a base
+ * Description: hdf_init_overlay creates an arena data set (see
+ *              hdf_init_arena) whose initial contents are the children
+ *              of base, without copying them.  Lookups fall through to
+ *              base until something is changed, and a level of base is
+ *              only shadowed by nodes of the overlay, sharing the names
+ *              and values of base, when one of its nodes is handed out
+ *              (hdf_get_obj, hdf_obj_child, etc), or something below it
+ *              is set or removed.  hdf_get_value, hdf_peek_obj and the
+ *              other calls which only read look at base directly.  base is
+ *              never modified, so it can be shared by any number of
+ *              overlays in any number of threads, as long as it isn't
+ *              modified or destroyed while they exist.  base may itself
+ *              be (part of) an overlay.
+ * Input: hdf - pointer to an HDF pointer
+ *        base - the data set to overlay
+ *        hint - as for hdf_init_arena
+ * Output: hdf - allocated hdf node
+ * Returns: NERR_ASSERT - base is NULL
+ *          NERR_NOMEM - unable to allocate memory for dataset
+ */
+NEOERR* hdf_init_overlay (HDF **hdf, HDF *base, size_t hint);
+
 /*
  * Function: hdf_destroy - deallocate an HDF data set
  * Description: hdf_destroy is used to deallocate all memory associated
@@ -236,6 +310,72 @@ NEOERR* hdf_get_copy (HDF *hdf, const char *name, char **value,
  */
 HDF* hdf_get_obj (HDF *hdf, const char *name);
 
+/*
+ * Function: hdf_path_init - Split a dotted name for repeated lookups
+ * Description: hdf_path_init splits the dotted HDF name into its
+ *              components and computes the hash of each, so that
+ *              lookups with hdf_get_obj_path don't have to do it again
+ *              on every call.  The path points into name instead of
+ *              copying it, so name must not be modified or free'd while
+ *              the path is in use.
+ * Input: path - pointer to an HDF_PATH pointer
+ *        name - the name to split
+ * Output: path - the allocated HDF_PATH, free with hdf_path_destroy
+ * Returns: NERR_NOMEM
+ */
+NEOERR* hdf_path_init (HDF_PATH **path, const char *name);
+
+/*
+ * Function: hdf_path_destroy - deallocate an HDF_PATH
+ * Description: hdf_path_destroy frees an HDF_PATH created with
+ *              hdf_path_init.  It is safe to call with a NULL path.
+ * Input: path - pointer to an HDF_PATH pointer
+ * Output: path - will be NULL
+ * Returns: None
+ */
+void hdf_path_destroy (HDF_PATH **path);
+
+/*
+ * Function: hdf_get_obj_path - hdf_get_obj for a pre split name
+ * Description: hdf_get_obj_path is the same as hdf_get_obj, except the
+ *              name is given as an HDF_PATH.  The walk starts at
+ *              component start of the path, ie a start of 1 looks up
+ *              "b.c" for the path of "a.b.c".
+ * Input: hdf -> the dataset node to start from
+ *        path -> the path to walk
+ *        start -> the index of the first component to walk
+ * Output: None
+ * Returns: the pointer to the named node, or NULL if it doesn't exist
+ */
+HDF* hdf_get_obj_path (HDF *hdf, HDF_PATH *path, int start);
+
+/*
+ * Function: hdf_peek_obj - hdf_get_obj for lookups which only read
+ * Description: hdf_peek_obj is the same as hdf_get_obj, except that
+ *              in an overlay data set (see hdf_init_overlay) it never
+ *              shadows a level of the base, so the node returned may be
+ *              a node of the base.  Such a node must not be modified,
+ *              and is only current until the overlay shadows its level
+ *              (see hdf_obj_is_base).
+ * Input: hdf -> the dataset node to start from
+ *        name -> the name to walk to
+ * Output: None
+ * Returns: the pointer to the named node, or NULL if it doesn't exist
+ */
+HDF* hdf_peek_obj (HDF *hdf, const char *name);
+
+/*
+ * Function: hdf_peek_obj_path - hdf_peek_obj for a pre split name
+ * Description: hdf_peek_obj_path is to hdf_peek_obj what
+ *              hdf_get_obj_path is to hdf_get_obj.
+ * Input: hdf -> the dataset node to start from
+ *        path -> the path to walk
+ *        start -> the index of the first component to walk
+ * Output: None
+ * Returns: the pointer to the named node, or NULL if it doesn't exist
+ */
+HDF* hdf_peek_obj_path (HDF *hdf, HDF_PATH *path, int start);
+
 /*
  * Function: hdf_get_node - Similar to hdf_get_obj except all the nodes
  *           are created if the don't exist.
@@ -294,6 +434,50 @@ NEOERR* hdf_set_attr (HDF *hdf, const char *name, const char *key,
  */
 HDF* hdf_obj_child (HDF *hdf);
 
+/*
+ * Function: hdf_obj_peek_child - hdf_obj_child for walks which only read
+ * Description: hdf_obj_peek_child is the same as hdf_obj_child, except
+ *              that like hdf_peek_obj it never shadows a level of an
+ *              overlay, so the children may be nodes of the base.
+ * Input: hdf -> the hdf dataset node
+ * Output: None
+ * Returns: The pointer to the first child, or NULL if there is none
+ */
+HDF* hdf_obj_peek_child (HDF *hdf);
+
+/*
+ * Function: hdf_obj_find_child - Find a child of a dataset node by name
+ * Description: hdf_obj_find_child returns the child of hdf named name,
+ *              which is a single component, not a dotted name.  Unlike
+ *              hdf_get_obj, the child is returned even if it is a link,
+ *              instead of the node it links to.  If shadow is set and
+ *              hdf is a node of an overlay, its level is shadowed first
+ *              (see hdf_init_overlay) so the child can be modified,
+ *              otherwise the child may be a node of the base as with
+ *              hdf_peek_obj.
+ * Input: hdf -> the hdf dataset node
+ *        name -> the name of the child
+ *        shadow -> whether to shadow the level of an overlay
+ * Output: None
+ * Returns: The pointer to the child, or NULL if there is none
+ */
+HDF* hdf_obj_find_child (HDF *hdf, const char *name, int shadow);
+
+/*
+ * Function: hdf_obj_is_base - Is a node one of the base of an overlay
+ * Description: hdf_obj_is_base tells whether obj, as returned by
+ *              hdf_peek_obj or hdf_obj_peek_child, is a node of the
+ *              base of the overlay data set hdf is part of (or of the
+ *              base's base, and so on), rather than of hdf's own data
+ *              set.  To modify it, or to see the changes made since to
+ *              the overlay, look it up again in hdf.
+ * Input: hdf -> a node of the overlay
+ *        obj -> the node to check
+ * Output: None
+ * Returns: 1 if obj belongs to a base of hdf, 0 otherwise
+ */
+int hdf_obj_is_base (HDF *hdf, HDF *obj);
+
 /*
  * Function: hdf_obj_next - Return the next node of a dataset level
  * Description: hdf_obj_next is an accessor function for the HDF struct
@@ -521,6 +705,43 @@ NEOERR* hdf_write_file (HDF *hdf, const char *path);
  */
 NEOERR* hdf_write_file_atomic (HDF *hdf, const char *path);
 
+/*
+ * Function: hdf_write_binary - write an HDF data set in binary form
+ * Description: hdf_write_binary writes hdf and everything below it to
+ *              path in the binary format read by hdf_map_binary, with
+ *              hdf as the top node (its name is not written).  Like
+ *              hdf_write_file_atomic, the file is written under a unique
+ *              name and renamed over path, so processes which have the
+ *              old file mapped keep seeing it.  The file is in the byte
+ *              order of this machine.
+ * Input: hdf - the HDF data set to write
+ *        path - the file to write to
+ * Output: None
+ * Returns: NERR_IO, NERR_NOMEM
+ */
+NEOERR* hdf_write_binary (HDF *hdf, const char *path);
+
+/*
+ * Function: hdf_map_binary - load an HDF data set written by
+ *           hdf_write_binary
+ * Description: hdf_map_binary mmap's a file written by hdf_write_binary
+ *              and creates an arena data set (see hdf_init_arena) from
+ *              it, whose names and values point into the mapping instead
+ *              of being copied, so the pages holding them are shared by
+ *              every process which maps the file.  The nodes themselves
+ *              are built in one pass over the file's node table, without
+ *              any parsing, string copies or hashing of names.  The data
+ *              set can be modified like any other, the mapping is private
+ *              so nothing is ever written back to the file.  The mapping
+ *              is released by hdf_destroy.
+ * Input: path - the file to map
+ * Output: hdf - the top of the new data set
+ * Returns: NERR_IO - unable to open or map the file
+ *          NERR_PARSE - the file is not a valid binary HDF file
+ *          NERR_NOMEM - unable to allocate memory for the data set
+ */
+NEOERR* hdf_map_binary (HDF **hdf, const char *path);
+
 /*
  * Function: hdf_read_string - read an HDF string
  * Description:
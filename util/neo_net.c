@@ -19,6 +19,11 @@
 #include <netinet/tcp.h>
 #include <netdb.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <sys/uio.h>
+#ifdef HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
 #include <stdlib.h>
 #include <stdio.h>
 #include <errno.h>
@@ -27,6 +32,7 @@
 #include "neo_misc.h"
 #include "neo_err.h"
 #include "neo_net.h"
+#include "neo_files.h"
 #include "neo_str.h"
 
 static int ShutdownAccept = 0;
@@ -36,6 +42,40 @@ void ne_net_shutdown()
   ShutdownAccept = 1;
 }
 
+/* Wait for fd to be ready for events, for up to timeout seconds.  This
+ * uses poll instead of select since servers can have descriptors past
+ * FD_SETSIZE. Returns like poll, retrying on EINTR */
+static int ne_net_wait(int fd, short events, int timeout)
+{
+  struct pollfd pfd;
+  int r;
+
+  pfd.fd = fd;
+  pfd.events = events;
+  pfd.revents = 0;
+  do
+  {
+    r = poll(&pfd, 1, timeout * 1000);
+  } while (r < 0 && errno == EINTR && !ShutdownAccept);
+  return r;
+}
+
+NEOERR *ne_net_set_nonblock(int fd, BOOL nonblock)
+{
+  int flags;
+
+  flags = fcntl(fd, F_GETFL, 0);
+  if (flags == -1)
+    return nerr_raise_errno(NERR_IO, "Unable to get socket flags");
+  if (nonblock)
+    flags |= O_NONBLOCK;
+  else
+    flags &= ~O_NONBLOCK;
+  if (fcntl(fd, F_SETFL, flags) == -1)
+    return nerr_raise_errno(NERR_IO, "Unable to set O_NONBLOCK");
+  return STATUS_OK;
+}
+
 /* Server side */
 NEOERR *ne_net_listen(int port, int *fd)
 {
@@ -119,6 +159,12 @@ NEOERR *ne_net_accept(NSOCK **sock, int sfd, int data_timeout)
   {
     fd = accept(sfd, (struct sockaddr *)&client_addr, &len);
     if (fd >= 0) break;
+    /* Only for a non-blocking listen socket */
+    if (errno == EAGAIN || errno == EWOULDBLOCK)
+    {
+      *sock = NULL;
+      return STATUS_OK;
+    }
     if (ShutdownAccept || errno != EINTR)
     {
       return nerr_raise_errno(NERR_IO, "accept() returned error");
@@ -155,8 +201,6 @@ NEOERR *ne_net_connect(NSOCK **sock, const char *host, int port,
   int fd;
   int r = 0, x;
   int flags;
-  struct timeval tv;
-  fd_set fds;
   int optval;
   socklen_t optlen;
   NSOCK *my_sock;
@@ -208,13 +252,7 @@ NEOERR *ne_net_connect(NSOCK **sock, const char *host, int port,
       return nerr_raise_errno(NERR_IO, "Unable to connect to %s:%d", 
 	  host, port);
     }
-    tv.tv_sec = conn_timeout;
-    tv.tv_usec = 0;
-
-    FD_ZERO(&fds);
-    FD_SET(fd, &fds);
-
-    r = select(fd+1, NULL, &fds, NULL, &tv);
+    r = ne_net_wait(fd, POLLOUT, conn_timeout);
     if (r == 0)
     {
       close(fd);
@@ -245,7 +283,7 @@ NEOERR *ne_net_connect(NSOCK **sock, const char *host, int port,
 	  port);
     }
   }
-  /* Re-enable blocking... we'll use select on read/write for timeouts
+  /* Re-enable blocking... we'll use poll on read/write for timeouts
    * anyways, and if we want non-blocking version in the future we'll
    * add a flag or something.
    */
@@ -306,8 +344,7 @@ NEOERR *ne_net_close(NSOCK **sock)
 static NEOERR *ne_net_fill(NSOCK *sock)
 {
   NEOERR *err;
-  struct timeval tv;
-  fd_set fds;
+  int timeout;
   int r;
 
   /* Ok, we are assuming a model where one side of the connection is the
@@ -329,33 +366,34 @@ static NEOERR *ne_net_fill(NSOCK *sock)
    * the full data timeout */
   if (sock->conn_timeout)
   {
-    tv.tv_sec = sock->conn_timeout;
+    timeout = sock->conn_timeout;
     sock->conn_timeout = 0;
   }
   else
   {
-    tv.tv_sec = sock->data_timeout;
-  }
-  tv.tv_usec = 0;
-
-  FD_ZERO(&fds);
-  FD_SET(sock->fd, &fds);
-
-  r = select(sock->fd+1, &fds, NULL, NULL, &tv);
-  if (r == 0)
-  {
-    return nerr_raise(NERR_IO, "read failed: Timeout");
-  }
-  if (r < 0)
-  {
-    return nerr_raise_errno(NERR_IO, "select for read failed");
+    timeout = sock->data_timeout;
   }
 
   sock->ibuf[0] = '\0';
-  r = read(sock->fd, sock->ibuf, NET_BUFSIZE);
-  if (r < 0)
+  while (1)
   {
-    return nerr_raise_errno(NERR_IO, "read failed");
+    r = ne_net_wait(sock->fd, POLLIN, timeout);
+    if (r == 0)
+    {
+      return nerr_raise(NERR_IO, "read failed: Timeout");
+    }
+    if (r < 0)
+    {
+      return nerr_raise_errno(NERR_IO, "poll for read failed");
+    }
+
+    r = read(sock->fd, sock->ibuf, NET_BUFSIZE);
+    if (r >= 0) break;
+    /* non-blocking sockets can have spurious wakeups */
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+    {
+      return nerr_raise_errno(NERR_IO, "read failed");
+    }
   }
 
   sock->ib = 0;
@@ -364,46 +402,58 @@ static NEOERR *ne_net_fill(NSOCK *sock)
   return STATUS_OK;
 }
 
-NEOERR *ne_net_flush(NSOCK *sock)
-{
-  fd_set fds;
-  struct timeval tv;
-  int r;
-  int x = 0;
+/* the most iovecs ne_net_writev will send along with the buffer in one
+ * call */
+#define NET_IOV_MAX 16
 
+static int ne_net_timeout(NSOCK *sock)
+{
   if (sock->conn_timeout)
-  {
-    tv.tv_sec = sock->conn_timeout;
-  }
-  else
-  {
-    tv.tv_sec = sock->data_timeout;
-  }
-  tv.tv_usec = 0;
+    return sock->conn_timeout;
+  return sock->data_timeout;
+}
 
-  x = 0;
-  while (x < sock->ol)
-  {
-    FD_ZERO(&fds);
-    FD_SET(sock->fd, &fds);
+/* Write all of iov (which is modified) straight to the socket */
+static NEOERR *ne_net_send(NSOCK *sock, struct iovec *iov, int iovcnt)
+{
+  int timeout = ne_net_timeout(sock);
+  ssize_t w;
+  int r;
 
-    r = select(sock->fd+1, NULL, &fds, NULL, &tv);
+  while (iovcnt > 0)
+  {
+    r = ne_net_wait(sock->fd, POLLOUT, timeout);
     if (r == 0)
     {
       return nerr_raise(NERR_IO, "write failed: Timeout");
     }
     if (r < 0)
     {
-      return nerr_raise_errno(NERR_IO, "select for write failed");
+      return nerr_raise_errno(NERR_IO, "poll for write failed");
     }
 
-    r = write(sock->fd, sock->obuf + x, sock->ol - x);
-    if (r < 0)
+    w = writev(sock->fd, iov, iovcnt > IOV_MAX ? IOV_MAX : iovcnt);
+    if (w < 0)
     {
-      return nerr_raise_errno(NERR_IO, "select for write failed");
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+        continue;
+      return nerr_raise_errno(NERR_IO, "write failed");
     }
-    x += r;
+    iovcnt = ne_iov_advance(&iov, iovcnt, w);
   }
+  return STATUS_OK;
+}
+
+NEOERR *ne_net_flush(NSOCK *sock)
+{
+  NEOERR *err;
+  struct iovec iov;
+
+  if (sock->ol == 0) return STATUS_OK;
+  iov.iov_base = sock->obuf;
+  iov.iov_len = sock->ol;
+  err = ne_net_send(sock, &iov, 1);
+  if (err) return nerr_pass(err);
   sock->ol = 0;
   return STATUS_OK;
 }
@@ -491,6 +541,8 @@ static NEOERR *_ne_net_read_int(NSOCK *sock, int *i, char end)
 
   while (x < sizeof(buf))
   {
+    /* so we don't mistake whatever was on the stack for the end */
+    buf[x] = '\0';
     while (sock->il - sock->ib > 0)
     {
       buf[x] = sock->ibuf[sock->ib++];
@@ -498,7 +550,7 @@ static NEOERR *_ne_net_read_int(NSOCK *sock, int *i, char end)
       x++;
       if (x == sizeof(buf)) break;
     }
-    if (buf[x] == end) break;
+    if (x == sizeof(buf) || buf[x] == end) break;
     err = ne_net_fill(sock);
     if (err) return nerr_pass(err);
     if (sock->il == 0) return STATUS_OK;
@@ -590,34 +642,110 @@ NEOERR *ne_net_read_int(NSOCK *sock, int *i)
 }
 
 NEOERR *ne_net_write(NSOCK *sock, const char *b, int blen)
+{
+  struct iovec iov;
+
+  iov.iov_base = (char *)b;
+  iov.iov_len = blen;
+  return nerr_pass(ne_net_writev(sock, &iov, 1));
+}
+
+NEOERR *ne_net_writev(NSOCK *sock, const struct iovec *iov, int iovcnt)
 {
   NEOERR *err;
-  int x = 0;
-  int l;
+  struct iovec vec[NET_IOV_MAX + 1];
+  size_t total = 0;
+  int x;
 
-  x = blen;
-  while (x > 0)
+  for (x = 0; x < iovcnt; x++)
+    total += iov[x].iov_len;
+
+  /* Small writes are gathered in the buffer */
+  if (sock->ol + total <= NET_BUFSIZE)
   {
-    if (sock->ol < NET_BUFSIZE)
+    for (x = 0; x < iovcnt; x++)
     {
-      if (sock->ol + x <= NET_BUFSIZE)
-      {
-	l = x;
-      }
-      else
-      {
-	l = NET_BUFSIZE - sock->ol;
-      }
-
-      memcpy(sock->obuf + sock->ol, b + blen - x, l);
-      sock->ol += l;
-      x -= l;
+      memcpy(sock->obuf + sock->ol, iov[x].iov_base, iov[x].iov_len);
+      sock->ol += iov[x].iov_len;
     }
-    else
+    return STATUS_OK;
+  }
+
+  /* Otherwise, send the buffer and the data together without copying
+   * the data */
+  if (iovcnt > NET_IOV_MAX)
+  {
+    err = ne_net_flush(sock);
+    if (err) return nerr_pass(err);
+    for (x = 0; x < iovcnt; x += NET_IOV_MAX)
     {
-      err = ne_net_flush(sock);
+      int n = MIN(NET_IOV_MAX, iovcnt - x);
+
+      memcpy(vec, iov + x, n * sizeof(struct iovec));
+      err = ne_net_send(sock, vec, n);
       if (err) return nerr_pass(err);
     }
+    return STATUS_OK;
+  }
+  vec[0].iov_base = sock->obuf;
+  vec[0].iov_len = sock->ol;
+  memcpy(vec + 1, iov, iovcnt * sizeof(struct iovec));
+  err = ne_net_send(sock, vec, iovcnt + 1);
+  if (err) return nerr_pass(err);
+  sock->ol = 0;
+  return STATUS_OK;
+}
+
+NEOERR *ne_net_sendfile(NSOCK *sock, int fd, off_t offset, off_t count)
+{
+  NEOERR *err;
+  ssize_t r;
+
+  err = ne_net_flush(sock);
+  if (err) return nerr_pass(err);
+
+#ifdef HAVE_SYS_SENDFILE_H
+  while (count > 0)
+  {
+    r = ne_net_wait(sock->fd, POLLOUT, ne_net_timeout(sock));
+    if (r == 0)
+    {
+      return nerr_raise(NERR_IO, "write failed: Timeout");
+    }
+    if (r < 0)
+    {
+      return nerr_raise_errno(NERR_IO, "poll for write failed");
+    }
+    r = sendfile(sock->fd, fd, &offset, count);
+    if (r < 0)
+    {
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+        continue;
+      /* not supported for this file, copy it below */
+      if (errno == EINVAL || errno == ENOSYS) break;
+      return nerr_raise_errno(NERR_IO, "sendfile failed");
+    }
+    if (r == 0)
+      return nerr_raise(NERR_IO, "Unexpected end of file on fd %d", fd);
+    count -= r;
+  }
+#endif
+  while (count > 0)
+  {
+    r = pread(fd, sock->obuf, count < NET_BUFSIZE ? count : NET_BUFSIZE,
+              offset);
+    if (r < 0)
+    {
+      if (errno == EINTR) continue;
+      return nerr_raise_errno(NERR_IO, "Unable to read fd %d", fd);
+    }
+    if (r == 0)
+      return nerr_raise(NERR_IO, "Unexpected end of file on fd %d", fd);
+    sock->ol = r;
+    err = ne_net_flush(sock);
+    if (err) return nerr_pass(err);
+    offset += r;
+    count -= r;
   }
   return STATUS_OK;
 }
@@ -14,6 +14,9 @@
 
 __BEGIN_DECLS
 
+#include <sys/types.h>
+#include <sys/uio.h>
+
 #define NET_BUFSIZE 4096
 
 typedef struct _neo_sock {
@@ -35,6 +38,8 @@ typedef struct _neo_sock {
 } NSOCK;
 
 NEOERR *ne_net_listen(int port, int *fd);
+/* If fd is non-blocking and there is no connection waiting, this
+ * returns STATUS_OK with *sock set to NULL */
 NEOERR *ne_net_accept(NSOCK **sock, int fd, int data_timeout);
 NEOERR *ne_net_connect(NSOCK **sock, const char *host, int port, 
                        int conn_timeout, int data_timeout);
@@ -44,12 +49,19 @@ NEOERR *ne_net_read_line(NSOCK *sock, char **buf);
 NEOERR *ne_net_read_binary(NSOCK *sock, UINT8 **b, int *blen);
 NEOERR *ne_net_read_str_alloc(NSOCK *sock, char **s, int *len);
 NEOERR *ne_net_read_int(NSOCK *sock, int *i);
+/* Writes which don't fit in the output buffer are sent along with it
+ * in one writev, without copying */
 NEOERR *ne_net_write(NSOCK *sock, const char *b, int blen);
+NEOERR *ne_net_writev(NSOCK *sock, const struct iovec *iov, int iovcnt);
+/* Flushes the output buffer, then sends count bytes of fd starting at
+ * offset, with sendfile where possible */
+NEOERR *ne_net_sendfile(NSOCK *sock, int fd, off_t offset, off_t count);
 NEOERR *ne_net_write_line(NSOCK *sock, const char *s);
 NEOERR *ne_net_write_binary(NSOCK *sock, const char *b, int blen);
 NEOERR *ne_net_write_str(NSOCK *sock, const char *s);
 NEOERR *ne_net_write_int(NSOCK *sock, int i);
 NEOERR *ne_net_flush(NSOCK *sock);
+NEOERR *ne_net_set_nonblock(int fd, BOOL nonblock);
 void ne_net_shutdown(void);
 
 __END_DECLS
@@ -21,6 +21,12 @@
  *
  * Parts 1 & 6 aren't part of the framework, and at this point, I don't
  * think I need to worry about 3 & 5 either, but maybe in the future.
+ *
+ * nserver_thread_start is the same framework with threads instead of
+ * processes: a single event thread accepts connections and waits (with
+ * epoll) until each has data to read, and only then hands it to one of
+ * a fixed pool of worker threads.  This way slow or idle clients only
+ * cost a descriptor, not a child stuck in a blocking read.
  */
 
 #include "cs_config.h"
@@ -32,6 +38,13 @@
 #include <errno.h>
 #include <string.h>
 #include <signal.h>
+#include <time.h>
+#ifdef HAVE_PTHREADS
+#include <pthread.h>
+#endif
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
 
 #include "neo_misc.h"
 #include "neo_err.h"
@@ -227,3 +240,423 @@ NEOERR *nserver_proc_start(NSERVER *server, BOOL debug)
   fDestroy(server->accept_lock);
   return nerr_pass(err);
 }
+
+#if defined(HAVE_PTHREADS) && defined(HAVE_SYS_EPOLL_H)
+
+/* A connection is either waiting in epoll for its request to arrive (on
+ * the pool's waiting list), ready for a worker (on the ready queue), or
+ * owned by the worker handling it */
+typedef struct _nconn
+{
+  NSOCK *sock;
+  time_t expires;
+  struct _nconn *prev;
+  struct _nconn *next;
+} NCONN;
+
+typedef struct _nconn_list
+{
+  NCONN *head;
+  NCONN *tail;
+} NCONN_LIST;
+
+typedef struct _nserver_pool
+{
+  NSERVER *server;
+  int epfd;
+
+  /* only touched by the event thread, oldest first so expired
+   * connections are at the head */
+  NCONN_LIST waiting;
+  /* set while the listen socket is out of epoll, see
+   * nserver_accept_pause */
+  int accept_paused;
+  time_t accept_resume;
+
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  NCONN_LIST ready;
+  int shutdown;
+} NSERVER_POOL;
+
+typedef struct _nserver_worker
+{
+  NSERVER_POOL *pool;
+  int num;
+  pthread_t thread;
+} NSERVER_WORKER;
+
+static void nconn_append(NCONN_LIST *list, NCONN *conn)
+{
+  conn->next = NULL;
+  conn->prev = list->tail;
+  if (list->tail)
+    list->tail->next = conn;
+  else
+    list->head = conn;
+  list->tail = conn;
+}
+
+static void nconn_remove(NCONN_LIST *list, NCONN *conn)
+{
+  if (conn->prev)
+    conn->prev->next = conn->next;
+  else
+    list->head = conn->next;
+  if (conn->next)
+    conn->next->prev = conn->prev;
+  else
+    list->tail = conn->prev;
+  conn->prev = conn->next = NULL;
+}
+
+static void nconn_close(NCONN *conn)
+{
+  NEOERR *err;
+
+  err = ne_net_close(&(conn->sock));
+  nerr_ignore(&err);
+  free(conn);
+}
+
+static void *nserver_worker_loop(void *arg)
+{
+  NSERVER_WORKER *worker = (NSERVER_WORKER *)arg;
+  NSERVER_POOL *pool = worker->pool;
+  NSERVER *server = pool->server;
+  NEOERR *err;
+  NCONN *conn;
+  int count = 0;
+
+  while (1)
+  {
+    pthread_mutex_lock(&(pool->lock));
+    while (pool->ready.head == NULL && !pool->shutdown)
+      pthread_cond_wait(&(pool->cond), &(pool->lock));
+    conn = pool->ready.head;
+    if (conn != NULL)
+      nconn_remove(&(pool->ready), conn);
+    pthread_mutex_unlock(&(pool->lock));
+    if (conn == NULL) break;
+
+    count++;
+    err = server->req_cb(server->data, worker->num, conn->sock);
+    if (err)
+    {
+      ne_net_close(&(conn->sock));
+    }
+    else
+    {
+      err = ne_net_close(&(conn->sock));
+    }
+    free(conn);
+    nerr_log_error(err);
+    nerr_ignore(&err);
+  }
+  ne_warn("nserver worker %d handled %d connections", worker->num, count);
+  return NULL;
+}
+
+/* The listen socket is level-triggered, so when accept fails with the
+ * connection still pending (out of descriptors or memory), epoll would
+ * wake straight back up for it.  Stop watching the listen socket until
+ * a connection closes, or for a second since the workers' closes aren't
+ * seen here. */
+static void nserver_accept_pause(NSERVER_POOL *pool)
+{
+  if (pool->accept_paused) return;
+  if (epoll_ctl(pool->epfd, EPOLL_CTL_DEL, pool->server->server_fd,
+                NULL) == -1)
+    return;
+  pool->accept_paused = 1;
+  pool->accept_resume = time(NULL) + 1;
+}
+
+static NEOERR *nserver_accept_resume(NSERVER_POOL *pool)
+{
+  struct epoll_event ev;
+
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.ptr = NULL;
+  if (epoll_ctl(pool->epfd, EPOLL_CTL_ADD, pool->server->server_fd, &ev) == -1)
+    return nerr_raise_errno(NERR_SYSTEM, "Unable to add listen socket to epoll");
+  pool->accept_paused = 0;
+  return STATUS_OK;
+}
+
+/* Called when a waiting connection is readable: pull in what has
+ * arrived, so the worker's first read doesn't have to wait, and queue
+ * it for a worker */
+static void nserver_conn_ready(NSERVER_POOL *pool, NCONN *conn)
+{
+  NSOCK *sock = conn->sock;
+  int r;
+
+  r = read(sock->fd, sock->ibuf, NET_BUFSIZE);
+  if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+  {
+    struct epoll_event ev;
+
+    /* spurious wakeup, wait some more */
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLONESHOT;
+    ev.data.ptr = conn;
+    if (epoll_ctl(pool->epfd, EPOLL_CTL_MOD, sock->fd, &ev) == 0)
+      return;
+  }
+  nconn_remove(&(pool->waiting), conn);
+  epoll_ctl(pool->epfd, EPOLL_CTL_DEL, sock->fd, NULL);
+  /* EOF or error before the request started, nothing to do */
+  if (r <= 0)
+  {
+    nconn_close(conn);
+    pool->accept_resume = 0;
+    return;
+  }
+  sock->ib = 0;
+  sock->il = r;
+
+  pthread_mutex_lock(&(pool->lock));
+  nconn_append(&(pool->ready), conn);
+  pthread_cond_signal(&(pool->cond));
+  pthread_mutex_unlock(&(pool->lock));
+}
+
+static NEOERR *nserver_accept_all(NSERVER_POOL *pool)
+{
+  NSERVER *server = pool->server;
+  NEOERR *err;
+  NSOCK *sock;
+  NCONN *conn;
+  struct epoll_event ev;
+
+  while (1)
+  {
+    err = ne_net_accept(&sock, server->server_fd, server->data_timeout);
+    if (err) return nerr_pass(err);
+    if (sock == NULL) return STATUS_OK;
+
+    err = ne_net_set_nonblock(sock->fd, TRUE);
+    if (err)
+    {
+      ne_net_close(&sock);
+      return nerr_pass(err);
+    }
+    conn = (NCONN *) calloc(1, sizeof(NCONN));
+    if (conn == NULL)
+    {
+      ne_net_close(&sock);
+      return nerr_raise(NERR_NOMEM, "Unable to allocate memory for NCONN");
+    }
+    conn->sock = sock;
+    conn->expires = time(NULL) + server->data_timeout;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLONESHOT;
+    ev.data.ptr = conn;
+    if (epoll_ctl(pool->epfd, EPOLL_CTL_ADD, sock->fd, &ev) == -1)
+    {
+      nconn_close(conn);
+      return nerr_raise_errno(NERR_SYSTEM, "Unable to add connection to epoll");
+    }
+    nconn_append(&(pool->waiting), conn);
+  }
+}
+
+#define NSERVER_MAX_EVENTS 64
+
+static NEOERR *nserver_event_loop(NSERVER_POOL *pool)
+{
+  NEOERR *err = STATUS_OK;
+  struct epoll_event events[NSERVER_MAX_EVENTS];
+  NCONN *conn;
+  time_t now;
+  int n, x;
+
+  err = nserver_accept_resume(pool);
+  if (err) return nerr_pass(err);
+
+  while (!ShutdownPending)
+  {
+    /* wake up at least once a second to expire idle connections */
+    n = epoll_wait(pool->epfd, events, NSERVER_MAX_EVENTS, 1000);
+    if (n < 0)
+    {
+      if (errno == EINTR) continue;
+      err = nerr_raise_errno(NERR_SYSTEM, "epoll_wait failed");
+      break;
+    }
+    for (x = 0; x < n; x++)
+    {
+      if (events[x].data.ptr == NULL)
+      {
+        err = nserver_accept_all(pool);
+        /* Out of descriptors or memory shouldn't take down the server */
+        if (err)
+        {
+          nerr_log_error(err);
+          nerr_ignore(&err);
+          nserver_accept_pause(pool);
+        }
+      }
+      else
+      {
+        nserver_conn_ready(pool, (NCONN *)events[x].data.ptr);
+      }
+    }
+
+    now = time(NULL);
+    while (pool->waiting.head && pool->waiting.head->expires <= now)
+    {
+      conn = pool->waiting.head;
+      nconn_remove(&(pool->waiting), conn);
+      epoll_ctl(pool->epfd, EPOLL_CTL_DEL, conn->sock->fd, NULL);
+      nconn_close(conn);
+      pool->accept_resume = 0;
+    }
+
+    if (pool->accept_paused && now >= pool->accept_resume)
+    {
+      err = nserver_accept_resume(pool);
+      if (err) break;
+    }
+  }
+  return nerr_pass(err);
+}
+
+NEOERR *nserver_thread_start(NSERVER *server)
+{
+  NEOERR *err = STATUS_OK, *clean_err;
+  NSERVER_POOL pool;
+  NSERVER_WORKER *workers = NULL;
+  NCONN *conn;
+  sigset_t mask, old_mask;
+  int started = 0, inited = 0;
+  int x, r;
+
+  if (server->req_cb == NULL)
+    return nerr_raise(NERR_ASSERT, "nserver requires a request callback");
+  if (server->num_children < 1)
+    return nerr_raise(NERR_ASSERT, "nserver requires at least one worker");
+
+  ignore_pipe();
+
+  setup_term();
+
+  ShutdownPending = 0;
+
+  memset(&pool, 0, sizeof(pool));
+  pool.server = server;
+  pool.epfd = -1;
+  server->server_fd = -1;
+  pthread_mutex_init(&(pool.lock), NULL);
+  pthread_cond_init(&(pool.cond), NULL);
+
+  do
+  {
+    workers = (NSERVER_WORKER *) calloc(server->num_children,
+                                        sizeof(NSERVER_WORKER));
+    if (workers == NULL)
+    {
+      err = nerr_raise(NERR_NOMEM, "Unable to allocate nserver workers");
+      break;
+    }
+
+    err = ne_net_listen(server->port, &(server->server_fd));
+    if (err) break;
+    err = ne_net_set_nonblock(server->server_fd, TRUE);
+    if (err) break;
+
+    pool.epfd = epoll_create(NSERVER_MAX_EVENTS);
+    if (pool.epfd == -1)
+    {
+      err = nerr_raise_errno(NERR_SYSTEM, "Unable to create epoll descriptor");
+      break;
+    }
+
+    if (server->init_cb)
+    {
+      for (inited = 0; inited < server->num_children; inited++)
+      {
+        err = server->init_cb(server->data, inited);
+        if (err) break;
+      }
+      if (err) break;
+    }
+    inited = server->num_children;
+
+    /* Only the event thread handles SIGTERM, the workers just see the
+     * shutdown through the pool */
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
+    for (started = 0; started < server->num_children; started++)
+    {
+      workers[started].pool = &pool;
+      workers[started].num = started;
+      r = pthread_create(&(workers[started].thread), NULL,
+                         nserver_worker_loop, &(workers[started]));
+      if (r)
+      {
+        errno = r;
+        err = nerr_raise_errno(NERR_SYSTEM, "Unable to create worker thread");
+        break;
+      }
+    }
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+    if (err) break;
+
+    err = nserver_event_loop(&pool);
+  }
+  while (0);
+
+  /* Workers finish the connections already handed to them */
+  pthread_mutex_lock(&(pool.lock));
+  pool.shutdown = 1;
+  pthread_cond_broadcast(&(pool.cond));
+  pthread_mutex_unlock(&(pool.lock));
+  for (x = 0; x < started; x++)
+    pthread_join(workers[x].thread, NULL);
+
+  while ((conn = pool.waiting.head) != NULL)
+  {
+    nconn_remove(&(pool.waiting), conn);
+    nconn_close(conn);
+  }
+  while ((conn = pool.ready.head) != NULL)
+  {
+    nconn_remove(&(pool.ready), conn);
+    nconn_close(conn);
+  }
+
+  if (server->clean_cb)
+  {
+    for (x = 0; x < inited; x++)
+    {
+      clean_err = server->clean_cb(server->data, x);
+      if (clean_err)
+      {
+        nerr_log_error(clean_err);
+        nerr_ignore(&clean_err);
+      }
+    }
+  }
+
+  if (pool.epfd != -1) close(pool.epfd);
+  if (server->server_fd != -1) close(server->server_fd);
+  pthread_cond_destroy(&(pool.cond));
+  pthread_mutex_destroy(&(pool.lock));
+  free(workers);
+  return nerr_pass(err);
+}
+
+#else
+
+NEOERR *nserver_thread_start(NSERVER *server)
+{
+  return nerr_raise(NERR_ASSERT,
+      "nserver_thread_start requires pthreads and epoll");
+}
+
+#endif
@@ -27,7 +27,9 @@ typedef struct _nserver {
 
   void *data;
 
+  /* the number of worker threads for nserver_thread_start */
   int num_children;
+  /* per child, not used by nserver_thread_start */
   int num_requests;
 
   int port;
@@ -43,6 +45,17 @@ typedef struct _nserver {
 
 NEOERR *nserver_proc_start(NSERVER *server, BOOL debug);
 
+/* Runs the server in this process, with num_children worker threads
+ * calling req_cb, and init_cb/clean_cb called once for each worker num
+ * at startup and shutdown.  Connections are only handed to a worker
+ * once their request has started arriving, and ones which send nothing
+ * within data_timeout are dropped, so slow clients don't tie up the
+ * workers.  The NSOCK given to req_cb is non-blocking, the ne_net
+ * calls still wait up to data_timeout.  Returns after a SIGTERM, once
+ * the workers have finished their current requests.  Requires pthreads
+ * and epoll. */
+NEOERR *nserver_thread_start(NSERVER *server);
+
 __END_DECLS
 
 #endif /* __NEO_SERVER_H_ */
@@ -23,6 +23,12 @@
 #include "neo_str.h"
 #include "ulist.h"
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && \
+    (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9) || defined(__clang__))
+#define NEOS_CHARSET_X86 1
+#include <immintrin.h>
+#endif
+
 #ifndef va_copy
 #ifdef __va_copy
 # define va_copy(dest,src) __va_copy(dest,src)
@@ -624,23 +630,138 @@ char *repr_string_alloc (const char *s)
   return rs;
 }
 
+static int charset_span_c (const NEOS_CHARSET *set, const UINT8 *s,
+                           int x, int len)
+{
+  while (x < len && !NEOS_CHARSET_HAS(set, s[x]))
+    x++;
+  return x;
+}
+
+#ifdef NEOS_CHARSET_X86
+/* The vector versions look up the low nibble of each byte in one half of
+ * the map or the other (pshufb gives 0 for an index with the high bit
+ * set, so xor'ing with 0x80 picks the other half), and then test the bit
+ * picked by the next three bits of the byte. */
+__attribute__((target("ssse3")))
+static int charset_span_ssse3 (const NEOS_CHARSET *set, const UINT8 *s,
+                               int x, int len)
+{
+  __m128i lo = _mm_loadu_si128((const __m128i *)set->map);
+  __m128i hi = _mm_loadu_si128((const __m128i *)(set->map + 16));
+  __m128i bits = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128,
+                               1, 2, 4, 8, 16, 32, 64, -128);
+  __m128i top = _mm_set1_epi8(-128);
+  __m128i nibble = _mm_set1_epi8(0x0f);
+  __m128i v, m;
+  int mask;
+
+  for (; x + 16 <= len; x += 16)
+  {
+    v = _mm_loadu_si128((const __m128i *)(s + x));
+    m = _mm_or_si128(_mm_shuffle_epi8(lo, v),
+                     _mm_shuffle_epi8(hi, _mm_xor_si128(v, top)));
+    m = _mm_and_si128(m, _mm_shuffle_epi8(bits,
+          _mm_and_si128(_mm_srli_epi16(v, 4), nibble)));
+    mask = _mm_movemask_epi8(_mm_cmpeq_epi8(m, _mm_setzero_si128())) ^ 0xffff;
+    if (mask)
+      return x + __builtin_ctz(mask);
+  }
+  return charset_span_c(set, s, x, len);
+}
+
+__attribute__((target("avx2")))
+static int charset_span_avx2 (const NEOS_CHARSET *set, const UINT8 *s,
+                              int x, int len)
+{
+  __m256i lo = _mm256_broadcastsi128_si256(
+      _mm_loadu_si128((const __m128i *)set->map));
+  __m256i hi = _mm256_broadcastsi128_si256(
+      _mm_loadu_si128((const __m128i *)(set->map + 16)));
+  __m256i bits = _mm256_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128,
+                                  1, 2, 4, 8, 16, 32, 64, -128,
+                                  1, 2, 4, 8, 16, 32, 64, -128,
+                                  1, 2, 4, 8, 16, 32, 64, -128);
+  __m256i top = _mm256_set1_epi8(-128);
+  __m256i nibble = _mm256_set1_epi8(0x0f);
+  __m256i v, m;
+  unsigned int mask;
+
+  for (; x + 32 <= len; x += 32)
+  {
+    v = _mm256_loadu_si256((const __m256i *)(s + x));
+    m = _mm256_or_si256(_mm256_shuffle_epi8(lo, v),
+                        _mm256_shuffle_epi8(hi, _mm256_xor_si256(v, top)));
+    m = _mm256_and_si256(m, _mm256_shuffle_epi8(bits,
+          _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble)));
+    mask = ~(unsigned int)_mm256_movemask_epi8(
+        _mm256_cmpeq_epi8(m, _mm256_setzero_si256()));
+    if (mask)
+      return x + __builtin_ctz(mask);
+  }
+  return charset_span_ssse3(set, s, x, len);
+}
+#endif
+
+typedef int (*CHARSET_SPAN_FUNC)(const NEOS_CHARSET *set, const UINT8 *s,
+                                 int x, int len);
+
+#ifdef NEOS_CHARSET_X86
+/* Picked by a constructor, before main can start any threads, and never
+ * changed after.  Anything run by an earlier constructor gets the plain
+ * C version. */
+static CHARSET_SPAN_FUNC CharsetSpan = charset_span_c;
+
+__attribute__((constructor))
+static void charset_span_detect (void)
+{
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    CharsetSpan = charset_span_avx2;
+  else if (__builtin_cpu_supports("ssse3"))
+    CharsetSpan = charset_span_ssse3;
+}
+#else
+#define CharsetSpan charset_span_c
+#endif
+
+int neos_charset_span (const NEOS_CHARSET *set, const char *s, int len)
+{
+  /* Most escaped values are short, not worth the vector setup */
+  if (len < 16)
+    return charset_span_c(set, (const UINT8 *)s, 0, len);
+  return CharsetSpan(set, (const UINT8 *)s, 0, len);
+}
+
+void neos_charset_add (NEOS_CHARSET *set, const char *chars)
+{
+  const UINT8 *c = (const UINT8 *)chars;
+
+  for (; *c; c++)
+    set->map[(*c >> 3 & 16) | (*c & 15)] |= 1 << ((*c >> 4) & 7);
+}
+
+#define JS_ESCAPE(c) ((c) == '/' || (c) == '"' || (c) == '\'' || \
+                      (c) == '\\' || (c) == '>' || (c) == '<' || \
+                      (c) == '&' || (c) == ';' || (c) < 32)
+static const NEOS_CHARSET JsEscapeChars = NEOS_CHARSET_INIT(JS_ESCAPE);
+
 NEOERR *neos_js_escape (const char *in, char **esc)
 {
   int nl = 0;
   int l = 0;
+  int x;
+  int len = strlen(in);
   unsigned char *buf = (unsigned char *)in;
   unsigned char *s;
 
-  while (buf[l])
+  nl = len;
+  l = neos_charset_span(&JsEscapeChars, in, len);
+  while (l < len)
   {
-    if (buf[l] == '/' || buf[l] == '"' || buf[l] == '\'' ||
-        buf[l] == '\\' || buf[l] == '>' || buf[l] == '<' ||
-        buf[l] == '&' || buf[l] == ';' || buf[l] < 32)
-    {
-      nl += 3;
-    }
-    nl++;
+    nl += 3;
     l++;
+    l += neos_charset_span(&JsEscapeChars, in + l, len - l);
   }
 
   s = (unsigned char *) malloc (sizeof(unsigned char) * (nl + 1));
@@ -649,22 +770,19 @@ NEOERR *neos_js_escape (const char *in, char **esc)
         buf);
 
   nl = 0; l = 0;
-  while (buf[l])
+  while (l < len)
   {
-    if (buf[l] == '/' || buf[l] == '"' || buf[l] == '\'' ||
-        buf[l] == '\\' || buf[l] == '>' || buf[l] == '<' ||
-        buf[l] == '&' || buf[l] == ';' || buf[l] < 32)
-    {
-      s[nl++] = '\\';
-      s[nl++] = 'x';
-      s[nl++] = "0123456789ABCDEF"[(buf[l] >> 4) & 0xF];
-      s[nl++] = "0123456789ABCDEF"[buf[l] & 0xF];
-      l++;
-    }
-    else
-    {
-      s[nl++] = buf[l++];
-    }
+    x = neos_charset_span(&JsEscapeChars, in + l, len - l);
+    memcpy(s + nl, buf + l, x);
+    nl += x;
+    l += x;
+    if (l == len) break;
+
+    s[nl++] = '\\';
+    s[nl++] = 'x';
+    s[nl++] = "0123456789ABCDEF"[(buf[l] >> 4) & 0xF];
+    s[nl++] = "0123456789ABCDEF"[buf[l] & 0xF];
+    l++;
   }
   s[nl] = '\0';
 
@@ -672,53 +790,56 @@ NEOERR *neos_js_escape (const char *in, char **esc)
   return STATUS_OK;
 }
 
-/* List of all characters that must be escaped
+/* List of all characters that must be escaped, along with all characters
+ * < 0x20 and > 0x7E
  * List based on http://www.blooberry.com/indexdot/html/topics/urlencoding.htm
  */
-static char QueryReservedChars[] = "$&+,/:;=?@ \"<>#%{}|\\^~[]`'";
+#define QUERY_RESERVED(c) ((c) == '$' || (c) == '&' || (c) == '+' || \
+    (c) == ',' || (c) == '/' || (c) == ':' || (c) == ';' || (c) == '=' || \
+    (c) == '?' || (c) == '@' || (c) == ' ' || (c) == '"' || (c) == '<' || \
+    (c) == '>' || (c) == '#' || (c) == '%' || (c) == '{' || (c) == '}' || \
+    (c) == '|' || (c) == '\\' || (c) == '^' || (c) == '~' || (c) == '[' || \
+    (c) == ']' || (c) == '`' || (c) == '\'' || (c) < 32 || (c) > 126)
+static const NEOS_CHARSET QueryReservedChars = NEOS_CHARSET_INIT(QUERY_RESERVED);
 // List of characters to escape in URLs inside CSS.
-static char CssReservedChars[] = "\n\r\"'()*<>\\";
-#define IN_LIST(l, c) (strchr(l, c) != NULL)
+#define CSS_RESERVED(c) ((c) == '\n' || (c) == '\r' || (c) == '"' || \
+    (c) == '\'' || (c) == '(' || (c) == ')' || (c) == '*' || (c) == '<' || \
+    (c) == '>' || (c) == '\\')
+static const NEOS_CHARSET CssReservedChars = NEOS_CHARSET_INIT(CSS_RESERVED);
 
 /*
  * Apply URL escaping to 'in' and return result in 'esc'.
  * The parameters 'reserved' and 'other' indicate which characters to escape.
- * If 'escape_non_printable' is non zero, all characters < 0x20 and > 0x7E
- * will also be escaped.
+ * A space is escaped as '+' if it is in 'reserved'.
  */
-static NEOERR *url_escape_helper (const char *in, char **esc, char *reserved,
-                                  const char *other, int escape_non_printable)
+static NEOERR *url_escape_helper (const char *in, char **esc,
+                                  const NEOS_CHARSET *reserved,
+                                  const char *other)
 {
   int nl = 0;
   int l = 0;
-  int x = 0;
+  int x;
+  int len = strlen(in);
+  int space_plus = NEOS_CHARSET_HAS(reserved, ' ');
   unsigned char *buf = (unsigned char *)in;
-  unsigned char *uother = (unsigned char *)other;
   unsigned char *s;
-  int match = 0;
+  NEOS_CHARSET escape;
 
-  while (buf[l])
+  if (other)
   {
-    if (IN_LIST(reserved, buf[l]) || 
-        (escape_non_printable && (buf[l] < 32 || buf[l] > 126)))
-    {
+    escape = *reserved;
+    neos_charset_add(&escape, other);
+    reserved = &escape;
+  }
+
+  nl = len;
+  l = neos_charset_span(reserved, in, len);
+  while (l < len)
+  {
+    if (buf[l] != ' ' || !space_plus)
       nl += 2;
-    }
-    else if (uother)
-    {
-      x = 0;
-      while (uother[x])
-      {
-        if (uother[x] == buf[l])
-        {
-          nl +=2;
-          break;
-        }
-        x++;
-      }
-    }
-    nl++;
     l++;
+    l += neos_charset_span(reserved, in + l, len - l);
   }
 
   s = (unsigned char *) malloc (sizeof(unsigned char) * (nl + 1));
@@ -727,46 +848,25 @@ static NEOERR *url_escape_helper (const char *in, char **esc, char *reserved,
       buf);
 
   nl = 0; l = 0;
-  while (buf[l])
+  while (l < len)
   {
-    match = 0;
-    if (buf[l] == ' ' && IN_LIST(reserved, buf[l]))
+    x = neos_charset_span(reserved, in + l, len - l);
+    memcpy(s + nl, buf + l, x);
+    nl += x;
+    l += x;
+    if (l == len) break;
+
+    if (buf[l] == ' ' && space_plus)
     {
       s[nl++] = '+';
-      l++;
     }
     else
     {
-      if (IN_LIST(reserved, buf[l]) ||
-          (escape_non_printable && (buf[l] < 32 || buf[l] > 126)))
-      {
-        match = 1;
-      }
-      else if (uother)
-      {
-        x = 0;
-        while (uother[x])
-        {
-          if (uother[x] == buf[l])
-          {
-            match = 1;
-            break;
-          }
-          x++;
-        }
-      }
-      if (match)
-      {
-        s[nl++] = '%';
-        s[nl++] = "0123456789ABCDEF"[buf[l] / 16];
-        s[nl++] = "0123456789ABCDEF"[buf[l] % 16];
-        l++;
-      }
-      else
-      {
-        s[nl++] = buf[l++];
-      }
+      s[nl++] = '%';
+      s[nl++] = "0123456789ABCDEF"[buf[l] / 16];
+      s[nl++] = "0123456789ABCDEF"[buf[l] % 16];
     }
+    l++;
   }
   s[nl] = '\0';
 
@@ -777,16 +877,19 @@ static NEOERR *url_escape_helper (const char *in, char **esc, char *reserved,
 NEOERR *neos_url_escape (const char *in, char **esc,
                          const char *other)
 {
-  return url_escape_helper(in, esc, QueryReservedChars, other, 1);
+  return url_escape_helper(in, esc, &QueryReservedChars, other);
 }
 
+#define HTML_ESCAPE(c) ((c) == '&' || (c) == '<' || (c) == '>' || \
+                        (c) == '"' || (c) == '\'' || (c) == '\r')
+static const NEOS_CHARSET HtmlEscapeChars = NEOS_CHARSET_INIT(HTML_ESCAPE);
+
 NEOERR *neos_html_escape (const char *src, int slen,
                           char **out)
 {
   NEOERR *err = STATUS_OK;
   STRING out_s;
-  int x;
-  char *ptr;
+  int x, l;
 
   string_init(&out_s);
   err = string_append (&out_s, "");
@@ -796,17 +899,17 @@ NEOERR *neos_html_escape (const char *src, int slen,
   x = 0;
   while (x < slen)
   {
-    ptr = strpbrk(src + x, "&<>\"'\r");
-    if (ptr == NULL || (ptr-src >= slen))
+    l = x + neos_charset_span(&HtmlEscapeChars, src + x, slen - x);
+    if (l == slen)
     {
       err = string_appendn (&out_s, src + x, slen-x);
       x = slen;
     }
     else
     {
-      err = string_appendn (&out_s, src + x, (ptr - src) - x);
+      err = string_appendn (&out_s, src + x, l - x);
       if (err != STATUS_OK) break;
-      x = ptr - src;
+      x = l;
       if (src[x] == '&')
         err = string_append (&out_s, "&amp;");
       else if (src[x] == '<')
@@ -834,7 +937,7 @@ NEOERR *neos_html_escape (const char *src, int slen,
 
 static NEOERR *css_url_escape(const char *in, char **esc)
 {
-  return url_escape_helper(in, esc, CssReservedChars, NULL, 0);
+  return url_escape_helper(in, esc, &CssReservedChars, NULL);
 }
 
 char *URL_PROTOCOLS[] = {"http://", "https://", "ftp://", "mailto:"};
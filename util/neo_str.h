@@ -98,6 +98,47 @@ typedef enum
   NEOS_ESCAPE_FUNCTION =  1<<5  /* Special case used to override the others */
 } NEOS_ESCAPE;
 
+/* NEOS_CHARSET is a set of bytes, used by the escaping routines to skip
+ * quickly over runs of bytes which don't need escaping.  The map is laid
+ * out for a nibble table lookup: byte c is in the set if bit
+ * ((c >> 4) & 7) of map[(c & 0x80 ? 16 : 0) + (c & 15)] is set. */
+typedef struct _neos_charset
+{
+  UINT8 map[32];
+} NEOS_CHARSET;
+
+#define NEOS_CHARSET_HAS(set, c) \
+  (((set)->map[(((UINT8)(c)) >> 3 & 16) | (((UINT8)(c)) & 15)] >> \
+    ((((UINT8)(c)) >> 4) & 7)) & 1)
+
+/* NEOS_CHARSET_INIT(IN) is a static initializer for the set of bytes
+ * c (0 - 255) for which the macro IN(c) is true, eg:
+ *   #define IS_QUOTE(c) ((c) == '"' || (c) == '\'')
+ *   static const NEOS_CHARSET Quotes = NEOS_CHARSET_INIT(IS_QUOTE);
+ */
+#define _NEOS_CS_BIT(IN, c, b) (IN(c) ? (b) : 0)
+#define _NEOS_CS_ROW(IN, h, l) \
+  (_NEOS_CS_BIT(IN, ((h)+0)*16+(l), 1) | _NEOS_CS_BIT(IN, ((h)+1)*16+(l), 2) | \
+   _NEOS_CS_BIT(IN, ((h)+2)*16+(l), 4) | _NEOS_CS_BIT(IN, ((h)+3)*16+(l), 8) | \
+   _NEOS_CS_BIT(IN, ((h)+4)*16+(l), 16) | _NEOS_CS_BIT(IN, ((h)+5)*16+(l), 32) | \
+   _NEOS_CS_BIT(IN, ((h)+6)*16+(l), 64) | _NEOS_CS_BIT(IN, ((h)+7)*16+(l), 128))
+#define _NEOS_CS_HALF(IN, h) \
+  _NEOS_CS_ROW(IN, h, 0), _NEOS_CS_ROW(IN, h, 1), _NEOS_CS_ROW(IN, h, 2), \
+  _NEOS_CS_ROW(IN, h, 3), _NEOS_CS_ROW(IN, h, 4), _NEOS_CS_ROW(IN, h, 5), \
+  _NEOS_CS_ROW(IN, h, 6), _NEOS_CS_ROW(IN, h, 7), _NEOS_CS_ROW(IN, h, 8), \
+  _NEOS_CS_ROW(IN, h, 9), _NEOS_CS_ROW(IN, h, 10), _NEOS_CS_ROW(IN, h, 11), \
+  _NEOS_CS_ROW(IN, h, 12), _NEOS_CS_ROW(IN, h, 13), _NEOS_CS_ROW(IN, h, 14), \
+  _NEOS_CS_ROW(IN, h, 15)
+#define NEOS_CHARSET_INIT(IN) {{ _NEOS_CS_HALF(IN, 0), _NEOS_CS_HALF(IN, 8) }}
+
+/* Returns the offset of the first byte of s (which may contain NULs)
+ * that is in set, or len if there is none.  On x86 this uses SSSE3 or
+ * AVX2 when the cpu has them, which is checked once at runtime. */
+int neos_charset_span (const NEOS_CHARSET *set, const char *s, int len);
+
+/* Adds each byte of the string chars to set */
+void neos_charset_add (NEOS_CHARSET *set, const char *chars);
+
 NEOERR* neos_escape(UINT8 *buf, int buflen, char esc_char, const char *escape,
                     char **esc);
 UINT8 *neos_unescape (UINT8 *s, int buflen, char esc_char);
@@ -135,6 +135,73 @@ NEOERR *hash_next_test()
   return STATUS_OK;
 }
 
+/* Random inserts and removes of int keys, checked against an array,
+ * to go through removed entries and resizes part way done */
+NEOERR *ohash_test (void)
+{
+  NEOERR *err;
+  NE_OHASH *hash;
+  static long values[4096];
+  void *key, *val;
+  long k;
+  int x, count, num = 0;
+
+  ne_warn("Running ohash_test");
+
+  err = ne_ohash_init(&hash, ne_hash_int_hash, ne_hash_int_comp);
+  if (err) return nerr_pass(err);
+
+  srand(1);
+  for (x = 0; x < 200000; x++)
+  {
+    /* grow to about half the keys, then churn */
+    k = rand() % (x < 20000 ? 4096 : 2048);
+    if (rand() % 3)
+    {
+      if (values[k] == 0) num++;
+      values[k] = x + 1;
+      err = ne_ohash_insert(hash, (void *)(k + 1), (void *)(long)(x + 1));
+      if (err) break;
+    }
+    else if ((long)ne_ohash_remove(hash, (void *)(k + 1)) != values[k])
+    {
+      err = nerr_raise(NERR_ASSERT, "Remove of %ld returned the wrong value", k);
+      break;
+    }
+    else if (values[k])
+    {
+      values[k] = 0;
+      num--;
+    }
+    k = rand() % 4096;
+    if ((long)ne_ohash_lookup(hash, (void *)(k + 1)) != values[k] ||
+        ne_ohash_has_key(hash, (void *)(k + 1)) != (values[k] != 0))
+    {
+      err = nerr_raise(NERR_ASSERT, "Lookup of %ld at step %d failed", k, x);
+      break;
+    }
+  }
+  if (err == STATUS_OK && hash->num != num)
+    err = nerr_raise(NERR_ASSERT, "Hash has %d entries, expected %d",
+                     hash->num, num);
+
+  count = 0;
+  key = NULL;
+  while (err == STATUS_OK && (val = ne_ohash_next(hash, &key)) != NULL)
+  {
+    k = (long)key - 1;
+    if (values[k] != (long)val)
+      err = nerr_raise(NERR_ASSERT, "Next returned the wrong value for %ld", k);
+    count++;
+  }
+  if (err == STATUS_OK && count != num)
+    err = nerr_raise(NERR_ASSERT, "Next returned %d entries, expected %d",
+                     count, num);
+
+  ne_ohash_destroy(&hash);
+  return nerr_pass(err);
+}
+
 int main(int argc, char **argv)
 {
   NEOERR *err;
@@ -154,6 +221,14 @@ int main(int argc, char **argv)
     printf("FAIL\n");
     return -1;
   }
+
+  err = ohash_test();
+  if (err)
+  {
+    nerr_log_error(err);
+    printf("FAIL\n");
+    return -1;
+  }
   printf("PASS\n");
   return 0;
 }
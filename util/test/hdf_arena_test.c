@@ -0,0 +1,127 @@
+/*
+ * Copyright 2001-2004 Brandon Long
+ * All Rights Reserved.
+ *
+ * ClearSilver Templating System
+ *
+ * This code is made available under the terms of the ClearSilver License.
+ * http://www.clearsilver.net/license.hdf
+ *
+ */
+
+#include "cs_config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util/neo_misc.h"
+#include "util/neo_hdf.h"
+#include "util/neo_str.h"
+#include "test_macros.h"
+
+/* Build the same data set in an arena and a malloc'd HDF and make sure
+ * they read back the same, including after overwrites, removals and
+ * copies between the two kinds of data set */
+static NEOERR *build(HDF *hdf)
+{
+  NEOERR *err;
+  char name[64], value[64];
+  char *big;
+  int i;
+
+  for (i = 0; i < 2000; i++)
+  {
+    snprintf(name, sizeof(name), "Page.Results.%d.Title", i);
+    snprintf(value, sizeof(value), "Result %d", i);
+    err = hdf_set_value(hdf, name, value);
+    if (err) return nerr_pass(err);
+    snprintf(name, sizeof(name), "Page.Results.%d.Id", i);
+    err = hdf_set_int_value(hdf, name, i);
+    if (err) return nerr_pass(err);
+  }
+  /* overwrite */
+  for (i = 0; i < 2000; i += 3)
+  {
+    snprintf(name, sizeof(name), "Page.Results.%d.Title", i);
+    err = hdf_set_value(hdf, name, "overwritten");
+    if (err) return nerr_pass(err);
+  }
+  /* a value larger than a chunk */
+  big = (char *) malloc(100000);
+  if (big == NULL) return nerr_raise(NERR_NOMEM, "Unable to allocate");
+  memset(big, 'x', 99999);
+  big[99999] = '\0';
+  err = hdf_set_value(hdf, "Page.Big", big);
+  free(big);
+  if (err) return nerr_pass(err);
+
+  err = hdf_set_buf(hdf, "Page.Buf", strdup("owned"));
+  if (err) return nerr_pass(err);
+  err = hdf_set_symlink(hdf, "Page.First", "Page.Results.0");
+  if (err) return nerr_pass(err);
+  err = hdf_set_attr(hdf, "Page.Buf", "lang", "en");
+  if (err) return nerr_pass(err);
+  err = hdf_read_string(hdf, "Config {\n Flag = 1\n Text << EOM\nmulti\nline\nEOM\n}\n");
+  if (err) return nerr_pass(err);
+  err = hdf_remove_tree(hdf, "Page.Results.5");
+  if (err) return nerr_pass(err);
+  err = hdf_copy(hdf, "Copy", hdf_get_obj(hdf, "Page.Results.7"));
+  if (err) return nerr_pass(err);
+  return STATUS_OK;
+}
+
+static NEOERR *dump(HDF *hdf, STRING *str)
+{
+  return nerr_pass(hdf_dump_str(hdf, NULL, 0, str));
+}
+
+int main(int argc, char *argv[])
+{
+  NEOERR *err;
+  HDF *hdf, *arena, *copy;
+  STRING a, b, c;
+
+  string_init(&a);
+  string_init(&b);
+  string_init(&c);
+
+  err = hdf_init(&hdf);
+  DIE_NOT_OK(err);
+  err = hdf_init_arena(&arena, 0);
+  DIE_NOT_OK(err);
+
+  err = build(hdf);
+  DIE_NOT_OK(err);
+  err = build(arena);
+  DIE_NOT_OK(err);
+
+  CHECK_STREQ(hdf_get_value(arena, "Page.First.Title", ""), "overwritten");
+  CHECK_STREQ(hdf_get_value(arena, "Page.Buf", ""), "owned");
+  CHECK_STREQ(hdf_get_value(arena, "Copy.Title", ""), "Result 7");
+  CHECK_STREQ(hdf_get_value(arena, "Config.Text", ""), "multi\nline\n");
+
+  err = dump(hdf, &a);
+  DIE_NOT_OK(err);
+  err = dump(arena, &b);
+  DIE_NOT_OK(err);
+  CHECK_STREQ(a.buf, b.buf);
+
+  /* copy out of the arena, then destroy it */
+  err = hdf_init_arena(&copy, 4096);
+  DIE_NOT_OK(err);
+  err = hdf_copy(copy, "", arena);
+  DIE_NOT_OK(err);
+  hdf_destroy(&arena);
+  err = dump(copy, &c);
+  DIE_NOT_OK(err);
+  CHECK_STREQ(a.buf, c.buf);
+
+  hdf_destroy(&copy);
+  hdf_destroy(&hdf);
+  string_clear(&a);
+  string_clear(&b);
+  string_clear(&c);
+
+  return 0;
+}
@@ -0,0 +1,154 @@
+/*
+ * Copyright 2001-2004 Brandon Long
+ * All Rights Reserved.
+ *
+ * ClearSilver Templating System
+ *
+ * This code is made available under the terms of the ClearSilver License.
+ * http://www.clearsilver.net/license.hdf
+ *
+ */
+
+#include "cs_config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "util/neo_misc.h"
+#include "util/neo_hdf.h"
+#include "util/neo_str.h"
+#include "test_macros.h"
+
+/* Write a data set in binary form, map it back and make sure it reads
+ * back the same as the original, and can still be modified */
+static NEOERR *build(HDF *hdf)
+{
+  NEOERR *err;
+  char name[64], value[64];
+  int i;
+
+  for (i = 0; i < 500; i++)
+  {
+    snprintf(name, sizeof(name), "Page.Results.%d.Title", i);
+    snprintf(value, sizeof(value), "Result %d", i);
+    err = hdf_set_value(hdf, name, value);
+    if (err) return nerr_pass(err);
+    snprintf(name, sizeof(name), "Page.Results.%d.Id", i);
+    err = hdf_set_int_value(hdf, name, i);
+    if (err) return nerr_pass(err);
+  }
+  err = hdf_set_symlink(hdf, "Page.First", "Page.Results.0");
+  if (err) return nerr_pass(err);
+  err = hdf_set_value(hdf, "Page.Empty", "");
+  if (err) return nerr_pass(err);
+  err = hdf_set_attr(hdf, "Page.Results", "type", "list");
+  if (err) return nerr_pass(err);
+  err = hdf_set_attr(hdf, "Page.Results", "lang", "en");
+  if (err) return nerr_pass(err);
+  err = hdf_read_string(hdf, "Config {\n Flag = 1\n Text << EOM\nmulti\nline\nEOM\n}\n");
+  if (err) return nerr_pass(err);
+  return STATUS_OK;
+}
+
+static NEOERR *dump(HDF *hdf, STRING *str)
+{
+  return nerr_pass(hdf_dump_str(hdf, NULL, 0, str));
+}
+
+int main(int argc, char *argv[])
+{
+  NEOERR *err;
+  HDF *hdf, *mapped, *sub;
+  HDF_ATTR *attr;
+  STRING a, b;
+  char path[256];
+  FILE *fp;
+
+  string_init(&a);
+  string_init(&b);
+  snprintf(path, sizeof(path), "/tmp/hdf_binary_test.%d", (int) getpid());
+
+  err = hdf_init(&hdf);
+  DIE_NOT_OK(err);
+  err = build(hdf);
+  DIE_NOT_OK(err);
+
+  err = hdf_write_binary(hdf, path);
+  DIE_NOT_OK(err);
+  err = hdf_map_binary(&mapped, path);
+  DIE_NOT_OK(err);
+
+  err = dump(hdf, &a);
+  DIE_NOT_OK(err);
+  err = dump(mapped, &b);
+  DIE_NOT_OK(err);
+  CHECK_STREQ(a.buf, b.buf);
+
+  CHECK_STREQ(hdf_get_value(mapped, "Page.Results.321.Title", ""), "Result 321");
+  CHECK_STREQ(hdf_get_value(mapped, "Page.First.Title", ""), "Result 0");
+  CHECK_STREQ(hdf_get_value(mapped, "Config.Text", ""), "multi\nline\n");
+  attr = hdf_get_attr(mapped, "Page.Results");
+  if (attr == NULL || attr->next == NULL)
+  {
+    ne_warn("FAIL: attributes not mapped");
+    exit(-1);
+  }
+  CHECK_STREQ(attr->key, "type");
+  CHECK_STREQ(attr->next->value, "en");
+
+  /* modify it, including overwriting mapped values */
+  err = hdf_set_value(mapped, "Page.Results.7.Title", "changed");
+  DIE_NOT_OK(err);
+  err = hdf_set_value(mapped, "Page.Results.500.Title", "added");
+  DIE_NOT_OK(err);
+  err = hdf_remove_tree(mapped, "Page.Results.8");
+  DIE_NOT_OK(err);
+  CHECK_STREQ(hdf_get_value(mapped, "Page.Results.7.Title", ""), "changed");
+  CHECK_STREQ(hdf_get_value(mapped, "Page.Results.500.Title", ""), "added");
+  CHECK_STREQ(hdf_get_value(mapped, "Page.Results.8.Title", "gone"), "gone");
+  hdf_destroy(&mapped);
+
+  /* a sub tree becomes the top of the mapped data set */
+  err = hdf_write_binary(hdf_get_obj(hdf, "Config"), path);
+  DIE_NOT_OK(err);
+  err = hdf_map_binary(&mapped, path);
+  DIE_NOT_OK(err);
+  CHECK_STREQ(hdf_get_value(mapped, "Flag", ""), "1");
+  sub = hdf_get_obj(mapped, "Text");
+  if (sub == NULL || hdf_get_obj(mapped, "Config") != NULL)
+  {
+    ne_warn("FAIL: sub tree not mapped as the top");
+    exit(-1);
+  }
+  hdf_destroy(&mapped);
+
+  /* a truncated file is refused */
+  fp = fopen(path, "r+");
+  if (fp == NULL || ftruncate(fileno(fp), 40))
+  {
+    ne_warn("FAIL: unable to truncate %s", path);
+    exit(-1);
+  }
+  fclose(fp);
+  err = hdf_map_binary(&mapped, path);
+  if (!nerr_handle(&err, NERR_PARSE))
+  {
+    ne_warn("FAIL: truncated file not refused");
+    exit(-1);
+  }
+  unlink(path);
+  err = hdf_map_binary(&mapped, path);
+  if (!nerr_handle(&err, NERR_IO))
+  {
+    ne_warn("FAIL: missing file not refused");
+    exit(-1);
+  }
+
+  hdf_destroy(&hdf);
+  string_clear(&a);
+  string_clear(&b);
+
+  return 0;
+}
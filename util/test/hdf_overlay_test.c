@@ -0,0 +1,240 @@
+/*
+ * Copyright 2001-2004 Brandon Long
+ * All Rights Reserved.
+ *
+ * ClearSilver Templating System
+ *
+ * This code is made available under the terms of the ClearSilver License.
+ * http://www.clearsilver.net/license.hdf
+ *
+ */
+
+#include "cs_config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util/neo_misc.h"
+#include "util/neo_hdf.h"
+#include "util/neo_str.h"
+#include "test_macros.h"
+
+/* Apply the same changes to an overlay and to a copy of its base, and
+ * make sure they read back the same, and that the base is untouched */
+static NEOERR *build(HDF *hdf)
+{
+  NEOERR *err;
+  char name[64], value[64];
+  int i;
+
+  for (i = 0; i < 100; i++)
+  {
+    snprintf(name, sizeof(name), "Config.Items.%d.Title", i);
+    snprintf(value, sizeof(value), "Item %d", i);
+    err = hdf_set_value(hdf, name, value);
+    if (err) return nerr_pass(err);
+  }
+  err = hdf_set_value(hdf, "Config.Site.Name", "example");
+  if (err) return nerr_pass(err);
+  err = hdf_set_value(hdf, "Config.Site.Url", "http://example.com/");
+  if (err) return nerr_pass(err);
+  err = hdf_set_symlink(hdf, "Config.Default", "Config.Site");
+  if (err) return nerr_pass(err);
+  err = hdf_set_attr(hdf, "Config.Site.Name", "lang", "en");
+  if (err) return nerr_pass(err);
+  err = hdf_set_value(hdf, "Strings.Hello", "hello");
+  if (err) return nerr_pass(err);
+  return STATUS_OK;
+}
+
+static NEOERR *change(HDF *hdf)
+{
+  NEOERR *err;
+  HDF *obj;
+
+  err = hdf_set_value(hdf, "Config.Site.Name", "changed");
+  if (err) return nerr_pass(err);
+  err = hdf_set_value(hdf, "Config.Items.42.Title", "changed");
+  if (err) return nerr_pass(err);
+  err = hdf_set_value(hdf, "Config.Items.100.Title", "added");
+  if (err) return nerr_pass(err);
+  err = hdf_remove_tree(hdf, "Config.Items.7");
+  if (err) return nerr_pass(err);
+  err = hdf_set_attr(hdf, "Config.Site.Name", "dir", "ltr");
+  if (err) return nerr_pass(err);
+  /* through a link into the overlay */
+  err = hdf_set_value(hdf, "Config.Default.Extra", "1");
+  if (err) return nerr_pass(err);
+  /* through a node handed out by the overlay */
+  obj = hdf_get_obj(hdf, "Config.Items.3");
+  if (obj == NULL) return nerr_raise(NERR_ASSERT, "Config.Items.3 missing");
+  err = hdf_set_value(obj, "Id", "3");
+  if (err) return nerr_pass(err);
+  for (obj = hdf_obj_child(hdf_get_obj(hdf, "Config.Items")); obj;
+       obj = hdf_obj_next(obj))
+  {
+    err = hdf_set_value(obj, "Seen", "1");
+    if (err) return nerr_pass(err);
+  }
+  err = hdf_set_value(hdf, "Request.Path", "/");
+  if (err) return nerr_pass(err);
+  return STATUS_OK;
+}
+
+/* Lookups which only read mustn't shadow a wide level of the base */
+static void test_peek(void)
+{
+  NEOERR *err;
+  HDF *base, *overlay, *obj, *lang;
+  char name[64];
+  int i, count = 0;
+
+  err = hdf_init(&base);
+  DIE_NOT_OK(err);
+  for (i = 0; i < 5000; i++)
+  {
+    snprintf(name, sizeof(name), "Lang.k%d", i);
+    err = hdf_set_value(base, name, "v");
+    DIE_NOT_OK(err);
+  }
+  err = hdf_set_symlink(base, "Link", "Lang.k7");
+  DIE_NOT_OK(err);
+  err = hdf_init_overlay(&overlay, base, 0);
+  DIE_NOT_OK(err);
+
+  obj = hdf_peek_obj(overlay, "Lang.k7");
+  if (obj == NULL || !hdf_obj_is_base(overlay, obj))
+  {
+    ne_warn("FAIL: hdf_peek_obj didn't find Lang.k7 in the base");
+    exit(-1);
+  }
+  lang = hdf_peek_obj(overlay, "Lang");
+  for (obj = hdf_obj_peek_child(lang); obj; obj = hdf_obj_next(obj))
+    count++;
+  if (count != 5000)
+  {
+    ne_warn("FAIL: hdf_obj_peek_child walked %d children", count);
+    exit(-1);
+  }
+  obj = hdf_obj_find_child(overlay, "Link", 0);
+  if (obj == NULL || !obj->link)
+  {
+    ne_warn("FAIL: hdf_obj_find_child followed the link");
+    exit(-1);
+  }
+  if (overlay->child != NULL || !hdf_obj_is_base(overlay, lang))
+  {
+    ne_warn("FAIL: overlay shadowed on peek");
+    exit(-1);
+  }
+
+  /* hdf_get_obj hands out nodes which can be changed */
+  obj = hdf_get_obj(overlay, "Lang.k7");
+  if (obj == NULL || hdf_obj_is_base(overlay, obj))
+  {
+    ne_warn("FAIL: hdf_get_obj returned a node of the base");
+    exit(-1);
+  }
+  obj = hdf_obj_find_child(hdf_get_obj(overlay, "Lang"), "k8", 1);
+  if (obj == NULL || hdf_obj_is_base(overlay, obj))
+  {
+    ne_warn("FAIL: hdf_obj_find_child didn't shadow");
+    exit(-1);
+  }
+  if (hdf_obj_is_base(base, hdf_get_obj(base, "Lang.k7")))
+  {
+    ne_warn("FAIL: a data set is its own base");
+    exit(-1);
+  }
+
+  hdf_destroy(&overlay);
+  hdf_destroy(&base);
+}
+
+static NEOERR *dump(HDF *hdf, STRING *str)
+{
+  return nerr_pass(hdf_dump_str(hdf, NULL, 0, str));
+}
+
+int main(int argc, char *argv[])
+{
+  NEOERR *err;
+  HDF *base, *copy, *overlay, *over2;
+  STRING before, after, a, b;
+
+  string_init(&before);
+  string_init(&after);
+  string_init(&a);
+  string_init(&b);
+
+  test_peek();
+
+  err = hdf_init(&base);
+  DIE_NOT_OK(err);
+  err = build(base);
+  DIE_NOT_OK(err);
+  err = dump(base, &before);
+  DIE_NOT_OK(err);
+
+  err = hdf_init_overlay(&overlay, base, 0);
+  DIE_NOT_OK(err);
+  /* reading doesn't shadow anything */
+  CHECK_STREQ(hdf_get_value(overlay, "Config.Default.Name", ""), "example");
+  CHECK_STREQ(hdf_get_value(overlay, "Config.Items.42.Title", ""), "Item 42");
+  if (overlay->child != NULL)
+  {
+    ne_warn("FAIL: overlay shadowed on read");
+    exit(-1);
+  }
+  err = dump(overlay, &a);
+  DIE_NOT_OK(err);
+  CHECK_STREQ(before.buf, a.buf);
+  string_clear(&a);
+
+  err = hdf_init(&copy);
+  DIE_NOT_OK(err);
+  err = hdf_copy(copy, "", base);
+  DIE_NOT_OK(err);
+
+  err = change(overlay);
+  DIE_NOT_OK(err);
+  err = change(copy);
+  DIE_NOT_OK(err);
+  CHECK_STREQ(hdf_get_value(overlay, "Config.Site.Extra", ""), "1");
+  CHECK_STREQ(hdf_get_value(overlay, "Strings.Hello", ""), "hello");
+
+  err = dump(copy, &a);
+  DIE_NOT_OK(err);
+  err = dump(overlay, &b);
+  DIE_NOT_OK(err);
+  CHECK_STREQ(a.buf, b.buf);
+  string_clear(&b);
+
+  /* an overlay of the overlay */
+  err = hdf_init_overlay(&over2, overlay, 0);
+  DIE_NOT_OK(err);
+  err = dump(over2, &b);
+  DIE_NOT_OK(err);
+  CHECK_STREQ(a.buf, b.buf);
+  string_clear(&b);
+  err = hdf_set_value(over2, "Config.Items.0.Title", "again");
+  DIE_NOT_OK(err);
+  CHECK_STREQ(hdf_get_value(over2, "Config.Items.0.Title", ""), "again");
+  CHECK_STREQ(hdf_get_value(overlay, "Config.Items.0.Title", ""), "Item 0");
+  hdf_destroy(&over2);
+
+  hdf_destroy(&overlay);
+  err = dump(base, &after);
+  DIE_NOT_OK(err);
+  CHECK_STREQ(before.buf, after.buf);
+
+  hdf_destroy(&copy);
+  hdf_destroy(&base);
+  string_clear(&before);
+  string_clear(&after);
+  string_clear(&a);
+  string_clear(&b);
+
+  return 0;
+}
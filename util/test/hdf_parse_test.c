@@ -0,0 +1,367 @@
+/*
+ * Copyright 2001-2004 Brandon Long
+ * All Rights Reserved.
+ *
+ * ClearSilver Templating System
+ *
+ * This code is made available under the terms of the ClearSilver License.
+ * http://www.clearsilver.net/license.hdf
+ *
+ */
+
+#include "cs_config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "util/neo_misc.h"
+#include "util/neo_hdf.h"
+#include "util/neo_str.h"
+#include "test_macros.h"
+
+/* Parses text into a new data set */
+static HDF *parse(const char *text)
+{
+  NEOERR *err;
+  HDF *hdf;
+
+  err = hdf_init(&hdf);
+  DIE_NOT_OK(err);
+  err = hdf_read_string(hdf, text);
+  DIE_NOT_OK(err);
+  return hdf;
+}
+
+/* Parsing text must fail with an error which mentions where */
+static void parse_fails(const char *text, const char *where)
+{
+  NEOERR *err;
+  HDF *hdf;
+  STRING str;
+
+  err = hdf_init(&hdf);
+  DIE_NOT_OK(err);
+  err = hdf_read_string(hdf, text);
+  if (err == STATUS_OK)
+  {
+    ne_warn("FAIL: parsed %s", text);
+    exit(-1);
+  }
+  string_init(&str);
+  nerr_error_traceback(err, &str);
+  if (str.buf == NULL || strstr(str.buf, where) == NULL)
+  {
+    ne_warn("FAIL: error for %s doesn't mention %s: %s", text, where,
+            str.buf ? str.buf : "");
+    exit(-1);
+  }
+  string_clear(&str);
+  nerr_ignore(&err);
+  hdf_destroy(&hdf);
+}
+
+static void test_multi_line(void)
+{
+  HDF *hdf;
+
+  hdf = parse("A = 1\n"
+              "Text <<EOM\n"
+              "first\n"
+              "  second = not a value\n"
+              "EOM\n"
+              "B = 2\n"
+              "Empty <<END\n"
+              "END\n"
+              "Open.Text << EOF\n"
+              "runs to\n"
+              "the end");
+  CHECK_STREQ(hdf_get_value(hdf, "A", ""), "1");
+  CHECK_STREQ(hdf_get_value(hdf, "Text", ""),
+              "first\n  second = not a value\n");
+  CHECK_STREQ(hdf_get_value(hdf, "B", ""), "2");
+  CHECK_STREQ(hdf_get_value(hdf, "Empty", "missing"), "");
+  CHECK_STREQ(hdf_get_value(hdf, "Open.Text", ""), "runs to\nthe end");
+  hdf_destroy(&hdf);
+
+  /* a marker only ends the value at the start of a line */
+  hdf = parse("Text <<EOM\n"
+              " EOM\n"
+              "EOMX\n"
+              "EOM \n"
+              "After = 1\n");
+  CHECK_STREQ(hdf_get_value(hdf, "Text", ""), " EOM\nEOMX\n");
+  CHECK_STREQ(hdf_get_value(hdf, "After", ""), "1");
+  hdf_destroy(&hdf);
+
+  parse_fails("A = 1\nText <<\n", "[<string>:2] No multi-assignment");
+}
+
+static void test_links_and_attrs(void)
+{
+  HDF *hdf;
+  HDF_ATTR *attr;
+
+  hdf = parse("Src.Name = hello\n"
+              "Copy := Src.Name\n"
+              "Missing := Nowhere\n"
+              "Link : Src\n"
+              "Link.Added = through\n"
+              "Src.Name = changed\n"
+              "Title [lang=fr, hidden, note=\"a, b\"] = Bonjour\n"
+              "Scope [lang=en] {\n"
+              "  Inner = 1\n"
+              "}\n");
+  CHECK_STREQ(hdf_get_value(hdf, "Copy", ""), "hello");
+  CHECK_STREQ(hdf_get_value(hdf, "Missing", "missing"), "");
+  CHECK_STREQ(hdf_get_value(hdf, "Link.Name", ""), "changed");
+  CHECK_STREQ(hdf_get_value(hdf, "Src.Added", ""), "through");
+  CHECK_STREQ(hdf_get_value(hdf, "Title", ""), "Bonjour");
+  attr = hdf_get_attr(hdf, "Title");
+  if (attr == NULL || strcmp(attr->key, "lang") || strcmp(attr->value, "fr") ||
+      attr->next == NULL || strcmp(attr->next->key, "hidden") ||
+      attr->next->next == NULL ||
+      strcmp(attr->next->next->value, "a, b"))
+  {
+    ne_warn("FAIL: attributes of Title");
+    exit(-1);
+  }
+  attr = hdf_get_attr(hdf, "Scope");
+  if (attr == NULL || strcmp(attr->value, "en"))
+  {
+    ne_warn("FAIL: attributes of Scope");
+    exit(-1);
+  }
+  CHECK_STREQ(hdf_get_value(hdf, "Scope.Inner", ""), "1");
+  hdf_destroy(&hdf);
+
+  parse_fails("A = 1\nB [lang=\"fr] = 2\n", "In file <string>:2");
+}
+
+/* Names are only [0-9a-zA-Z_.], but values can be anything */
+static void test_high_bit(void)
+{
+  HDF *hdf;
+
+  hdf = parse("Caf = caf\xc3\xa9\n"
+              "Multi <<EOM\n"
+              "\xc3\xa9 \xff\xa0\n"
+              "EOM\n");
+  CHECK_STREQ(hdf_get_value(hdf, "Caf", ""), "caf\xc3\xa9");
+  CHECK_STREQ(hdf_get_value(hdf, "Multi", ""), "\xc3\xa9 \xff\xa0\n");
+  hdf_destroy(&hdf);
+
+  parse_fails("A = 1\nCaf\xc3\xa9 = 2\n", "[<string>:2] Unable to parse");
+  parse_fails("\xff\n", "[<string>:1] Unable to parse");
+}
+
+/* The parent found for one assignment is reused by the next ones with
+ * the same prefix, but must not outlive a scope or a link */
+static void test_parent_cache(void)
+{
+  HDF *hdf;
+  HDF *obj;
+  int count = 0;
+
+  hdf = parse("A.B.c = 1\n"
+              "A.B.d = 2\n"
+              "A {\n"
+              "  B.e = 3\n"
+              "  B {\n"
+              "    f = 4\n"
+              "  }\n"
+              "  B.g = 5\n"
+              "}\n"
+              "A.B.h = 6\n"
+              "A.C.i = 7\n"
+              "A.B.j = 8\n"
+              "X.k = 9\n"
+              "A.B : X\n"
+              "A.B.l = 10\n"
+              "A.Bc.m = 11\n");
+  CHECK_STREQ(hdf_get_value(hdf, "A.B.k", ""), "9");
+  CHECK_STREQ(hdf_get_value(hdf, "X.l", ""), "10");
+  CHECK_STREQ(hdf_get_value(hdf, "A.C.i", ""), "7");
+  CHECK_STREQ(hdf_get_value(hdf, "A.Bc.m", ""), "11");
+  hdf_destroy(&hdf);
+
+  hdf = parse("A.B.c = 1\n"
+              "A {\n"
+              "  B.e = 3\n"
+              "  B {\n"
+              "    f = 4\n"
+              "  }\n"
+              "  B.g = 5\n"
+              "}\n"
+              "A.B.h = 6\n");
+  for (obj = hdf_get_child(hdf, "A.B"); obj; obj = hdf_obj_next(obj))
+    count++;
+  if (count != 5)
+  {
+    ne_warn("FAIL: A.B has %d children", count);
+    exit(-1);
+  }
+  CHECK_STREQ(hdf_get_value(hdf, "A.B.c", ""), "1");
+  CHECK_STREQ(hdf_get_value(hdf, "A.B.e", ""), "3");
+  CHECK_STREQ(hdf_get_value(hdf, "A.B.f", ""), "4");
+  CHECK_STREQ(hdf_get_value(hdf, "A.B.g", ""), "5");
+  CHECK_STREQ(hdf_get_value(hdf, "A.B.h", ""), "6");
+  hdf_destroy(&hdf);
+
+  /* the parent of a link target path is looked up through the link */
+  hdf = parse("L.x = 0\n"
+              "T.y = 1\n"
+              "L : T\n"
+              "L.z = 2\n"
+              "L.z = 3\n");
+  CHECK_STREQ(hdf_get_value(hdf, "T.z", ""), "3");
+  hdf_destroy(&hdf);
+}
+
+static void test_errors(void)
+{
+  parse_fails("A = 1\n"
+              "\n"
+              "# comment\n"
+              "Text <<EOM\n"
+              "x\n"
+              "EOM\n"
+              "B {\n"
+              "  C = 2\n"
+              "}\n"
+              "bad line\n", "[<string>:10] Unable to parse");
+  parse_fails("A {\n"
+              "  B = 1\n"
+              "  } x\n", "[<string>:3] Trailing garbage");
+  parse_fails("A {\n"
+              "  B = 1\n"
+              "  C = \n"
+              "  ? \n"
+              "}\n", "[<string>:4] Unable to parse");
+  parse_fails("A..B = 1\n", "In file <string>:1");
+  parse_fails("A = 1\n#include \"x.hdf\"\n", "[2]: #include not supported");
+}
+
+/* Writes text to a new temporary file, whose name is left in path */
+static void write_file(char *path, const char *text)
+{
+  int fd;
+
+  fd = mkstemp(path);
+  if (fd == -1 || write(fd, text, strlen(text)) != (int)strlen(text))
+  {
+    ne_warn("FAIL: unable to write %s", path);
+    exit(-1);
+  }
+  close(fd);
+}
+
+static void test_include(void)
+{
+  NEOERR *err;
+  HDF *hdf;
+  STRING str;
+  char inner[] = "/tmp/hdf_parse_test.XXXXXX";
+  char outer[] = "/tmp/hdf_parse_test.XXXXXX";
+  char sub[] = "/tmp/hdf_parse_test.XXXXXX";
+  char bad[] = "/tmp/hdf_parse_test.XXXXXX";
+  char *text;
+
+  write_file(inner, "B.c = inner\n"
+                    "B.d : Top.Value\n"
+                    "Multi <<EOM\n"
+                    "one\n"
+                    "EOM\n");
+  text = sprintf_alloc("Top.Value = top\n"
+                       "A.B.a = 1\n"
+                       "A {\n"
+                       "#include \"%s\"\n"
+                       "  B.e = 2\n"
+                       "}\n"
+                       "A.B.f = 3\n"
+                       "Again {\n"
+                       "#include %s\n"
+                       "}\n", inner, inner);
+  if (text == NULL)
+  {
+    ne_warn("FAIL: unable to allocate");
+    exit(-1);
+  }
+  write_file(outer, text);
+  free(text);
+
+  err = hdf_init(&hdf);
+  DIE_NOT_OK(err);
+  err = hdf_read_file(hdf, outer);
+  DIE_NOT_OK(err);
+  CHECK_STREQ(hdf_get_value(hdf, "A.B.a", ""), "1");
+  CHECK_STREQ(hdf_get_value(hdf, "A.B.c", ""), "inner");
+  CHECK_STREQ(hdf_get_value(hdf, "A.B.d", ""), "top");
+  CHECK_STREQ(hdf_get_value(hdf, "A.B.e", ""), "2");
+  CHECK_STREQ(hdf_get_value(hdf, "A.B.f", ""), "3");
+  CHECK_STREQ(hdf_get_value(hdf, "A.Multi", ""), "one\n");
+  CHECK_STREQ(hdf_get_value(hdf, "Again.B.c", ""), "inner");
+  hdf_destroy(&hdf);
+
+  /* errors in an included file give its line, and the include's */
+  write_file(sub, "X = 1\n"
+                  "Y <<EOM\n"
+                  "a\n"
+                  "EOM\n"
+                  "oops\n");
+  text = sprintf_alloc("A = 1\n"
+                       "#include \"%s\"\n", sub);
+  if (text == NULL)
+  {
+    ne_warn("FAIL: unable to allocate");
+    exit(-1);
+  }
+  write_file(bad, text);
+  free(text);
+
+  err = hdf_init(&hdf);
+  DIE_NOT_OK(err);
+  err = hdf_read_file(hdf, bad);
+  if (err == STATUS_OK)
+  {
+    ne_warn("FAIL: parsed a bad include");
+    exit(-1);
+  }
+  string_init(&str);
+  nerr_error_traceback(err, &str);
+  text = sprintf_alloc("[%s:5] Unable to parse", sub);
+  if (str.buf == NULL || text == NULL || strstr(str.buf, text) == NULL)
+  {
+    ne_warn("FAIL: bad include error: %s", str.buf ? str.buf : "");
+    exit(-1);
+  }
+  free(text);
+  text = sprintf_alloc("In file %s:2", bad);
+  if (text == NULL || strstr(str.buf, text) == NULL)
+  {
+    ne_warn("FAIL: bad include context: %s", str.buf);
+    exit(-1);
+  }
+  free(text);
+  string_clear(&str);
+  nerr_ignore(&err);
+  hdf_destroy(&hdf);
+
+  unlink(inner);
+  unlink(outer);
+  unlink(sub);
+  unlink(bad);
+}
+
+int main(int argc, char *argv[])
+{
+  test_multi_line();
+  test_links_and_attrs();
+  test_high_bit();
+  test_parent_cache();
+  test_errors();
+  test_include();
+  printf("Passed hdf parse tests\n");
+  return 0;
+}
@@ -0,0 +1,114 @@
+/*
+ * Copyright 2001-2004 Brandon Long
+ * All Rights Reserved.
+ *
+ * ClearSilver Templating System
+ *
+ * This code is made available under the terms of the ClearSilver License.
+ * http://www.clearsilver.net/license.hdf
+ *
+ */
+
+#include "cs_config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util/neo_misc.h"
+#include "util/neo_err.h"
+#include "util/neo_str.h"
+#include "test_macros.h"
+
+#define IS_TEST_CHAR(c) ((c) == '<' || (c) == 0x7f || (c) == 0x80 || \
+                         (c) == 0xff || ((c) > 0 && (c) < 8))
+static const NEOS_CHARSET TestChars = NEOS_CHARSET_INIT(IS_TEST_CHAR);
+
+/* Check the vector scan against a byte at a time lookup, for every
+ * offset and length in a buffer with a sprinkling of bytes in the set */
+static void test_charset_span(void)
+{
+  char buf[200];
+  int i, len, off, expect;
+  NEOS_CHARSET set;
+
+  for (i = 0; i < 256; i++)
+  {
+    if (NEOS_CHARSET_HAS(&TestChars, i) != (IS_TEST_CHAR(i) ? 1 : 0))
+    {
+      ne_warn("FAIL: byte %d in charset is %d", i,
+              NEOS_CHARSET_HAS(&TestChars, i));
+      exit(-1);
+    }
+  }
+
+  for (i = 0; i < sizeof(buf); i++)
+  {
+    buf[i] = 'a' + (i % 26);
+    if (i % 37 == 36) buf[i] = "<\x7f\x80\xff\x01"[i % 5];
+    if (i % 11 == 5) buf[i] = "\xfe\x81;>"[i % 4];
+  }
+
+  for (off = 0; off < 40; off++)
+  {
+    for (len = 0; off + len <= sizeof(buf); len++)
+    {
+      expect = 0;
+      while (expect < len && !IS_TEST_CHAR((UINT8)buf[off + expect]))
+        expect++;
+      i = neos_charset_span(&TestChars, buf + off, len);
+      if (i != expect)
+      {
+        ne_warn("FAIL: span at %d len %d is %d, expected %d", off, len, i,
+                expect);
+        exit(-1);
+      }
+    }
+  }
+
+  memset(&set, 0, sizeof(set));
+  neos_charset_add(&set, "z\xe9");
+  if (!NEOS_CHARSET_HAS(&set, 'z') || !NEOS_CHARSET_HAS(&set, 0xe9) ||
+      NEOS_CHARSET_HAS(&set, 'y') ||
+      neos_charset_span(&set, "abcdefghijklmnopqrstuvwxyz", 26) != 25)
+  {
+    ne_warn("FAIL: neos_charset_add");
+    exit(-1);
+  }
+}
+
+static void check_escape(NEOERR *err, char *out, const char *expect)
+{
+  DIE_NOT_OK(err);
+  CHECK_STREQ(out, expect);
+  free(out);
+}
+
+static void test_escape(void)
+{
+  NEOERR *err;
+  char *out;
+  const char *src = "plain text long enough to be scanned <b>&\"'\r";
+  const char *tail = "long plain text without specials<b>";
+
+  err = neos_html_escape(src, strlen(src), &out);
+  check_escape(err, out, "plain text long enough to be scanned "
+               "&lt;b&gt;&amp;&quot;&#39;");
+  /* slen stops before the <b>, so the whole span is the tail */
+  err = neos_html_escape(tail, 32, &out);
+  check_escape(err, out, "long plain text without specials");
+  err = neos_js_escape("a long string with a 'quote' and\ta</script>", &out);
+  check_escape(err, out, "a long string with a \\x27quote\\x27 and"
+               "\\x09a\\x3C\\x2Fscript\\x3E");
+  err = neos_url_escape("a long query value=1&b c\xe9", &out, NULL);
+  check_escape(err, out, "a+long+query+value%3D1%26b+c%E9");
+  err = neos_url_escape("a long query value with others", &out, "lo");
+  check_escape(err, out, "a+%6C%6Fng+query+va%6Cue+with+%6Fthers");
+}
+
+int main(int argc, char *argv[])
+{
+  test_charset_span();
+  test_escape();
+  return 0;
+}
@@ -0,0 +1,173 @@
+
+#include "cs_config.h"
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "util/neo_misc.h"
+#include "util/neo_err.h"
+#include "util/neo_net.h"
+#include "util/neo_server.h"
+
+#define TEST_PORT 46033
+#define NUM_WORKERS 2
+#define NUM_IDLE 6
+#define COUNT 200
+/* The descriptor limit of the second server, and how many connections
+ * are held open against it */
+#define FD_LIMIT 16
+#define NUM_FLOOD 24
+
+/* Each request is a number, answered with the number plus one */
+static NEOERR *req_cb(void *rock, int num, NSOCK *sock)
+{
+  NEOERR *err;
+  int i = 0;
+
+  err = ne_net_read_int(sock, &i);
+  if (err) return nerr_pass(err);
+  return nerr_pass(ne_net_write_int(sock, i + 1));
+}
+
+static NEOERR *client_proc(int port)
+{
+  NEOERR *err = STATUS_OK;
+  NSOCK *idle[NUM_IDLE];
+  NSOCK *nsock;
+  int x, i;
+
+  /* Connections which never send anything would each hold a child of
+   * nserver_proc_start, here they shouldn't hold up the others */
+  memset(idle, 0, sizeof(idle));
+  for (x = 0; x < NUM_IDLE; x++)
+  {
+    err = ne_net_connect(&(idle[x]), "localhost", port, 10, 10);
+    if (err) break;
+  }
+
+  for (x = 0; x < COUNT && err == STATUS_OK; x++)
+  {
+    err = ne_net_connect(&nsock, "localhost", port, 10, 10);
+    if (err) break;
+    err = ne_net_write_int(nsock, x);
+    if (err == STATUS_OK)
+      err = ne_net_read_int(nsock, &i);
+    if (err == STATUS_OK && i != x + 1)
+      err = nerr_raise(NERR_ASSERT, "Expected %d, got %d", x + 1, i);
+    ne_net_close(&nsock);
+  }
+
+  for (x = 0; x < NUM_IDLE; x++)
+    ne_net_close(&(idle[x]));
+  return nerr_pass(err);
+}
+
+/* Holds more connections open than the server has descriptors for, so
+ * its accepts fail, then checks it still answers once they're gone */
+static NEOERR *flood_proc(int port)
+{
+  NEOERR *err = STATUS_OK;
+  NSOCK *flood[NUM_FLOOD];
+  NSOCK *nsock;
+  int x, i;
+
+  memset(flood, 0, sizeof(flood));
+  for (x = 0; x < NUM_FLOOD; x++)
+  {
+    err = ne_net_connect(&(flood[x]), "localhost", port, 10, 10);
+    if (err) break;
+  }
+  sleep(2);
+  for (x = 0; x < NUM_FLOOD; x++)
+    ne_net_close(&(flood[x]));
+  if (err) return nerr_pass(err);
+
+  err = ne_net_connect(&nsock, "localhost", port, 10, 10);
+  if (err) return nerr_pass(err);
+  err = ne_net_write_int(nsock, 41);
+  if (err == STATUS_OK)
+    err = ne_net_read_int(nsock, &i);
+  if (err == STATUS_OK && i != 42)
+    err = nerr_raise(NERR_ASSERT, "Expected 42, got %d", i);
+  ne_net_close(&nsock);
+  return nerr_pass(err);
+}
+
+/* Runs an nserver_thread_start server in a child, with at most fd_limit
+ * descriptors if that isn't 0, while client runs, and returns the CPU
+ * time the server used in usecs */
+static NEOERR *run_server(int port, int fd_limit,
+                          NEOERR *(*client)(int port), long *usecs)
+{
+  NEOERR *err;
+  NSERVER server;
+  struct rlimit rl;
+  struct rusage ru;
+  pid_t child;
+  int status;
+
+  memset(&server, 0, sizeof(server));
+  server.req_cb = req_cb;
+  server.num_children = NUM_WORKERS;
+  server.port = port;
+  server.data_timeout = 10;
+
+  child = fork();
+  if (child == -1)
+    return nerr_raise_errno(NERR_SYSTEM, "fork failed");
+  if (!child)
+  {
+    if (fd_limit)
+    {
+      rl.rlim_cur = rl.rlim_max = fd_limit;
+      setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    err = nserver_thread_start(&server);
+    if (err)
+    {
+      nerr_log_error(err);
+      exit(-1);
+    }
+    exit(0);
+  }
+
+  sleep(1);
+  err = client(port);
+  kill(child, SIGTERM);
+  if (wait4(child, &status, 0, &ru) == -1 || !WIFEXITED(status) ||
+      WEXITSTATUS(status))
+  {
+    nerr_ignore(&err);
+    return nerr_raise(NERR_ASSERT, "nserver exited badly");
+  }
+  *usecs = (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000L +
+           ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+  return nerr_pass(err);
+}
+
+int main(int argc, char *argv[])
+{
+  NEOERR *err;
+  long usecs;
+
+  err = run_server(TEST_PORT, 0, client_proc, &usecs);
+  if (err == STATUS_OK)
+    err = run_server(TEST_PORT + 1, FD_LIMIT, flood_proc, &usecs);
+  if (err)
+  {
+    nerr_log_error(err);
+    return -1;
+  }
+  /* spinning on the failed accepts would take the whole two seconds */
+  if (usecs > 500000)
+  {
+    ne_warn("nserver used %ldus of CPU while out of descriptors", usecs);
+    return -1;
+  }
+  return 0;
+}